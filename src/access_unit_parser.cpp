@@ -0,0 +1,295 @@
+#include <cstring>
+
+#include <spdlog/spdlog.h>
+
+#include "access_unit_parser.hpp"
+
+using namespace camcoder;
+
+static constexpr size_t NO_POS = static_cast<size_t>(-1);
+
+/**
+ * Reads the start of a NAL unit's payload bit by bit, skipping emulation
+ * prevention bytes.
+ */
+class BitReader {
+public:
+  BitReader(const std::uint8_t *data, size_t size)
+      : data_{data}, size_{size}, pos_{0}, bit_{0}, zeros_{0} {}
+
+  bool bits(unsigned n, std::uint32_t &value) {
+    value = 0;
+    for (unsigned i = 0; i < n; i++) {
+      if (bit_ == 0 && !next_byte()) {
+        return false;
+      }
+      value = value << 1 | ((data_[pos_ - 1] >> (7 - bit_)) & 1);
+      bit_ = (bit_ + 1) % 8;
+    }
+    return true;
+  }
+
+  /**
+   * Exp-Golomb coded unsigned integer.
+   */
+  bool ue(std::uint32_t &value) {
+    unsigned zeros = 0;
+    std::uint32_t bit = 0;
+    while (bits(1, bit) && bit == 0) {
+      if (++zeros > 31) {
+        return false;
+      }
+    }
+    if (bit == 0 || !bits(zeros, value)) {
+      return false;
+    }
+    value += (std::uint32_t{1} << zeros) - 1;
+    return true;
+  }
+
+private:
+  bool next_byte() {
+    if (pos_ < size_ && zeros_ >= 2 && data_[pos_] == 0x03) {
+      pos_++;
+      zeros_ = 0;
+    }
+    if (pos_ >= size_) {
+      return false;
+    }
+    zeros_ = data_[pos_] == 0 ? zeros_ + 1 : 0;
+    pos_++;
+    return true;
+  }
+
+  const std::uint8_t *data_;
+  size_t size_;
+  size_t pos_;
+  unsigned bit_;
+  unsigned zeros_;
+};
+
+AccessUnitParser::AccessUnitParser(Encoding encoding)
+    : encoding_{encoding}, buffer_{}, size_{0}, scan_pos_{0},
+      have_nal_{false}, have_vcl_{false}, keyframe_{false}, synced_{false},
+      b_frames_{false}, slice_pos_{NO_POS}, pps_pos_{},
+      extra_slice_header_bits_{}, discarded_{0} {}
+
+char *AccessUnitParser::prepare(size_t n) {
+  if (buffer_.size() < size_ + n) {
+    buffer_.resize(size_ + n);
+  }
+  return reinterpret_cast<char *>(buffer_.data() + size_);
+}
+
+void AccessUnitParser::commit(size_t n) { size_ += n; }
+
+size_t AccessUnitParser::header_size() const {
+  // The byte after the header starts with first_mb_in_slice (H.264) or
+  // first_slice_segment_in_pic_flag (H.265)
+  return encoding_ == Encoding::H265 ? 3 : 2;
+}
+
+bool AccessUnitParser::is_vcl(const std::uint8_t *nal) const {
+  if (encoding_ == Encoding::H265) {
+    return ((nal[0] >> 1) & 0x3f) <= 31;
+  }
+  const auto type = nal[0] & 0x1f;
+  return type >= 1 && type <= 5;
+}
+
+bool AccessUnitParser::is_keyframe(const std::uint8_t *nal) const {
+  if (encoding_ == Encoding::H265) {
+    // IRAP pictures: BLA, IDR and CRA
+    const auto type = (nal[0] >> 1) & 0x3f;
+    return type >= 16 && type <= 23;
+  }
+  return (nal[0] & 0x1f) == 5;
+}
+
+bool AccessUnitParser::starts_access_unit(const std::uint8_t *nal) const {
+  if (encoding_ == Encoding::H265) {
+    const auto type = (nal[0] >> 1) & 0x3f;
+    if (type <= 31) {
+      return nal[2] & 0x80;
+    }
+    // VPS, SPS, PPS, AUD, prefix SEI and reserved types
+    return (type >= 32 && type <= 35) || type == 39 ||
+           (type >= 41 && type <= 44) || (type >= 48 && type <= 55);
+  }
+  const auto type = nal[0] & 0x1f;
+  if (type >= 1 && type <= 5) {
+    // first_mb_in_slice is ue(v), so it's 0 iff the first bit is set
+    return nal[1] & 0x80;
+  }
+  // SEI, SPS, PPS, AUD and reserved types
+  return (type >= 6 && type <= 9) || (type >= 14 && type <= 18);
+}
+
+bool AccessUnitParser::next(AccessUnit &au) {
+  const auto header = header_size();
+  // A start code is 00 00 01, optionally with another leading zero byte
+  while (scan_pos_ + 3 + header <= size_) {
+    const auto *p = static_cast<const std::uint8_t *>(std::memchr(
+        buffer_.data() + scan_pos_ + 2, 0x01, size_ - scan_pos_ - 2));
+    if (p == nullptr) {
+      // Keep the last two bytes; they may be the start of a start code
+      scan_pos_ = size_ - 2;
+      break;
+    }
+    const size_t one = p - buffer_.data();
+    if (buffer_[one - 1] != 0 || buffer_[one - 2] != 0) {
+      scan_pos_ = one - 1;
+      continue;
+    }
+    if (one + 1 + header > size_) {
+      // Wait for the rest of the NAL unit header
+      scan_pos_ = one - 2;
+      break;
+    }
+    const size_t start =
+        one >= 3 && buffer_[one - 3] == 0 ? one - 3 : one - 2;
+    // Where the NAL unit will be once the access unit before it is taken
+    const size_t next_offset = one + 1 - start;
+    const auto *nal = buffer_.data() + one + 1;
+    scan_pos_ = one + 1;
+
+    if (!have_nal_) {
+      // Drop anything before the first start code
+      if (start > 0) {
+        std::memmove(buffer_.data(), buffer_.data() + start, size_ - start);
+        size_ -= start;
+        scan_pos_ -= start;
+        nal -= start;
+      }
+      have_nal_ = true;
+    } else if (have_vcl_ && starts_access_unit(nal)) {
+      const bool keyframe = is_keyframe(nal);
+      const bool vcl = is_vcl(nal);
+      const bool taken = take(start, au);
+      // The NAL unit that ended the access unit is now at the front
+      have_vcl_ = vcl;
+      keyframe_ = keyframe;
+      note_nal(next_offset);
+      if (taken) {
+        return true;
+      }
+      continue;
+    }
+
+    if (is_vcl(nal)) {
+      have_vcl_ = true;
+      keyframe_ |= is_keyframe(nal);
+    }
+    note_nal(nal - buffer_.data());
+  }
+
+  if (size_ > MAX_ACCESS_UNIT_SIZE) {
+    spdlog::warn("Access unit exceeded {} bytes; discarding it",
+                 MAX_ACCESS_UNIT_SIZE);
+    reset();
+    discarded_++;
+  }
+  return false;
+}
+
+bool AccessUnitParser::flush(AccessUnit &au) {
+  if (!have_vcl_) {
+    reset();
+    return false;
+  }
+  const bool taken = take(size_, au);
+  reset();
+  return taken;
+}
+
+void AccessUnitParser::reset() {
+  size_ = 0;
+  scan_pos_ = 0;
+  have_nal_ = false;
+  have_vcl_ = false;
+  keyframe_ = false;
+  synced_ = false;
+  b_frames_ = false;
+  slice_pos_ = NO_POS;
+  pps_pos_.clear();
+}
+
+void AccessUnitParser::note_nal(size_t offset) {
+  const auto *nal = buffer_.data() + offset;
+  if (is_vcl(nal)) {
+    if (slice_pos_ == NO_POS) {
+      slice_pos_ = offset;
+    }
+  } else if (encoding_ == Encoding::H265 && ((nal[0] >> 1) & 0x3f) == 34) {
+    pps_pos_.push_back(offset);
+  }
+}
+
+bool AccessUnitParser::starts_with_b_slice(size_t end) {
+  if (encoding_ == Encoding::H265) {
+    for (const auto pos : pps_pos_) {
+      // pps_pic_parameter_set_id, pps_seq_parameter_set_id,
+      // dependent_slice_segments_enabled_flag, output_flag_present_flag,
+      // num_extra_slice_header_bits
+      BitReader pps{buffer_.data() + pos + 2, end - pos - 2};
+      std::uint32_t id = 0;
+      std::uint32_t value = 0;
+      if (pps.ue(id) && id < extra_slice_header_bits_.size() &&
+          pps.ue(value) && pps.bits(2, value) && pps.bits(3, value)) {
+        extra_slice_header_bits_[id] = static_cast<std::uint8_t>(value);
+      }
+    }
+  }
+  if (slice_pos_ == NO_POS || slice_pos_ >= end) {
+    return false;
+  }
+  const auto *nal = buffer_.data() + slice_pos_;
+  const auto header = encoding_ == Encoding::H265 ? 2 : 1;
+  BitReader slice{nal + header, end - slice_pos_ - header};
+  std::uint32_t value = 0;
+  std::uint32_t slice_type = 0;
+  if (encoding_ == Encoding::H265) {
+    // first_slice_segment_in_pic_flag, no_output_of_prior_pics_flag for
+    // IRAP pictures, slice_pic_parameter_set_id, then (for a picture's
+    // first slice) the extra header bits
+    std::uint32_t pps_id = 0;
+    if (!slice.bits(1, value) || value == 0 ||
+        (is_keyframe(nal) && !slice.bits(1, value)) || !slice.ue(pps_id) ||
+        pps_id >= extra_slice_header_bits_.size() ||
+        !slice.bits(extra_slice_header_bits_[pps_id], value) ||
+        !slice.ue(slice_type)) {
+      return false;
+    }
+    return slice_type == 0;
+  }
+  // first_mb_in_slice, slice_type; types 1 and 6 are B
+  if (!slice.ue(value) || !slice.ue(slice_type)) {
+    return false;
+  }
+  return slice_type % 5 == 1;
+}
+
+bool AccessUnitParser::take(size_t end, AccessUnit &au) {
+  if (!b_frames_ && starts_with_b_slice(end)) {
+    spdlog::error("Stream has B-frames, which can't be passed through; "
+                  "configure the camera without them");
+    b_frames_ = true;
+  }
+  synced_ |= keyframe_;
+  const bool keep = synced_ && !b_frames_;
+  if (keep) {
+    au.data.assign(buffer_.begin(), buffer_.begin() + end);
+    au.keyframe = keyframe_;
+  } else {
+    discarded_++;
+  }
+  std::memmove(buffer_.data(), buffer_.data() + end, size_ - end);
+  size_ -= end;
+  scan_pos_ -= end;
+  keyframe_ = false;
+  have_vcl_ = false;
+  // Any slice or parameter set of the next access unit is noted after this
+  slice_pos_ = NO_POS;
+  pps_pos_.clear();
+  return keep;
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "frame_parameters.hpp"
+
+namespace camcoder {
+
+/**
+ * Splits an H.264 or H.265 Annex-B byte stream into access units.
+ *
+ * Input is appended as it's read. An access unit is only known to be complete
+ * once the first NAL unit of the next one arrives, so output lags input by
+ * one access unit. Access units before the first keyframe are discarded, so
+ * output starts (and, after reset(), restarts) where a decoder can.
+ *
+ * Streams with B-frames are refused: access units are muxed in decode order
+ * with PTS equal to DTS, which would show reordered pictures out of order.
+ * Once a B slice is seen, everything is discarded until reset().
+ */
+class AccessUnitParser {
+public:
+  /**
+   * An access unit is discarded if it grows past this without ending, since
+   * the input probably isn't an Annex-B stream.
+   */
+  static constexpr size_t MAX_ACCESS_UNIT_SIZE = 16 * 1024 * 1024;
+
+  struct AccessUnit {
+    std::vector<std::uint8_t> data;
+    bool keyframe;
+  };
+
+  explicit AccessUnitParser(Encoding encoding);
+
+  /**
+   * Space for up to n more bytes of input. Call commit() with the number of
+   * bytes actually written.
+   */
+  char *prepare(size_t n);
+  void commit(size_t n);
+
+  /**
+   * Take the next complete access unit. Returns false if more input is
+   * needed.
+   */
+  bool next(AccessUnit &au);
+
+  /**
+   * Take whatever is left as the last access unit, at the end of the stream.
+   */
+  bool flush(AccessUnit &au);
+
+  /**
+   * Drop buffered input and wait for a keyframe again, e.g. after the source
+   * reconnects.
+   */
+  void reset();
+
+  /**
+   * True if no input is buffered.
+   */
+  bool empty() const { return size_ == 0; }
+
+  /**
+   * Access units discarded while waiting for a keyframe, because they were
+   * too large, or because the stream has B-frames.
+   */
+  std::uint64_t discarded() const { return discarded_; }
+
+  /**
+   * True if a B slice was seen since the last reset().
+   */
+  bool has_b_frames() const { return b_frames_; }
+
+private:
+  /**
+   * NAL unit header bytes needed to classify a NAL unit.
+   */
+  size_t header_size() const;
+
+  bool is_vcl(const std::uint8_t *nal) const;
+  bool is_keyframe(const std::uint8_t *nal) const;
+
+  /**
+   * True if the NAL unit begins a new access unit, given that the current one
+   * already has a coded slice (H.264 7.4.1.2.3, H.265 7.4.2.4.4).
+   */
+  bool starts_access_unit(const std::uint8_t *nal) const;
+
+  /**
+   * Note where the NAL unit at offset in buffer_ is if it's needed to find
+   * the access unit's slice type.
+   */
+  void note_nal(size_t offset);
+
+  /**
+   * True if the access unit ending at end starts with a B slice. Reads the
+   * H.265 picture parameter sets it carries on the way.
+   */
+  bool starts_with_b_slice(size_t end);
+
+  /**
+   * Move the first end bytes out as an access unit, keeping the rest.
+   * Returns false if it was discarded.
+   */
+  bool take(size_t end, AccessUnit &au);
+
+  Encoding encoding_;
+  std::vector<std::uint8_t> buffer_;
+  // Bytes of buffer_ holding input
+  size_t size_;
+  // Where to resume looking for start codes
+  size_t scan_pos_;
+  bool have_nal_;
+  bool have_vcl_;
+  bool keyframe_;
+  bool synced_;
+  bool b_frames_;
+  // Offsets in buffer_ of the current access unit's first slice (or npos)
+  // and of its H.265 picture parameter sets
+  size_t slice_pos_;
+  std::vector<size_t> pps_pos_;
+  // num_extra_slice_header_bits of each H.265 picture parameter set, which
+  // come before slice_type
+  std::array<std::uint8_t, 64> extra_slice_header_bits_;
+  std::uint64_t discarded_;
+};
+
+} // namespace camcoder
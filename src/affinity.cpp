@@ -0,0 +1,134 @@
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+
+#include "affinity.hpp"
+
+using namespace camcoder;
+
+/**
+ * Longest thread name the kernel keeps, without the terminator.
+ */
+static constexpr size_t MAX_THREAD_NAME = 15;
+
+bool ThreadOptions::apply(const std::string &source, const std::string &role,
+                          bool realtime) const {
+  set_thread_name(source, role);
+  bool ok = true;
+  if (!cpus.empty()) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (const auto cpu : cpus) {
+      CPU_SET(cpu, &set);
+    }
+    const auto err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0) {
+      spdlog::warn("Can't pin {}/{} to its CPUs: {}", source, role,
+                   std::strerror(err));
+      ok = false;
+    }
+  }
+  if (realtime && reader_priority > 0) {
+    sched_param param{};
+    param.sched_priority = reader_priority;
+    const auto err =
+        pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (err != 0) {
+      spdlog::warn("Can't give {}/{} real-time priority {}: {}", source, role,
+                   reader_priority, std::strerror(err));
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+void camcoder::set_thread_name(const std::string &source,
+                               const std::string &role) {
+  const auto suffix = "/" + role;
+  const auto name =
+      suffix.size() < MAX_THREAD_NAME
+          ? source.substr(0, MAX_THREAD_NAME - suffix.size()) + suffix
+          : suffix.substr(0, MAX_THREAD_NAME);
+  pthread_setname_np(pthread_self(), name.c_str());
+}
+
+bool camcoder::parse_cpu_list(const std::string &text,
+                              std::vector<int> &cpus) {
+  cpus.clear();
+  size_t pos = 0;
+  while (pos < text.size()) {
+    auto end = text.find(',', pos);
+    if (end == std::string::npos) {
+      end = text.size();
+    }
+    const auto range = text.substr(pos, end - pos);
+    pos = end + 1;
+    int first = 0;
+    int last = 0;
+    char trailing = '\0';
+    const auto n =
+        std::sscanf(range.c_str(), "%d-%d%c", &first, &last, &trailing);
+    if (n == 1) {
+      last = first;
+    } else if (n != 2) {
+      return false;
+    }
+    if (first < 0 || last < first || last >= CPU_SETSIZE) {
+      return false;
+    }
+    for (int cpu = first; cpu <= last; cpu++) {
+      cpus.push_back(cpu);
+    }
+  }
+  return !cpus.empty();
+}
+
+std::vector<int> camcoder::node_cpus(int node) {
+  std::ifstream ifs{
+      fmt::format("/sys/devices/system/node/node{}/cpulist", node)};
+  std::string text;
+  std::vector<int> cpus;
+  if (!std::getline(ifs, text) || !parse_cpu_list(text, cpus)) {
+    spdlog::warn("Can't find the CPUs of NUMA node {}", node);
+    cpus.clear();
+  }
+  return cpus;
+}
+
+bool camcoder::bind_to_node(void *data, size_t size, int node) {
+  constexpr size_t MASK_BITS = 1024;
+  if (node < 0 || static_cast<size_t>(node) >= MASK_BITS) {
+    return false;
+  }
+  const auto page = static_cast<std::uintptr_t>(sysconf(_SC_PAGESIZE));
+  const auto begin = (reinterpret_cast<std::uintptr_t>(data) + page - 1) /
+                     page * page;
+  const auto end = (reinterpret_cast<std::uintptr_t>(data) + size) / page *
+                   page;
+  if (end <= begin) {
+    return true;
+  }
+  unsigned long mask[MASK_BITS / (8 * sizeof(unsigned long))] = {};
+  mask[node / (8 * sizeof(unsigned long))] |=
+      1UL << (node % (8 * sizeof(unsigned long)));
+  // Preferred rather than strictly bound, so a full node falls back to
+  // another instead of failing allocations. The kernel reads one bit less
+  // than maxnode.
+  if (syscall(SYS_mbind, begin, end - begin, MPOL_PREFERRED, mask,
+              MASK_BITS + 1, MPOL_MF_MOVE) != 0) {
+    spdlog::warn("Can't place frame memory on NUMA node {}: {}", node,
+                 std::strerror(errno));
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace camcoder {
+
+/**
+ * Per-source placement and scheduling of the threads that read and encode
+ * its frames, so on machines with several NUMA nodes a frame is read,
+ * stored and encoded on the same one.
+ */
+struct ThreadOptions {
+  /**
+   * CPUs the source's threads run on. Empty leaves them to the scheduler,
+   * unless numa_node is set.
+   */
+  std::vector<int> cpus;
+
+  /**
+   * Node frame memory is allocated on; threads run on its CPUs too if cpus
+   * isn't given. Negative leaves placement to the kernel.
+   */
+  int numa_node = -1;
+
+  /**
+   * SCHED_FIFO priority (1-99) for the reader thread, so frames are taken
+   * off the socket promptly under load. Zero keeps the normal scheduler.
+   * Needs CAP_SYS_NICE.
+   */
+  int reader_priority = 0;
+
+  /**
+   * Name the calling thread after the source and its role in it, and pin it
+   * to cpus. realtime gives it reader_priority as well. Returns false if
+   * anything couldn't be applied.
+   */
+  bool apply(const std::string &source, const std::string &role,
+             bool realtime = false) const;
+};
+
+/**
+ * Name the calling thread "<source>/<role>" for top and perf, shortening
+ * the source's name to fit the kernel's limit.
+ */
+void set_thread_name(const std::string &source, const std::string &role);
+
+/**
+ * Parse a CPU list in the kernel's format, e.g. "0-3,8-11". Returns false
+ * if it's malformed.
+ */
+bool parse_cpu_list(const std::string &text, std::vector<int> &cpus);
+
+/**
+ * The CPUs of a NUMA node, from sysfs. Empty if they can't be found.
+ */
+std::vector<int> node_cpus(int node);
+
+/**
+ * Place the memory pages wholly inside [data, data + size) on a NUMA node,
+ * moving any that are already there. Returns false on failure.
+ */
+bool bind_to_node(void *data, size_t size, int node);
+
+} // namespace camcoder
@@ -0,0 +1,398 @@
+#include <algorithm>
+#include <cstdlib>
+#include <ctime>
+#include <filesystem>
+
+#include <spdlog/spdlog.h>
+
+#include "affinity.hpp"
+#include "archiver.hpp"
+#include "utils.hpp"
+
+using namespace camcoder;
+
+namespace fs = std::filesystem;
+
+template <typename T> static void put_le(char *out, T value) {
+  for (size_t i = 0; i < sizeof(T); i++) {
+    out[i] = static_cast<char>(static_cast<std::uint64_t>(value) >> (8 * i));
+  }
+}
+
+template <typename T> static T get_le(const char *in) {
+  std::uint64_t value = 0;
+  for (size_t i = 0; i < sizeof(T); i++) {
+    value |= static_cast<std::uint64_t>(static_cast<std::uint8_t>(in[i]))
+             << (8 * i);
+  }
+  return static_cast<T>(value);
+}
+
+/**
+ * The buffer's decode time, or its presentation time if there's none.
+ */
+static GstClockTime buffer_time(GstBuffer *buf) {
+  return GST_CLOCK_TIME_IS_VALID(GST_BUFFER_DTS(buf)) ? GST_BUFFER_DTS(buf)
+                                                      : GST_BUFFER_PTS(buf);
+}
+
+static std::int64_t wall_now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+/**
+ * The hour's directory, relative to the source's archive, e.g.
+ * "2024-05-01/13".
+ */
+static std::string hour_directory(std::int64_t time_ns) {
+  const std::time_t seconds = time_ns / 1000000000;
+  std::tm tm{};
+  gmtime_r(&seconds, &tm);
+  char buf[32];
+  std::strftime(buf, sizeof(buf), "%Y-%m-%d/%H", &tm);
+  return buf;
+}
+
+static bool has_segments(const fs::path &directory) {
+  std::error_code ec;
+  for (const auto &entry : fs::directory_iterator{directory, ec}) {
+    if (entry.path().extension() == ".ts") {
+      return true;
+    }
+  }
+  return false;
+}
+
+Archiver::Archiver(std::string name, const ArchiveParameters &params)
+    : name_{std::move(name)}, params_{params},
+      root_{utils::path_join(params.directory, name_)}, mutex_{},
+      queue_cv_{}, queue_{}, keyframe_times_{}, queued_bytes_{0},
+      skipping_{false},
+      stopping_{false}, bytes_written_{0}, segments_written_{0}, dropped_{0},
+      segments_deleted_{0}, segment_file_{}, index_file_{},
+      segment_buffer_(1 << 20), current_{}, current_hour_{}, segments_{},
+      total_bytes_{0} {
+  scan_existing();
+  spdlog::info("Archiving source {} to {} ({} segments, {} MB already)",
+               name_, root_, segments_.size(), total_bytes_ / 1000000);
+  writer_ = std::thread{&Archiver::run_writer, this};
+}
+
+Archiver::~Archiver() {
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    stopping_ = true;
+  }
+  queue_cv_.notify_all();
+  writer_.join();
+}
+
+GstPadProbeReturn Archiver::probe(GstPad *pad, GstPadProbeInfo *info,
+                                  gpointer udata) {
+  auto &archiver = *reinterpret_cast<Archiver *>(udata);
+  if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER) {
+    archiver.push(GST_PAD_PROBE_INFO_BUFFER(info));
+  } else if (GST_EVENT_TYPE(GST_PAD_PROBE_INFO_EVENT(info)) == GST_EVENT_EOS) {
+    archiver.close_segment();
+  }
+  return GST_PAD_PROBE_OK;
+}
+
+GstPadProbeReturn Archiver::coded_probe(GstPad *pad, GstPadProbeInfo *info,
+                                        gpointer udata) {
+  auto buf = GST_PAD_PROBE_INFO_BUFFER(info);
+  if (!GST_BUFFER_FLAG_IS_SET(buf, GST_BUFFER_FLAG_DELTA_UNIT)) {
+    reinterpret_cast<Archiver *>(udata)->push_keyframe(buffer_time(buf));
+  }
+  return GST_PAD_PROBE_OK;
+}
+
+void Archiver::push_keyframe(GstClockTime time) {
+  if (!GST_CLOCK_TIME_IS_VALID(time)) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock{mutex_};
+  // In case the muxer's output stops carrying timestamps
+  if (keyframe_times_.size() >= MAX_PENDING_KEYFRAMES) {
+    keyframe_times_.pop_front();
+  }
+  keyframe_times_.push_back(time);
+}
+
+void Archiver::push(GstBuffer *buf) {
+  const auto size = gst_buffer_get_size(buf);
+  const auto time = buffer_time(buf);
+  std::lock_guard<std::mutex> lock{mutex_};
+  // The muxer stamps a keyframe's packets, and the tables it puts before
+  // them, with the keyframe's time; the first of them starts the keyframe
+  bool keyframe = false;
+  while (GST_CLOCK_TIME_IS_VALID(time) && !keyframe_times_.empty() &&
+         time >= keyframe_times_.front()) {
+    keyframe_times_.pop_front();
+    keyframe = true;
+  }
+  if (skipping_ && !keyframe) {
+    dropped_++;
+    return;
+  }
+  if (queued_bytes_ + size > MAX_QUEUE_BYTES) {
+    if (!skipping_) {
+      spdlog::warn("Archive of {} can't keep up; dropping until the next "
+                   "keyframe",
+                   name_);
+    }
+    skipping_ = true;
+    dropped_++;
+    return;
+  }
+  skipping_ = false;
+  queue_.push_back(Item{gst_buffer_ref(buf), keyframe, wall_now_ns()});
+  queued_bytes_ += size;
+  if (queued_bytes_ >= BATCH_BYTES) {
+    queue_cv_.notify_one();
+  }
+}
+
+void Archiver::close_segment() {
+  std::lock_guard<std::mutex> lock{mutex_};
+  queue_.push_back(Item{nullptr, false, 0});
+  queue_cv_.notify_one();
+}
+
+void Archiver::run_writer() {
+  set_thread_name(name_, "arch");
+  std::vector<Item> batch;
+  std::unique_lock<std::mutex> lock{mutex_};
+  while (true) {
+    queue_cv_.wait_for(lock, FLUSH_INTERVAL, [this] {
+      return stopping_ || queued_bytes_ >= BATCH_BYTES;
+    });
+    batch.swap(queue_);
+    queued_bytes_ = 0;
+    const bool stop = stopping_;
+    lock.unlock();
+
+    for (const auto &item : batch) {
+      write(item);
+      if (item.buffer != nullptr) {
+        gst_buffer_unref(item.buffer);
+      }
+    }
+    batch.clear();
+    // One trip to the OS per batch
+    segment_file_.flush();
+    index_file_.flush();
+    enforce_retention();
+
+    if (stop) {
+      finish_segment();
+      index_file_.close();
+      return;
+    }
+    lock.lock();
+  }
+}
+
+void Archiver::write(const Item &item) {
+  if (item.buffer == nullptr) {
+    finish_segment();
+    return;
+  }
+  if (item.keyframe) {
+    const auto hour = hour_directory(item.time);
+    const auto age = std::chrono::milliseconds{item.time / 1000000 -
+                                               current_.start_ms};
+    if (!segment_file_.is_open() || age >= params_.segment_duration ||
+        hour != current_hour_) {
+      finish_segment();
+      open_segment(item.time);
+    }
+  }
+  // Until a segment is open there's no keyframe to start it
+  if (!segment_file_.is_open()) {
+    return;
+  }
+
+  if (item.keyframe && index_file_.is_open()) {
+    char record[INDEX_RECORD_SIZE];
+    put_le<std::int64_t>(record, item.time);
+    put_le<std::int64_t>(record + 8, current_.start_ms);
+    put_le<std::int64_t>(record + 16, current_.size);
+    index_file_.write(record, sizeof(record));
+  }
+  GstMapInfo map;
+  if (!gst_buffer_map(item.buffer, &map, GST_MAP_READ)) {
+    return;
+  }
+  segment_file_.write(reinterpret_cast<const char *>(map.data), map.size);
+  current_.size += map.size;
+  bytes_written_ += map.size;
+  gst_buffer_unmap(item.buffer, &map);
+  if (!segment_file_) {
+    spdlog::error("Failed to write {}; dropping it", current_.path);
+    segment_file_.close();
+    std::error_code ec;
+    fs::remove(current_.path, ec);
+  }
+}
+
+bool Archiver::open_segment(std::int64_t time) {
+  const auto hour = hour_directory(time);
+  const auto directory = utils::path_join(root_, hour);
+  std::error_code ec;
+  fs::create_directories(directory, ec);
+  if (ec) {
+    spdlog::error("Failed to create {}: {}", directory, ec.message());
+    return false;
+  }
+  if (hour != current_hour_) {
+    index_file_.close();
+    index_file_.clear();
+    index_file_.open(utils::path_join(directory, "index"),
+                     std::ofstream::binary | std::ofstream::app);
+    if (!index_file_) {
+      spdlog::error("Failed to open the archive index in {}", directory);
+    }
+    current_hour_ = hour;
+  }
+
+  current_.start_ms = time / 1000000;
+  current_.path =
+      utils::path_join(directory, fmt::format("{}.ts", current_.start_ms));
+  current_.size = 0;
+  segment_file_.clear();
+  segment_file_.rdbuf()->pubsetbuf(segment_buffer_.data(),
+                                   segment_buffer_.size());
+  segment_file_.open(current_.path,
+                     std::ofstream::binary | std::ofstream::trunc);
+  if (!segment_file_) {
+    spdlog::error("Failed to open {}", current_.path);
+    segment_file_.close();
+    return false;
+  }
+  return true;
+}
+
+void Archiver::finish_segment() {
+  if (!segment_file_.is_open()) {
+    return;
+  }
+  segment_file_.close();
+  if (!segment_file_) {
+    spdlog::error("Failed to write {}", current_.path);
+  }
+  segments_.push_back(current_);
+  total_bytes_ += current_.size;
+  segments_written_++;
+  enforce_retention();
+}
+
+void Archiver::enforce_retention() {
+  const auto now_ms = wall_now_ns() / 1000000;
+  const auto max_age_ms =
+      std::chrono::duration_cast<std::chrono::milliseconds>(params_.max_age)
+          .count();
+  while (!segments_.empty()) {
+    const auto &oldest = segments_.front();
+    const bool too_old =
+        max_age_ms > 0 && now_ms - oldest.start_ms > max_age_ms;
+    const auto open_bytes = segment_file_.is_open() ? current_.size : 0;
+    const bool too_big = params_.max_bytes > 0 &&
+                         total_bytes_ + open_bytes > params_.max_bytes;
+    if (!too_old && !too_big) {
+      break;
+    }
+    std::error_code ec;
+    fs::remove(oldest.path, ec);
+    if (ec) {
+      spdlog::warn("Failed to delete {}: {}", oldest.path, ec.message());
+    }
+    total_bytes_ -= oldest.size;
+    segments_deleted_++;
+
+    // Drop the hour's index with its last segment, then the day if that
+    // was its last hour
+    const auto hour = fs::path{oldest.path}.parent_path();
+    if (has_segments(hour)) {
+      remove_from_index(hour.string(), oldest.start_ms);
+    } else {
+      fs::remove(hour / "index", ec);
+      fs::remove(hour, ec);
+      const auto day = hour.parent_path();
+      if (fs::is_empty(day, ec)) {
+        fs::remove(day, ec);
+      }
+    }
+    segments_.pop_front();
+  }
+}
+
+void Archiver::remove_from_index(const std::string &hour,
+                                 std::int64_t start_ms) {
+  const auto path = utils::path_join(hour, "index");
+  std::vector<char> records;
+  {
+    std::ifstream in{path, std::ifstream::binary};
+    char record[INDEX_RECORD_SIZE];
+    while (in.read(record, sizeof(record))) {
+      if (get_le<std::int64_t>(record + 8) != start_ms) {
+        records.insert(records.end(), record, record + sizeof(record));
+      }
+    }
+  }
+  // The open index appends to the file being replaced, so it's reopened
+  // on the new one
+  const bool current =
+      index_file_.is_open() &&
+      fs::path{utils::path_join(root_, current_hour_)} == fs::path{hour};
+  if (current) {
+    index_file_.close();
+  }
+  const auto tmp_path = path + ".tmp";
+  {
+    std::ofstream out{tmp_path, std::ofstream::binary | std::ofstream::trunc};
+    out.write(records.data(), records.size());
+    out.close();
+    std::error_code ec;
+    if (out) {
+      fs::rename(tmp_path, path, ec);
+    }
+    if (!out || ec) {
+      spdlog::warn("Failed to rewrite the archive index {}", path);
+      fs::remove(tmp_path, ec);
+    }
+  }
+  if (current) {
+    index_file_.clear();
+    index_file_.open(path, std::ofstream::binary | std::ofstream::app);
+  }
+}
+
+void Archiver::scan_existing() {
+  std::error_code ec;
+  for (auto it = fs::recursive_directory_iterator{root_, ec};
+       it != fs::recursive_directory_iterator{}; it.increment(ec)) {
+    if (ec) {
+      break;
+    }
+    const auto &path = it->path();
+    if (path.extension() != ".ts" || !it->is_regular_file(ec)) {
+      continue;
+    }
+    const auto stem = path.stem().string();
+    char *end = nullptr;
+    const auto start_ms = std::strtoll(stem.c_str(), &end, 10);
+    if (end == stem.c_str() || *end != '\0') {
+      continue;
+    }
+    const auto size = it->file_size(ec);
+    segments_.push_back(Segment{path.string(), start_ms, ec ? 0 : size});
+    total_bytes_ += segments_.back().size;
+  }
+  std::sort(segments_.begin(), segments_.end(),
+            [](const auto &a, const auto &b) {
+              return a.start_ms < b.start_ms;
+            });
+}
@@ -0,0 +1,217 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gst/gst.h>
+
+namespace camcoder {
+
+/**
+ * Per-source options for recording to an archive, apart from HLS's rolling
+ * live window.
+ */
+struct ArchiveParameters {
+  /**
+   * Root of the archive; the source records to a subdirectory named after
+   * it. Empty disables recording.
+   */
+  std::string directory;
+
+  /**
+   * A segment is closed at the first keyframe after it has run this long.
+   */
+  std::chrono::milliseconds segment_duration{60000};
+
+  /**
+   * Segments older than this are deleted. Zero keeps them regardless of age.
+   */
+  std::chrono::seconds max_age{0};
+
+  /**
+   * The oldest segments are deleted while the source's archive is larger
+   * than this. Zero means no limit.
+   */
+  std::uint64_t max_bytes = 0;
+};
+
+/**
+ * Records a source's muxed MPEG-TS to disk as it leaves the muxer, in
+ * segments grouped into a directory per hour (UTC):
+ *
+ *   <directory>/<source>/YYYY-MM-DD/HH/<start>.ts
+ *   <directory>/<source>/YYYY-MM-DD/HH/index
+ *
+ * where <start> is the segment's first keyframe in milliseconds since the
+ * epoch. index holds a record per keyframe in that hour's segments: its
+ * time in nanoseconds since the epoch, the <start> of its segment, and its
+ * byte offset there, all int64 little-endian. Segments begin on keyframes,
+ * so any can be played on its own.
+ *
+ * Keyframes are told apart where they leave the encoder (or parser), and
+ * the muxed buffer carrying a keyframe's timestamp starts its packets.
+ *
+ * The streaming thread only queues buffer references. A writer thread
+ * writes them in batches, so a slow disk never holds up the live stream; if
+ * the queue outgrows MAX_QUEUE_BYTES, buffers are dropped up to the next
+ * keyframe instead. Retention is enforced after each batch.
+ */
+class Archiver {
+public:
+  static constexpr size_t INDEX_RECORD_SIZE = 3 * sizeof(std::int64_t);
+
+  /**
+   * The writer wakes this often, or sooner once BATCH_BYTES are queued.
+   */
+  static constexpr std::chrono::milliseconds FLUSH_INTERVAL{500};
+  static constexpr size_t BATCH_BYTES = 4 << 20;
+
+  /**
+   * Queued bytes beyond which new buffers are dropped.
+   */
+  static constexpr size_t MAX_QUEUE_BYTES = 64 << 20;
+
+  /**
+   * Keyframes remembered on their way into the muxer.
+   */
+  static constexpr size_t MAX_PENDING_KEYFRAMES = 64;
+
+  /**
+   * Scans the source's existing archive, so retention covers earlier runs
+   * too.
+   */
+  Archiver(std::string name, const ArchiveParameters &params);
+
+  /**
+   * Write what's queued and close the current segment.
+   */
+  ~Archiver();
+
+  Archiver(const Archiver &) = delete;
+  Archiver &operator=(const Archiver &) = delete;
+
+  /**
+   * Pad probe for the muxer's source pad that queues its buffers to the
+   * Archiver in udata, and closes the segment at the end of stream.
+   */
+  static GstPadProbeReturn probe(GstPad *pad, GstPadProbeInfo *info,
+                                 gpointer udata);
+
+  /**
+   * Pad probe for the encoder's (or parser's) source pad that notes the
+   * keyframes going into the muxer for the Archiver in udata.
+   */
+  static GstPadProbeReturn coded_probe(GstPad *pad, GstPadProbeInfo *info,
+                                       gpointer udata);
+
+  /**
+   * Queue a muxed buffer; takes its own reference.
+   */
+  void push(GstBuffer *buf);
+
+  /**
+   * Note a keyframe with the given decode (or presentation) time on its way
+   * into the muxer.
+   */
+  void push_keyframe(GstClockTime time);
+
+  /**
+   * Close the current segment once what's queued has been written.
+   */
+  void close_segment();
+
+  std::uint64_t bytes_written() const { return bytes_written_; }
+
+  std::uint64_t segments_written() const { return segments_written_; }
+
+  /**
+   * Buffers dropped because the writer fell behind.
+   */
+  std::uint64_t dropped() const { return dropped_; }
+
+  std::uint64_t segments_deleted() const { return segments_deleted_; }
+
+private:
+  /**
+   * A queued buffer, or a request to close the segment if buffer is null.
+   */
+  struct Item {
+    GstBuffer *buffer;
+    bool keyframe;
+    // Wall-clock arrival time, ns since the epoch
+    std::int64_t time;
+  };
+
+  struct Segment {
+    std::string path;
+    std::int64_t start_ms;
+    std::uint64_t size;
+  };
+
+  void run_writer();
+
+  /**
+   * Write an item to the current segment, first starting a new segment if
+   * it's a keyframe and the current one is long enough or in an earlier
+   * hour. Runs on the writer thread.
+   */
+  void write(const Item &item);
+
+  bool open_segment(std::int64_t time);
+
+  void finish_segment();
+
+  /**
+   * Delete the oldest segments (and emptied directories) past max_age or
+   * max_bytes, counting the open segment.
+   */
+  void enforce_retention();
+
+  /**
+   * Rewrite the hour's index without the records of the deleted segment
+   * that started at start_ms.
+   */
+  void remove_from_index(const std::string &hour, std::int64_t start_ms);
+
+  void scan_existing();
+
+  std::string name_;
+  ArchiveParameters params_;
+  std::string root_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable queue_cv_;
+  std::vector<Item> queue_;
+  // Times of keyframes that have gone into the muxer but not come out
+  std::deque<GstClockTime> keyframe_times_;
+  size_t queued_bytes_;
+  // Dropping until the next keyframe after the queue overflowed
+  bool skipping_;
+  bool stopping_;
+  std::atomic<std::uint64_t> bytes_written_;
+  std::atomic<std::uint64_t> segments_written_;
+  std::atomic<std::uint64_t> dropped_;
+  std::atomic<std::uint64_t> segments_deleted_;
+
+  // Writer thread state
+  std::ofstream segment_file_;
+  std::ofstream index_file_;
+  std::vector<char> segment_buffer_;
+  Segment current_;
+  std::string current_hour_;
+  // Closed segments, oldest first
+  std::deque<Segment> segments_;
+  std::uint64_t total_bytes_;
+
+  std::thread writer_;
+};
+
+} // namespace camcoder
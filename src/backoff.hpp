@@ -0,0 +1,48 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+
+namespace camcoder {
+
+/**
+ * Exponential backoff with jitter, for spacing out reconnect attempts.
+ */
+class Backoff {
+public:
+  static constexpr std::chrono::milliseconds DEFAULT_MIN{100};
+  static constexpr std::chrono::milliseconds DEFAULT_MAX{10000};
+
+  Backoff(std::chrono::milliseconds min = DEFAULT_MIN,
+          std::chrono::milliseconds max = DEFAULT_MAX)
+      : min_{min}, max_{std::max(min, max)}, ceiling_{min},
+        rng_{std::random_device{}()} {}
+
+  /**
+   * Delay before the next attempt. It's somewhere between half the current
+   * ceiling and the ceiling, so many sources that lost the same peer don't
+   * retry in lockstep. The ceiling doubles each time, up to the maximum.
+   */
+  std::chrono::milliseconds next() {
+    const auto half = ceiling_.count() / 2;
+    std::uniform_int_distribution<std::chrono::milliseconds::rep> jitter{
+        0, ceiling_.count() - half};
+    const std::chrono::milliseconds delay{half + jitter(rng_)};
+    ceiling_ = std::min(ceiling_ * 2, max_);
+    return delay;
+  }
+
+  /**
+   * Start over from the minimum, e.g. after a successful connect.
+   */
+  void reset() { ceiling_ = min_; }
+
+private:
+  std::chrono::milliseconds min_;
+  std::chrono::milliseconds max_;
+  std::chrono::milliseconds ceiling_;
+  std::minstd_rand rng_;
+};
+
+} // namespace camcoder
@@ -0,0 +1,208 @@
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+
+#include <spdlog/spdlog.h>
+
+#include "capture_file.hpp"
+
+using namespace camcoder;
+
+template <typename T> static void put_le(char *out, T value) {
+  for (size_t i = 0; i < sizeof(T); i++) {
+    out[i] = static_cast<char>(static_cast<std::uint64_t>(value) >> (8 * i));
+  }
+}
+
+template <typename T> static T get_le(const char *in) {
+  std::uint64_t value = 0;
+  for (size_t i = 0; i < sizeof(T); i++) {
+    value |= static_cast<std::uint64_t>(static_cast<std::uint8_t>(in[i]))
+             << (8 * i);
+  }
+  return static_cast<T>(value);
+}
+
+bool CaptureHeader::read(std::istream &is, CaptureHeader &header) {
+  char buf[SIZE];
+  is.seekg(0, std::istream::beg);
+  if (!is.read(buf, SIZE) || std::memcmp(buf, MAGIC, sizeof(MAGIC)) != 0) {
+    return false;
+  }
+  const auto version = get_le<std::uint32_t>(buf + 8);
+  if (version != VERSION) {
+    spdlog::error("Capture file version {} isn't supported", version);
+    return false;
+  }
+  header.frame_params.pixel_format =
+      static_cast<PixelFormat>(get_le<std::uint32_t>(buf + 12));
+  header.frame_params.width = get_le<std::uint32_t>(buf + 16);
+  header.frame_params.height = get_le<std::uint32_t>(buf + 20);
+  header.frame_rate.numerator = get_le<std::uint32_t>(buf + 24);
+  header.frame_rate.denominator = get_le<std::uint32_t>(buf + 28);
+  header.frame_count = get_le<std::uint64_t>(buf + 32);
+  header.index_offset = get_le<std::uint64_t>(buf + 40);
+  if (header.frame_size() == 0 || header.frame_rate.denominator == 0) {
+    spdlog::error("Capture file has invalid frame parameters");
+    return false;
+  }
+  return true;
+}
+
+void CaptureHeader::write(std::ostream &os) const {
+  char buf[SIZE];
+  std::memcpy(buf, MAGIC, sizeof(MAGIC));
+  put_le<std::uint32_t>(buf + 8, VERSION);
+  put_le<std::uint32_t>(buf + 12,
+                        static_cast<std::uint32_t>(frame_params.pixel_format));
+  put_le<std::uint32_t>(buf + 16, frame_params.width);
+  put_le<std::uint32_t>(buf + 20, frame_params.height);
+  put_le<std::uint32_t>(buf + 24, frame_rate.numerator);
+  put_le<std::uint32_t>(buf + 28, frame_rate.denominator);
+  put_le<std::uint64_t>(buf + 32, frame_count);
+  put_le<std::uint64_t>(buf + 40, index_offset);
+  os.seekp(0, std::ostream::beg);
+  os.write(buf, SIZE);
+}
+
+bool camcoder::read_capture_timestamps(std::istream &is,
+                                       const CaptureHeader &header,
+                                       std::vector<std::int64_t> &timestamps) {
+  timestamps.clear();
+  char buf[CaptureHeader::TIMESTAMP_SIZE];
+  is.seekg(0, std::istream::end);
+  const std::uint64_t file_size = is.tellg();
+  if (header.index_offset != 0) {
+    // The counts come from the file, so check the frames and the index fit
+    // in it before allocating anything for them
+    if (header.index_offset < CaptureHeader::SIZE ||
+        header.index_offset > file_size ||
+        header.frame_count > (file_size - header.index_offset) / sizeof(buf) ||
+        header.frame_count > (header.index_offset - CaptureHeader::SIZE) /
+                                 header.record_size()) {
+      spdlog::error("Capture file's index doesn't fit in the file");
+      return false;
+    }
+    is.seekg(header.index_offset, std::istream::beg);
+    std::vector<char> index(header.frame_count * sizeof(buf));
+    if (!is.read(index.data(), index.size())) {
+      return false;
+    }
+    timestamps.reserve(header.frame_count);
+    for (size_t i = 0; i < header.frame_count; i++) {
+      timestamps.push_back(
+          get_le<std::int64_t>(index.data() + i * sizeof(buf)));
+    }
+    return true;
+  }
+
+  // Only complete records count; the last may have been cut off
+  const auto frames = file_size < CaptureHeader::SIZE
+                          ? 0
+                          : (file_size - CaptureHeader::SIZE) /
+                                header.record_size();
+  spdlog::warn("Capture file has no index; scanning {} frames", frames);
+  timestamps.reserve(frames);
+  for (std::uint64_t frame = 0; frame < frames; frame++) {
+    is.seekg(header.record_offset(frame), std::istream::beg);
+    if (!is.read(buf, sizeof(buf))) {
+      return false;
+    }
+    timestamps.push_back(get_le<std::int64_t>(buf));
+  }
+  return true;
+}
+
+/**
+ * path, or if that exists, the first of path-1, path-2, ... (before the
+ * extension) that doesn't, so a restarted source doesn't overwrite what it
+ * recorded before.
+ */
+static std::string unused_path(const std::string &path) {
+  std::error_code ec;
+  if (!std::filesystem::exists(path, ec)) {
+    return path;
+  }
+  const std::filesystem::path p{path};
+  const auto stem = (p.parent_path() / p.stem()).string();
+  const auto extension = p.extension().string();
+  for (unsigned n = 1;; n++) {
+    auto candidate = fmt::format("{}-{}{}", stem, n, extension);
+    if (!std::filesystem::exists(candidate, ec)) {
+      return candidate;
+    }
+  }
+}
+
+CaptureWriter::CaptureWriter(const std::string &path,
+                             const FrameParameters &frame_params,
+                             const FrameRate &frame_rate)
+    : path_{unused_path(path)}, header_{}, buffer_(BUFFER_SIZE), ofs_{},
+      timestamps_{}, first_timestamp_{0} {
+  header_.frame_params = frame_params;
+  header_.frame_rate = frame_rate;
+  // Must be set before the file is opened to take effect
+  ofs_.rdbuf()->pubsetbuf(buffer_.data(), buffer_.size());
+  if (path_ != path) {
+    spdlog::warn("Capture file {} exists; recording to {} instead", path,
+                 path_);
+  }
+  ofs_.open(path_, std::ofstream::binary);
+  header_.write(ofs_);
+  if (!ofs_.good()) {
+    spdlog::error("Failed to create capture file {}", path_);
+  }
+}
+
+CaptureWriter::~CaptureWriter() { close(); }
+
+bool CaptureWriter::write(const Frame &frame) {
+  if (!ofs_.is_open() || frame.width() != header_.frame_params.width ||
+      frame.height() != header_.frame_params.height ||
+      frame.pixel_format() != header_.frame_params.pixel_format) {
+    return false;
+  }
+  auto timestamp = frame.timestamp();
+  if (timestamp.count() == 0) {
+    timestamp = std::chrono::steady_clock::now().time_since_epoch();
+  }
+  if (timestamps_.empty()) {
+    first_timestamp_ = timestamp;
+  }
+  const auto relative = (timestamp - first_timestamp_).count();
+  char buf[CaptureHeader::TIMESTAMP_SIZE];
+  put_le<std::int64_t>(buf, relative);
+  ofs_.write(buf, sizeof(buf));
+  ofs_.write(frame.raw_data(), header_.frame_size());
+  if (!ofs_.good()) {
+    return false;
+  }
+  timestamps_.push_back(relative);
+  return true;
+}
+
+bool CaptureWriter::close() {
+  if (!ofs_.is_open()) {
+    return true;
+  }
+  header_.frame_count = timestamps_.size();
+  header_.index_offset = header_.record_offset(timestamps_.size());
+  ofs_.seekp(header_.index_offset, std::ostream::beg);
+  std::vector<char> index(timestamps_.size() * CaptureHeader::TIMESTAMP_SIZE);
+  for (size_t i = 0; i < timestamps_.size(); i++) {
+    put_le<std::int64_t>(index.data() + i * CaptureHeader::TIMESTAMP_SIZE,
+                         timestamps_[i]);
+  }
+  ofs_.write(index.data(), index.size());
+  // The header goes last, so a file cut off before here is scanned instead
+  header_.write(ofs_);
+  ofs_.close();
+  const bool ok = !ofs_.fail();
+  if (ok) {
+    spdlog::info("Wrote {} frames to capture file {}", timestamps_.size(),
+                 path_);
+  } else {
+    spdlog::error("Failed to finish capture file {}", path_);
+  }
+  return ok;
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "frame.hpp"
+#include "frame_parameters.hpp"
+
+namespace camcoder {
+
+/**
+ * Header of a capture file, which holds raw frames along with the time each
+ * arrived. The layout, all little-endian, is:
+ *
+ *   header   magic, version, pixel format, width, height, frame rate, frame
+ *            count and index offset (SIZE bytes)
+ *   records  per frame, its timestamp (int64 ns since the first frame) and
+ *            then its pixels
+ *   index    each frame's timestamp again, written when the file is closed
+ *
+ * Frames are a fixed size, so finding a frame's record is arithmetic. The
+ * index lets the timestamps be loaded without reading through the frames; a
+ * file whose writer never closed it has none and is scanned instead.
+ */
+struct CaptureHeader {
+  static constexpr char MAGIC[8] = {'C', 'A', 'M', 'C', 'A', 'P', 0, 0};
+  static constexpr std::uint32_t VERSION = 1;
+  static constexpr size_t SIZE = 48;
+  static constexpr size_t TIMESTAMP_SIZE = sizeof(std::int64_t);
+
+  FrameParameters frame_params{};
+  FrameRate frame_rate{};
+  // Zero until the writer closes the file
+  std::uint64_t frame_count = 0;
+  std::uint64_t index_offset = 0;
+
+  /**
+   * Read a header from the start of the stream. Returns false if it isn't a
+   * capture file (or is one of a version we don't know).
+   */
+  static bool read(std::istream &is, CaptureHeader &header);
+
+  void write(std::ostream &os) const;
+
+  size_t frame_size() const {
+    return frame_params.width * frame_params.height *
+           pixel_size(frame_params.pixel_format);
+  }
+
+  /**
+   * Bytes from one frame's record to the next.
+   */
+  size_t record_size() const { return TIMESTAMP_SIZE + frame_size(); }
+
+  std::uint64_t record_offset(std::uint64_t frame) const {
+    return SIZE + frame * record_size();
+  }
+};
+
+/**
+ * Load every frame's timestamp, from the index or, if the file wasn't closed
+ * properly, by visiting each complete record. Returns false on a read error.
+ */
+bool read_capture_timestamps(std::istream &is, const CaptureHeader &header,
+                             std::vector<std::int64_t> &timestamps);
+
+/**
+ * Records raw frames to a capture file as they're read from a source.
+ */
+class CaptureWriter {
+public:
+  /**
+   * Create the file and write its header. An existing file is kept, and a
+   * numbered one next to it is created instead; path() tells which. Check
+   * good() afterwards.
+   */
+  CaptureWriter(const std::string &path, const FrameParameters &frame_params,
+                const FrameRate &frame_rate);
+
+  /**
+   * Closes the file, if it's still open.
+   */
+  ~CaptureWriter();
+
+  CaptureWriter(const CaptureWriter &) = delete;
+  CaptureWriter &operator=(const CaptureWriter &) = delete;
+
+  bool good() const { return ofs_.good(); }
+
+  /**
+   * Append a frame. Its timestamp is taken relative to the first frame's;
+   * frames without one (from sources that aren't live) are stamped with the
+   * time they're written. Returns false if the frame doesn't match the
+   * file's parameters or the write failed.
+   */
+  bool write(const Frame &frame);
+
+  /**
+   * Write the index and the final header. Returns false if that failed.
+   */
+  bool close();
+
+  const std::string &path() const { return path_; }
+
+  std::uint64_t frame_count() const { return timestamps_.size(); }
+
+private:
+  /**
+   * Buffer for writing, large enough to take a typical frame in one go.
+   */
+  static constexpr size_t BUFFER_SIZE = 1024 * 1024;
+
+  std::string path_;
+  CaptureHeader header_;
+  std::vector<char> buffer_;
+  std::ofstream ofs_;
+  std::vector<std::int64_t> timestamps_;
+  Frame::Timestamp first_timestamp_;
+};
+
+} // namespace camcoder
@@ -0,0 +1,343 @@
+#include <algorithm>
+#include <ctime>
+#include <filesystem>
+
+#include <spdlog/spdlog.h>
+
+#include <gst/app/gstappsrc.h>
+
+#include "affinity.hpp"
+#include "clip_buffer.hpp"
+#include "utils.hpp"
+
+using namespace camcoder;
+
+static bool ends_with(const std::string &s, const std::string &suffix) {
+  return s.size() >= suffix.size() &&
+         s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+ClipBuffer::ClipBuffer(std::string name, const ClipParameters &params,
+                       std::string directory)
+    : name_{std::move(name)}, params_{params},
+      directory_{std::move(directory)}, mutex_{}, units_{}, first_seq_{0},
+      keyframes_{}, bytes_{0}, caps_{nullptr}, pending_{}, jobs_{},
+      jobs_cv_{}, stopping_{false}, written_{0}, failed_{0},
+      writer_{&ClipBuffer::run_writer, this} {}
+
+ClipBuffer::~ClipBuffer() {
+  flush();
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    stopping_ = true;
+  }
+  jobs_cv_.notify_all();
+  writer_.join();
+  for (const auto &unit : units_) {
+    gst_buffer_unref(unit.buffer);
+  }
+  if (caps_ != nullptr) {
+    gst_caps_unref(caps_);
+  }
+}
+
+GstPadProbeReturn ClipBuffer::probe(GstPad *pad, GstPadProbeInfo *info,
+                                    gpointer udata) {
+  auto &clips = *reinterpret_cast<ClipBuffer *>(udata);
+  if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER) {
+    clips.push(GST_PAD_PROBE_INFO_BUFFER(info));
+    return GST_PAD_PROBE_OK;
+  }
+  auto event = GST_PAD_PROBE_INFO_EVENT(info);
+  if (GST_EVENT_TYPE(event) == GST_EVENT_CAPS) {
+    GstCaps *caps = nullptr;
+    gst_event_parse_caps(event, &caps);
+    clips.set_caps(caps);
+  } else if (GST_EVENT_TYPE(event) == GST_EVENT_EOS) {
+    clips.flush();
+  }
+  return GST_PAD_PROBE_OK;
+}
+
+void ClipBuffer::push(GstBuffer *buf) {
+  const bool keyframe =
+      !GST_BUFFER_FLAG_IS_SET(buf, GST_BUFFER_FLAG_DELTA_UNIT);
+  const auto time = GST_CLOCK_TIME_IS_VALID(GST_BUFFER_DTS(buf))
+                        ? GST_BUFFER_DTS(buf)
+                        : GST_BUFFER_PTS(buf);
+  if (!GST_CLOCK_TIME_IS_VALID(time)) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock{mutex_};
+  // Nothing before the first keyframe can be decoded
+  if (keyframes_.empty() && !keyframe) {
+    return;
+  }
+  const auto seq = first_seq_ + units_.size();
+  if (keyframe) {
+    keyframes_.push_back(seq);
+  }
+  units_.push_back(Unit{gst_buffer_ref(buf), static_cast<std::int64_t>(time),
+                        keyframe});
+  bytes_ += gst_buffer_get_size(buf);
+
+  for (auto it = pending_.begin(); it != pending_.end();) {
+    if (units_.back().time < it->end_time) {
+      ++it;
+      continue;
+    }
+    finish(*it, seq);
+    it = pending_.erase(it);
+  }
+  if (over_limit() && !pending_.empty()) {
+    spdlog::warn("Clip buffer of {} reached {} bytes; finishing {} clips "
+                 "early",
+                 name_, params_.max_bytes, pending_.size());
+    flush_locked();
+  }
+  trim();
+}
+
+void ClipBuffer::set_caps(GstCaps *caps) {
+  std::lock_guard<std::mutex> lock{mutex_};
+  if (caps_ != nullptr) {
+    gst_caps_unref(caps_);
+  }
+  caps_ = gst_caps_ref(caps);
+}
+
+void ClipBuffer::flush() {
+  std::lock_guard<std::mutex> lock{mutex_};
+  flush_locked();
+}
+
+void ClipBuffer::flush_locked() {
+  for (const auto &clip : pending_) {
+    finish(clip, first_seq_ + units_.size());
+  }
+  pending_.clear();
+}
+
+std::string ClipBuffer::request(std::chrono::milliseconds pre,
+                                std::chrono::milliseconds post,
+                                std::string file_name, std::string &error) {
+  if (file_name.empty()) {
+    char stamp[32];
+    const auto now = std::time(nullptr);
+    std::tm tm{};
+    localtime_r(&now, &tm);
+    std::strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+    file_name = fmt::format("{}-{}", name_, stamp);
+  } else if (file_name.find('/') != std::string::npos) {
+    error = "file name can't contain a directory";
+    return {};
+  }
+  if (!ends_with(file_name, ".ts") && !ends_with(file_name, ".mp4")) {
+    file_name += "." + params_.format;
+  }
+  const auto path = utils::path_join(directory_, file_name);
+
+  std::lock_guard<std::mutex> lock{mutex_};
+  if (units_.empty() || caps_ == nullptr) {
+    error = "nothing buffered yet";
+    return {};
+  }
+  const auto newest = units_.back().time;
+  const auto start =
+      newest -
+      std::chrono::duration_cast<std::chrono::nanoseconds>(pre).count();
+  // The last keyframe at or before the start, or the oldest one if the
+  // buffer doesn't reach back that far
+  auto keyframe = std::upper_bound(
+      keyframes_.begin(), keyframes_.end(), start,
+      [this](std::int64_t time, std::uint64_t seq) {
+        return time < units_[seq - first_seq_].time;
+      });
+  if (keyframe != keyframes_.begin()) {
+    --keyframe;
+  }
+  pending_.push_back(Pending{
+      path, *keyframe,
+      newest +
+          std::chrono::duration_cast<std::chrono::nanoseconds>(post).count()});
+  spdlog::info("Clip {} of {} starts {:.1f} s back", path, name_,
+               (newest - units_[*keyframe - first_seq_].time) / 1e9);
+  if (post.count() <= 0) {
+    finish(pending_.back(), first_seq_ + units_.size());
+    pending_.pop_back();
+  }
+  return path;
+}
+
+std::chrono::nanoseconds ClipBuffer::buffered_duration() const {
+  std::lock_guard<std::mutex> lock{mutex_};
+  return units_.empty() ? std::chrono::nanoseconds{0}
+                        : std::chrono::nanoseconds{units_.back().time -
+                                                   units_.front().time};
+}
+
+size_t ClipBuffer::buffered_bytes() const {
+  std::lock_guard<std::mutex> lock{mutex_};
+  return bytes_;
+}
+
+std::uint64_t ClipBuffer::clips_written() const {
+  std::lock_guard<std::mutex> lock{mutex_};
+  return written_;
+}
+
+std::uint64_t ClipBuffer::clips_failed() const {
+  std::lock_guard<std::mutex> lock{mutex_};
+  return failed_;
+}
+
+void ClipBuffer::finish(const Pending &clip, std::uint64_t end) {
+  Job job{clip.path, gst_caps_ref(caps_), {}};
+  for (auto seq = std::max(clip.first, first_seq_); seq < end; seq++) {
+    job.buffers.push_back(gst_buffer_ref(units_[seq - first_seq_].buffer));
+  }
+  jobs_.push_back(std::move(job));
+  jobs_cv_.notify_one();
+}
+
+void ClipBuffer::trim() {
+  const auto cutoff =
+      units_.back().time -
+      std::chrono::duration_cast<std::chrono::nanoseconds>(params_.pre_roll)
+          .count();
+  auto keep = first_seq_ + units_.size();
+  for (const auto &clip : pending_) {
+    keep = std::min(keep, clip.first);
+  }
+  // The second keyframe can become the oldest once it's itself old enough
+  // to cover the pre-roll
+  while (keyframes_.size() > 1 && keyframes_[1] <= keep &&
+         (units_[keyframes_[1] - first_seq_].time <= cutoff || over_limit())) {
+    while (first_seq_ < keyframes_[1]) {
+      bytes_ -= gst_buffer_get_size(units_.front().buffer);
+      gst_buffer_unref(units_.front().buffer);
+      units_.pop_front();
+      first_seq_++;
+    }
+    keyframes_.pop_front();
+  }
+}
+
+void ClipBuffer::run_writer() {
+  set_thread_name(name_, "clip");
+  std::unique_lock<std::mutex> lock{mutex_};
+  while (true) {
+    jobs_cv_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+    if (jobs_.empty()) {
+      return;
+    }
+    auto job = std::move(jobs_.front());
+    jobs_.pop_front();
+    lock.unlock();
+    const bool ok = write(job);
+    for (auto buf : job.buffers) {
+      gst_buffer_unref(buf);
+    }
+    gst_caps_unref(job.caps);
+    lock.lock();
+    if (ok) {
+      written_++;
+    } else {
+      failed_++;
+    }
+  }
+}
+
+bool ClipBuffer::write(const Job &job) const {
+  if (job.buffers.empty()) {
+    spdlog::error("Clip {} of {} is empty", job.path, name_);
+    return false;
+  }
+  std::error_code ec;
+  std::filesystem::create_directories(
+      std::filesystem::path{job.path}.parent_path(), ec);
+
+  const bool h265 =
+      gst_structure_has_name(gst_caps_get_structure(job.caps, 0),
+                             "video/x-h265");
+  auto pipeline = gst_pipeline_new(nullptr);
+  auto appsrc = gst_element_factory_make("appsrc", nullptr);
+  auto parser =
+      gst_element_factory_make(h265 ? "h265parse" : "h264parse", nullptr);
+  auto mux = gst_element_factory_make(
+      ends_with(job.path, ".mp4") ? "mp4mux" : "mpegtsmux", nullptr);
+  auto sink = gst_element_factory_make("filesink", nullptr);
+  if (appsrc == nullptr || parser == nullptr || mux == nullptr ||
+      sink == nullptr) {
+    spdlog::error("Failed to create the clip pipeline for {}", name_);
+    for (auto element : {appsrc, parser, mux, sink}) {
+      if (element != nullptr) {
+        gst_object_unref(element);
+      }
+    }
+    gst_object_unref(pipeline);
+    return false;
+  }
+  gst_bin_add_many(GST_BIN(pipeline), appsrc, parser, mux, sink, nullptr);
+  gst_element_link_many(appsrc, parser, mux, sink, nullptr);
+
+  // Written beside the clip and renamed over it, so nothing picks up a
+  // partial one
+  const auto tmp_path = job.path + ".part";
+  g_object_set(appsrc, "caps", job.caps, "format", GST_FORMAT_TIME, "block",
+               TRUE, nullptr);
+  g_object_set(sink, "location", tmp_path.c_str(), nullptr);
+
+  // Rebase timestamps so the clip starts at zero
+  const auto first = job.buffers.front();
+  auto base = GST_BUFFER_PTS(first);
+  if (GST_CLOCK_TIME_IS_VALID(GST_BUFFER_DTS(first))) {
+    base = std::min(base, GST_BUFFER_DTS(first));
+  }
+  bool ok = gst_element_set_state(pipeline, GST_STATE_PLAYING) !=
+            GST_STATE_CHANGE_FAILURE;
+  for (auto it = job.buffers.begin(); ok && it != job.buffers.end(); ++it) {
+    // Shares the encoded data; only the metadata is copied
+    auto buf = gst_buffer_copy(*it);
+    for (auto time : {&GST_BUFFER_PTS(buf), &GST_BUFFER_DTS(buf)}) {
+      if (GST_CLOCK_TIME_IS_VALID(*time)) {
+        *time = *time > base ? *time - base : 0;
+      }
+    }
+    ok = gst_app_src_push_buffer(GST_APP_SRC(appsrc), buf) == GST_FLOW_OK;
+  }
+  gst_app_src_end_of_stream(GST_APP_SRC(appsrc));
+
+  // The muxer finishes the file (e.g. MP4's index) at the end of stream
+  auto bus = gst_element_get_bus(pipeline);
+  auto msg = gst_bus_timed_pop_filtered(
+      bus, GST_CLOCK_TIME_NONE,
+      static_cast<GstMessageType>(GST_MESSAGE_EOS | GST_MESSAGE_ERROR));
+  if (msg != nullptr) {
+    if (GST_MESSAGE_TYPE(msg) == GST_MESSAGE_ERROR) {
+      GError *err = nullptr;
+      gst_message_parse_error(msg, &err, nullptr);
+      spdlog::error("Error writing clip {} of {}: {}", job.path, name_,
+                    err->message);
+      g_error_free(err);
+      ok = false;
+    }
+    gst_message_unref(msg);
+  }
+  gst_object_unref(bus);
+  gst_element_set_state(pipeline, GST_STATE_NULL);
+  gst_object_unref(pipeline);
+
+  if (ok) {
+    std::filesystem::rename(tmp_path, job.path, ec);
+    ok = !ec;
+  }
+  if (!ok) {
+    spdlog::error("Failed to write clip {} of {}", job.path, name_);
+    std::filesystem::remove(tmp_path, ec);
+    return false;
+  }
+  spdlog::info("Wrote clip {} of {} ({} access units)", job.path, name_,
+               job.buffers.size());
+  return true;
+}
@@ -0,0 +1,196 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gst/gst.h>
+
+namespace camcoder {
+
+/**
+ * Per-source options for exporting clips of recent video.
+ */
+struct ClipParameters {
+  /**
+   * Encoded video kept so a clip can start this far before it's asked for.
+   * Zero disables clips.
+   */
+  std::chrono::milliseconds pre_roll{0};
+
+  /**
+   * How long a clip runs on after it's asked for, unless the request says
+   * otherwise.
+   */
+  std::chrono::milliseconds post_roll{30000};
+
+  /**
+   * Longest post-roll a request may ask for.
+   */
+  std::chrono::milliseconds max_post_roll{300000};
+
+  /**
+   * Most encoded video kept, in bytes. Pending clips are finished early and
+   * the pre-roll shortened to stay under it. Zero means no limit.
+   */
+  std::uint64_t max_bytes = 256 << 20;
+
+  /**
+   * Container for clips whose file name doesn't pick one: "ts" or "mp4".
+   */
+  std::string format{"ts"};
+
+  /**
+   * Where clips are written. Empty means a clips directory beside the
+   * source's segments.
+   */
+  std::string directory;
+};
+
+/**
+ * Recent encoded access units of one source, for cutting clips around an
+ * event without encoding anything again. Units are taken as they leave the
+ * encoder (or parser) by reference, not copied, and the oldest are dropped a
+ * keyframe interval at a time, so the buffer always starts on a keyframe and
+ * reaches back at least the pre-roll.
+ *
+ * A clip starts at the last keyframe at or before its start time and is
+ * finished once its post-roll has been buffered, or at the end of stream.
+ * It's then muxed and written on a background thread.
+ */
+class ClipBuffer {
+public:
+  /**
+   * name is the source's, for logging and clip file names. Clips are written
+   * to directory.
+   */
+  ClipBuffer(std::string name, const ClipParameters &params,
+             std::string directory);
+
+  /**
+   * Finish pending clips with what's buffered and wait for them to be
+   * written.
+   */
+  ~ClipBuffer();
+
+  ClipBuffer(const ClipBuffer &) = delete;
+  ClipBuffer &operator=(const ClipBuffer &) = delete;
+
+  /**
+   * Pad probe for the encoder's source pad that feeds its buffers, caps and
+   * end of stream to the ClipBuffer in udata.
+   */
+  static GstPadProbeReturn probe(GstPad *pad, GstPadProbeInfo *info,
+                                 gpointer udata);
+
+  /**
+   * Add an access unit; takes its own reference.
+   */
+  void push(GstBuffer *buf);
+
+  void set_caps(GstCaps *caps);
+
+  /**
+   * Finish pending clips with what's buffered, e.g. at the end of stream.
+   */
+  void flush();
+
+  /**
+   * Ask for a clip from pre before the newest unit until post after it. The
+   * file goes in the clip directory; its name is made up if file_name is
+   * empty, and its extension (".mp4" or ".ts") picks the container. Returns
+   * the clip's path, or an empty string with error set.
+   */
+  std::string request(std::chrono::milliseconds pre,
+                      std::chrono::milliseconds post, std::string file_name,
+                      std::string &error);
+
+  const ClipParameters &parameters() const { return params_; }
+
+  std::chrono::nanoseconds buffered_duration() const;
+
+  size_t buffered_bytes() const;
+
+  std::uint64_t clips_written() const;
+
+  std::uint64_t clips_failed() const;
+
+private:
+  struct Unit {
+    GstBuffer *buffer;
+    // Decode time, or presentation time if there's none
+    std::int64_t time;
+    bool keyframe;
+  };
+
+  /**
+   * A clip waiting for its post-roll.
+   */
+  struct Pending {
+    std::string path;
+    std::uint64_t first;
+    std::int64_t end_time;
+  };
+
+  /**
+   * A finished clip waiting to be written. Holds references to its units.
+   */
+  struct Job {
+    std::string path;
+    GstCaps *caps;
+    std::vector<GstBuffer *> buffers;
+  };
+
+  /**
+   * Queue the pending clip's units up to (not including) end for writing.
+   * Called with mutex_ held.
+   */
+  void finish(const Pending &clip, std::uint64_t end);
+
+  /**
+   * flush() with mutex_ held.
+   */
+  void flush_locked();
+
+  /**
+   * Drop whole keyframe intervals that are older than the pre-roll and that
+   * no pending clip needs, or while over max_bytes. Called with mutex_ held.
+   */
+  void trim();
+
+  bool over_limit() const {
+    return params_.max_bytes > 0 && bytes_ > params_.max_bytes;
+  }
+
+  void run_writer();
+
+  bool write(const Job &job) const;
+
+  std::string name_;
+  ClipParameters params_;
+  std::string directory_;
+
+  mutable std::mutex mutex_;
+  std::deque<Unit> units_;
+  // Sequence number of units_.front()
+  std::uint64_t first_seq_;
+  // Sequence numbers of the keyframes in units_
+  std::deque<std::uint64_t> keyframes_;
+  size_t bytes_;
+  GstCaps *caps_;
+  std::vector<Pending> pending_;
+
+  std::deque<Job> jobs_;
+  std::condition_variable jobs_cv_;
+  bool stopping_;
+  std::uint64_t written_;
+  std::uint64_t failed_;
+  std::thread writer_;
+};
+
+} // namespace camcoder
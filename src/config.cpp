@@ -4,6 +4,7 @@
 #include <toml.hpp>
 #include <spdlog/spdlog.h>
 
+#include "affinity.hpp"
 #include "config.hpp"
 
 using namespace camcoder;
@@ -17,6 +18,11 @@ static const std::unordered_map<std::string, FrameSourceType>
         {"file", FrameSourceType::FILE},
         {"tcp_client", FrameSourceType::TCP_CLIENT},
         {"tcp_server", FrameSourceType::TCP_SERVER},
+        {"shm", FrameSourceType::SHM},
+        {"unix_client", FrameSourceType::UNIX_CLIENT},
+        {"unix_server", FrameSourceType::UNIX_SERVER},
+        {"udp", FrameSourceType::UDP},
+        {"synthetic", FrameSourceType::SYNTHETIC},
     };
 
 static const std::unordered_map<std::string, PixelFormat>
@@ -24,6 +30,75 @@ static const std::unordered_map<std::string, PixelFormat>
         {"RGB", PixelFormat::RGB},
     };
 
+static const std::unordered_map<std::string, Encoding> encoding_from_string{
+    {"raw", Encoding::RAW},
+    {"h264", Encoding::H264},
+    {"h265", Encoding::H265},
+};
+
+static const std::unordered_map<std::string, FeedMode> feed_mode_from_string{
+    {"auto", FeedMode::AUTO},
+    {"pull", FeedMode::PULL},
+    {"push", FeedMode::PUSH},
+    {"inline", FeedMode::INLINE},
+};
+
+static const std::unordered_map<std::string, OverflowPolicy>
+    overflow_policy_from_string{
+        {"block", OverflowPolicy::BLOCK},
+        {"drop_oldest", OverflowPolicy::DROP_OLDEST},
+        {"drop_newest", OverflowPolicy::DROP_NEWEST},
+    };
+
+static const std::unordered_map<std::string, PlaceholderFrame>
+    placeholder_frame_from_string{
+        {"last", PlaceholderFrame::LAST},
+        {"black", PlaceholderFrame::BLACK},
+    };
+
+bool camcoder::parse_overflow_policy(const std::string &name,
+                                    OverflowPolicy &policy) {
+  const auto it = overflow_policy_from_string.find(name);
+  if (it == overflow_policy_from_string.end()) {
+    return false;
+  }
+  policy = it->second;
+  return true;
+}
+
+/**
+ * Parse a frame rate given either as an integer (Hz) or as a [numerator] or
+ * [numerator, denominator] array. Returns false if it's malformed.
+ */
+static bool parse_frame_rate(const toml::value &node, FrameRate &frame_rate) {
+  if (node.is_integer()) {
+    frame_rate.numerator = node.as_integer();
+    return true;
+  }
+  const auto frame_rate_array = node.as_array();
+  if (frame_rate_array.size() == 1) {
+    frame_rate.numerator = frame_rate_array.at(0).as_integer();
+  } else if (frame_rate_array.size() == 2 &&
+             frame_rate_array.at(1).as_integer() != 0) {
+    frame_rate.numerator = frame_rate_array.at(0).as_integer();
+    frame_rate.denominator = frame_rate_array.at(1).as_integer();
+  } else {
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Read a number that may be written as either an integer or a float.
+ */
+static double find_number(const toml::value &node, const std::string &key) {
+  const auto &value = toml::find(node, key);
+  if (value.is_integer()) {
+    return static_cast<double>(value.as_integer());
+  }
+  return value.as_floating();
+}
+
 Config::Config(std::istream &&is, const std::string &path) : Config{} {
   if (!is) {
     spdlog::warn("Failed to load config from {}; defaults will be used", path);
@@ -36,6 +111,9 @@ Config::Config(std::istream &&is, const std::string &path) : Config{} {
   if (root_.contains("output_directory")) {
     output_directory = toml::find<std::string>(root_, "output_directory");
   }
+  if (root_.contains("control_socket")) {
+    control_socket = toml::find<std::string>(root_, "control_socket");
+  }
 
   if (root_.contains("sources")) {
     for (const auto &[source_name, source_node] :
@@ -56,69 +134,376 @@ Config::Config(std::istream &&is, const std::string &path) : Config{} {
         continue;
       }
 
-      // Read frame parameters
+      auto encoding = Encoding::RAW;
+      if (source_node.contains("encoding")) {
+        const auto encoding_name =
+            toml::find<std::string>(source_node, "encoding");
+        const auto encoding_it = encoding_from_string.find(encoding_name);
+        if (encoding_it == encoding_from_string.end()) {
+          spdlog::error("Source node {} has invalid encoding {}", source_name,
+                        encoding_name);
+          continue;
+        }
+        encoding = encoding_it->second;
+      }
+      if (encoding != Encoding::RAW &&
+          (type->second == FrameSourceType::SHM ||
+           type->second == FrameSourceType::UDP ||
+           type->second == FrameSourceType::SYNTHETIC)) {
+        spdlog::error("Source node {} of type {} only supports raw frames",
+                      source_name, type_name);
+        continue;
+      }
+
+      // Read frame parameters. Capture files have them in their header.
       FrameParameters frame_params{};
-      if (!source_node.contains("frame_size")) {
+      const bool params_from_file = type->second == FrameSourceType::FILE &&
+                                    !source_node.contains("frame_size");
+      std::vector<int> frame_size{0, 0};
+      if (params_from_file) {
+        // The file source checks that it's a capture file
+      } else if (!source_node.contains("frame_size")) {
         spdlog::error("Source node {} missing required parameter frame_size",
                       source_name);
         continue;
-      } else if (!source_node.contains("pixel_format")) {
-        spdlog::error("Source node {} missing required parameter pixel_format");
-        continue;
-      }
-      const auto frame_size =
-          toml::find<std::vector<int>>(source_node, "frame_size");
-      if (frame_size.size() != 2) {
-        spdlog::error(
-            "Source node {} frame_size should have exactly 2 elements",
-            source_name);
-        continue;
-      } else if (std::find_if(frame_size.begin(), frame_size.end(),
-                              [](const auto &dim) { return dim <= 0; }) !=
-                 frame_size.end()) {
-        spdlog::error("Source node {} has invalid frame size", source_name);
+      } else if (encoding == Encoding::RAW &&
+                 !source_node.contains("pixel_format")) {
+        spdlog::error("Source node {} missing required parameter pixel_format",
+                      source_name);
         continue;
+      } else {
+        frame_size = toml::find<std::vector<int>>(source_node, "frame_size");
+        if (frame_size.size() != 2) {
+          spdlog::error(
+              "Source node {} frame_size should have exactly 2 elements",
+              source_name);
+          continue;
+        } else if (std::find_if(frame_size.begin(), frame_size.end(),
+                                [](const auto &dim) { return dim <= 0; }) !=
+                   frame_size.end()) {
+          spdlog::error("Source node {} has invalid frame size", source_name);
+          continue;
+        }
       }
       frame_params.width = frame_size[0];
       frame_params.height = frame_size[1];
 
+      ScaleParameters scale{};
+      if (source_node.contains("crop")) {
+        const auto crop = toml::find<std::vector<std::int64_t>>(
+            source_node, "crop");
+        if (crop.size() != 4 || crop[0] < 0 || crop[1] < 0 || crop[2] <= 0 ||
+            crop[3] <= 0 || crop[0] + crop[2] > frame_size[0] ||
+            crop[1] + crop[3] > frame_size[1]) {
+          spdlog::error("Source node {} crop should be [x, y, width, height] "
+                        "within frame_size",
+                        source_name);
+          continue;
+        }
+        scale.crop_x = crop[0];
+        scale.crop_y = crop[1];
+        scale.crop_width = crop[2];
+        scale.crop_height = crop[3];
+      }
+      if (source_node.contains("scale")) {
+        const auto size = toml::find<std::vector<std::int64_t>>(
+            source_node, "scale");
+        if (size.size() != 2 || size[0] <= 0 || size[1] <= 0) {
+          spdlog::error("Source node {} scale should be [width, height]",
+                        source_name);
+          continue;
+        }
+        scale.width = size[0];
+        scale.height = size[1];
+      }
+      if ((scale.cropped() || scale.scaled()) && encoding != Encoding::RAW) {
+        spdlog::warn("Source node {} is encoded; ignoring crop and scale",
+                     source_name);
+        scale = ScaleParameters{};
+      }
+
       FrameRate frame_rate{};
-      if (source_node.contains("frame_rate")) {
-        const auto frame_rate_node = toml::find(source_node, "frame_rate");
-        if (frame_rate_node.is_integer()) {
-          frame_rate.numerator = frame_rate_node.as_integer();
+      if (source_node.contains("frame_rate") &&
+          !parse_frame_rate(toml::find(source_node, "frame_rate"),
+                            frame_rate)) {
+        spdlog::error(
+            "Source node {} has invalid frame rate numerator/denominator",
+            source_name);
+      }
+
+      PacingParameters pacing{};
+      if (source_node.contains("target_frame_rate") &&
+          !parse_frame_rate(toml::find(source_node, "target_frame_rate"),
+                            pacing.target_frame_rate)) {
+        spdlog::error("Source node {} has invalid target_frame_rate",
+                      source_name);
+      }
+      if (source_node.contains("jitter_buffer")) {
+        const auto jitter_buffer_ms =
+            toml::find<std::int64_t>(source_node, "jitter_buffer");
+        if (jitter_buffer_ms < 0) {
+          spdlog::error("Source node {} has negative jitter_buffer",
+                        source_name);
         } else {
-          const auto frame_rate_array = frame_rate_node.as_array();
-          if (frame_rate_array.size() == 1) {
-            frame_rate.numerator = frame_rate_array.at(0).as_integer();
-          } else if (frame_rate_array.size() == 2 &&
-                     frame_rate_array.at(1).as_integer() != 0) {
-            frame_rate.numerator = frame_rate_array.at(0).as_integer();
-            frame_rate.denominator = frame_rate_array.at(1).as_integer();
-          } else {
-            spdlog::error(
-                "Source node {} has invalid frame rate numerator/denominator",
-                source_name);
-          }
-        }
-      }
-
-      const auto pixel_format_name =
-          toml::find<std::string>(source_node, "pixel_format");
-      const auto pixel_format =
-          pixel_format_from_string.find(pixel_format_name);
-      if (pixel_format == pixel_format_from_string.end()) {
-        spdlog::error("Source node {} has invalid pixel_format {}", source_name,
-                      pixel_format_name);
-        continue;
+          pacing.jitter_buffer = std::chrono::milliseconds{jitter_buffer_ms};
+        }
+      }
+
+      FeedParameters feed{};
+      if (source_node.contains("feed")) {
+        const auto feed_name = toml::find<std::string>(source_node, "feed");
+        const auto feed_mode = feed_mode_from_string.find(feed_name);
+        if (feed_mode == feed_mode_from_string.end()) {
+          spdlog::error("Source node {} has invalid feed {}", source_name,
+                        feed_name);
+        } else {
+          feed.mode = feed_mode->second;
+        }
+      }
+      if (source_node.contains("overflow")) {
+        const auto overflow_name =
+            toml::find<std::string>(source_node, "overflow");
+        if (!parse_overflow_policy(overflow_name, feed.overflow)) {
+          spdlog::error("Source node {} has invalid overflow {}", source_name,
+                        overflow_name);
+        }
+      }
+      if (source_node.contains("max_buffers")) {
+        feed.max_buffers =
+            toml::find<std::uint64_t>(source_node, "max_buffers");
+      }
+      if (source_node.contains("max_bytes")) {
+        feed.max_bytes = toml::find<std::uint64_t>(source_node, "max_bytes");
+      }
+
+      RecoveryParameters recovery{};
+      if (source_node.contains("reconnect_min")) {
+        recovery.reconnect_min = std::chrono::milliseconds{
+            toml::find<std::int64_t>(source_node, "reconnect_min")};
+      }
+      if (source_node.contains("reconnect_max")) {
+        recovery.reconnect_max = std::chrono::milliseconds{
+            toml::find<std::int64_t>(source_node, "reconnect_max")};
+      }
+      if (source_node.contains("stale_timeout")) {
+        recovery.stale_timeout = std::chrono::milliseconds{
+            toml::find<std::int64_t>(source_node, "stale_timeout")};
+      }
+      if (source_node.contains("stall_timeout")) {
+        recovery.stall_timeout = std::chrono::milliseconds{
+            toml::find<std::int64_t>(source_node, "stall_timeout")};
+      }
+      if (source_node.contains("max_restarts")) {
+        recovery.max_restarts =
+            toml::find<unsigned int>(source_node, "max_restarts");
+      }
+      if (source_node.contains("placeholder")) {
+        const auto placeholder_name =
+            toml::find<std::string>(source_node, "placeholder");
+        const auto placeholder =
+            placeholder_frame_from_string.find(placeholder_name);
+        if (placeholder == placeholder_frame_from_string.end()) {
+          spdlog::error("Source node {} has invalid placeholder {}",
+                        source_name, placeholder_name);
+        } else {
+          recovery.placeholder = placeholder->second;
+        }
+      }
+
+      MotionParameters motion{};
+      if (source_node.contains("motion")) {
+        motion.enabled = toml::find<bool>(source_node, "motion");
+      }
+      if (source_node.contains("motion_threshold")) {
+        motion.block_threshold = find_number(source_node, "motion_threshold");
+      }
+      if (source_node.contains("motion_static")) {
+        motion.static_activity = find_number(source_node, "motion_static");
+      }
+      if (source_node.contains("motion_scene_change")) {
+        motion.scene_change = find_number(source_node, "motion_scene_change");
+      }
+      if (source_node.contains("motion_skip")) {
+        motion.skip_static = toml::find<bool>(source_node, "motion_skip");
+      }
+      if (source_node.contains("motion_refresh")) {
+        motion.refresh = std::chrono::milliseconds{
+            toml::find<std::int64_t>(source_node, "motion_refresh")};
+      }
+      if (source_node.contains("motion_idle_after")) {
+        motion.idle_after = std::chrono::milliseconds{
+            toml::find<std::int64_t>(source_node, "motion_idle_after")};
+      }
+      if (source_node.contains("motion_idle_bitrate")) {
+        motion.idle_bitrate =
+            toml::find<unsigned int>(source_node, "motion_idle_bitrate");
+      }
+      if (motion.enabled && encoding != Encoding::RAW) {
+        spdlog::warn("Source node {} is encoded; ignoring motion", source_name);
+        motion.enabled = false;
+      }
+
+      std::string record;
+      if (source_node.contains("record")) {
+        record = toml::find<std::string>(source_node, "record");
+        if (encoding != Encoding::RAW) {
+          spdlog::warn("Source node {} is encoded; ignoring record",
+                       source_name);
+          record.clear();
+        }
+      }
+
+      ClipParameters clips{};
+      if (source_node.contains("clip_pre_roll")) {
+        clips.pre_roll = std::chrono::milliseconds{
+            toml::find<std::int64_t>(source_node, "clip_pre_roll")};
+      }
+      if (source_node.contains("clip_post_roll")) {
+        clips.post_roll = std::chrono::milliseconds{
+            toml::find<std::int64_t>(source_node, "clip_post_roll")};
+      }
+      if (source_node.contains("clip_max_post_roll")) {
+        clips.max_post_roll = std::chrono::milliseconds{
+            toml::find<std::int64_t>(source_node, "clip_max_post_roll")};
+      }
+      if (clips.post_roll > clips.max_post_roll) {
+        spdlog::warn("Source node {} has clip_post_roll over "
+                     "clip_max_post_roll; limiting it to {} ms",
+                     source_name, clips.max_post_roll.count());
+        clips.post_roll = clips.max_post_roll;
+      }
+      if (source_node.contains("clip_max_bytes")) {
+        clips.max_bytes =
+            toml::find<std::uint64_t>(source_node, "clip_max_bytes");
+      }
+      if (source_node.contains("clip_format")) {
+        clips.format = toml::find<std::string>(source_node, "clip_format");
+        if (clips.format != "ts" && clips.format != "mp4") {
+          spdlog::error("Source node {} has invalid clip_format {}",
+                        source_name, clips.format);
+          clips.format = ClipParameters{}.format;
+        }
+      }
+      if (source_node.contains("clip_directory")) {
+        clips.directory =
+            toml::find<std::string>(source_node, "clip_directory");
+      }
+
+      ArchiveParameters archive{};
+      if (source_node.contains("archive")) {
+        archive.directory = toml::find<std::string>(source_node, "archive");
+      }
+      if (source_node.contains("archive_segment")) {
+        archive.segment_duration = std::chrono::milliseconds{
+            toml::find<std::int64_t>(source_node, "archive_segment")};
+      }
+      if (source_node.contains("archive_max_age")) {
+        archive.max_age = std::chrono::seconds{
+            toml::find<std::int64_t>(source_node, "archive_max_age")};
+      }
+      if (source_node.contains("archive_max_bytes")) {
+        archive.max_bytes =
+            toml::find<std::uint64_t>(source_node, "archive_max_bytes");
+      }
+
+      DemandParameters demand{};
+      if (source_node.contains("on_demand")) {
+        demand.on_demand = toml::find<bool>(source_node, "on_demand");
+      }
+      if (source_node.contains("idle_timeout")) {
+        demand.idle_timeout = std::chrono::milliseconds{
+            toml::find<std::int64_t>(source_node, "idle_timeout")};
+      }
+      if (demand.on_demand &&
+          (clips.pre_roll.count() > 0 || !archive.directory.empty())) {
+        spdlog::warn("Source node {} keeps clips or an archive, which need "
+                     "the encoder running; ignoring on_demand",
+                     source_name);
+        demand.on_demand = false;
+      }
+
+      SegmentParameters segments{};
+      if (source_node.contains("segment_duration")) {
+        segments.duration = std::chrono::seconds{
+            toml::find<std::int64_t>(source_node, "segment_duration")};
+        if (segments.duration.count() <= 0) {
+          spdlog::error("Source node {} has invalid segment_duration {}",
+                        source_name, segments.duration.count());
+          segments.duration = SegmentParameters{}.duration;
+        }
+      }
+      if (source_node.contains("keyframe_interval")) {
+        segments.keyframe_interval =
+            toml::find<unsigned int>(source_node, "keyframe_interval");
+      }
+
+      ThreadOptions threads{};
+      if (source_node.contains("cpu_set")) {
+        const auto cpu_set = toml::find<std::string>(source_node, "cpu_set");
+        if (!parse_cpu_list(cpu_set, threads.cpus)) {
+          spdlog::error("Source node {} has invalid cpu_set {}", source_name,
+                        cpu_set);
+          threads.cpus.clear();
+        }
+      }
+      if (source_node.contains("numa_node")) {
+        threads.numa_node = toml::find<int>(source_node, "numa_node");
+        if (threads.cpus.empty() && threads.numa_node >= 0) {
+          threads.cpus = node_cpus(threads.numa_node);
+        }
+      }
+      if (source_node.contains("reader_priority")) {
+        threads.reader_priority =
+            toml::find<int>(source_node, "reader_priority");
+        if (threads.reader_priority < 0 || threads.reader_priority > 99) {
+          spdlog::error("Source node {} has invalid reader_priority {}",
+                        source_name, threads.reader_priority);
+          threads.reader_priority = 0;
+        }
+      }
+
+      bool huge_pages = false;
+      if (source_node.contains("huge_pages")) {
+        huge_pages = toml::find<bool>(source_node, "huge_pages");
+        if (huge_pages && encoding != Encoding::RAW) {
+          spdlog::warn("Source node {} is encoded; ignoring huge_pages",
+                       source_name);
+          huge_pages = false;
+        }
+      }
+
+      // Encoded streams carry their own format
+      if (encoding == Encoding::RAW && !params_from_file) {
+        const auto pixel_format_name =
+            toml::find<std::string>(source_node, "pixel_format");
+        const auto pixel_format =
+            pixel_format_from_string.find(pixel_format_name);
+        if (pixel_format == pixel_format_from_string.end()) {
+          spdlog::error("Source node {} has invalid pixel_format {}",
+                        source_name, pixel_format_name);
+          continue;
+        }
+        frame_params.pixel_format = pixel_format->second;
       }
-      frame_params.pixel_format = pixel_format->second;
 
       frame_sources.push_back(FrameSourceConfig{
           .name = source_name,
           .type = type->second,
           .frame_params = frame_params,
           .frame_rate = frame_rate,
+          .scale = scale,
+          .encoding = encoding,
+          .pacing = pacing,
+          .feed = feed,
+          .recovery = recovery,
+          .motion = motion,
+          .record = record,
+          .clips = clips,
+          .archive = archive,
+          .demand = demand,
+          .segments = segments,
+          .threads = threads,
+          .huge_pages = huge_pages,
           .options = source_node.as_table(),
       });
     }
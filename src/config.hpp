@@ -8,7 +8,13 @@
 
 #include <toml.hpp>
 
+#include "archiver.hpp"
+#include "clip_buffer.hpp"
 #include "frame_parameters.hpp"
+#include "frame_pacer.hpp"
+#include "frame_source.hpp"
+#include "frame_scaler.hpp"
+#include "motion_detector.hpp"
 
 namespace camcoder {
 
@@ -20,6 +26,117 @@ enum class FrameSourceType {
   FILE,
   TCP_CLIENT,
   TCP_SERVER,
+  SHM,
+  UNIX_CLIENT,
+  UNIX_SERVER,
+  UDP,
+  SYNTHETIC,
+};
+
+/**
+ * How frames get from a FrameThread into the pipeline.
+ */
+enum class FeedMode {
+  INVALID = 0,
+  AUTO,   /// INLINE if the source supports it, otherwise PULL
+  PULL,   /// The pipeline pops a frame when appsrc emits need-data
+  PUSH,   /// The reader thread pushes each frame into appsrc once it's read
+  INLINE, /// No reader thread; frames are read when appsrc emits need-data
+};
+
+/**
+ * Options for feeding a frame source into the pipeline.
+ */
+struct FeedParameters {
+  FeedMode mode = FeedMode::AUTO;
+
+  /**
+   * What to do with new frames when the queue (or appsrc, in push mode) is
+   * full.
+   */
+  OverflowPolicy overflow = OverflowPolicy::BLOCK;
+
+  /**
+   * appsrc queue limits. Zero leaves the appsrc default.
+   */
+  std::uint64_t max_buffers = 0;
+  std::uint64_t max_bytes = 0;
+};
+
+/**
+ * What to feed the encoder while a source is stale.
+ */
+enum class PlaceholderFrame {
+  INVALID = 0,
+  LAST,  /// Repeat the last frame received
+  BLACK, /// A black frame
+};
+
+/**
+ * How a source rides out outages.
+ */
+struct RecoveryParameters {
+  /**
+   * Bounds for the exponential backoff between reconnect attempts.
+   */
+  std::chrono::milliseconds reconnect_min = Backoff::DEFAULT_MIN;
+  std::chrono::milliseconds reconnect_max = Backoff::DEFAULT_MAX;
+
+  /**
+   * The source is stale once it has gone this long without a frame, and
+   * placeholder frames are fed to the encoder so the stream doesn't stall.
+   * Zero disables placeholders.
+   */
+  std::chrono::milliseconds stale_timeout{1000};
+
+  PlaceholderFrame placeholder = PlaceholderFrame::LAST;
+
+  /**
+   * The branch is stalled once frames have waited this long, in its appsrc
+   * or its reader's queue, without being taken or the encoder (or parser)
+   * putting anything out, and it's restarted. Zero disables the watchdog.
+   */
+  std::chrono::milliseconds stall_timeout{10000};
+
+  /**
+   * Consecutive restarts after a stall or error before the source is given
+   * up on. Zero removes a failed source straight away.
+   */
+  unsigned int max_restarts = 5;
+};
+
+/**
+ * Encoding a source only while someone is watching it.
+ */
+struct DemandParameters {
+  /**
+   * Run the encoder only while the source has viewers. While it's idle,
+   * frames are still read but only the last few are kept, for a fast
+   * restart.
+   */
+  bool on_demand = false;
+
+  /**
+   * The encoder is spun down once no viewer has been seen for this long.
+   */
+  std::chrono::milliseconds idle_timeout{60000};
+};
+
+/**
+ * How a source's HLS stream is cut into segments.
+ */
+struct SegmentParameters {
+  /**
+   * Target length of a segment. A segment is cut at the first keyframe
+   * after it, so this is also about how long the first one takes to appear.
+   */
+  std::chrono::seconds duration{2};
+
+  /**
+   * Most frames between keyframes of a raw source's encoder. Zero means one
+   * segment's worth at the source's frame rate.
+   */
+  unsigned int keyframe_interval = 0;
 };
 
 /**
@@ -43,12 +160,84 @@ struct FrameSourceConfig {
 
   FrameRate frame_rate;
 
+  /**
+   * Region of interest and output size, applied as frames are read.
+   */
+  ScaleParameters scale;
+
+  /**
+   * Raw frames, which are encoded, or an encoded stream passed through.
+   */
+  Encoding encoding;
+
+  /**
+   * Jitter buffer and output rate for timestamp regeneration.
+   */
+  PacingParameters pacing;
+
+  /**
+   * Push or pull feeding, queue limits and overflow policy.
+   */
+  FeedParameters feed;
+
+  /**
+   * Reconnect backoff and stale-source placeholders.
+   */
+  RecoveryParameters recovery;
+
+  /**
+   * Frame differencing to skip static frames and adapt the encoder.
+   */
+  MotionParameters motion;
+
+  /**
+   * Capture file to record raw frames to as they're read, before cropping
+   * and scaling. Empty if not recording.
+   */
+  std::string record;
+
+  /**
+   * Pre-roll of encoded video kept for exporting clips around events.
+   */
+  ClipParameters clips;
+
+  /**
+   * Continuous recording of the muxed stream, with rotation and retention.
+   */
+  ArchiveParameters archive;
+
+  /**
+   * Spinning the encoder down while nobody is watching.
+   */
+  DemandParameters demand;
+
+  /**
+   * Segment length and keyframe spacing.
+   */
+  SegmentParameters segments;
+
+  /**
+   * Placement and scheduling of the threads that read and encode frames.
+   */
+  ThreadOptions threads;
+
+  /**
+   * Back raw frames by 2 MiB huge pages, reserved at startup.
+   */
+  bool huge_pages;
+
   /**
    * Options specific to each type of frame source.
    */
   const toml::table &options;
 };
 
+/**
+ * Look up an overflow policy by its config name, e.g. "drop_oldest".
+ * Returns false if there's no such policy.
+ */
+bool parse_overflow_policy(const std::string &name, OverflowPolicy &policy);
+
 /**
  * Configuration for a running instance of camcoder.
  */
@@ -71,6 +260,11 @@ public:
   std::string output_directory;
   static constexpr std::string_view DEFAULT_OUTPUT_DIRECTORY{"."};
 
+  /**
+   * Path of the Unix socket for control commands. Empty disables control.
+   */
+  std::string control_socket;
+
   /**
    * This is the list of configs for the frame sources.
    */
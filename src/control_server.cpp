@@ -0,0 +1,144 @@
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include <spdlog/spdlog.h>
+
+#include "control_server.hpp"
+#include "utils.hpp"
+
+using namespace camcoder;
+
+ControlServer::ControlServer(const std::string &path, Handler handler)
+    : path_{path}, handler_{std::move(handler)}, acceptor_{},
+      stopping_{false}, thread_{}, clients_mutex_{}, clients_{} {}
+
+ControlServer::~ControlServer() { stop(); }
+
+bool ControlServer::start() {
+  // Remove a socket left behind by a previous run
+  if (!utils::remove_stale_socket(path_)) {
+    spdlog::error("{} exists and isn't a socket", path_);
+    return false;
+  }
+  // Commands can reconfigure the pipeline, so only our user may connect.
+  // Linux gives the socket file the socket's own mode at bind(), so it's
+  // restricted before anyone could connect, and without the process-wide
+  // umask other threads create files under.
+  const int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 || ::fchmod(fd, S_IRUSR | S_IWUSR) != 0) {
+    spdlog::error("Failed to create the control socket: {}",
+                  std::strerror(errno));
+    if (fd >= 0) {
+      ::close(fd);
+    }
+    return false;
+  }
+  acceptor_.reset(fd);
+  if (!acceptor_.bind(sockpp::unix_address{path_}) || !acceptor_.listen()) {
+    spdlog::error("Failed to listen for control connections on {}: {}", path_,
+                  acceptor_.last_error_str());
+    acceptor_.close();
+    return false;
+  }
+  spdlog::info("Listening for control connections on {}", path_);
+  thread_ = std::thread{&ControlServer::accept_loop, this};
+  return true;
+}
+
+void ControlServer::stop() {
+  if (stopping_.exchange(true) || !thread_.joinable()) {
+    return;
+  }
+  // Wakes accept()
+  acceptor_.shutdown();
+  thread_.join();
+  {
+    std::lock_guard<std::mutex> lock{clients_mutex_};
+    for (auto &client : clients_) {
+      client.sock.shutdown();
+    }
+  }
+  for (auto &client : clients_) {
+    client.thread.join();
+  }
+  clients_.clear();
+  acceptor_.close();
+  utils::remove_stale_socket(path_);
+}
+
+void ControlServer::accept_loop() {
+  while (!stopping_) {
+    sockpp::stream_socket sock = acceptor_.accept();
+    if (!sock.is_open()) {
+      if (!stopping_) {
+        spdlog::warn("Failed to accept a control connection: {}",
+                     acceptor_.last_error_str());
+      }
+      continue;
+    }
+    reap_clients();
+    std::lock_guard<std::mutex> lock{clients_mutex_};
+    auto &client = clients_.emplace_back();
+    client.sock = std::move(sock);
+    client.thread = std::thread{&ControlServer::serve, this, std::ref(client)};
+  }
+}
+
+void ControlServer::reap_clients() {
+  std::lock_guard<std::mutex> lock{clients_mutex_};
+  for (auto it = clients_.begin(); it != clients_.end();) {
+    if (it->done) {
+      it->thread.join();
+      it = clients_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void ControlServer::serve(Client &client) {
+  spdlog::debug("Control client connected");
+  std::string buffer;
+  char chunk[4096];
+  bool open = true;
+  while (open && !stopping_) {
+    const auto n = client.sock.read(chunk, sizeof(chunk));
+    if (n <= 0) {
+      break;
+    }
+    buffer.append(chunk, n);
+
+    size_t start = 0;
+    size_t end = 0;
+    while (open && (end = buffer.find('\n', start)) != std::string::npos) {
+      auto line = std::string_view{buffer}.substr(start, end - start);
+      start = end + 1;
+      if (!line.empty() && line.back() == '\r') {
+        line.remove_suffix(1);
+      }
+      if (line.empty()) {
+        continue;
+      }
+      json::Object command;
+      auto response =
+          json::parse_object(line, command)
+              ? handler_(command)
+              : std::string{R"({"ok":false,"error":"expected a JSON object"})"};
+      response.push_back('\n');
+      open = client.sock.write_n(response.data(), response.size()) ==
+             static_cast<ssize_t>(response.size());
+    }
+    buffer.erase(0, start);
+    if (buffer.size() > MAX_LINE_SIZE) {
+      spdlog::warn("Control command too long; closing the connection");
+      break;
+    }
+  }
+  client.sock.close();
+  client.done = true;
+  spdlog::debug("Control client disconnected");
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <sockpp/unix_acceptor.h>
+
+#include "json.hpp"
+
+namespace camcoder {
+
+/**
+ * Accepts control connections on a Unix-domain socket. Each line a client
+ * sends is a JSON object naming a command; each gets a one-line JSON object
+ * back. Clients are served on their own threads, so the handler must be
+ * thread-safe.
+ */
+class ControlServer {
+public:
+  /**
+   * Carry out a command and return the response object as JSON text.
+   */
+  using Handler = std::function<std::string(const json::Object &command)>;
+
+  /**
+   * Longer lines close the connection.
+   */
+  static constexpr size_t MAX_LINE_SIZE = 64 * 1024;
+
+  ControlServer(const std::string &path, Handler handler);
+  ~ControlServer();
+
+  ControlServer(const ControlServer &) = delete;
+  ControlServer &operator=(const ControlServer &) = delete;
+
+  /**
+   * Start accepting connections. Returns false if the socket couldn't be
+   * bound.
+   */
+  bool start();
+
+  /**
+   * Close the socket and every connection, and wait for their threads.
+   */
+  void stop();
+
+  const std::string &path() const { return path_; }
+
+private:
+  struct Client {
+    sockpp::stream_socket sock;
+    std::thread thread;
+    std::atomic<bool> done{false};
+  };
+
+  void accept_loop();
+  void serve(Client &client);
+
+  /**
+   * Join and forget clients that have disconnected.
+   */
+  void reap_clients();
+
+  std::string path_;
+  Handler handler_;
+  sockpp::unix_acceptor acceptor_;
+  std::atomic<bool> stopping_;
+  std::thread thread_;
+  std::mutex clients_mutex_;
+  std::list<Client> clients_;
+};
+
+} // namespace camcoder
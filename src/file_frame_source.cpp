@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <filesystem>
+
 #include <spdlog/spdlog.h>
 
 #include "file_frame_source.hpp"
@@ -8,7 +11,25 @@ FileFrameSource::FileFrameSource(const std::string &path,
                                  const FrameParameters &frame_params,
                                  const FrameRate &frame_rate)
     : FrameSource{frame_params, frame_rate}, path_{path}, ifs_{path},
-      loop_{false} {}
+      loop_{false}, capture_{false}, realtime_{false}, header_{},
+      timestamps_{}, next_frame_{0}, replay_base_ns_{-1}, replay_start_{},
+      interrupted_{false}, interrupt_mutex_{}, interrupt_cv_{} {}
+
+FileFrameSource::FileFrameSource(const std::string &path,
+                                 const CaptureHeader &header, bool realtime)
+    : FrameSource{header.frame_params, header.frame_rate}, path_{path},
+      ifs_{path, std::ifstream::binary}, loop_{false}, capture_{true},
+      realtime_{realtime}, header_{header}, timestamps_{}, next_frame_{0},
+      replay_base_ns_{-1}, replay_start_{}, interrupted_{false},
+      interrupt_mutex_{}, interrupt_cv_{} {
+  if (!read_capture_timestamps(ifs_, header_, timestamps_)) {
+    spdlog::error("Failed to read the frame index of {}", path_);
+    ifs_.setstate(std::ifstream::badbit);
+    return;
+  }
+  ifs_.clear();
+  ifs_.seekg(header_.record_offset(0), std::ifstream::beg);
+}
 
 std::unique_ptr<FileFrameSource>
 FileFrameSource::from_config(const FrameSourceConfig &config) {
@@ -18,17 +39,76 @@ FileFrameSource::from_config(const FrameSourceConfig &config) {
     spdlog::error("Option path is required for source {}", config.name);
     return nullptr;
   }
+  const std::string path = path_it->second.as_string();
+
+  std::unique_ptr<FileFrameSource> frame_source;
+  std::ifstream probe{path, std::ifstream::binary};
+  CaptureHeader header{};
+  if (CaptureHeader::read(probe, header)) {
+    if (config.encoding != Encoding::RAW) {
+      spdlog::error("{} is a capture file, which only holds raw frames",
+                    path);
+      return nullptr;
+    }
+    if (config.frame_params.width != 0 &&
+        (config.frame_params.width != header.frame_params.width ||
+         config.frame_params.height != header.frame_params.height)) {
+      spdlog::error("frame_size for source {} doesn't match capture file {}",
+                    config.name, path);
+      return nullptr;
+    }
+    if (config.frame_rate.numerator != 0) {
+      header.frame_rate = config.frame_rate;
+    }
+    bool realtime = true;
+    const auto realtime_it = config.options.find("realtime");
+    if (realtime_it != config.options.end()) {
+      realtime = realtime_it->second.as_boolean();
+    }
+    frame_source = std::make_unique<FileFrameSource>(path, header, realtime);
+    if (frame_source->bad()) {
+      return nullptr;
+    }
+    spdlog::info("Opened capture file {} with {} {}x{} frames", path,
+                 frame_source->timestamps_.size(), header.frame_params.width,
+                 header.frame_params.height);
+  } else {
+    if (config.frame_params.width == 0) {
+      spdlog::error("{} isn't a capture file, so source {} needs frame_size",
+                    path, config.name);
+      return nullptr;
+    }
+    frame_source = std::make_unique<FileFrameSource>(
+        path, config.frame_params, config.frame_rate);
+  }
 
-  auto frame_source = std::make_unique<FileFrameSource>(
-      path_it->second.as_string(), config.frame_params, config.frame_rate);
-
+  bool loop = false;
   const auto loop_it = config.options.find("loop");
   if (loop_it != config.options.end()) {
-    frame_source->enable_loop(loop_it->second.as_boolean());
+    loop = loop_it->second.as_boolean();
+    frame_source->enable_loop(loop);
+  }
+
+  const auto start_frame_it = config.options.find("start_frame");
+  const auto start_time_it = config.options.find("start_time");
+  if (start_frame_it != config.options.end()) {
+    if (!frame_source->seek_frame(start_frame_it->second.as_integer())) {
+      spdlog::error("Source {} can't start at frame {}", config.name,
+                    start_frame_it->second.as_integer());
+      return nullptr;
+    }
+  } else if (start_time_it != config.options.end()) {
+    const std::chrono::milliseconds start_time{
+        start_time_it->second.as_integer()};
+    if (!frame_source->seek_time(start_time)) {
+      spdlog::error("Source {} can't start at {} ms", config.name,
+                    start_time.count());
+      return nullptr;
+    }
   }
 
   spdlog::info("Creating FileFrameSource<path={}, loop={}>",
-               frame_source->path(), loop_it->second.as_boolean());
+               frame_source->path(), loop);
 
   return frame_source;
 }
@@ -41,29 +121,114 @@ bool FileFrameSource::seek(ptrdiff_t pos) {
   return ifs_.good();
 }
 
+bool FileFrameSource::seek_frame(std::uint64_t frame) {
+  if (capture_) {
+    if (frame >= timestamps_.size()) {
+      return false;
+    }
+    if (!seek(header_.record_offset(frame))) {
+      return false;
+    }
+  } else if (!seek(frame * frame_size_bytes())) {
+    return false;
+  }
+  next_frame_ = frame;
+  replay_base_ns_ = -1;
+  return true;
+}
+
+bool FileFrameSource::seek_time(Frame::Timestamp time) {
+  if (capture_) {
+    // The last frame captured at or before the time
+    const auto it = std::upper_bound(timestamps_.begin(), timestamps_.end(),
+                                     time.count());
+    const auto frame =
+        it == timestamps_.begin() ? 0 : it - timestamps_.begin() - 1;
+    return seek_frame(frame);
+  }
+  const auto rate = frame_rate();
+  if (rate.numerator == 0) {
+    return false;
+  }
+  return seek_frame(time.count() * rate.numerator /
+                    (std::int64_t{1000000000} * rate.denominator));
+}
+
+std::uint64_t FileFrameSource::frames() const {
+  if (capture_) {
+    return timestamps_.size();
+  }
+  std::error_code ec;
+  const auto size = std::filesystem::file_size(path_, ec);
+  return ec ? 0 : size / frame_size_bytes();
+}
+
 void FileFrameSource::enable_loop(bool enabled) { loop_ = enabled; }
 
 size_t FileFrameSource::read(char *buf, size_t n) {
+  if (capture_) {
+    // Records start with the timestamp, which is already in the index
+    if (at_end() || !ifs_.ignore(CaptureHeader::TIMESTAMP_SIZE)) {
+      return 0;
+    }
+    if (realtime_ && !wait_for_capture_time(timestamps_[next_frame_])) {
+      return 0;
+    }
+  }
   if (ifs_.read(buf, n)) {
+    next_frame_++;
     return n;
   } else {
     return 0;
   }
 }
 
-bool FileFrameSource::eof() const { return !loop_ && ifs_.eof(); }
+size_t FileFrameSource::read_some(char *buf, size_t n) {
+  ifs_.read(buf, n);
+  return ifs_.gcount();
+}
+
+bool FileFrameSource::eof() const { return !loop_ && at_end(); }
 
 bool FileFrameSource::good() const { return ifs_.good(); }
 
 bool FileFrameSource::bad() const { return ifs_.bad(); }
 
-bool FileFrameSource::connected_() const { return !ifs_.eof(); }
+bool FileFrameSource::connected_() const { return !at_end(); }
 
 bool FileFrameSource::connect_() {
-  if (loop_ && ifs_.eof()) {
+  if (loop_ && at_end()) {
     spdlog::debug("Rewinding file");
-    return seek(0);
+    return capture_ ? seek_frame(0) : seek(0);
   } else {
     return connected_();
   }
 }
+
+void FileFrameSource::interrupt_() {
+  {
+    std::lock_guard<std::mutex> lock{interrupt_mutex_};
+    interrupted_ = true;
+  }
+  interrupt_cv_.notify_all();
+}
+
+bool FileFrameSource::at_end() const {
+  if (capture_) {
+    // The index follows the last frame, so the stream doesn't end there
+    return next_frame_ >= timestamps_.size() || ifs_.bad();
+  }
+  return ifs_.eof();
+}
+
+bool FileFrameSource::wait_for_capture_time(std::int64_t timestamp) {
+  if (replay_base_ns_ < 0) {
+    replay_base_ns_ = timestamp;
+    replay_start_ = std::chrono::steady_clock::now();
+    return true;
+  }
+  const auto due =
+      replay_start_ + std::chrono::nanoseconds{timestamp - replay_base_ns_};
+  std::unique_lock<std::mutex> lock{interrupt_mutex_};
+  return !interrupt_cv_.wait_until(lock, due, [this] { return interrupted_; });
+}
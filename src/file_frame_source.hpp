@@ -1,5 +1,11 @@
 #pragma once
 
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+#include "capture_file.hpp"
 #include "frame_source.hpp"
 #include "config.hpp"
 
@@ -10,11 +16,50 @@ public:
   FileFrameSource(const std::string &path, const FrameParameters &frame_params,
                   const FrameRate &frame_rate = {0, 1});
 
+  /**
+   * Read a capture file, whose header gives the frame parameters and rate.
+   * With realtime set, frames are returned at the times they were captured,
+   * and the source is live; otherwise they're paced at the frame rate like a
+   * headerless file.
+   */
+  FileFrameSource(const std::string &path, const CaptureHeader &header,
+                  bool realtime);
+
   static std::unique_ptr<FileFrameSource>
   from_config(const FrameSourceConfig &config);
 
   bool seek(ptrdiff_t pos);
 
+  /**
+   * Continue reading from the given frame. Capture files and headerless
+   * files both have fixed-size frames, so this doesn't read anything.
+   */
+  bool seek_frame(std::uint64_t frame);
+
+  /**
+   * Continue reading from the last frame captured at or before time, which
+   * is since the first frame. Headerless files need a frame rate for this.
+   */
+  bool seek_time(Frame::Timestamp time);
+
+  bool is_capture() const { return capture_; }
+
+  /**
+   * Replay a capture file as fast as it can be read instead of at the times
+   * its frames were captured. Must be called before reading.
+   */
+  void set_realtime(bool realtime) { realtime_ = realtime; }
+
+  /**
+   * Number of whole frames in the file.
+   */
+  std::uint64_t frames() const;
+
+  /**
+   * Index of the frame the next read returns.
+   */
+  std::uint64_t position() const { return next_frame_; }
+
   void enable_loop(bool enabled);
 
   const std::string &path() const { return path_; }
@@ -22,6 +67,8 @@ public:
 private:
   size_t read(char *buf, size_t n) override;
 
+  size_t read_some(char *buf, size_t n) override;
+
   bool eof() const override;
 
   bool good() const override;
@@ -32,9 +79,42 @@ private:
 
   bool connect_() override;
 
+  // Reading a file never blocks for long, and its frames have no arrival
+  // time, unless a capture is being replayed in real time
+  bool can_read_inline_() const override { return !live_(); }
+
+  bool live_() const override { return capture_ && realtime_; }
+
+  void interrupt_() override;
+
+  /**
+   * True once every frame has been read.
+   */
+  bool at_end() const;
+
+  /**
+   * Wait until the frame captured at timestamp is due. Returns false if
+   * interrupted.
+   */
+  bool wait_for_capture_time(std::int64_t timestamp);
+
   std::string path_;
   std::ifstream ifs_;
   bool loop_;
+
+  bool capture_;
+  bool realtime_;
+  CaptureHeader header_;
+  // Capture time of each frame, in ns since the first
+  std::vector<std::int64_t> timestamps_;
+  std::uint64_t next_frame_;
+  // The first frame read since opening or seeking, and when it was read, for
+  // replaying in real time
+  std::int64_t replay_base_ns_;
+  std::chrono::steady_clock::time_point replay_start_;
+  bool interrupted_;
+  std::mutex interrupt_mutex_;
+  std::condition_variable interrupt_cv_;
 };
 
 } // namespace camcoder
@@ -2,9 +2,13 @@
 
 #include <cstdlib>
 #include <cstdint>
+#include <cstring>
+#include <chrono>
 #include <memory>
+#include <vector>
 
 #include "frame_parameters.hpp"
+#include "frame_pool.hpp"
 
 namespace camcoder {
 static constexpr size_t pixel_size(PixelFormat t);
@@ -57,11 +61,24 @@ public:
 
   constexpr std::uint64_t frame_number() const { return frame_number_; }
 
+  /**
+   * Time the frame finished arriving, on the steady clock. Zero if unknown.
+   */
   constexpr Timestamp timestamp() const { return timestamp_; }
 
   void set_timestamp(Timestamp timestamp) { timestamp_ = timestamp; }
 
-  const char *raw_data() { return raw_data_(); }
+  const char *raw_data() const { return raw_data_(); }
+
+  /**
+   * Bytes at raw_data(). For pixel frames this is size_bytes().
+   */
+  size_t raw_size() const { return raw_size_(); }
+
+  /**
+   * A copy with its own memory, taken from the same pool as this frame's.
+   */
+  virtual std::unique_ptr<Frame> clone() const = 0;
 
 protected:
   constexpr Frame() : Frame{{}, {}, {}} {}
@@ -75,6 +92,7 @@ protected:
   Frame &operator=(const Frame &other) = default;
 
   virtual const char *raw_data_() const = 0;
+  virtual size_t raw_size_() const { return size_bytes(); }
 
 private:
   FrameParameters params_;
@@ -88,7 +106,16 @@ template <typename TPixel> struct FrameTmpl : public Frame {
   FrameTmpl(size_t width, size_t height, std::uint64_t frame_number,
             Timestamp timestamp_ns = Timestamp{0})
       : Frame{{width, height, TPixel::format()}, frame_number, timestamp_ns},
-        data_{new TPixel[size_bytes()]} {}
+        data_{new std::uint8_t[size_bytes()]} {}
+
+  /**
+   * Wrap existing storage, e.g. from a FramePool. It must hold at least
+   * width * height pixels.
+   */
+  FrameTmpl(size_t width, size_t height, std::uint64_t frame_number,
+            FrameStorage storage, Timestamp timestamp_ns = Timestamp{0})
+      : Frame{{width, height, TPixel::format()}, frame_number, timestamp_ns},
+        data_{std::move(storage)} {}
 
   FrameTmpl() : Frame{}, data_{nullptr} {}
 
@@ -99,8 +126,8 @@ template <typename TPixel> struct FrameTmpl : public Frame {
   // Only move
   // Move constructor
   FrameTmpl(FrameTmpl<TPixel> &&other)
-      : Frame{other.params(), other.frame_number()}, data_{std::move(
-                                                         other.data_)} {}
+      : Frame{other.params(), other.frame_number(), other.timestamp()},
+        data_{std::move(other.data_)} {}
 
   // Move assignment operator
   FrameTmpl &operator=(FrameTmpl<TPixel> &&other) {
@@ -114,14 +141,16 @@ template <typename TPixel> struct FrameTmpl : public Frame {
   static constexpr size_t pixel_size() { return sizeof(pixel_type); }
   constexpr size_t size_bytes() const { return size_pixels() * pixel_size(); }
 
-  TPixel *data() { return data_.get(); }
+  TPixel *data() { return reinterpret_cast<TPixel *>(data_.get()); }
 
-  const TPixel *data() const { return data_.get(); }
+  const TPixel *data() const {
+    return reinterpret_cast<const TPixel *>(data_.get());
+  }
 
   TPixel &at(size_t x, size_t y) {
     size_t i = y * width() + x;
     if (i < size_pixels()) {
-      return data_.get()[i];
+      return data()[i];
     } else {
       throw std::out_of_range{"Frame access out of range"};
     }
@@ -130,7 +159,7 @@ template <typename TPixel> struct FrameTmpl : public Frame {
   const TPixel &at(size_t x, size_t y) const {
     size_t i = y * width() + x;
     if (i < size_pixels()) {
-      return data_.get()[i];
+      return data()[i];
     } else {
       throw std::out_of_range{"Frame access out of range"};
     }
@@ -144,6 +173,19 @@ template <typename TPixel> struct FrameTmpl : public Frame {
     }
   }
 
+  std::unique_ptr<Frame> clone() const override {
+    const auto &pool = data_.get_deleter().pool;
+    FrameStorage storage =
+        pool != nullptr && pool->buffer_size() >= size_bytes()
+            ? pool->acquire()
+            : FrameStorage{new std::uint8_t[size_bytes()]};
+    if (size_bytes() > 0) {
+      std::memcpy(storage.get(), data_.get(), size_bytes());
+    }
+    return std::make_unique<FrameTmpl<TPixel>>(
+        width(), height(), frame_number(), std::move(storage), timestamp());
+  }
+
   static constexpr std::unique_ptr<FrameTmpl<TPixel>>
   cast(std::unique_ptr<Frame> f) {
     if (TPixel::format() == f->pixel_format()) {
@@ -159,11 +201,91 @@ private:
     return reinterpret_cast<const char *>(data_.get());
   }
 
-  std::unique_ptr<TPixel[]> data_;
+  FrameStorage data_;
 };
 
 using RGBFrame = FrameTmpl<RGBPixel>;
 
 static_assert(RGBFrame::pixel_size() == 3);
 
+/**
+ * One access unit (a coded picture and the parameter sets or SEI that precede
+ * it) from an encoded stream. The frame parameters are informational only.
+ */
+class EncodedFrame : public Frame {
+public:
+  EncodedFrame(const FrameParameters &params, std::uint64_t frame_number,
+               Encoding encoding, std::vector<std::uint8_t> data,
+               bool keyframe, Timestamp timestamp_ns = Timestamp{0})
+      : Frame{params, frame_number, timestamp_ns}, encoding_{encoding},
+        data_{std::move(data)}, keyframe_{keyframe} {}
+
+  Encoding encoding() const { return encoding_; }
+
+  /**
+   * True if decoding can start at this frame.
+   */
+  bool keyframe() const { return keyframe_; }
+
+  const std::uint8_t *data() const { return data_.data(); }
+
+  std::unique_ptr<Frame> clone() const override {
+    return std::make_unique<EncodedFrame>(*this);
+  }
+
+private:
+  const char *raw_data_() const override {
+    return reinterpret_cast<const char *>(data_.data());
+  }
+
+  size_t raw_size_() const override { return data_.size(); }
+
+  Encoding encoding_;
+  std::vector<std::uint8_t> data_;
+  bool keyframe_;
+};
+
+/**
+ * A reference-counted, read-only handle to a frame, so one frame can go to
+ * several consumers without being copied. Copies share the frame, and can be
+ * released on any thread; its memory goes back to its pool once the last one
+ * is. A consumer that needs to modify the frame uses make_writable(), which
+ * copies it first if anyone else still holds it.
+ */
+class SharedFrame {
+public:
+  SharedFrame() = default;
+  SharedFrame(std::nullptr_t) {}
+  SharedFrame(std::unique_ptr<Frame> frame) : frame_{std::move(frame)} {}
+
+  const Frame &operator*() const { return *frame_; }
+  const Frame *operator->() const { return frame_.get(); }
+  const Frame *get() const { return frame_.get(); }
+
+  explicit operator bool() const { return frame_ != nullptr; }
+  bool operator==(std::nullptr_t) const { return frame_ == nullptr; }
+  bool operator!=(std::nullptr_t) const { return frame_ != nullptr; }
+
+  /**
+   * Handles to the frame, including this one.
+   */
+  long use_count() const { return frame_.use_count(); }
+
+  /**
+   * The frame, to modify in place. If other handles share it, this one is
+   * moved to a copy first, so they never see the change.
+   */
+  Frame &make_writable() {
+    if (frame_.use_count() > 1) {
+      frame_ = std::shared_ptr<Frame>{frame_->clone()};
+    }
+    return *frame_;
+  }
+
+  void reset() { frame_.reset(); }
+
+private:
+  std::shared_ptr<Frame> frame_;
+};
+
 } // namespace camcoder
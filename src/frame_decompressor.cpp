@@ -0,0 +1,143 @@
+#include <algorithm>
+#include <cstring>
+
+#include <lz4.h>
+#include <zstd.h>
+
+#include <spdlog/spdlog.h>
+
+#include "frame_decompressor.hpp"
+
+using namespace camcoder;
+
+static std::uint32_t load_le32(const std::uint8_t *p) {
+  return std::uint32_t{p[0]} | std::uint32_t{p[1]} << 8 |
+         std::uint32_t{p[2]} << 16 | std::uint32_t{p[3]} << 24;
+}
+
+/**
+ * dst ^= src, a word at a time; the compiler vectorizes the main loop.
+ */
+static void xor_into(char *dst, const char *src, size_t n) {
+  size_t i = 0;
+  for (; i + sizeof(std::uint64_t) <= n; i += sizeof(std::uint64_t)) {
+    std::uint64_t a, b;
+    std::memcpy(&a, dst + i, sizeof(a));
+    std::memcpy(&b, src + i, sizeof(b));
+    a ^= b;
+    std::memcpy(dst + i, &a, sizeof(a));
+  }
+  for (; i < n; i++) {
+    dst[i] ^= src[i];
+  }
+}
+
+FrameDecompressor::FrameDecompressor(size_t frame_size, bool deltas)
+    : max_payload_size_{std::max<size_t>(LZ4_COMPRESSBOUND(frame_size),
+                                         ZSTD_COMPRESSBOUND(frame_size))},
+      zstd_{ZSTD_createDCtx()}, payload_(max_payload_size_), deltas_{deltas},
+      previous_(deltas ? frame_size : 0), have_previous_{false},
+      payload_bytes_{0}, frame_bytes_{0}, delta_frames_{0} {}
+
+FrameDecompressor::~FrameDecompressor() { ZSTD_freeDCtx(zstd_); }
+
+bool FrameDecompressor::receive(sockpp::socket &sock, char *buf, size_t n,
+                                ReceiveStats &stats) {
+  std::uint8_t header[HEADER_SIZE];
+  if (receive_exact(sock, reinterpret_cast<char *>(header), sizeof(header),
+                    stats) != sizeof(header)) {
+    return false;
+  }
+
+  const auto magic = load_le32(header);
+  const auto codec = header[4];
+  const auto flags = header[5];
+  const size_t payload_size = load_le32(header + 8);
+  const size_t frame_size = load_le32(header + 12);
+  if (magic != MAGIC) {
+    spdlog::error("Bad frame header magic {:#010x}", magic);
+    return false;
+  }
+  if (frame_size != n || payload_size > max_payload_size_) {
+    spdlog::error("Frame of {} bytes ({} on the wire) doesn't fit in {}",
+                  frame_size, payload_size, n);
+    return false;
+  }
+  const bool delta = flags & FLAG_DELTA;
+  if (delta && !deltas_) {
+    spdlog::error("Delta frame, but deltas aren't enabled for the source");
+    return false;
+  }
+  if (delta && !have_previous_) {
+    spdlog::error("Delta frame without a previous frame");
+    return false;
+  }
+
+  if (!decode(sock, stats, codec, buf, n, payload_size)) {
+    return false;
+  }
+  payload_bytes_ += HEADER_SIZE + payload_size;
+  frame_bytes_ += n;
+
+  if (delta) {
+    xor_into(buf, previous_.data(), n);
+    delta_frames_++;
+  }
+  if (deltas_) {
+    std::memcpy(previous_.data(), buf, n);
+    have_previous_ = true;
+  }
+  return true;
+}
+
+bool FrameDecompressor::decode(sockpp::socket &sock, ReceiveStats &stats,
+                               std::uint8_t codec, char *buf, size_t n,
+                               size_t payload_size) {
+  switch (static_cast<Codec>(codec)) {
+  case Codec::NONE:
+    if (payload_size != n) {
+      spdlog::error("Uncompressed frame is {} bytes, expected {}",
+                    payload_size, n);
+      return false;
+    }
+    return receive_exact(sock, buf, n, stats) == n;
+  case Codec::LZ4: {
+    if (receive_exact(sock, payload_.data(), payload_size, stats) !=
+        payload_size) {
+      return false;
+    }
+    const auto size = LZ4_decompress_safe(payload_.data(), buf,
+                                          static_cast<int>(payload_size),
+                                          static_cast<int>(n));
+    if (size < 0 || static_cast<size_t>(size) != n) {
+      spdlog::error("LZ4 frame failed to decompress");
+      return false;
+    }
+    return true;
+  }
+  case Codec::ZSTD: {
+    if (receive_exact(sock, payload_.data(), payload_size, stats) !=
+        payload_size) {
+      return false;
+    }
+    const auto size =
+        ZSTD_decompressDCtx(zstd_, buf, n, payload_.data(), payload_size);
+    if (ZSTD_isError(size) || size != n) {
+      spdlog::error("zstd frame failed to decompress: {}",
+                    ZSTD_isError(size) ? ZSTD_getErrorName(size)
+                                       : "wrong size");
+      return false;
+    }
+    return true;
+  }
+  default:
+    spdlog::error("Unknown frame codec {}", codec);
+    return false;
+  }
+}
+
+SourceStats FrameDecompressor::stats() const {
+  return {{"payload_bytes", payload_bytes_},
+          {"decoded_bytes", frame_bytes_},
+          {"delta_frames", delta_frames_}};
+}
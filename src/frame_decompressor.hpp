@@ -0,0 +1,93 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include <sockpp/socket.h>
+
+#include "frame_source.hpp"
+#include "socket_options.hpp"
+
+typedef struct ZSTD_DCtx_s ZSTD_DCtx;
+
+namespace camcoder {
+
+/**
+ * Reads frames that are sent with a per-frame header, optionally compressed
+ * and optionally as a delta against the previous frame.
+ *
+ * Each frame on the wire is a 16-byte little-endian header followed by the
+ * payload:
+ *
+ *     uint32 magic         "CCFZ"
+ *     uint8  codec         0 = uncompressed, 1 = LZ4 block, 2 = zstd frame
+ *     uint8  flags         bit 0: the decoded payload is XORed with the
+ *                          previous frame
+ *     uint16 reserved
+ *     uint32 payload_size  bytes following the header
+ *     uint32 frame_size    bytes once decoded; must match the source's frames
+ *
+ * XOR deltas of a mostly static scene are mostly zeros, which both codecs
+ * squeeze down to almost nothing. The first frame after connecting can't be
+ * a delta. Deltas have to be enabled up front, since then every frame is
+ * copied to decode the next one against; streams without them aren't.
+ */
+class FrameDecompressor {
+public:
+  static constexpr std::uint32_t MAGIC = 0x5a464343; // "CCFZ"
+  static constexpr size_t HEADER_SIZE = 16;
+
+  enum class Codec : std::uint8_t {
+    NONE = 0,
+    LZ4 = 1,
+    ZSTD = 2,
+  };
+
+  static constexpr std::uint8_t FLAG_DELTA = 0x01;
+
+  /**
+   * deltas allows delta frames, at the cost of keeping a copy of each frame.
+   */
+  FrameDecompressor(size_t frame_size, bool deltas);
+  ~FrameDecompressor();
+
+  FrameDecompressor(const FrameDecompressor &) = delete;
+  FrameDecompressor &operator=(const FrameDecompressor &) = delete;
+
+  /**
+   * Receive one frame from sock and decode it into buf, which holds n bytes.
+   * Returns false if the connection failed or the frame couldn't be decoded;
+   * either way the stream can't be trusted and should be reconnected.
+   */
+  bool receive(sockpp::socket &sock, char *buf, size_t n, ReceiveStats &stats);
+
+  /**
+   * Forget the previous frame, e.g. after reconnecting.
+   */
+  void reset() { have_previous_ = false; }
+
+  SourceStats stats() const;
+
+private:
+  /**
+   * Receive the payload and decode it into buf.
+   */
+  bool decode(sockpp::socket &sock, ReceiveStats &stats, std::uint8_t codec,
+              char *buf, size_t n, size_t payload_size);
+
+  size_t max_payload_size_;
+  ZSTD_DCtx *zstd_;
+  std::vector<char> payload_;
+  bool deltas_;
+  // The last frame, if deltas are allowed
+  std::vector<char> previous_;
+  bool have_previous_;
+
+  // Counted on the reader thread, read by stats() from the pipeline thread
+  std::atomic<std::uint64_t> payload_bytes_;
+  std::atomic<std::uint64_t> frame_bytes_;
+  std::atomic<std::uint64_t> delta_frames_;
+};
+
+} // namespace camcoder
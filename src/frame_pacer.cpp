@@ -0,0 +1,150 @@
+#include <algorithm>
+#include <cmath>
+
+#include "frame_pacer.hpp"
+
+using namespace camcoder;
+
+static FramePacer::Timestamp period_of(const FrameRate &frame_rate) {
+  return FramePacer::Timestamp{std::uint64_t{frame_rate.denominator} *
+                               1'000'000'000 / frame_rate.numerator};
+}
+
+FramePacer::FramePacer(const FrameRate &source_frame_rate,
+                       const PacingParameters &params)
+    : params_{params}, estimate_rate_{false}, period_{0}, started_{false},
+      have_previous_{false}, next_slot_{0}, last_pts_{Timestamp::min()},
+      last_arrival_{Timestamp::min()}, mean_interval_ns_{0},
+      interval_count_{0}, dropped_{0}, duplicated_{0} {
+  if (params_.target_frame_rate.numerator == 0) {
+    params_.target_frame_rate = source_frame_rate;
+  }
+  if (params_.target_frame_rate.numerator > 0 &&
+      params_.target_frame_rate.denominator > 0) {
+    period_ = period_of(params_.target_frame_rate);
+  } else {
+    estimate_rate_ = true;
+  }
+}
+
+FramePacer::Decision FramePacer::admit(Timestamp arrival) {
+  update_estimate(arrival);
+  return schedule(arrival);
+}
+
+FramePacer::Decision FramePacer::admit_placeholder(Timestamp now) {
+  return schedule(now);
+}
+
+FramePacer::Decision FramePacer::schedule(Timestamp arrival) {
+  if (period_.count() == 0) {
+    // No rate yet, so pass the arrival time through
+    next_slot_ = arrival;
+    started_ = true;
+    have_previous_ = true;
+    return {0, true};
+  }
+
+  if (!started_) {
+    next_slot_ = arrival;
+    started_ = true;
+  }
+
+  Decision decision{0, true};
+  const auto lateness = arrival - next_slot_;
+  const auto tolerance = params_.jitter_buffer + period_ / 2;
+  if (lateness > params_.jitter_buffer + RESYNC_THRESHOLD) {
+    // The source was gone for a while; don't try to fill the gap
+    next_slot_ = arrival;
+  } else if (lateness > tolerance) {
+    const std::size_t missed =
+        (lateness - params_.jitter_buffer + period_ / 2) / period_;
+    if (have_previous_) {
+      decision.duplicates = missed;
+      duplicated_ += missed;
+    } else {
+      next_slot_ += missed * period_;
+    }
+  } else if (-lateness > tolerance) {
+    // Burst beyond what the jitter buffer can absorb
+    ++dropped_;
+    decision.emit = false;
+    return decision;
+  }
+
+  have_previous_ = true;
+  return decision;
+}
+
+FramePacer::Decision FramePacer::admit_next(Timestamp now) {
+  if (!started_ || period_.count() == 0) {
+    // Without a rate, frames go out as fast as they're read
+    next_slot_ = now;
+    started_ = true;
+  }
+  have_previous_ = true;
+  return {0, true};
+}
+
+FramePacer::Decision FramePacer::admit_passthrough(Timestamp arrival) {
+  update_estimate(arrival);
+  next_slot_ = arrival;
+  started_ = true;
+  have_previous_ = true;
+  return {0, true};
+}
+
+FramePacer::Timestamp FramePacer::next_pts() {
+  auto pts = next_slot_ + params_.jitter_buffer;
+  if (last_pts_ != Timestamp::min() && pts <= last_pts_) {
+    pts = last_pts_ + Timestamp{1};
+  }
+  next_slot_ += period_;
+  last_pts_ = pts;
+  return pts;
+}
+
+FrameRate FramePacer::output_frame_rate() const {
+  if (estimate_rate_) {
+    return estimated_frame_rate();
+  } else {
+    return params_.target_frame_rate;
+  }
+}
+
+FrameRate FramePacer::estimated_frame_rate() const {
+  if (interval_count_ < ESTIMATE_WARMUP_FRAMES || mean_interval_ns_ <= 0) {
+    return {};
+  }
+  // Millihertz resolution is enough to tell 29.97 from 30
+  return {static_cast<std::uint32_t>(std::lround(1e12 / mean_interval_ns_)),
+          1000};
+}
+
+void FramePacer::reset() {
+  started_ = false;
+  have_previous_ = false;
+  last_arrival_ = Timestamp::min();
+}
+
+void FramePacer::update_estimate(Timestamp arrival) {
+  const auto previous = last_arrival_;
+  last_arrival_ = arrival;
+  if (previous == Timestamp::min()) {
+    return;
+  }
+  const auto interval = arrival - previous;
+  if (interval.count() <= 0 || interval > RESYNC_THRESHOLD) {
+    return;
+  }
+
+  // Exponential moving average, but a plain mean until it has warmed up
+  constexpr std::size_t MAX_WEIGHT = 16;
+  ++interval_count_;
+  const auto weight = std::min(interval_count_, MAX_WEIGHT);
+  mean_interval_ns_ += (interval.count() - mean_interval_ns_) / weight;
+
+  if (estimate_rate_ && interval_count_ >= ESTIMATE_WARMUP_FRAMES) {
+    period_ = Timestamp{std::llround(mean_interval_ns_)};
+  }
+}
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include "frame_parameters.hpp"
+
+namespace camcoder {
+
+/**
+ * Per-source pacing options.
+ */
+struct PacingParameters {
+  /**
+   * Output frame rate. If the numerator is 0, the source's frame rate is used,
+   * and if that is also 0, the rate is estimated from frame arrivals.
+   */
+  FrameRate target_frame_rate;
+
+  /**
+   * How much arrival jitter to absorb before frames are dropped or
+   * duplicated. Output timestamps are delayed by this much.
+   */
+  std::chrono::nanoseconds jitter_buffer;
+};
+
+/**
+ * Regenerates monotonic, evenly spaced timestamps for frames that arrive at
+ * irregular times, dropping or duplicating frames to hold a target rate.
+ *
+ * All times are running times on the pipeline clock. The pacer doesn't hold
+ * frames; it only tells the caller what to do with each one.
+ */
+class FramePacer {
+public:
+  using Timestamp = std::chrono::nanoseconds;
+
+  /**
+   * What to do with a frame that just arrived.
+   */
+  struct Decision {
+    /**
+     * Number of output slots to fill with the previous frame before this one.
+     */
+    std::size_t duplicates;
+
+    /**
+     * False if the frame arrived too early and should be dropped.
+     */
+    bool emit;
+  };
+
+  /**
+   * Number of arrivals averaged before an estimated rate is used.
+   */
+  static constexpr std::size_t ESTIMATE_WARMUP_FRAMES = 8;
+
+  /**
+   * A gap longer than this (past the jitter buffer) resets the output
+   * schedule instead of being filled with duplicates.
+   */
+  static constexpr Timestamp RESYNC_THRESHOLD = std::chrono::seconds{1};
+
+  FramePacer(const FrameRate &source_frame_rate,
+             const PacingParameters &params);
+
+  /**
+   * Record the arrival of a frame.
+   */
+  Decision admit(Timestamp arrival);
+
+  /**
+   * Schedule a frame from a source that isn't live, in the slot after the
+   * previous one. Such frames are never dropped or duplicated; `now` only
+   * anchors the first slot.
+   */
+  Decision admit_next(Timestamp now);
+
+  /**
+   * Schedule a live frame that must not be dropped or duplicated, like an
+   * access unit of an encoded stream, at its arrival time. The rate is still
+   * estimated for buffer durations.
+   */
+  Decision admit_passthrough(Timestamp arrival);
+
+  /**
+   * Schedule a placeholder standing in for frames that didn't arrive. Like
+   * admit(), but it isn't counted toward the estimated rate.
+   */
+  Decision admit_placeholder(Timestamp now);
+
+  /**
+   * Timestamp for the next output slot. Call once per buffer pushed (each
+   * duplicate, then the frame itself).
+   */
+  Timestamp next_pts();
+
+  /**
+   * Duration of one output slot, or 0 if the rate isn't known yet.
+   */
+  Timestamp frame_duration() const { return period_; }
+
+  /**
+   * How far output timestamps are delayed behind the slots they fill.
+   */
+  Timestamp latency() const { return params_.jitter_buffer; }
+
+  /**
+   * The rate frames are being emitted at, or 0/1 if it isn't known yet.
+   */
+  FrameRate output_frame_rate() const;
+
+  /**
+   * The input rate as estimated from arrival times, or 0/1 if there haven't
+   * been enough arrivals.
+   */
+  FrameRate estimated_frame_rate() const;
+
+  std::uint64_t dropped() const { return dropped_; }
+  std::uint64_t duplicated() const { return duplicated_; }
+
+  /**
+   * Forget the output schedule, e.g. after the source reconnects.
+   */
+  void reset();
+
+private:
+  void update_estimate(Timestamp arrival);
+  Decision schedule(Timestamp arrival);
+
+  PacingParameters params_;
+  bool estimate_rate_;
+  Timestamp period_;
+
+  bool started_;
+  bool have_previous_;
+  Timestamp next_slot_;
+  Timestamp last_pts_;
+
+  Timestamp last_arrival_;
+  double mean_interval_ns_;
+  std::size_t interval_count_;
+
+  // Read by stats requests on other threads
+  std::atomic<std::uint64_t> dropped_;
+  std::atomic<std::uint64_t> duplicated_;
+};
+
+} // namespace camcoder
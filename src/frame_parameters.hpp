@@ -19,6 +19,16 @@ pixel_format_to_string(PixelFormat format) {
   }
 }
 
+/**
+ * How a source's frames are coded.
+ */
+enum class Encoding {
+  INVALID = 0,
+  RAW,  /// Uncompressed frames of a fixed size
+  H264, /// H.264 Annex-B byte stream
+  H265, /// H.265 Annex-B byte stream
+};
+
 struct FrameParameters {
   size_t width;
   size_t height;
@@ -0,0 +1,259 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <new>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+
+#include "affinity.hpp"
+#include "frame_pool.hpp"
+
+using namespace camcoder;
+
+/**
+ * Where the kernel's pool of reserved 2 MiB pages is configured, for the
+ * whole system or a NUMA node.
+ */
+static std::string huge_page_directory(int node) {
+  if (node < 0) {
+    return "/sys/kernel/mm/hugepages/hugepages-2048kB/";
+  }
+  return fmt::format(
+      "/sys/devices/system/node/node{}/hugepages/hugepages-2048kB/", node);
+}
+
+static std::int64_t read_count(const std::string &path) {
+  std::ifstream ifs{path};
+  std::int64_t count = 0;
+  ifs >> count;
+  return count;
+}
+
+/**
+ * Make sure at least pages reserved huge pages are free, growing the
+ * kernel's pool if it's short. Returns false if it couldn't be.
+ */
+static bool grow_huge_page_pool(size_t pages, int node) {
+  const auto dir = huge_page_directory(node);
+  const auto total = read_count(dir + "nr_hugepages");
+  // Pages promised to mappings but not yet faulted in are free but taken;
+  // only counted system-wide
+  const auto available =
+      read_count(dir + "free_hugepages") - read_count(dir + "resv_hugepages");
+  const auto wanted = static_cast<std::int64_t>(pages);
+  if (available >= wanted) {
+    return true;
+  }
+  const auto target = total + wanted - std::max<std::int64_t>(available, 0);
+  {
+    std::ofstream ofs{dir + "nr_hugepages"};
+    ofs << target;
+  }
+  // The kernel reserves what it can find contiguous memory for
+  const auto reserved = read_count(dir + "nr_hugepages");
+  if (reserved < target) {
+    spdlog::warn("Only {} of {} huge pages could be reserved in {}; the rest "
+                 "of the frame buffers will use transparent huge pages",
+                 reserved, target, dir);
+    return false;
+  }
+  spdlog::info("Reserved {} huge pages in {}", target, dir);
+  return true;
+}
+
+/**
+ * Size of the mappings that back buffers of buffer_size bytes, or zero if
+ * they come from the heap.
+ */
+static size_t mapped_size(size_t buffer_size, const FrameMemory &memory) {
+  size_t page = 0;
+  if (memory.huge_pages) {
+    page = FramePool::HUGE_PAGE_SIZE;
+  } else if (memory.numa_node >= 0) {
+    page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  } else {
+    return 0;
+  }
+  return (buffer_size + page - 1) / page * page;
+}
+
+void FrameStorageDeleter::operator()(std::uint8_t *data) const {
+  if (pool != nullptr) {
+    pool->release(data);
+  } else {
+    delete[] data;
+  }
+}
+
+std::shared_ptr<FramePool> FramePool::create(size_t buffer_size,
+                                             size_t max_free,
+                                             const FrameMemory &memory) {
+  // The constructor is private, so make_shared can't be used
+  return std::shared_ptr<FramePool>{
+      new FramePool{buffer_size, max_free, memory}};
+}
+
+FramePool::FramePool(size_t buffer_size, size_t max_free,
+                     const FrameMemory &memory)
+    : buffer_size_{buffer_size}, max_free_{max_free}, memory_{memory},
+      mapped_size_{mapped_size(buffer_size, memory)}, mutex_{}, free_{},
+      allocated_{0}, reused_{0}, huge_allocated_{0}, huge_fallbacks_{0} {
+  free_.reserve(max_free_);
+}
+
+FramePool::~FramePool() {
+  for (auto data : free_) {
+    deallocate(data);
+  }
+}
+
+FrameStorage FramePool::acquire() {
+  std::uint8_t *data = nullptr;
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    if (!free_.empty()) {
+      data = free_.back();
+      free_.pop_back();
+      reused_++;
+    } else {
+      allocated_++;
+    }
+  }
+  if (data == nullptr) {
+    data = allocate();
+  }
+  return FrameStorage{data, FrameStorageDeleter{shared_from_this()}};
+}
+
+size_t FramePool::reserve(size_t count) {
+  count = std::min(count, max_free_);
+  size_t needed = 0;
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    needed = count > free_.size() ? count - free_.size() : 0;
+  }
+  if (needed == 0) {
+    return 0;
+  }
+  if (memory_.huge_pages) {
+    grow_huge_page_pool(needed * mapped_size_ / HUGE_PAGE_SIZE,
+                        memory_.numa_node);
+  }
+  std::vector<std::uint8_t *> buffers;
+  for (size_t i = 0; i < needed; i++) {
+    auto data = allocate();
+    // Take the page faults now rather than while frames are arriving
+    std::memset(data, 0, buffer_size_);
+    buffers.push_back(data);
+  }
+  std::lock_guard<std::mutex> lock{mutex_};
+  allocated_ += buffers.size();
+  free_.insert(free_.end(), buffers.begin(), buffers.end());
+  return buffers.size();
+}
+
+std::uint64_t FramePool::allocated() const {
+  std::lock_guard<std::mutex> lock{mutex_};
+  return allocated_;
+}
+
+std::uint64_t FramePool::reused() const {
+  std::lock_guard<std::mutex> lock{mutex_};
+  return reused_;
+}
+
+std::uint64_t FramePool::huge_allocated() const {
+  std::lock_guard<std::mutex> lock{mutex_};
+  return huge_allocated_;
+}
+
+std::uint64_t FramePool::huge_fallbacks() const {
+  std::lock_guard<std::mutex> lock{mutex_};
+  return huge_fallbacks_;
+}
+
+std::uint8_t *FramePool::allocate() {
+  if (memory_.huge_pages) {
+    auto data = allocate_huge();
+    if (memory_.numa_node >= 0) {
+      bind_to_node(data, mapped_size_, memory_.numa_node);
+    }
+    return data;
+  }
+  if (memory_.numa_node >= 0) {
+    // A mapping of its own, so binding it doesn't move heap memory that
+    // other allocations share pages with
+    auto addr = mmap(nullptr, mapped_size_, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+      throw std::bad_alloc{};
+    }
+    bind_to_node(addr, mapped_size_, memory_.numa_node);
+    return static_cast<std::uint8_t *>(addr);
+  }
+  return new std::uint8_t[buffer_size_];
+}
+
+std::uint8_t *FramePool::allocate_huge() {
+  auto addr = mmap(nullptr, mapped_size_, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (addr != MAP_FAILED) {
+    std::lock_guard<std::mutex> lock{mutex_};
+    huge_allocated_++;
+    return static_cast<std::uint8_t *>(addr);
+  }
+
+  // Over-map so the buffer can start on a huge page boundary, which
+  // transparent huge pages need
+  const auto size = mapped_size_ + HUGE_PAGE_SIZE;
+  addr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (addr == MAP_FAILED) {
+    throw std::bad_alloc{};
+  }
+  const auto start = reinterpret_cast<std::uintptr_t>(addr);
+  const auto aligned = (start + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+  const auto end = aligned + mapped_size_;
+  if (aligned > start) {
+    munmap(addr, aligned - start);
+  }
+  if (start + size > end) {
+    munmap(reinterpret_cast<void *>(end), start + size - end);
+  }
+  const auto data = reinterpret_cast<std::uint8_t *>(aligned);
+  madvise(data, mapped_size_, MADV_HUGEPAGE);
+
+  std::uint64_t fallbacks = 0;
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    fallbacks = ++huge_fallbacks_;
+  }
+  if (fallbacks == 1) {
+    spdlog::warn("No reserved huge pages left for {} byte frame buffers; "
+                 "using transparent huge pages",
+                 buffer_size_);
+  }
+  return data;
+}
+
+void FramePool::deallocate(std::uint8_t *data) {
+  if (mapped_size_ > 0) {
+    munmap(data, mapped_size_);
+  } else {
+    delete[] data;
+  }
+}
+
+void FramePool::release(std::uint8_t *data) {
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    if (free_.size() < max_free_) {
+      free_.push_back(data);
+      return;
+    }
+  }
+  deallocate(data);
+}
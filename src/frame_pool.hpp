@@ -0,0 +1,135 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace camcoder {
+
+class FramePool;
+
+/**
+ * Frees frame memory, or hands it back to the pool it came from.
+ */
+struct FrameStorageDeleter {
+  std::shared_ptr<FramePool> pool;
+
+  void operator()(std::uint8_t *data) const;
+};
+
+/**
+ * Memory backing a frame's pixels.
+ */
+using FrameStorage = std::unique_ptr<std::uint8_t[], FrameStorageDeleter>;
+
+/**
+ * How a pool's buffers are allocated. It's fixed when the pool is created,
+ * since each buffer has to be freed the way it was allocated.
+ */
+struct FrameMemory {
+  /**
+   * NUMA node buffers are placed on, e.g. the one whose CPUs read and
+   * encode them, each in a mapping of its own. Negative leaves it to the
+   * kernel.
+   */
+  int numa_node = -1;
+
+  /**
+   * Back buffers by 2 MiB huge pages, so large frames take a few TLB
+   * entries instead of hundreds. Reserved (hugetlbfs) pages are used while
+   * there are any; after that buffers ask for transparent huge pages.
+   */
+  bool huge_pages = false;
+};
+
+/**
+ * Recycles fixed-size frame buffers so steady-state reading doesn't allocate.
+ * Buffers keep the pool alive until they're released, so frames can outlive
+ * the source that read them.
+ */
+class FramePool : public std::enable_shared_from_this<FramePool> {
+public:
+  /**
+   * Free buffers kept for reuse; more can be outstanding, but extras are
+   * freed when released.
+   */
+  static constexpr size_t DEFAULT_MAX_FREE = 16;
+
+  /**
+   * Size of the huge pages buffers are backed by when enabled.
+   */
+  static constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+  static std::shared_ptr<FramePool> create(size_t buffer_size,
+                                           size_t max_free = DEFAULT_MAX_FREE,
+                                           const FrameMemory &memory = {});
+
+  ~FramePool();
+
+  FramePool(const FramePool &) = delete;
+  FramePool &operator=(const FramePool &) = delete;
+
+  /**
+   * Take a free buffer, or allocate one if there are none.
+   */
+  FrameStorage acquire();
+
+  size_t buffer_size() const { return buffer_size_; }
+
+  bool huge_pages() const { return memory_.huge_pages; }
+
+  /**
+   * Allocate and fault in buffers until count are free, so the memory for
+   * steady-state reading is taken up front. With huge pages, the kernel's
+   * pool of reserved huge pages is grown to fit them first if it's short,
+   * which needs root. Returns the number of buffers added.
+   */
+  size_t reserve(size_t count);
+
+  /**
+   * Buffers allocated over the pool's lifetime.
+   */
+  std::uint64_t allocated() const;
+
+  /**
+   * Acquisitions satisfied from the free list.
+   */
+  std::uint64_t reused() const;
+
+  /**
+   * Buffers allocated from reserved huge pages.
+   */
+  std::uint64_t huge_allocated() const;
+
+  /**
+   * Buffers that fell back to transparent huge pages because no reserved
+   * ones were left.
+   */
+  std::uint64_t huge_fallbacks() const;
+
+private:
+  friend struct FrameStorageDeleter;
+
+  FramePool(size_t buffer_size, size_t max_free, const FrameMemory &memory);
+
+  std::uint8_t *allocate();
+  std::uint8_t *allocate_huge();
+  void deallocate(std::uint8_t *data);
+  void release(std::uint8_t *data);
+
+  size_t buffer_size_;
+  size_t max_free_;
+  FrameMemory memory_;
+  // Buffer size rounded up to whole pages (huge ones with huge_pages) when
+  // buffers are mapped; zero when they come from the heap
+  size_t mapped_size_;
+  mutable std::mutex mutex_;
+  std::vector<std::uint8_t *> free_;
+  std::uint64_t allocated_;
+  std::uint64_t reused_;
+  std::uint64_t huge_allocated_;
+  std::uint64_t huge_fallbacks_;
+};
+
+} // namespace camcoder
@@ -0,0 +1,46 @@
+#include "frame_queue.hpp"
+
+using namespace camcoder;
+using code_machina::BlockingStatus;
+
+FrameQueue::FrameQueue(size_t size, OverflowPolicy overflow)
+    : queue_{size}, overflow_{overflow}, dropped_{0} {}
+
+void FrameQueue::push(SharedFrame frame) {
+  if (queue_.is_adding_completed()) {
+    return;
+  }
+  switch (overflow_) {
+  case OverflowPolicy::DROP_NEWEST:
+    if (queue_.try_add(std::move(frame)) != BlockingStatus::Ok) {
+      dropped_++;
+    }
+    break;
+  case OverflowPolicy::DROP_OLDEST:
+    while (queue_.try_add(std::move(frame)) != BlockingStatus::Ok &&
+           !queue_.is_adding_completed()) {
+      SharedFrame oldest;
+      if (queue_.try_take(oldest) == BlockingStatus::Ok) {
+        dropped_++;
+      }
+    }
+    break;
+  case OverflowPolicy::BLOCK:
+  case OverflowPolicy::INVALID:
+  default:
+    queue_.add(std::move(frame));
+    break;
+  }
+}
+
+SharedFrame FrameQueue::pop() {
+  SharedFrame frame;
+  queue_.take(frame);
+  return frame;
+}
+
+bool FrameQueue::pop(SharedFrame &frame, std::chrono::milliseconds timeout) {
+  return queue_.try_take(frame, timeout) == BlockingStatus::Ok;
+}
+
+void FrameQueue::close() { queue_.complete_adding(); }
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include <BlockingCollection.h>
+
+#include "frame.hpp"
+
+namespace camcoder {
+
+/**
+ * What a FrameQueue does with a new frame when it's full.
+ */
+enum class OverflowPolicy {
+  INVALID = 0,
+  BLOCK,       /// Wait for room, stalling the reader
+  DROP_OLDEST, /// Discard the oldest queued frame
+  DROP_NEWEST, /// Discard the new frame
+};
+
+/**
+ * A bounded queue of frames from a FrameThread to one consumer. Each queue
+ * has its own overflow policy, so a consumer that can afford to lose frames
+ * falling behind never holds up the reader, or the other consumers.
+ */
+class FrameQueue {
+public:
+  FrameQueue(size_t size, OverflowPolicy overflow);
+
+  FrameQueue(const FrameQueue &) = delete;
+  FrameQueue &operator=(const FrameQueue &) = delete;
+
+  /**
+   * Add a frame, making room as the overflow policy says. Ignored once the
+   * queue is closed.
+   */
+  void push(SharedFrame frame);
+
+  /**
+   * Take the next frame, blocking until there is one. Returns null once the
+   * queue is closed and empty.
+   */
+  SharedFrame pop();
+
+  /**
+   * Like pop(), but give up after timeout. Returns false if there was no
+   * frame.
+   */
+  bool pop(SharedFrame &frame, std::chrono::milliseconds timeout);
+
+  /**
+   * No more frames will be added. Wakes anything blocked in push() or pop().
+   */
+  void close();
+
+  /**
+   * True once the queue is closed and empty.
+   */
+  bool finished() const { return queue_.is_completed(); }
+
+  size_t size() const { return queue_.size(); }
+
+  OverflowPolicy overflow_policy() const { return overflow_; }
+
+  /**
+   * Change the overflow policy; safe while frames are flowing.
+   */
+  void set_overflow_policy(OverflowPolicy overflow) { overflow_ = overflow; }
+
+  /**
+   * Frames discarded by the overflow policy.
+   */
+  std::uint64_t dropped() const { return dropped_; }
+
+private:
+  mutable code_machina::BlockingQueue<SharedFrame> queue_;
+  std::atomic<OverflowPolicy> overflow_;
+  std::atomic<std::uint64_t> dropped_;
+};
+
+} // namespace camcoder
@@ -0,0 +1,215 @@
+#include <algorithm>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "frame_scaler.hpp"
+
+using namespace camcoder;
+
+static constexpr size_t CHANNELS = sizeof(RGBPixel);
+
+// Bilinear weights are 7-bit so that a weighted sum of two bytes fits in a
+// signed 16-bit lane
+static constexpr std::uint32_t WEIGHT_ONE = 128;
+static constexpr std::uint32_t WEIGHT_SHIFT = 7;
+
+/**
+ * Map output positions to the input position to the left of (or above) each,
+ * and the weight of the next one, sampling at pixel centers.
+ */
+static void bilinear_taps(size_t in_size, size_t out_size,
+                          std::vector<std::uint32_t> &positions,
+                          std::vector<std::uint8_t> &weights) {
+  positions.resize(out_size);
+  weights.resize(out_size);
+  const double ratio = static_cast<double>(in_size) / out_size;
+  for (size_t i = 0; i < out_size; i++) {
+    const double position = std::clamp((i + 0.5) * ratio - 0.5, 0.0,
+                                       static_cast<double>(in_size - 1));
+    const auto whole = static_cast<std::uint32_t>(position);
+    positions[i] = whole;
+    weights[i] = static_cast<std::uint8_t>((position - whole) * WEIGHT_ONE);
+  }
+}
+
+FrameScaler::FrameScaler(const FrameParameters &input,
+                         const ScaleParameters &params,
+                         const FrameMemory &memory)
+    : input_{input}, output_{input}, params_{params}, method_{Method::COPY},
+      factor_x_{1}, factor_y_{1}, x_columns_{}, x_weights_{}, y_rows_{},
+      y_weights_{}, row_sums_{}, row_{}, pool_{} {
+  if (!params_.cropped()) {
+    params_.crop_x = 0;
+    params_.crop_y = 0;
+    params_.crop_width = input.width;
+    params_.crop_height = input.height;
+  }
+  output_.width = params_.scaled() ? params_.width : params_.crop_width;
+  output_.height = params_.scaled() ? params_.height : params_.crop_height;
+
+  const auto crop_width = params_.crop_width;
+  const auto crop_height = params_.crop_height;
+  if (output_.width == crop_width && output_.height == crop_height) {
+    method_ = Method::COPY;
+  } else if (crop_width % output_.width == 0 &&
+             crop_height % output_.height == 0 &&
+             (crop_width / output_.width) * (crop_height / output_.height) <=
+                 256) {
+    // Keeps column sums within 16 bits and the reciprocal below accurate
+    method_ = Method::BOX;
+    factor_x_ = crop_width / output_.width;
+    factor_y_ = crop_height / output_.height;
+    row_sums_.resize(crop_width * CHANNELS);
+  } else {
+    method_ = Method::BILINEAR;
+    bilinear_taps(crop_width, output_.width, x_columns_, x_weights_);
+    bilinear_taps(crop_height, output_.height, y_rows_, y_weights_);
+    // One more pixel so the last column can always read its right neighbour
+    row_.resize((crop_width + 1) * CHANNELS);
+  }
+
+  pool_ = FramePool::create(output_.width * output_.height *
+                                pixel_size(output_.pixel_format),
+                            FramePool::DEFAULT_MAX_FREE, memory);
+}
+
+std::unique_ptr<Frame> FrameScaler::scale(const RGBFrame &frame) {
+  auto out = std::make_unique<RGBFrame>(output_.width, output_.height,
+                                        frame.frame_number(), pool_->acquire(),
+                                        frame.timestamp());
+  const auto stride = frame.width() * CHANNELS;
+  const auto *in = reinterpret_cast<const std::uint8_t *>(frame.data()) +
+                   params_.crop_y * stride + params_.crop_x * CHANNELS;
+  auto *dst = reinterpret_cast<std::uint8_t *>(out->data());
+  switch (method_) {
+  case Method::COPY:
+    copy(in, stride, dst);
+    break;
+  case Method::BOX:
+    box(in, stride, dst);
+    break;
+  case Method::BILINEAR:
+    bilinear(in, stride, dst);
+    break;
+  }
+  return out;
+}
+
+void FrameScaler::copy(const std::uint8_t *in, size_t stride,
+                       std::uint8_t *out) const {
+  const auto row_size = output_.width * CHANNELS;
+  for (size_t y = 0; y < output_.height; y++) {
+    std::memcpy(out + y * row_size, in + y * stride, row_size);
+  }
+}
+
+void FrameScaler::box(const std::uint8_t *in, size_t stride,
+                      std::uint8_t *out) {
+  const auto row_size = params_.crop_width * CHANNELS;
+  const auto area = static_cast<std::uint32_t>(factor_x_ * factor_y_);
+  // Divide by multiplying with a 16-bit fixed-point reciprocal
+  const auto reciprocal = ((1u << 16) + area / 2) / area;
+  auto *sums = row_sums_.data();
+
+  for (size_t oy = 0; oy < output_.height; oy++) {
+    std::fill(row_sums_.begin(), row_sums_.end(), 0);
+    for (size_t dy = 0; dy < factor_y_; dy++) {
+      const auto *row = in + (oy * factor_y_ + dy) * stride;
+      size_t i = 0;
+#if defined(__SSE2__)
+      const auto zero = _mm_setzero_si128();
+      for (; i + 16 <= row_size; i += 16) {
+        const auto bytes =
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + i));
+        auto *lo = reinterpret_cast<__m128i *>(sums + i);
+        auto *hi = reinterpret_cast<__m128i *>(sums + i + 8);
+        _mm_storeu_si128(lo, _mm_add_epi16(_mm_loadu_si128(lo),
+                                           _mm_unpacklo_epi8(bytes, zero)));
+        _mm_storeu_si128(hi, _mm_add_epi16(_mm_loadu_si128(hi),
+                                           _mm_unpackhi_epi8(bytes, zero)));
+      }
+#endif
+      for (; i < row_size; i++) {
+        sums[i] += row[i];
+      }
+    }
+
+    auto *dst = out + oy * output_.width * CHANNELS;
+    for (size_t ox = 0; ox < output_.width; ox++) {
+      const auto *block = sums + ox * factor_x_ * CHANNELS;
+      for (size_t c = 0; c < CHANNELS; c++) {
+        std::uint32_t sum = 0;
+        for (size_t dx = 0; dx < factor_x_; dx++) {
+          sum += block[dx * CHANNELS + c];
+        }
+        dst[ox * CHANNELS + c] = static_cast<std::uint8_t>(
+            std::min<std::uint32_t>((sum * reciprocal + (1u << 15)) >> 16,
+                                    255));
+      }
+    }
+  }
+}
+
+void FrameScaler::bilinear(const std::uint8_t *in, size_t stride,
+                           std::uint8_t *out) {
+  const auto row_size = params_.crop_width * CHANNELS;
+  const auto last_row = params_.crop_height - 1;
+  auto *blended = row_.data();
+
+  for (size_t oy = 0; oy < output_.height; oy++) {
+    const auto y = y_rows_[oy];
+    const auto *top = in + y * stride;
+    const auto *bottom = in + std::min<size_t>(y + 1, last_row) * stride;
+    const std::uint16_t w1 = y_weights_[oy];
+    const std::uint16_t w0 = WEIGHT_ONE - w1;
+
+    size_t i = 0;
+#if defined(__SSE2__)
+    const auto zero = _mm_setzero_si128();
+    const auto vw0 = _mm_set1_epi16(w0);
+    const auto vw1 = _mm_set1_epi16(w1);
+    const auto round = _mm_set1_epi16(WEIGHT_ONE / 2);
+    for (; i + 16 <= row_size; i += 16) {
+      const auto a =
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(top + i));
+      const auto b =
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(bottom + i));
+      const auto lo = _mm_srli_epi16(
+          _mm_add_epi16(
+              _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), vw0),
+                            _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), vw1)),
+              round),
+          WEIGHT_SHIFT);
+      const auto hi = _mm_srli_epi16(
+          _mm_add_epi16(
+              _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), vw0),
+                            _mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), vw1)),
+              round),
+          WEIGHT_SHIFT);
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(blended + i),
+                       _mm_packus_epi16(lo, hi));
+    }
+#endif
+    for (; i < row_size; i++) {
+      blended[i] = static_cast<std::uint8_t>(
+          (top[i] * w0 + bottom[i] * w1 + WEIGHT_ONE / 2) >> WEIGHT_SHIFT);
+    }
+    // Repeat the last pixel for the last column's right neighbour
+    std::memcpy(blended + row_size, blended + row_size - CHANNELS, CHANNELS);
+
+    auto *dst = out + oy * output_.width * CHANNELS;
+    for (size_t ox = 0; ox < output_.width; ox++) {
+      const auto *left = blended + x_columns_[ox] * CHANNELS;
+      const std::uint32_t x1 = x_weights_[ox];
+      const std::uint32_t x0 = WEIGHT_ONE - x1;
+      for (size_t c = 0; c < CHANNELS; c++) {
+        dst[ox * CHANNELS + c] = static_cast<std::uint8_t>(
+            (left[c] * x0 + left[c + CHANNELS] * x1 + WEIGHT_ONE / 2) >>
+            WEIGHT_SHIFT);
+      }
+    }
+  }
+}
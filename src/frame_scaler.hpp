@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "frame.hpp"
+#include "frame_pool.hpp"
+
+namespace camcoder {
+
+/**
+ * Per-source crop and scale, applied as frames are read.
+ */
+struct ScaleParameters {
+  /**
+   * Region of the source frame to keep. A zero width or height keeps the
+   * whole frame.
+   */
+  size_t crop_x = 0;
+  size_t crop_y = 0;
+  size_t crop_width = 0;
+  size_t crop_height = 0;
+
+  /**
+   * Size of the output frame. Zero keeps the size of the cropped region.
+   */
+  size_t width = 0;
+  size_t height = 0;
+
+  bool cropped() const { return crop_width > 0 && crop_height > 0; }
+  bool scaled() const { return width > 0 && height > 0; }
+};
+
+/**
+ * Crops a region out of raw frames and resizes it into a frame from its own
+ * pool, so everything downstream only ever sees the smaller frame.
+ *
+ * Integer downscales (e.g. 3840x2160 to 1280x720) average each block of input
+ * pixels; anything else is interpolated bilinearly. The vertical pass, which
+ * touches every input row, is vectorized with SSE2 where available.
+ */
+class FrameScaler {
+public:
+  /**
+   * memory says how the pool of scaled frames is allocated.
+   */
+  FrameScaler(const FrameParameters &input, const ScaleParameters &params,
+              const FrameMemory &memory = {});
+
+  /**
+   * Parameters of the frames scale() returns.
+   */
+  const FrameParameters &output_parameters() const { return output_; }
+
+  /**
+   * Where scaled frames' memory comes from.
+   */
+  const std::shared_ptr<FramePool> &frame_pool() const { return pool_; }
+
+  /**
+   * Crop and scale a frame. The result keeps the frame's number and
+   * timestamp.
+   */
+  std::unique_ptr<Frame> scale(const RGBFrame &frame);
+
+private:
+  enum class Method {
+    COPY,     /// Crop only
+    BOX,      /// Average factor_x by factor_y blocks
+    BILINEAR, /// Interpolate between the nearest input pixels
+  };
+
+  // in points at the top left of the crop region; stride is the input row
+  // length in bytes
+  void copy(const std::uint8_t *in, size_t stride, std::uint8_t *out) const;
+  void box(const std::uint8_t *in, size_t stride, std::uint8_t *out);
+  void bilinear(const std::uint8_t *in, size_t stride, std::uint8_t *out);
+
+  FrameParameters input_;
+  FrameParameters output_;
+  ScaleParameters params_;
+  Method method_;
+  // Box factors
+  size_t factor_x_;
+  size_t factor_y_;
+  // Bilinear source columns and weights (out of 128) for each output column,
+  // and the same for rows
+  std::vector<std::uint32_t> x_columns_;
+  std::vector<std::uint8_t> x_weights_;
+  std::vector<std::uint32_t> y_rows_;
+  std::vector<std::uint8_t> y_weights_;
+  // One row of vertically blended input
+  std::vector<std::uint16_t> row_sums_;
+  std::vector<std::uint8_t> row_;
+  std::shared_ptr<FramePool> pool_;
+};
+
+} // namespace camcoder
@@ -3,26 +3,83 @@
 using namespace camcoder;
 
 template <> RGBFrame FrameSource::get_frame<RGBFrame>() {
-  auto frame =
-      RGBFrame{frame_params_.width, frame_params_.height, frame_count_++};
-  if (frame.timestamp().count() == 0 && frame_rate().numerator == 0) {
-    // Use the receive time as a timestamp
-    frame.set_timestamp(std::chrono::system_clock::now().time_since_epoch());
-  }
+  auto frame = RGBFrame{frame_params_.width, frame_params_.height,
+                        frame_count_++, pool_->acquire()};
   const auto size = frame_size_bytes();
   if (read(reinterpret_cast<char *>(frame.data()), size) != size) {
     throw std::runtime_error{"Failed to read frame"};
   }
+  if (live()) {
+    // Use the capture or receive time as a timestamp; the pipeline paces
+    // from it
+    const auto captured = capture_time_();
+    frame.set_timestamp(
+        captured.count() > 0
+            ? captured
+            : std::chrono::steady_clock::now().time_since_epoch());
+  }
   return frame;
 }
 
+template <> EncodedFrame FrameSource::get_frame<EncodedFrame>() {
+  // Annex-B streams are read in chunks this big
+  constexpr size_t READ_SIZE = 64 * 1024;
+  AccessUnitParser::AccessUnit au{};
+  while (!parser_->next(au)) {
+    const auto n = read_some(parser_->prepare(READ_SIZE), READ_SIZE);
+    if (n == 0) {
+      // A file's last access unit is complete, but a socket's may have been
+      // cut off
+      if (live() || !parser_->flush(au)) {
+        throw std::runtime_error{"Failed to read frame"};
+      }
+      break;
+    }
+    parser_->commit(n);
+  }
+  auto frame = EncodedFrame{frame_params_, frame_count_++, encoding_,
+                            std::move(au.data), au.keyframe};
+  if (live()) {
+    // The access unit was complete once the next one started arriving
+    frame.set_timestamp(std::chrono::steady_clock::now().time_since_epoch());
+  }
+  return frame;
+}
+
+bool FrameSource::connect() {
+  if (!connect_()) {
+    return false;
+  }
+  if (parser_ != nullptr) {
+    // Wait for a keyframe rather than decoding from the middle of a GOP
+    parser_->reset();
+  }
+  return true;
+}
+
+void FrameSource::set_encoding(Encoding encoding) {
+  encoding_ = encoding;
+  parser_ = encoding == Encoding::RAW
+                ? nullptr
+                : std::make_unique<AccessUnitParser>(encoding);
+}
+
+SourceStats FrameSource::stats() const {
+  auto stats = stats_();
+  if (parser_ != nullptr) {
+    stats.emplace("discarded_access_units", parser_->discarded());
+  }
+  return stats;
+}
+
 std::unique_ptr<Frame> FrameSource::get_frame_ptr() {
   try {
+    if (parser_ != nullptr) {
+      return std::make_unique<EncodedFrame>(get_frame<EncodedFrame>());
+    }
     switch (frame_parameters().pixel_format) {
     case PixelFormat::RGB: {
-      auto pframe = std::make_unique<RGBFrame>();
-      *pframe = std::move(get_frame<RGBFrame>());
-      return pframe;
+      return std::make_unique<RGBFrame>(get_frame<RGBFrame>());
     } break;
     case PixelFormat::INVALID:
     default:
@@ -35,9 +92,124 @@ std::unique_ptr<Frame> FrameSource::get_frame_ptr() {
 }
 
 FrameThread::FrameThread(std::unique_ptr<FrameSource> frame_source,
-                         size_t queue_size)
-    : frame_source_{std::move(frame_source)}, frame_q_{queue_size},
-      thread_{std::ref(*this)} {}
+                         size_t queue_size, OverflowPolicy overflow)
+    : frame_source_{std::move(frame_source)}, frame_q_{queue_size, overflow},
+      consumer_{}, taps_{}, name_{"source"}, thread_options_{}, inline_{false},
+      backoff_{}, scaler_{}, recorder_{}, recorder_q_{}, recorder_thread_{},
+      next_connect_{},
+      reconnecting_{false}, stopping_{false}, done_{false}, stop_mutex_{},
+      stop_cv_{}, thread_{} {}
+
+FrameThread::~FrameThread() {
+  stop();
+  // A tap's consumer may have stopped taking frames too
+  close_taps();
+  if (thread_.joinable()) {
+    // Nothing may be taking frames any more, so make room in case the
+    // reader is waiting for it
+    while (!done_) {
+      SharedFrame frame;
+      frame_q_.pop(frame, std::chrono::milliseconds{10});
+    }
+    thread_.join();
+  }
+  if (recorder_thread_.joinable()) {
+    recorder_thread_.join();
+  }
+}
+
+void FrameThread::stop() {
+  {
+    std::lock_guard<std::mutex> lock{stop_mutex_};
+    stopping_ = true;
+  }
+  stop_cv_.notify_all();
+  frame_source_->interrupt();
+}
+
+bool FrameThread::sleep_until(Deadline deadline) {
+  std::unique_lock<std::mutex> lock{stop_mutex_};
+  return !stop_cv_.wait_until(lock, deadline,
+                              [this] { return stopping_.load(); });
+}
+
+void FrameThread::set_consumer(FrameConsumer consumer) {
+  consumer_ = std::move(consumer);
+}
+
+void FrameThread::set_thread_options(std::string name,
+                                     const ThreadOptions &options) {
+  name_ = std::move(name);
+  thread_options_ = options;
+}
+
+void FrameThread::set_backoff(const Backoff &backoff) { backoff_ = backoff; }
+
+void FrameThread::set_scaler(std::unique_ptr<FrameScaler> scaler) {
+  scaler_ = std::move(scaler);
+}
+
+void FrameThread::set_recorder(std::unique_ptr<CaptureWriter> recorder) {
+  recorder_ = std::move(recorder);
+  recorder_q_ = add_tap(RECORDER_QUEUE_SIZE, OverflowPolicy::DROP_NEWEST);
+}
+
+std::shared_ptr<FrameQueue> FrameThread::add_tap(size_t queue_size,
+                                                 OverflowPolicy overflow) {
+  taps_.push_back(std::make_shared<FrameQueue>(queue_size, overflow));
+  return taps_.back();
+}
+
+void FrameThread::close_taps() {
+  for (const auto &tap : taps_) {
+    tap->close();
+  }
+}
+
+void FrameThread::run_recorder() {
+  thread_options_.apply(name_, "rec");
+  while (const auto frame = recorder_q_->pop()) {
+    if (frame->pixel_format() == PixelFormat::RGB &&
+        !recorder_->write(*frame)) {
+      spdlog::error("Failed to write to capture file {}; stopping recording",
+                    recorder_->path());
+      recorder_q_->close();
+      // Let go of what's still queued
+      while (recorder_q_->pop() != nullptr) {
+      }
+      break;
+    }
+  }
+  if (recorder_q_->dropped() > 0) {
+    spdlog::warn("Recording to {} dropped {} frames", recorder_->path(),
+                 recorder_q_->dropped());
+  }
+  // Finish the file as soon as the source does
+  recorder_.reset();
+}
+
+void FrameThread::start() {
+  start_recorder();
+  thread_ = std::thread{std::ref(*this)};
+}
+
+void FrameThread::start_inline() {
+  spdlog::info("Frame source reading inline");
+  start_recorder();
+  inline_ = true;
+}
+
+void FrameThread::start_recorder() {
+  if (recorder_ != nullptr) {
+    recorder_thread_ = std::thread{&FrameThread::run_recorder, this};
+  }
+}
+
+bool FrameThread::can_read_inline() const {
+  return frame_source_->can_read_inline();
+}
+
+bool FrameThread::live() const { return frame_source_->live(); }
 
 // This should let us do e.g.
 //   FrameThread frame_thread{TCPServerFrameSource{...}}
@@ -54,40 +226,128 @@ std::uint64_t FrameThread::frame_count() const {
   return frame_source_->frame_count();
 }
 
-void FrameThread::operator()() {
-  spdlog::info("Frame source started");
-  while (!frame_source_->finished()) {
+FrameThread::PopStatus FrameThread::read_frame(SharedFrame &frame,
+                                               Deadline deadline) {
+  while (!stopping_ && !frame_source_->finished()) {
     if (!frame_source_->connected()) {
-      spdlog::debug("Reconnecting");
+      if (!reconnecting_) {
+        spdlog::info("Frame source disconnected; reconnecting");
+        reconnecting_ = true;
+      }
+      // Back off between attempts so an unreachable source doesn't spin
+      if (std::chrono::steady_clock::now() < next_connect_) {
+        if (next_connect_ > deadline) {
+          sleep_until(deadline);
+          return PopStatus::TIMEOUT;
+        }
+        if (!sleep_until(next_connect_)) {
+          break;
+        }
+      }
       if (!frame_source_->connect()) {
-        // If we failed to reconnect, wait a little bit so we don't just spin
-        using namespace std::chrono_literals;
-        std::this_thread::sleep_for(1ms);
+        const auto delay = backoff_.next();
+        spdlog::debug("Connect failed; retrying in {} ms", delay.count());
+        next_connect_ = std::chrono::steady_clock::now() + delay;
+        continue;
+      }
+      spdlog::info("Frame source connected");
+      backoff_.reset();
+      reconnecting_ = false;
+    }
+    frame = SharedFrame{frame_source_->get_frame_ptr()};
+    if (frame != nullptr) {
+      for (const auto &tap : taps_) {
+        tap->push(frame);
+      }
+      if (scaler_ != nullptr && frame->pixel_format() == PixelFormat::RGB) {
+        // The full-size frame goes back to the source's pool once the taps
+        // are done with it
+        frame = SharedFrame{
+            scaler_->scale(static_cast<const RGBFrame &>(*frame))};
       }
+      return PopStatus::FRAME;
     }
-    auto pframe = frame_source_->get_frame_ptr();
-    if (pframe != nullptr) {
-      spdlog::debug("Add frame {} at {}", frame_count(),
-                    reinterpret_cast<void *>(pframe.get()));
-      frame_q_.add(std::move(pframe));
+    if (std::chrono::steady_clock::now() >= deadline) {
+      return PopStatus::TIMEOUT;
     }
   }
-  frame_q_.complete_adding();
-  // TODO: thread name
+  close_taps();
+  return PopStatus::FINISHED;
+}
+
+void FrameThread::operator()() {
+  thread_options_.apply(name_, "read", true);
+  spdlog::info("Frame source started");
+  SharedFrame frame;
+  while (read_frame(frame, Deadline::max()) == PopStatus::FRAME) {
+    spdlog::debug("Add frame {} at {}", frame_count(),
+                  reinterpret_cast<const void *>(frame.get()));
+    if (consumer_) {
+      consumer_(std::move(frame));
+    } else {
+      frame_q_.push(std::move(frame));
+    }
+  }
+  if (consumer_) {
+    consumer_(nullptr);
+  }
+  frame_q_.close();
+  done_ = true;
   spdlog::info("Frame source done");
 }
 
-std::unique_ptr<Frame> FrameThread::pop_frame() {
-  std::unique_ptr<Frame> pframe;
-  frame_q_.take(pframe);
-  spdlog::debug("Take frame at {}", reinterpret_cast<void *>(pframe.get()));
-  return pframe;
+SharedFrame FrameThread::pop_frame() {
+  SharedFrame frame;
+  if (inline_) {
+    read_frame(frame, Deadline::max());
+    return frame;
+  }
+  frame = frame_q_.pop();
+  spdlog::debug("Take frame at {}",
+                reinterpret_cast<const void *>(frame.get()));
+  return frame;
+}
+
+FrameThread::PopStatus
+FrameThread::pop_frame(SharedFrame &frame, std::chrono::milliseconds timeout) {
+  if (inline_) {
+    return read_frame(frame, std::chrono::steady_clock::now() + timeout);
+  }
+  if (frame_q_.pop(frame, timeout)) {
+    return PopStatus::FRAME;
+  }
+  return frame_q_.finished() ? PopStatus::FINISHED : PopStatus::TIMEOUT;
 }
 
 FrameParameters FrameThread::frame_parameters() const {
+  if (scaler_ != nullptr) {
+    return scaler_->output_parameters();
+  }
   return frame_source_->frame_parameters();
 }
 
 FrameRate FrameThread::frame_rate() const {
   return frame_source_->frame_rate();
 }
+
+SourceStats FrameThread::stats() const {
+  auto stats = frame_source_->stats();
+  if (recorder_q_ != nullptr) {
+    stats.emplace("record_dropped", recorder_q_->dropped());
+  }
+  std::uint64_t huge_allocated = 0;
+  std::uint64_t huge_fallbacks = 0;
+  for (const auto *pool :
+       {frame_source_->frame_pool().get(),
+        scaler_ != nullptr ? scaler_->frame_pool().get() : nullptr}) {
+    if (pool != nullptr && pool->huge_pages()) {
+      huge_allocated += pool->huge_allocated();
+      huge_fallbacks += pool->huge_fallbacks();
+    }
+  }
+  if (huge_allocated + huge_fallbacks > 0) {
+    stats.emplace("huge_page_buffers", huge_allocated);
+    stats.emplace("huge_page_fallbacks", huge_fallbacks);
+  }
+  return stats;
+}
@@ -1,27 +1,49 @@
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
 #include <cstdint>
 #include <memory>
 #include <fstream>
+#include <functional>
+#include <map>
+#include <mutex>
 #include <stdexcept>
+#include <string>
 #include <thread>
+#include <vector>
 
-#include <BlockingCollection.h>
 // TODO: move implementation out of header
 #include <spdlog/spdlog.h>
 
 #include "frame_parameters.hpp"
 #include "frame.hpp"
+#include "frame_pool.hpp"
+#include "frame_queue.hpp"
+#include "frame_scaler.hpp"
+#include "access_unit_parser.hpp"
+#include "affinity.hpp"
+#include "backoff.hpp"
+#include "capture_file.hpp"
 
 namespace camcoder {
 
+/**
+ * Source-specific counters, by name, for logging.
+ */
+using SourceStats = std::map<std::string, std::uint64_t>;
+
 class FrameSource {
 public:
   FrameSource(const FrameParameters &frame_params)
       : FrameSource{frame_params, FrameRate{0, 1}} {}
 
   FrameSource(const FrameParameters &frame_params, const FrameRate &frame_rate)
-      : frame_count_{0}, frame_params_{frame_params}, frame_rate_{frame_rate} {}
+      : frame_count_{0}, frame_params_{frame_params}, frame_rate_{frame_rate},
+        pool_{FramePool::create(frame_size_bytes())},
+        encoding_{Encoding::RAW}, parser_{} {}
+
+  virtual ~FrameSource() = default;
 
   template <typename TFrame> TFrame get_frame();
 
@@ -31,21 +53,90 @@ public:
 
   bool connected() const { return connected_(); }
 
-  bool connect() { return connect_(); }
+  bool connect();
+
+  /**
+   * Unblock a read in progress on another thread, so its reader can stop.
+   * The source shouldn't be read from afterwards.
+   */
+  void interrupt() { interrupt_(); }
+
+  /**
+   * True once the source has ended and every frame read from it has been
+   * returned.
+   */
+  bool finished() const {
+    return eof() && (parser_ == nullptr || parser_->empty());
+  }
+
+  /**
+   * True if reads never block for long, so frames can be read directly on
+   * the pipeline's streaming thread instead of a dedicated thread.
+   */
+  bool can_read_inline() const { return can_read_inline_(); }
+
+  /**
+   * True if frames arrive in real time. Frames from sources that aren't live
+   * (like files) carry no arrival timestamp and are paced by the pipeline.
+   */
+  bool live() const { return live_(); }
+
+  /**
+   * Read an encoded stream (split into access units) instead of raw frames.
+   * Only stream sources (files and TCP or Unix sockets) support this.
+   */
+  void set_encoding(Encoding encoding);
 
-  bool finished() const { return eof(); }
+  Encoding encoding() const { return encoding_; }
+
+  /**
+   * Counters specific to this kind of source.
+   */
+  SourceStats stats() const;
 
   constexpr std::uint64_t frame_count() const { return frame_count_; }
   constexpr FrameParameters frame_parameters() const { return frame_params_; }
   constexpr FrameRate frame_rate() const { return frame_rate_; }
 
+  /**
+   * Where frame memory comes from. Frames are read directly into it.
+   */
+  const std::shared_ptr<FramePool> &frame_pool() const { return pool_; }
+
+  /**
+   * Read frames from now on into a new pool allocated as memory says.
+   * Frames already read keep the pool they came from. Not thread-safe; call
+   * it before reading.
+   */
+  void set_frame_memory(const FrameMemory &memory) {
+    pool_ = FramePool::create(frame_size_bytes(), FramePool::DEFAULT_MAX_FREE,
+                              memory);
+  }
+
 protected:
   virtual size_t read(char *buf, size_t n) = 0;
+
+  /**
+   * Read whatever is available, up to n bytes, blocking only until there is
+   * something. Returns 0 if the source failed or ended. Used for encoded
+   * streams, whose frames vary in size.
+   */
+  virtual size_t read_some(char *buf, size_t n) { return read(buf, n); }
   virtual bool eof() const = 0;
   virtual bool good() const = 0;
   virtual bool bad() const = 0;
   virtual bool connected_() const = 0;
   virtual bool connect_() = 0;
+  virtual bool can_read_inline_() const { return false; }
+  virtual bool live_() const { return true; }
+  /**
+   * When the frame just read was captured, on the steady clock, if the
+   * source knows; zero to timestamp it as it arrives.
+   */
+  virtual Frame::Timestamp capture_time_() const { return Frame::Timestamp{0}; }
+  // Only sources whose reads can block indefinitely need to override this
+  virtual void interrupt_() {}
+  virtual SourceStats stats_() const { return {}; }
 
   constexpr size_t frame_size_bytes() const {
     return frame_params_.width * frame_params_.height *
@@ -56,19 +147,53 @@ private:
   std::uint64_t frame_count_;
   FrameParameters frame_params_;
   FrameRate frame_rate_;
+  std::shared_ptr<FramePool> pool_;
+  Encoding encoding_;
+  std::unique_ptr<AccessUnitParser> parser_;
 };
 
-// TODO: I think FrameThread could implement the FrameSource interface, too, and
-// just pop something off the queue when get_frame is called. Not strictly
-// necessary, but it could help keep the number of threads in the application
-// down. Some thread sources (like FileFrameSource) don't need a thread to
-// read--they can do it in the need-data callback.
+/**
+ * Reads frames from a FrameSource, either on a dedicated thread that queues
+ * them (or hands them to a consumer), or inline from pop_frame() for sources
+ * that can read without blocking.
+ *
+ * Frames are shared rather than copied, so besides the main consumer any
+ * number of taps can see each frame as it's read, each through its own
+ * bounded queue.
+ */
 class FrameThread {
 public:
   static constexpr size_t DEFAULT_QUEUE_SIZE = 128;
 
+  /**
+   * Frames that can wait for the recorder; beyond that new ones are dropped
+   * rather than holding up the reader.
+   */
+  static constexpr size_t RECORDER_QUEUE_SIZE = 16;
+
+  /**
+   * Receives each frame as soon as it's read, on the reader thread. A null
+   * frame means the source finished.
+   */
+  using FrameConsumer = std::function<void(SharedFrame)>;
+
+  /**
+   * Result of waiting for a frame with a timeout.
+   */
+  enum class PopStatus {
+    FRAME,    /// Got a frame
+    TIMEOUT,  /// No frame before the timeout
+    FINISHED, /// The source finished
+  };
+
   FrameThread(std::unique_ptr<FrameSource> frame_source,
-              size_t queue_size = DEFAULT_QUEUE_SIZE);
+              size_t queue_size = DEFAULT_QUEUE_SIZE,
+              OverflowPolicy overflow = OverflowPolicy::BLOCK);
+
+  /**
+   * Stops the reader and waits for it.
+   */
+  ~FrameThread();
 
   // This should let us do e.g.
   //   FrameThread frame_thread{TCPServerFrameSource{...}}
@@ -83,19 +208,155 @@ public:
 
   size_t frame_count() const;
 
+  /**
+   * Push frames to consumer instead of queueing them for pop_frame(). Must be
+   * called before start().
+   */
+  void set_consumer(FrameConsumer consumer);
+
+  /**
+   * Name the reader (and recorder) thread after the source, and place and
+   * schedule them as options say. Must be called before start().
+   */
+  void set_thread_options(std::string name, const ThreadOptions &options);
+
+  /**
+   * Delay between failed connect attempts. Must be called before start().
+   */
+  void set_backoff(const Backoff &backoff);
+
+  /**
+   * Crop and scale raw frames as they're read, before they're queued. Must be
+   * called before start(); frame_parameters() reports the scaled size from
+   * then on.
+   */
+  void set_scaler(std::unique_ptr<FrameScaler> scaler);
+
+  /**
+   * Record raw frames to a capture file as they're read, before they're
+   * scaled. Must be called before start(). Writing happens on a thread of its
+   * own, fed by a tap that drops frames if the disk can't keep up. Recording
+   * stops if a write fails.
+   */
+  void set_recorder(std::unique_ptr<CaptureWriter> recorder);
+
+  /**
+   * Also hand every frame to a new queue as it's read, before it's cropped
+   * and scaled. The queue is closed once the source finishes or the thread
+   * stops. Must be called before start() or start_inline().
+   *
+   * A tap that blocks when full holds up the reader, and with it every other
+   * consumer, so taps that can fall behind should drop frames instead.
+   */
+  std::shared_ptr<FrameQueue> add_tap(size_t queue_size,
+                                      OverflowPolicy overflow);
+
+  /**
+   * Start reading frames on a dedicated thread.
+   */
+  void start();
+
+  /**
+   * Read frames on the caller's thread from pop_frame() instead of starting a
+   * thread. Only for sources that can_read_inline().
+   */
+  void start_inline();
+
+  /**
+   * Stop reading. A consumer then gets a null frame, and pop_frame() reports
+   * the source finished once the queue is drained. Doesn't wait for the
+   * reader thread; the destructor does.
+   */
+  void stop();
+
+  bool is_inline() const { return inline_; }
+  bool can_read_inline() const;
+  bool live() const;
+
   void operator()();
 
-  std::unique_ptr<Frame> pop_frame();
+  /**
+   * Take the next queued frame (or read one, if inline), blocking until there
+   * is one. Returns null once the source has finished.
+   */
+  SharedFrame pop_frame();
+
+  /**
+   * Like pop_frame(), but give up after timeout.
+   */
+  PopStatus pop_frame(SharedFrame &frame, std::chrono::milliseconds timeout);
+
+  /**
+   * True while the source is disconnected and being reconnected.
+   */
+  bool reconnecting() const { return reconnecting_; }
 
   FrameParameters frame_parameters() const;
   FrameRate frame_rate() const;
+  SourceStats stats() const;
+  OverflowPolicy overflow_policy() const { return frame_q_.overflow_policy(); }
+
+  /**
+   * Change the overflow policy while running. Only affects the queue, not a
+   * consumer or taps.
+   */
+  void set_overflow_policy(OverflowPolicy overflow) {
+    frame_q_.set_overflow_policy(overflow);
+  }
+
+  /**
+   * Frames waiting in the queue.
+   */
+  size_t queued_frames() const { return frame_q_.size(); }
+
+  /**
+   * Frames discarded by the queue's overflow policy.
+   */
+  std::uint64_t dropped_frames() const { return frame_q_.dropped(); }
 
 private:
+  using Deadline = std::chrono::steady_clock::time_point;
+
+  /**
+   * Read the next frame, reconnecting as needed, until the deadline.
+   */
+  PopStatus read_frame(SharedFrame &frame, Deadline deadline);
+
+  void close_taps();
+
+  void start_recorder();
+
+  void run_recorder();
+
+  /**
+   * Sleep until the deadline, waking early if stopped. Returns false if
+   * stopped.
+   */
+  bool sleep_until(Deadline deadline);
+
   std::unique_ptr<FrameSource> frame_source_;
-  code_machina::BlockingQueue<std::unique_ptr<Frame>> frame_q_;
+  FrameQueue frame_q_;
+  FrameConsumer consumer_;
+  std::vector<std::shared_ptr<FrameQueue>> taps_;
+  std::string name_;
+  ThreadOptions thread_options_;
+  bool inline_;
+  Backoff backoff_;
+  std::unique_ptr<FrameScaler> scaler_;
+  std::unique_ptr<CaptureWriter> recorder_;
+  std::shared_ptr<FrameQueue> recorder_q_;
+  std::thread recorder_thread_;
+  Deadline next_connect_;
+  std::atomic<bool> reconnecting_;
+  std::atomic<bool> stopping_;
+  // Set once the reader thread has finished
+  std::atomic<bool> done_;
+  std::mutex stop_mutex_;
+  std::condition_variable stop_cv_;
   std::thread thread_;
 };
 
 template <> RGBFrame FrameSource::get_frame<RGBFrame>();
+template <> EncodedFrame FrameSource::get_frame<EncodedFrame>();
 
 } // namespace camcoder
@@ -0,0 +1,223 @@
+#include <cstdlib>
+
+#include <spdlog/fmt/fmt.h>
+
+#include "json.hpp"
+
+using namespace camcoder;
+using namespace camcoder::json;
+
+namespace {
+
+/**
+ * Recursive descent over one flat object.
+ */
+class Parser {
+public:
+  explicit Parser(std::string_view text) : text_{text}, pos_{0} {}
+
+  bool object(Object &object) {
+    if (!consume('{')) {
+      return false;
+    }
+    if (consume('}')) {
+      return at_end();
+    }
+    do {
+      std::string key;
+      Value value;
+      if (!string(key) || !consume(':') || !scalar(value)) {
+        return false;
+      }
+      object[key] = std::move(value);
+    } while (consume(','));
+    return consume('}') && at_end();
+  }
+
+private:
+  void skip_space() {
+    while (pos_ < text_.size() &&
+           (text_[pos_] == ' ' || text_[pos_] == '\t' || text_[pos_] == '\n' ||
+            text_[pos_] == '\r')) {
+      pos_++;
+    }
+  }
+
+  bool consume(char c) {
+    skip_space();
+    if (pos_ < text_.size() && text_[pos_] == c) {
+      pos_++;
+      return true;
+    }
+    return false;
+  }
+
+  bool consume_word(std::string_view word) {
+    if (text_.substr(pos_, word.size()) == word) {
+      pos_ += word.size();
+      return true;
+    }
+    return false;
+  }
+
+  bool at_end() {
+    skip_space();
+    return pos_ == text_.size();
+  }
+
+  bool scalar(Value &value) {
+    skip_space();
+    if (pos_ >= text_.size()) {
+      return false;
+    }
+    const char c = text_[pos_];
+    if (c == '"') {
+      value.type = Value::Type::STRING;
+      return string(value.string);
+    } else if (consume_word("true")) {
+      value.type = Value::Type::BOOLEAN;
+      value.boolean = true;
+    } else if (consume_word("false")) {
+      value.type = Value::Type::BOOLEAN;
+      value.boolean = false;
+    } else if (consume_word("null")) {
+      value.type = Value::Type::NUL;
+    } else if (c == '-' || (c >= '0' && c <= '9')) {
+      // strtod accepts a superset of JSON numbers, which is fine here
+      const std::string rest{text_.substr(pos_)};
+      char *end = nullptr;
+      value.number = std::strtod(rest.c_str(), &end);
+      value.type = Value::Type::NUMBER;
+      pos_ += end - rest.c_str();
+    } else {
+      return false;
+    }
+    return true;
+  }
+
+  bool string(std::string &out) {
+    if (!consume('"')) {
+      return false;
+    }
+    while (pos_ < text_.size()) {
+      const char c = text_[pos_++];
+      if (c == '"') {
+        return true;
+      } else if (c != '\\') {
+        out.push_back(c);
+        continue;
+      }
+      if (pos_ >= text_.size()) {
+        return false;
+      }
+      switch (text_[pos_++]) {
+      case '"':
+        out.push_back('"');
+        break;
+      case '\\':
+        out.push_back('\\');
+        break;
+      case '/':
+        out.push_back('/');
+        break;
+      case 'b':
+        out.push_back('\b');
+        break;
+      case 'f':
+        out.push_back('\f');
+        break;
+      case 'n':
+        out.push_back('\n');
+        break;
+      case 'r':
+        out.push_back('\r');
+        break;
+      case 't':
+        out.push_back('\t');
+        break;
+      case 'u': {
+        if (pos_ + 4 > text_.size()) {
+          return false;
+        }
+        const std::string hex{text_.substr(pos_, 4)};
+        pos_ += 4;
+        char *end = nullptr;
+        const auto code = std::strtoul(hex.c_str(), &end, 16);
+        if (end != hex.c_str() + 4) {
+          return false;
+        }
+        // Names and property values are ASCII in practice; encode the basic
+        // plane as UTF-8 and leave surrogates alone
+        if (code < 0x80) {
+          out.push_back(static_cast<char>(code));
+        } else if (code < 0x800) {
+          out.push_back(static_cast<char>(0xc0 | (code >> 6)));
+          out.push_back(static_cast<char>(0x80 | (code & 0x3f)));
+        } else {
+          out.push_back(static_cast<char>(0xe0 | (code >> 12)));
+          out.push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3f)));
+          out.push_back(static_cast<char>(0x80 | (code & 0x3f)));
+        }
+      } break;
+      default:
+        return false;
+      }
+    }
+    return false;
+  }
+
+  std::string_view text_;
+  size_t pos_;
+};
+
+} // namespace
+
+std::string json::Value::to_string() const {
+  switch (type) {
+  case Type::BOOLEAN:
+    return boolean ? "true" : "false";
+  case Type::NUMBER:
+    return fmt::format("{}", number);
+  case Type::STRING:
+    return string;
+  case Type::NUL:
+  default:
+    return "";
+  }
+}
+
+bool json::parse_object(std::string_view text, Object &object) {
+  return Parser{text}.object(object);
+}
+
+std::string json::quote(std::string_view s) {
+  std::string out{"\""};
+  for (const char c : s) {
+    switch (c) {
+    case '"':
+      out += "\\\"";
+      break;
+    case '\\':
+      out += "\\\\";
+      break;
+    case '\n':
+      out += "\\n";
+      break;
+    case '\r':
+      out += "\\r";
+      break;
+    case '\t':
+      out += "\\t";
+      break;
+    default:
+      if (static_cast<unsigned char>(c) < 0x20) {
+        out += fmt::format("\\u{:04x}", static_cast<unsigned char>(c));
+      } else {
+        out.push_back(c);
+      }
+      break;
+    }
+  }
+  out.push_back('"');
+  return out;
+}
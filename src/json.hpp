@@ -0,0 +1,46 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <string_view>
+
+namespace camcoder {
+namespace json {
+
+/**
+ * A scalar JSON value. Control commands are flat objects, so nothing nests.
+ */
+struct Value {
+  enum class Type {
+    NUL,
+    BOOLEAN,
+    NUMBER,
+    STRING,
+  };
+
+  Type type = Type::NUL;
+  bool boolean = false;
+  double number = 0;
+  std::string string;
+
+  /**
+   * The value as text, e.g. for setting a GObject property from it.
+   */
+  std::string to_string() const;
+};
+
+using Object = std::map<std::string, Value>;
+
+/**
+ * Parse a JSON object whose members are all scalars. Returns false if the
+ * text is anything else.
+ */
+bool parse_object(std::string_view text, Object &object);
+
+/**
+ * s as a JSON string literal, quotes included.
+ */
+std::string quote(std::string_view s);
+
+} // namespace json
+} // namespace camcoder
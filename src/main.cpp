@@ -1,5 +1,13 @@
+#include <algorithm>
 #include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <future>
+#include <map>
+#include <memory>
+#include <set>
 #include <thread>
+#include <vector>
 #include <assert.h>
 
 #include <sockpp/socket.h>
@@ -11,7 +19,14 @@
 #include "file_frame_source.hpp"
 #include "tcp_server_frame_source.hpp"
 #include "tcp_client_frame_source.hpp"
+#include "shm_frame_source.hpp"
+#include "unix_frame_source.hpp"
+#include "udp_frame_source.hpp"
+#include "synthetic_frame_source.hpp"
 #include "config.hpp"
+#include "control_server.hpp"
+#include "startup_timer.hpp"
+#include "transcoder.hpp"
 
 using namespace camcoder;
 
@@ -41,6 +56,277 @@ RGBFrame generate_frame(int i) {
   return os;
 }
 
+/**
+ * Construct the frame source a config describes and, unless it waits for a
+ * peer to connect to it, connect it. Runs concurrently for all sources, so
+ * one slow peer doesn't hold up the others.
+ */
+static std::unique_ptr<FrameSource>
+make_frame_source(const FrameSourceConfig &conf) {
+  std::unique_ptr<FrameSource> pframe_source{nullptr};
+  switch (conf.type) {
+  case FrameSourceType::FILE:
+    pframe_source = FileFrameSource::from_config(conf);
+    break;
+  case FrameSourceType::TCP_CLIENT:
+    pframe_source = TCPClientFrameSource::from_config(conf);
+    break;
+  case FrameSourceType::TCP_SERVER:
+    pframe_source = TCPServerFrameSource::from_config(conf);
+    break;
+  case FrameSourceType::SHM:
+    pframe_source = ShmFrameSource::from_config(conf);
+    break;
+  case FrameSourceType::UNIX_CLIENT:
+    pframe_source = UnixClientFrameSource::from_config(conf);
+    break;
+  case FrameSourceType::UNIX_SERVER:
+    pframe_source = UnixServerFrameSource::from_config(conf);
+    break;
+  case FrameSourceType::UDP:
+    pframe_source = UDPFrameSource::from_config(conf);
+    break;
+  case FrameSourceType::SYNTHETIC:
+    pframe_source = SyntheticFrameSource::from_config(conf);
+    break;
+  default:
+    break;
+  }
+  if (pframe_source == nullptr) {
+    return nullptr;
+  }
+  pframe_source->set_encoding(conf.encoding);
+  // Servers block in accept(), so they're left to their reader threads
+  if (conf.type != FrameSourceType::TCP_SERVER &&
+      conf.type != FrameSourceType::UNIX_SERVER &&
+      !pframe_source->connected() && !pframe_source->connect()) {
+    spdlog::info("Source {} isn't reachable yet; its reader will retry",
+                 conf.name);
+  }
+  return pframe_source;
+}
+
+/**
+ * Set when SIGHUP asks for the config to be reloaded.
+ */
+static volatile std::sig_atomic_t reload_requested = 0;
+
+/**
+ * Wrap a constructed source in a FrameThread and add it to the pipeline.
+ * With reserve, its frame buffers are allocated and faulted in up front,
+ * growing the kernel's huge page pool if needed. That's done once at
+ * startup, not on the pipeline's thread when a source restarts; by then the
+ * huge pages its old buffers held are free again.
+ */
+static void start_frame_source(Pipeline &p, const FrameSourceConfig &conf,
+                               std::unique_ptr<FrameSource> pframe_source,
+                               bool reserve = false) {
+  if (pframe_source == nullptr) {
+    spdlog::warn("Failed to construct frame source from config for {}",
+                 conf.name);
+    return;
+  }
+  const auto source_params = pframe_source->frame_parameters();
+  const auto source_rate = pframe_source->frame_rate();
+  const auto &thread_options = conf.threads;
+  const FrameMemory memory{thread_options.numa_node, conf.huge_pages};
+  pframe_source->set_frame_memory(memory);
+  if (reserve && conf.huge_pages) {
+    pframe_source->frame_pool()->reserve(FramePool::DEFAULT_MAX_FREE);
+  }
+  auto pframe_thread = std::make_unique<FrameThread>(
+      std::move(pframe_source), FrameThread::DEFAULT_QUEUE_SIZE,
+      conf.feed.overflow);
+  pframe_thread->set_thread_options(conf.name, thread_options);
+  pframe_thread->set_backoff(
+      Backoff{conf.recovery.reconnect_min, conf.recovery.reconnect_max});
+  if (conf.scale.cropped() || conf.scale.scaled()) {
+    auto scaler =
+        std::make_unique<FrameScaler>(source_params, conf.scale, memory);
+    if (reserve && conf.huge_pages) {
+      scaler->frame_pool()->reserve(FramePool::DEFAULT_MAX_FREE);
+    }
+    pframe_thread->set_scaler(std::move(scaler));
+    const auto scaled = pframe_thread->frame_parameters();
+    spdlog::info("Source {} frames reduced from {}x{} to {}x{}", conf.name,
+                 source_params.width, source_params.height, scaled.width,
+                 scaled.height);
+  }
+  if (!conf.record.empty()) {
+    auto recorder = std::make_unique<CaptureWriter>(
+        conf.record, source_params, source_rate);
+    if (recorder->good()) {
+      spdlog::info("Recording source {} to {}", conf.name, recorder->path());
+      pframe_thread->set_recorder(std::move(recorder));
+    }
+  }
+  p.add_frame_source(std::move(pframe_thread), conf);
+}
+
+/**
+ * The config of the source called name, or nullptr if there's no such
+ * source.
+ */
+static const FrameSourceConfig *find_source_config(const Config &config,
+                                                   const std::string &name) {
+  for (const auto &conf : config.frame_sources) {
+    if (conf.name == name) {
+      return &conf;
+    }
+  }
+  return nullptr;
+}
+
+/**
+ * Constructs and connects sources off the pipeline's thread, since a
+ * connect can take up to connect_timeout, then adds them from the
+ * pipeline's thread. A source that was changed or removed by a reload
+ * while it was connecting is started again from the new config, or
+ * dropped.
+ */
+class SourceStarter {
+public:
+  SourceStarter(Pipeline &p, const std::shared_ptr<const Config> &config)
+      : p_{p}, config_{config}, pending_{}, builds_{} {}
+
+  // Waits for sources still connecting
+  ~SourceStarter() = default;
+
+  SourceStarter(const SourceStarter &) = delete;
+  SourceStarter &operator=(const SourceStarter &) = delete;
+
+  /**
+   * Start the source called name from the current config, unless it's
+   * already being started. Returns false if it isn't configured. Call from
+   * the pipeline's thread.
+   */
+  bool start(const std::string &name) {
+    const auto *conf = find_source_config(*config_, name);
+    if (conf == nullptr) {
+      return false;
+    }
+    if (!pending_.insert(name).second) {
+      return true;
+    }
+    // Let go of builds that have been handed over
+    builds_.erase(std::remove_if(builds_.begin(), builds_.end(),
+                                 [](const auto &build) {
+                                   return build.wait_for(std::chrono::seconds{
+                                              0}) == std::future_status::ready;
+                                 }),
+                  builds_.end());
+    builds_.push_back(std::async(
+        std::launch::async, [this, config = config_, conf] {
+          auto pframe_source = std::make_shared<std::unique_ptr<FrameSource>>(
+              make_frame_source(*conf));
+          p_.post([this, config, conf, pframe_source] {
+            finish(*conf, std::move(*pframe_source));
+          });
+        }));
+    return true;
+  }
+
+private:
+  void finish(const FrameSourceConfig &conf,
+              std::unique_ptr<FrameSource> pframe_source) {
+    pending_.erase(conf.name);
+    const auto *current = find_source_config(*config_, conf.name);
+    if (current == nullptr) {
+      spdlog::info("Source {} was removed while it was connecting",
+                   conf.name);
+      return;
+    }
+    if (current->options != conf.options) {
+      spdlog::info("Source {} changed while it was connecting; starting it "
+                   "again",
+                   conf.name);
+      pframe_source.reset();
+      start(conf.name);
+      return;
+    }
+    if (pframe_source == nullptr) {
+      start_frame_source(p_, conf, nullptr);
+      p_.start_failed(conf.name);
+      return;
+    }
+    start_frame_source(p_, conf, std::move(pframe_source));
+  }
+
+  Pipeline &p_;
+  const std::shared_ptr<const Config> &config_;
+  // Names of sources being constructed
+  std::set<std::string> pending_;
+  std::vector<std::future<void>> builds_;
+};
+
+/**
+ * Load the config again and apply the difference to the running pipeline.
+ * Sources that disappeared are removed, new ones are added, and ones whose
+ * settings changed are removed and added again once their old branch has
+ * drained. Sources that didn't change keep running untouched.
+ */
+static void reload(std::shared_ptr<const Config> &config,
+                   const std::string &path, Pipeline &p,
+                   SourceStarter &starter) {
+  spdlog::info("Reloading config from {}", path);
+  std::shared_ptr<const Config> new_config;
+  try {
+    new_config = std::make_shared<const Config>(path);
+  } catch (const std::exception &e) {
+    spdlog::error("Failed to parse {}; keeping the running config: {}", path,
+                  e.what());
+    return;
+  }
+  if (!new_config->loaded()) {
+    spdlog::error("Failed to load {}; keeping the running config", path);
+    return;
+  }
+  if (new_config->output_directory != config->output_directory) {
+    spdlog::warn("Changing output_directory requires a restart; ignoring it");
+  }
+
+  std::map<std::string, const FrameSourceConfig *> old_sources;
+  for (const auto &conf : config->frame_sources) {
+    old_sources.emplace(conf.name, &conf);
+  }
+  std::vector<std::string> added;
+  std::vector<std::string> changed;
+  for (const auto &conf : new_config->frame_sources) {
+    const auto old = old_sources.find(conf.name);
+    if (old == old_sources.end()) {
+      added.push_back(conf.name);
+    } else {
+      if (old->second->options != conf.options) {
+        changed.push_back(conf.name);
+      }
+      old_sources.erase(old);
+    }
+  }
+  for (const auto &[name, conf] : old_sources) {
+    // Also cancels restarting it if it's still draining from a change
+    p.remove_frame_source(name);
+  }
+  // Sources are started from the current config, so it has to be in place
+  config = std::move(new_config);
+
+  for (const auto &name : changed) {
+    spdlog::info("Source {} changed; restarting it", name);
+  }
+  for (const auto &name : added) {
+    spdlog::info("Source {} added", name);
+  }
+  changed.insert(changed.end(), added.begin(), added.end());
+  for (const auto &name : changed) {
+    // The old source may hold resources the new one needs, like its port,
+    // so it has to be gone first. An added source may still be draining
+    // from an earlier reload that removed it.
+    if (!p.remove_frame_source(name,
+                               [&starter, name] { starter.start(name); })) {
+      starter.start(name);
+    }
+  }
+}
+
 static cag_option options[] = {{
                                    .identifier = 'c',
                                    .access_letters = "c",
@@ -48,6 +334,23 @@ static cag_option options[] = {{
                                    .value_name = "CONFIG_PATH",
                                    .description = "Path to config file",
                                },
+                               {
+                                   .identifier = 't',
+                                   .access_letters = "t",
+                                   .access_name = "transcode",
+                                   .value_name = nullptr,
+                                   .description = "Transcode file sources as "
+                                                  "fast as possible, then exit",
+                               },
+                               {
+                                   .identifier = 'j',
+                                   .access_letters = "j",
+                                   .access_name = "jobs",
+                                   .value_name = "JOBS",
+                                   .description = "Chunks to transcode at "
+                                                  "once (default: one per "
+                                                  "core)",
+                               },
                                {
                                    .identifier = 'v',
                                    .access_letters = "v",
@@ -65,6 +368,8 @@ static cag_option options[] = {{
 
 int main(int argc, char *argv[]) {
   const char *config_path = "camcoder.toml";
+  bool transcode = false;
+  unsigned int jobs = 0;
 
   cag_option_context option_ctx{};
   cag_option_prepare(&option_ctx, options, CAG_ARRAY_SIZE(options), argc, argv);
@@ -74,6 +379,12 @@ int main(int argc, char *argv[]) {
     case 'c':
       config_path = cag_option_get_value(&option_ctx);
       break;
+    case 't':
+      transcode = true;
+      break;
+    case 'j':
+      jobs = std::strtoul(cag_option_get_value(&option_ctx), nullptr, 10);
+      break;
     case 'v':
       spdlog::set_level(spdlog::level::debug);
       break;
@@ -84,40 +395,69 @@ int main(int argc, char *argv[]) {
     }
   }
 
+  StartupTimer startup;
   spdlog::info("Using config at {}", config_path);
-  Config config{config_path};
+  auto config = std::make_shared<const Config>(std::string{config_path});
+  startup.phase("config");
 
   // Only needed if we're writing socket code, but for now we'll assume it
   // doesn't hurt to initialize it.
   sockpp::socket_initializer{};
 
   Gst::init();
+  startup.phase("GStreamer init");
 
-  Pipeline p{config};
+  if (transcode) {
+    return Transcoder{*config, jobs}() ? 0 : 1;
+  }
 
-  for (const auto &conf : config.frame_sources) {
-    std::unique_ptr<FrameSource> pframe_source{nullptr};
-    switch (conf.type) {
-    case FrameSourceType::FILE:
-      pframe_source = FileFrameSource::from_config(conf);
-      break;
-    case FrameSourceType::TCP_CLIENT:
-      pframe_source = TCPClientFrameSource::from_config(conf);
-      break;
-    case FrameSourceType::TCP_SERVER:
-      pframe_source = TCPServerFrameSource::from_config(conf);
-      break;
-    default:
-      break;
-    }
-    if (pframe_source != nullptr) {
-      auto pframe_thread =
-          std::make_unique<FrameThread>(std::move(pframe_source));
-      p.add_frame_source(std::move(pframe_thread));
-    } else {
-      spdlog::warn("Failed to construct frame source from config for {}",
-                   conf.name);
+  // Plugins load while the sources connect
+  auto prewarmed =
+      std::async(std::launch::async, [&config] { Pipeline::prewarm(*config); });
+  std::vector<std::future<std::unique_ptr<FrameSource>>> pending_sources;
+  for (const auto &conf : config->frame_sources) {
+    pending_sources.push_back(std::async(
+        std::launch::async, [&conf] { return make_frame_source(conf); }));
+  }
+  std::vector<std::unique_ptr<FrameSource>> frame_sources;
+  for (auto &pending : pending_sources) {
+    frame_sources.push_back(pending.get());
+  }
+  prewarmed.get();
+  startup.phase("source construction");
+
+  Pipeline p{*config, startup};
+
+  for (size_t i = 0; i < config->frame_sources.size(); i++) {
+    start_frame_source(p, config->frame_sources[i],
+                       std::move(frame_sources[i]), true);
+  }
+  startup.phase("pipeline build");
+
+  // Declared after the pipeline, so sources still connecting are waited for
+  // before the pipeline goes away
+  SourceStarter starter{p, config};
+
+  // Failed sources are rebuilt from the current config, so a reload that
+  // changed or removed one is respected
+  p.set_restart_handler(
+      [&starter](const std::string &name) { return starter.start(name); });
+
+  std::signal(SIGHUP, [](int) { reload_requested = 1; });
+  p.set_tick([&] {
+    if (reload_requested) {
+      reload_requested = 0;
+      reload(config, config_path, p, starter);
     }
+  });
+
+  // Declared after the pipeline, so it's closed before the pipeline goes away
+  std::unique_ptr<ControlServer> control;
+  if (!config->control_socket.empty()) {
+    control = std::make_unique<ControlServer>(
+        config->control_socket,
+        [&p](const json::Object &command) { return p.control(command); });
+    control->start();
   }
 
   p();
@@ -0,0 +1,115 @@
+#include <cstdlib>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "motion_detector.hpp"
+
+using namespace camcoder;
+
+static size_t round_up(size_t n, size_t multiple) {
+  return (n + multiple - 1) / multiple * multiple;
+}
+
+MotionDetector::MotionDetector(const FrameParameters &frame_params,
+                               const MotionParameters &params)
+    : params_{params},
+      grid_width_{round_up(frame_params.width / SAMPLE_STEP, BLOCK_SIZE)},
+      grid_height_{round_up(frame_params.height / SAMPLE_STEP, BLOCK_SIZE)},
+      blocks_x_{grid_width_ / BLOCK_SIZE}, blocks_y_{grid_height_ / BLOCK_SIZE},
+      luma_(grid_width_ * grid_height_), reference_(grid_width_ * grid_height_),
+      have_reference_{false}, last_activity_{0}, last_kept_{0},
+      last_motion_{0}, activity_{0}, skipped_{0}, scene_changes_{0} {}
+
+void MotionDetector::sample(const RGBFrame &frame) {
+  const auto columns = frame.width() / SAMPLE_STEP;
+  const auto rows = frame.height() / SAMPLE_STEP;
+  for (size_t gy = 0; gy < rows; gy++) {
+    const auto *row = frame.data() + gy * SAMPLE_STEP * frame.width();
+    auto *out = luma_.data() + gy * grid_width_;
+    for (size_t gx = 0; gx < columns; gx++) {
+      const auto &pixel = row[gx * SAMPLE_STEP];
+      // BT.601 luma in fixed point
+      out[gx] = (77 * pixel.r + 150 * pixel.g + 29 * pixel.b) >> 8;
+    }
+  }
+}
+
+std::uint32_t MotionDetector::block_sad(size_t bx, size_t by) const {
+  const auto offset = by * BLOCK_SIZE * grid_width_ + bx * BLOCK_SIZE;
+  const auto *a = luma_.data() + offset;
+  const auto *b = reference_.data() + offset;
+#if defined(__SSE2__)
+  static_assert(BLOCK_SIZE == 16, "One SSE2 register per block row");
+  auto sum = _mm_setzero_si128();
+  for (size_t y = 0; y < BLOCK_SIZE; y++) {
+    const auto va = _mm_loadu_si128(
+        reinterpret_cast<const __m128i *>(a + y * grid_width_));
+    const auto vb = _mm_loadu_si128(
+        reinterpret_cast<const __m128i *>(b + y * grid_width_));
+    // Two partial sums, one per 64-bit half
+    sum = _mm_add_epi64(sum, _mm_sad_epu8(va, vb));
+  }
+  return _mm_cvtsi128_si32(sum) + _mm_extract_epi16(sum, 4);
+#else
+  std::uint32_t sum = 0;
+  for (size_t y = 0; y < BLOCK_SIZE; y++) {
+    for (size_t x = 0; x < BLOCK_SIZE; x++) {
+      sum += std::abs(a[y * grid_width_ + x] - b[y * grid_width_ + x]);
+    }
+  }
+  return sum;
+#endif
+}
+
+MotionDetector::Result MotionDetector::analyze(const RGBFrame &frame,
+                                               Timestamp now) {
+  sample(frame);
+
+  double activity = 1.0;
+  if (have_reference_) {
+    const auto threshold = static_cast<std::uint32_t>(
+        params_.block_threshold * BLOCK_SIZE * BLOCK_SIZE);
+    size_t changed = 0;
+    for (size_t by = 0; by < blocks_y_; by++) {
+      for (size_t bx = 0; bx < blocks_x_; bx++) {
+        changed += block_sad(bx, by) > threshold;
+      }
+    }
+    const auto blocks = blocks_x_ * blocks_y_;
+    activity = blocks > 0 ? static_cast<double>(changed) / blocks : 0.0;
+  } else {
+    last_motion_ = now;
+  }
+
+  Result result{activity, false, false, false};
+  if (activity > params_.static_activity) {
+    last_motion_ = now;
+  }
+  result.idle = params_.idle_after.count() > 0 &&
+                now - last_motion_ >= params_.idle_after;
+  result.scene_change = have_reference_ &&
+                        activity >= params_.scene_change &&
+                        last_activity_ < params_.scene_change;
+  result.skip = params_.skip_static && have_reference_ &&
+                activity <= params_.static_activity &&
+                now - last_kept_ < params_.refresh;
+  last_activity_ = activity;
+
+  if (result.skip) {
+    skipped_++;
+  } else {
+    luma_.swap(reference_);
+    have_reference_ = true;
+    last_kept_ = now;
+  }
+  if (result.scene_change) {
+    scene_changes_++;
+  }
+
+  // Roughly a one-second average at 30 fps
+  constexpr double SMOOTHING = 1.0 / 32;
+  activity_ = activity_ + (activity - activity_) * SMOOTHING;
+  return result;
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#include "frame.hpp"
+
+namespace camcoder {
+
+/**
+ * Per-source options for motion-aware encoding.
+ */
+struct MotionParameters {
+  bool enabled = false;
+
+  /**
+   * Mean absolute luma difference (0-255) above which a block has changed.
+   */
+  double block_threshold = 4.0;
+
+  /**
+   * A frame with at most this fraction of changed blocks is static.
+   */
+  double static_activity = 0.002;
+
+  /**
+   * A jump to at least this fraction of changed blocks is a scene change,
+   * which forces a keyframe.
+   */
+  double scene_change = 0.5;
+
+  /**
+   * Don't encode static frames, except one every refresh interval so the
+   * stream keeps moving.
+   */
+  bool skip_static = true;
+  std::chrono::milliseconds refresh{1000};
+
+  /**
+   * After this long without motion the source is idle, and its encoder is
+   * switched to idle_bitrate (kbit/s) until motion resumes. A bitrate of
+   * zero leaves the encoder alone.
+   */
+  std::chrono::milliseconds idle_after{5000};
+  unsigned int idle_bitrate = 0;
+};
+
+/**
+ * Cheap frame differencing for deciding which frames are worth encoding.
+ *
+ * Frames are reduced to luma sampled every SAMPLE_STEP pixels in each
+ * direction and compared, in BLOCK_SIZE x BLOCK_SIZE blocks of samples, with
+ * the last frame that was kept. Comparing against the last kept frame rather
+ * than the previous one means slow changes still add up to a kept frame.
+ */
+class MotionDetector {
+public:
+  static constexpr size_t SAMPLE_STEP = 4;
+  static constexpr size_t BLOCK_SIZE = 16;
+
+  using Timestamp = std::chrono::nanoseconds;
+
+  struct Result {
+    /**
+     * Fraction of blocks that changed.
+     */
+    double activity;
+
+    /**
+     * The frame is static and can be skipped.
+     */
+    bool skip;
+
+    /**
+     * The scene changed abruptly; a keyframe should start here.
+     */
+    bool scene_change;
+
+    /**
+     * The source is idle (no motion for a while).
+     */
+    bool idle;
+  };
+
+  MotionDetector(const FrameParameters &frame_params,
+                 const MotionParameters &params);
+
+  /**
+   * Compare a frame with the last kept one. now is any monotonic time.
+   */
+  Result analyze(const RGBFrame &frame, Timestamp now);
+
+  /**
+   * Smoothed fraction of blocks changing per frame, for reporting.
+   */
+  double activity() const { return activity_; }
+
+  std::uint64_t skipped() const { return skipped_; }
+  std::uint64_t scene_changes() const { return scene_changes_; }
+
+private:
+  /**
+   * Fill luma_ from the frame.
+   */
+  void sample(const RGBFrame &frame);
+
+  /**
+   * Sum of absolute differences between luma_ and reference_ over the block
+   * at block column bx, block row by.
+   */
+  std::uint32_t block_sad(size_t bx, size_t by) const;
+
+  MotionParameters params_;
+  // Sample grid, padded to whole blocks
+  size_t grid_width_;
+  size_t grid_height_;
+  size_t blocks_x_;
+  size_t blocks_y_;
+  std::vector<std::uint8_t> luma_;
+  std::vector<std::uint8_t> reference_;
+  bool have_reference_;
+
+  double last_activity_;
+  Timestamp last_kept_;
+  Timestamp last_motion_;
+
+  std::atomic<double> activity_;
+  std::atomic<std::uint64_t> skipped_;
+  std::atomic<std::uint64_t> scene_changes_;
+};
+
+} // namespace camcoder
@@ -1,37 +1,343 @@
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <optional>
+#include <tuple>
+
 #include <spdlog/spdlog.h>
 
+#include <gst/app/gstappsrc.h>
+#include <gst/video/video-event.h>
+
 #include "pipeline.hpp"
 #include "utils.hpp"
 
 using namespace camcoder;
 
-Pipeline::Pipeline(const Config &config)
-    : convert_{Gst::ElementFactory::create_element("videoconvert")},
-      encoder_{Gst::ElementFactory::create_element("x264enc")},
-      // encoder_{Gst::ElementFactory::create_element("vaapih264enc")},
-      // encoder_{Gst::ElementFactory::create_element("nvh264enc")},
-      tsmux_{Gst::ElementFactory::create_element("mpegtsmux")},
-      hls_sink_{Gst::ElementFactory::create_element("hlssink")},
-      pipeline_{Gst::Pipeline::create()},
-      terminate_{false}, playing_{false}, ready_{false} {
+/**
+ * Convert a steady-clock arrival time to running time on the element's clock.
+ * Empty if the element has no clock yet, i.e. the pipeline isn't playing, so
+ * there's no running time to convert to.
+ */
+static std::optional<FramePacer::Timestamp>
+running_time(GstElement *element, Frame::Timestamp arrival) {
+  GstClock *clock = gst_element_get_clock(element);
+  if (clock == nullptr) {
+    return std::nullopt;
+  }
+  const auto now = std::chrono::steady_clock::now().time_since_epoch();
+  const auto age = arrival.count() == 0 ? Frame::Timestamp{0} : now - arrival;
+  const auto clock_now = gst_clock_get_time(clock);
+  gst_object_unref(clock);
+  const auto base_time = gst_element_get_base_time(element);
+  return FramePacer::Timestamp{
+             static_cast<std::int64_t>(clock_now - base_time)} -
+         age;
+}
+
+/**
+ * Block until the element's clock reaches the given running time.
+ */
+static void wait_for_running_time(GstElement *element,
+                                  FramePacer::Timestamp running_time) {
+  GstClock *clock = gst_element_get_clock(element);
+  if (clock == nullptr) {
+    return;
+  }
+  auto clock_id = gst_clock_new_single_shot_id(
+      clock, gst_element_get_base_time(element) + running_time.count());
+  gst_clock_id_wait(clock_id, nullptr);
+  gst_clock_id_unref(clock_id);
+  gst_object_unref(clock);
+}
+
+/**
+ * Give the buffer the pacer's next output slot, and return its PTS.
+ */
+static FramePacer::Timestamp stamp_buffer(const Glib::RefPtr<Gst::Buffer> &buf,
+                                          FramePacer &pacer) {
+  const auto pts = pacer.next_pts();
+  buf->set_pts(pts.count());
+  buf->set_dts(pts.count());
+  const auto duration = pacer.frame_duration().count();
+  buf->set_duration(duration > 0 ? duration : GST_CLOCK_TIME_NONE);
+  return pts;
+}
+
+/**
+ * Wrap the frame's memory in a buffer without copying. The buffer holds a
+ * reference to the frame until it's freed.
+ */
+static Glib::RefPtr<Gst::Buffer> wrap_frame(SharedFrame frame) {
+  const auto size = frame->raw_size();
+  auto data = const_cast<char *>(frame->raw_data());
+  auto buf = gst_buffer_new_wrapped_full(
+      GST_MEMORY_FLAG_READONLY, data, size, 0, size,
+      new SharedFrame{std::move(frame)},
+      [](gpointer frame) { delete reinterpret_cast<SharedFrame *>(frame); });
+  return Glib::wrap(buf, false);
+}
+
+static void push_buffer(GstElement *appsrc,
+                        const Glib::RefPtr<Gst::Buffer> &buf) {
+  // appsrc takes ownership of the reference
+  const auto ret =
+      gst_app_src_push_buffer(GST_APP_SRC(appsrc), gst_buffer_ref(buf->gobj()));
+  if (ret < 0) {
+    spdlog::error(gst_flow_get_name(ret));
+  }
+}
+
+static bool has_property(GstElement *element, const char *name) {
+  return g_object_class_find_property(G_OBJECT_GET_CLASS(element), name) !=
+         nullptr;
+}
+
+/**
+ * Ask the encoder to make its next frame a keyframe.
+ */
+static void force_keyframe(GstElement *encoder) {
+  auto pad = gst_element_get_static_pad(encoder, "src");
+  gst_pad_send_event(pad, gst_video_event_new_upstream_force_key_unit(
+                              GST_CLOCK_TIME_NONE, TRUE, 0));
+  gst_object_unref(pad);
+}
+
+/**
+ * Drops the buffers of a standing-by source's appsrc, whose branch is gone.
+ */
+static GstPadProbeReturn drop_probe(GstPad *pad, GstPadProbeInfo *info,
+                                    gpointer udata) {
+  return GST_PAD_PROBE_DROP;
+}
+
+/**
+ * Cut the pad off from the branch it feeds, and end the branch's stream so
+ * the encoder gives up what it's holding and the open segment is finished.
+ * Runs once nothing is being pushed.
+ */
+static GstPadProbeReturn detach_probe(GstPad *pad, GstPadProbeInfo *info,
+                                      gpointer udata) {
+  auto peer = gst_pad_get_peer(pad);
+  if (peer != nullptr) {
+    gst_pad_unlink(pad, peer);
+    gst_pad_send_event(peer, gst_event_new_eos());
+    gst_object_unref(peer);
+  }
+  return GST_PAD_PROBE_REMOVE;
+}
+
+/**
+ * True if element is one of the branch's elements or inside one; sinks like
+ * hlssink are bins, so messages can come from their children.
+ */
+static bool
+branch_contains(const std::vector<Glib::RefPtr<Gst::Element>> &branch,
+                GstObject *element) {
+  return std::any_of(branch.begin(), branch.end(),
+                     [element](const auto &branch_element) {
+                       return element == GST_OBJECT(branch_element->gobj()) ||
+                              gst_object_has_as_ancestor(
+                                  element, GST_OBJECT(branch_element->gobj()));
+                     });
+}
+
+/**
+ * Take the end marker out of a playlist, so players keep polling it.
+ */
+static void reopen_playlist(const std::string &path) {
+  std::ifstream in{path};
+  std::string contents;
+  bool ended = false;
+  for (std::string line; std::getline(in, line);) {
+    if (line == "#EXT-X-ENDLIST") {
+      ended = true;
+      continue;
+    }
+    contents += line + "\n";
+  }
+  in.close();
+  if (!ended) {
+    return;
+  }
+  const auto tmp_path = path + ".tmp";
+  std::ofstream out{tmp_path, std::ofstream::trunc};
+  out << contents;
+  out.close();
+  std::error_code ec;
+  if (out) {
+    std::filesystem::rename(tmp_path, path, ec);
+  }
+  if (!out || ec) {
+    spdlog::warn("Failed to rewrite {}", path);
+    std::filesystem::remove(tmp_path, ec);
+  }
+}
+
+/**
+ * The message a bin forwarded from one of its children, or null if msg isn't
+ * one. Not a new reference.
+ */
+static GstMessage *forwarded_message(GstMessage *msg) {
+  if (GST_MESSAGE_TYPE(msg) != GST_MESSAGE_ELEMENT) {
+    return nullptr;
+  }
+  const auto structure = gst_message_get_structure(msg);
+  if (!gst_structure_has_name(structure, "GstBinForwarded")) {
+    return nullptr;
+  }
+  const auto value = gst_structure_get_value(structure, "message");
+  return value != nullptr ? GST_MESSAGE(g_value_get_boxed(value)) : nullptr;
+}
+
+static const char *encoding_name(Encoding encoding) {
+  switch (encoding) {
+  case Encoding::RAW:
+    return "raw";
+  case Encoding::H264:
+    return "h264";
+  case Encoding::H265:
+    return "h265";
+  default:
+    return "invalid";
+  }
+}
+
+static const char *feed_mode_name(FeedMode mode) {
+  switch (mode) {
+  case FeedMode::PULL:
+    return "pull";
+  case FeedMode::PUSH:
+    return "push";
+  case FeedMode::INLINE:
+    return "inline";
+  case FeedMode::AUTO:
+  default:
+    return "auto";
+  }
+}
+
+static const char *overflow_policy_name(OverflowPolicy policy) {
+  switch (policy) {
+  case OverflowPolicy::DROP_OLDEST:
+    return "drop_oldest";
+  case OverflowPolicy::DROP_NEWEST:
+    return "drop_newest";
+  case OverflowPolicy::BLOCK:
+  default:
+    return "block";
+  }
+}
+
+/**
+ * A string member of a control command, or empty if it's missing.
+ */
+static std::string command_string(const json::Object &command,
+                                  const std::string &key) {
+  const auto it = command.find(key);
+  return it == command.end() ? std::string{} : it->second.to_string();
+}
+
+static std::string control_error(std::string_view error) {
+  return fmt::format(R"({{"ok":false,"error":{}}})", json::quote(error));
+}
 
-  // TODO: check for null elements
-  hls_sink_->set_property(
-      "location", utils::path_join(config.output_directory, "segment%05d.ts"));
-  hls_sink_->set_property(
-      "playlist-location",
-      utils::path_join(config.output_directory, "playlist.m3u8"));
+static const std::string CONTROL_OK{R"({"ok":true})"};
+
+/**
+ * Key of the SourceContext set on each source's appsrc.
+ */
+static constexpr const char *SOURCE_KEY = "camcoder-source";
+
+static std::int64_t steady_now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
 
-  pipeline_->add(convert_)->add(encoder_)->add(tsmux_)->add(hls_sink_);
-  convert_->link(encoder_)->link(tsmux_)->link(hls_sink_);
+/**
+ * Record in udata when a buffer passes, for the stall watchdog.
+ */
+static GstPadProbeReturn output_probe(GstPad *pad, GstPadProbeInfo *info,
+                                      gpointer udata) {
+  *reinterpret_cast<std::atomic<std::int64_t> *>(udata) = steady_now_ns();
+  return GST_PAD_PROBE_OK;
+}
+
+Pipeline::SourceContext::SourceContext(
+    std::unique_ptr<FrameThread> frame_thread_,
+    const FrameSourceConfig &config)
+    : name{config.name}, encoding{config.encoding}, recovery{config.recovery},
+      threads{config.threads},
+      feed_mode{FeedMode::PULL}, frame_thread{std::move(frame_thread_)},
+      pacer{frame_thread->frame_rate(), config.pacing}, last_buffer{},
+      appsrc{nullptr}, overflow{OverflowPolicy::BLOCK}, full{false},
+      dropped_frames{0}, push_mutex{}, black_buffer{}, stale{false},
+      last_frame_ns{steady_now_ns()}, branch{}, encoder{},
+      motion{config.motion.enabled
+                 ? std::make_unique<MotionDetector>(
+                       frame_thread->frame_parameters(), config.motion)
+                 : nullptr},
+      snapshot{}, clip_params{config.clips}, clips{},
+      archive_params{config.archive},
+      archiver{}, active_bitrate{0},
+      idle_bitrate{config.motion.idle_bitrate},
+      idle{false}, paused{false}, await_keyframe{false},
+      demand{config.demand}, segments{config.segments},
+      standby{config.demand.on_demand},
+      standing_by{false}, held_frames{}, last_viewer_ns{0}, wakeups{0},
+      standby_probe{0}, retired_branch{}, retired_drained{false},
+      retired_deadline{}, woke_ns{0},
+      startup{nullptr},
+      first_frame_pushed{false}, playlist{}, segment_prefix{},
+      old_playlist_time{}, first_segment_written{false}, drained{false},
+      last_output_ns{steady_now_ns()}, last_taken_ns{0}, backlog_since_ns{0} {}
+
+Pipeline::Pipeline(const Config &config, StartupTimer &startup)
+    : output_directory_{config.output_directory}, startup_{startup},
+      pipeline_{Gst::Pipeline::create()}, tick_{}, restart_handler_{},
+      health_{}, branch_generations_{}, posted_mutex_{},
+      posted_{}, started_{false},
+      terminate_{false}, playing_{false}, ready_{false} {
+  // A sink's own end of stream is otherwise kept inside the pipeline, and
+  // it's what says a removed branch has finished its last segment
+  g_object_set(pipeline_->gobj(), "message-forward", TRUE, nullptr);
+  gst_bus_set_sync_handler(pipeline_->get_bus()->gobj(), bus_sync_handler,
+                           nullptr, nullptr);
+}
+
+void Pipeline::prewarm(const Config &config) {
+  std::vector<std::string> factories{"appsrc"};
+  for (const auto &source : config.frame_sources) {
+    const auto branch = branch_factories(source.encoding);
+    factories.insert(factories.end(), branch.begin(), branch.end());
+  }
+  std::sort(factories.begin(), factories.end());
+  factories.erase(std::unique(factories.begin(), factories.end()),
+                  factories.end());
+  for (const auto &name : factories) {
+    auto factory = gst_element_factory_find(name.c_str());
+    if (factory == nullptr) {
+      // build_branch() reports it
+      continue;
+    }
+    auto loaded = gst_plugin_feature_load(GST_PLUGIN_FEATURE(factory));
+    if (loaded != nullptr) {
+      gst_object_unref(loaded);
+    }
+    gst_object_unref(factory);
+  }
 }
 
 void Pipeline::operator()() {
+  started_ = true;
   if (pipeline_->set_state(Gst::State::STATE_PLAYING) ==
       Gst::StateChangeReturn::STATE_CHANGE_FAILURE) {
     throw std::runtime_error{"Failed to change to playing state"};
   }
   spdlog::info("Pipeline starting");
+  startup_.phase("state change");
 
   // Gst::Task
   // Gst::Buffer;
@@ -44,6 +350,7 @@ void Pipeline::operator()() {
                         Gst::MessageType::MESSAGE_STATE_CHANGED |
                             Gst::MessageType::MESSAGE_ERROR |
                             Gst::MessageType::MESSAGE_EOS |
+                            Gst::MessageType::MESSAGE_ELEMENT |
                             Gst::MessageType::MESSAGE_DURATION_CHANGED);
 
     if (msg) {
@@ -51,48 +358,411 @@ void Pipeline::operator()() {
     } else {
       // The timeout expired
     }
+    check_stale_sources();
+    check_first_segments();
+    check_stalls();
+    check_viewers();
+    finish_retired_branches();
+    finish_removals();
+    check_restarts();
+    run_posted();
+    if (tick_) {
+      tick_();
+    }
   }
   pipeline_->set_state(Gst::State::STATE_NULL);
+  for (const auto &source : frame_sources_) {
+    spdlog::info("Source {} dropped {} and duplicated {} frames", source->name,
+                 source->pacer.dropped() + source->dropped_frames +
+                     source->frame_thread->dropped_frames(),
+                 source->pacer.duplicated());
+    if (source->motion != nullptr) {
+      spdlog::info("Source {} skipped {} static frames and had {} scene "
+                   "changes; activity {:.3f}",
+                   source->name, source->motion->skipped(),
+                   source->motion->scene_changes(),
+                   source->motion->activity());
+    }
+    const auto stats = source->frame_thread->stats();
+    for (const auto &[stat, value] : stats) {
+      spdlog::info("Source {} {}: {}", source->name, stat, value);
+    }
+    const auto health = health_.find(source->name);
+    if (health != health_.end()) {
+      spdlog::info("Source {} had {} errors and {} stalls, and was restarted "
+                   "{} times",
+                   source->name, health->second.errors,
+                   health->second.stalls, health->second.restarts);
+    }
+    const auto frames = stats.find("frames_received");
+    const auto recv_calls = stats.find("recv_calls");
+    if (frames != stats.end() && recv_calls != stats.end() &&
+        frames->second > 0) {
+      spdlog::info("Source {} averaged {:.2f} recv calls per frame",
+                   source->name,
+                   static_cast<double>(recv_calls->second) / frames->second);
+    }
+  }
   spdlog::info("Pipeline done");
 }
 
-void Pipeline::add_frame_source(std::unique_ptr<FrameThread> frame_source) {
+void Pipeline::add_frame_source(std::unique_ptr<FrameThread> frame_source,
+                                const FrameSourceConfig &config) {
+  if (has_frame_source(config.name)) {
+    spdlog::error("Source {} already exists", config.name);
+    return;
+  }
   auto appsrc = Gst::ElementFactory::create_element("appsrc");
 
-  Gst::VideoInfo video_info;
-  video_info.init();
-  const auto &frame_params = frame_source->frame_parameters();
-  video_info.set_format(Gst::VideoFormat::VIDEO_FORMAT_RGB, frame_params.width,
-                        frame_params.height);
-  const auto frame_rate = frame_source->frame_rate();
-  if (frame_rate.numerator > 0) {
-    video_info.set_fps_n(frame_rate.numerator);
-    video_info.set_fps_d(frame_rate.denominator);
-  }
+  auto source =
+      std::make_unique<SourceContext>(std::move(frame_source), config);
+  source->appsrc = appsrc->gobj();
+  source->startup = &startup_;
+  g_object_set_data(G_OBJECT(appsrc->gobj()), SOURCE_KEY, source.get());
+
+  const auto &frame_params = source->frame_thread->frame_parameters();
+  // Zero if the rate will be estimated, which leaves it variable in the caps
+  const auto frame_rate = source->pacer.output_frame_rate();
   spdlog::info("Using frame rate {}/{}", frame_rate.numerator,
                frame_rate.denominator);
-  auto video_caps = video_info.to_caps();
+  if (source->encoding == Encoding::RAW) {
+    Gst::VideoInfo video_info;
+    video_info.init();
+    video_info.set_format(Gst::VideoFormat::VIDEO_FORMAT_RGB,
+                          frame_params.width, frame_params.height);
+    if (frame_rate.numerator > 0) {
+      video_info.set_fps_n(frame_rate.numerator);
+      video_info.set_fps_d(frame_rate.denominator);
+    }
+    appsrc->set_property("caps", video_info.to_caps());
 
-  appsrc->set_property("caps", video_caps);
-  appsrc->set_property("block", true);
+    // Zeroed RGB is black
+    const auto frame_size = frame_params.width * frame_params.height *
+                            pixel_size(frame_params.pixel_format);
+    source->black_buffer = Gst::Buffer::create(frame_size);
+    gst_buffer_memset(source->black_buffer->gobj(), 0, 0, frame_size);
+  } else {
+    // Whole access units in Annex-B format; the parser fills in the rest
+    auto caps = gst_caps_new_simple(
+        source->encoding == Encoding::H265 ? "video/x-h265" : "video/x-h264",
+        "stream-format", G_TYPE_STRING, "byte-stream", "alignment",
+        G_TYPE_STRING, "au", nullptr);
+    if (frame_rate.numerator > 0) {
+      gst_caps_set_simple(caps, "framerate", GST_TYPE_FRACTION,
+                          static_cast<gint>(frame_rate.numerator),
+                          static_cast<gint>(frame_rate.denominator), nullptr);
+    }
+    g_object_set(appsrc->gobj(), "caps", caps, nullptr);
+    gst_caps_unref(caps);
+
+    // Raw placeholders can't be spliced into an encoded stream, and dropping
+    // access units would corrupt it until the next keyframe
+    source->recovery.stale_timeout = std::chrono::milliseconds{0};
+    if (config.feed.overflow != OverflowPolicy::BLOCK) {
+      spdlog::warn("Source {} is encoded; dropped frames will corrupt its "
+                   "stream until the next keyframe",
+                   config.name);
+    }
+  }
+
+  // Timestamps are regenerated by the pacer as running times, delayed by the
+  // jitter buffer
+  g_object_set(appsrc->gobj(), "is-live", TRUE, "format", GST_FORMAT_TIME,
+               "min-latency",
+               static_cast<gint64>(config.pacing.jitter_buffer.count()),
+               nullptr);
+
+  if (config.feed.max_bytes > 0) {
+    g_object_set(appsrc->gobj(), "max-bytes",
+                 static_cast<guint64>(config.feed.max_bytes), nullptr);
+  }
+  if (config.feed.max_buffers > 0) {
+    if (has_property(appsrc->gobj(), "max-buffers")) {
+      g_object_set(appsrc->gobj(), "max-buffers",
+                   static_cast<guint64>(config.feed.max_buffers), nullptr);
+    } else {
+      spdlog::warn("appsrc doesn't support max-buffers; ignoring it for {}",
+                   config.name);
+    }
+  }
+
+  auto feed_mode = config.feed.mode;
+  if (feed_mode == FeedMode::AUTO) {
+    feed_mode = source->frame_thread->can_read_inline() ? FeedMode::INLINE
+                                                        : FeedMode::PULL;
+  } else if (feed_mode == FeedMode::INLINE &&
+             !source->frame_thread->can_read_inline()) {
+    spdlog::warn("Source {} can't be read inline; using a reader thread",
+                 config.name);
+    feed_mode = FeedMode::PULL;
+  }
+
+  source->feed_mode = feed_mode;
+  if (feed_mode == FeedMode::PUSH) {
+    // The reader thread pushes directly, so the overflow policy applies to
+    // appsrc's own queue
+    source->overflow = source->frame_thread->overflow_policy();
+    switch (source->overflow) {
+    case OverflowPolicy::DROP_OLDEST:
+      if (has_property(appsrc->gobj(), "leaky-type")) {
+        appsrc->set_property("block", false);
+        // GST_APP_LEAKY_TYPE_DOWNSTREAM, which older headers don't define
+        g_object_set(appsrc->gobj(), "leaky-type", 2, nullptr);
+        break;
+      }
+      spdlog::warn("appsrc can't drop old buffers; dropping new frames from "
+                   "{} instead",
+                   config.name);
+      source->overflow = OverflowPolicy::DROP_NEWEST;
+      [[fallthrough]];
+    case OverflowPolicy::DROP_NEWEST:
+      appsrc->set_property("block", false);
+      break;
+    case OverflowPolicy::BLOCK:
+    default:
+      appsrc->set_property("block", true);
+      break;
+    }
+
+    g_signal_connect(appsrc->gobj(), "need-data",
+                     G_CALLBACK(appsrc_push_need_data_callback),
+                     reinterpret_cast<gpointer>(source.get()));
+    g_signal_connect(appsrc->gobj(), "enough-data",
+                     G_CALLBACK(appsrc_enough_data_callback),
+                     reinterpret_cast<gpointer>(source.get()));
+    auto &source_ref = *source;
+    source->frame_thread->set_consumer(
+        [&source_ref](SharedFrame pframe) {
+          push_frame(source_ref, std::move(pframe));
+        });
+  } else {
+    appsrc->set_property("block", true);
+    g_signal_connect(appsrc->gobj(), "need-data",
+                     G_CALLBACK(appsrc_need_data_callback),
+                     reinterpret_cast<gpointer>(source.get()));
+  }
 
-  g_signal_connect(appsrc->gobj(), "need-data",
-                   G_CALLBACK(appsrc_need_data_callback),
-                   reinterpret_cast<gpointer>(frame_source.get()));
   pipeline_->add(appsrc);
-  appsrc->link(convert_);
-  frame_sources_.push_back(std::move(frame_source));
+  if (!build_branch(*source, appsrc)) {
+    spdlog::error("Failed to build the pipeline for source {}", config.name);
+    pipeline_->remove(appsrc);
+    return;
+  }
+  if (started_) {
+    // Bring the branch up sink first, so nothing flows into an element that
+    // isn't ready for it
+    for (auto element = source->branch.rbegin();
+         element != source->branch.rend(); ++element) {
+      (*element)->sync_state_with_parent();
+    }
+    appsrc->sync_state_with_parent();
+    spdlog::info("Added source {} to the running pipeline", config.name);
+  }
+  if (feed_mode == FeedMode::INLINE) {
+    source->frame_thread->start_inline();
+  } else {
+    source->frame_thread->start();
+  }
+  frame_sources_.push_back(std::move(source));
+}
+
+std::vector<std::string> Pipeline::branch_factories(Encoding encoding) {
+  switch (encoding) {
+  case Encoding::H264:
+    return {"h264parse", "mpegtsmux", "hlssink"};
+  case Encoding::H265:
+    return {"h265parse", "mpegtsmux", "hlssink"};
+  case Encoding::RAW:
+  default:
+    // Convert format into something the encoder can use
+    return {"videoconvert", "x264enc", "mpegtsmux", "hlssink"};
+    // return {"videoconvert", "vaapih264enc", "mpegtsmux", "hlssink"};
+    // return {"videoconvert", "nvh264enc", "mpegtsmux", "hlssink"};
+  }
+}
+
+bool Pipeline::build_branch(SourceContext &source,
+                            const Glib::RefPtr<Gst::Element> &appsrc) {
+  std::vector<Glib::RefPtr<Gst::Element>> branch;
+  for (const auto &factory : branch_factories(source.encoding)) {
+    auto element = Gst::ElementFactory::create_element(factory);
+    if (!element) {
+      spdlog::error("Failed to create {} for source {}", factory, source.name);
+      return false;
+    }
+    branch.push_back(element);
+  }
+
+  const auto directory = utils::path_join(output_directory_, source.name);
+  std::error_code ec;
+  std::filesystem::create_directories(directory, ec);
+  if (ec) {
+    spdlog::error("Failed to create {}: {}", directory, ec.message());
+    return false;
+  }
+  auto &hls_sink = branch.back();
+  // Each hlssink numbers its segments from zero, so a restarted or reloaded
+  // source names them apart from the ones its old playlist still lists
+  source.segment_prefix =
+      fmt::format("segment-{}-", branch_generations_[source.name]++);
+  hls_sink->set_property(
+      "location",
+      utils::path_join(directory, source.segment_prefix + "%05d.ts"));
+  source.playlist = utils::path_join(directory, "playlist.m3u8");
+  if (source.demand.on_demand) {
+    viewers_.watch(source.name, directory);
+  }
+  source.old_playlist_time =
+      std::filesystem::last_write_time(source.playlist, ec);
+  hls_sink->set_property("playlist-location", source.playlist);
+  // hlssink's default of 15 s would keep the stream from appearing for that
+  // long
+  g_object_set(hls_sink->gobj(), "target-duration",
+               static_cast<guint>(source.segments.duration.count()), nullptr);
+
+  auto upstream = appsrc;
+  for (const auto &element : branch) {
+    pipeline_->add(element);
+    upstream->link(element);
+    upstream = element;
+  }
+  // The watchdog watches what comes out of the encoder, or the parser for
+  // encoded sources
+  auto coded_pad = gst_element_get_static_pad(
+      branch[source.encoding == Encoding::RAW ? 1 : 0]->gobj(), "src");
+  gst_pad_add_probe(coded_pad, GST_PAD_PROBE_TYPE_BUFFER, output_probe,
+                    &source.last_output_ns, nullptr);
+  if (source.clip_params.pre_roll.count() > 0) {
+    source.clips = std::make_unique<ClipBuffer>(
+        source.name, source.clip_params,
+        source.clip_params.directory.empty()
+            ? utils::path_join(directory, "clips")
+            : source.clip_params.directory);
+    gst_pad_add_probe(coded_pad,
+                      GST_PAD_PROBE_TYPE_BUFFER |
+                          GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+                      ClipBuffer::probe, source.clips.get(), nullptr);
+    if (source.encoding != Encoding::RAW) {
+      // Repeat the parameter sets at every keyframe, so any clip can start
+      // at one
+      g_object_set(branch[0]->gobj(), "config-interval", -1, nullptr);
+    }
+  }
+  if (!source.archive_params.directory.empty()) {
+    // The same muxed stream hlssink gets, so archiving costs no extra
+    // encoding or muxing
+    source.archiver =
+        std::make_unique<Archiver>(source.name, source.archive_params);
+    gst_pad_add_probe(coded_pad, GST_PAD_PROBE_TYPE_BUFFER,
+                      Archiver::coded_probe, source.archiver.get(), nullptr);
+    auto muxed_pad =
+        gst_element_get_static_pad(branch[branch.size() - 2]->gobj(), "src");
+    gst_pad_add_probe(muxed_pad,
+                      GST_PAD_PROBE_TYPE_BUFFER |
+                          GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+                      Archiver::probe, source.archiver.get(), nullptr);
+    gst_object_unref(muxed_pad);
+  }
+  gst_object_unref(coded_pad);
+  if (source.encoding == Encoding::RAW) {
+    // Kept when the branch is rebuilt after standby, since held frames still
+    // update it meanwhile
+    if (source.snapshot == nullptr) {
+      source.snapshot = std::make_shared<Snapshot>(
+          source.frame_thread->frame_parameters(), directory);
+    }
+    // After videoconvert
+    source.encoder = branch[1];
+    // Segments are cut at keyframes, so there has to be one at least every
+    // segment
+    auto keyframe_interval = source.segments.keyframe_interval;
+    const auto frame_duration = source.pacer.frame_duration();
+    if (keyframe_interval == 0 && frame_duration.count() > 0) {
+      keyframe_interval = static_cast<unsigned int>(
+          std::chrono::nanoseconds{source.segments.duration} / frame_duration);
+    }
+    if (keyframe_interval > 0 &&
+        has_property(source.encoder->gobj(), "key-int-max")) {
+      g_object_set(source.encoder->gobj(), "key-int-max", keyframe_interval,
+                   nullptr);
+    }
+    if (source.motion != nullptr && source.idle_bitrate > 0 &&
+        has_property(source.encoder->gobj(), "bitrate")) {
+      guint bitrate = 0;
+      g_object_get(source.encoder->gobj(), "bitrate", &bitrate, nullptr);
+      source.active_bitrate = bitrate;
+    }
+  }
+  source.branch = std::move(branch);
+  return true;
 }
 
 void Pipeline::handle_message(Glib::RefPtr<Gst::Message> msg) {
   switch (msg->get_message_type()) {
   case Gst::MessageType::MESSAGE_ERROR: {
     auto err = Glib::RefPtr<Gst::MessageError>::cast_static(msg);
+    auto element = GST_MESSAGE_SRC(msg->gobj());
     spdlog::error("Error from {}:", msg->get_source()->get_name().raw());
     spdlog::error("Debug information: {}", err->parse_debug());
-    terminate_ = true;
+    const auto retired = find_retired_owner(element);
+    if (retired != nullptr) {
+      // It was only finishing its last segment
+      spdlog::warn("Source {} failed while going on standby", retired->name);
+      remove_retired_branch(*retired);
+      break;
+    }
+    auto owner = find_branch_owner(element);
+    const auto removal =
+        std::find_if(removals_.begin(), removals_.end(),
+                     [owner](const auto &removal) {
+                       return removal.source.get() == owner;
+                     });
+    if (owner != nullptr && removal != removals_.end()) {
+      // A branch that failed while draining won't finish; tear it down at
+      // the next check and carry on with whatever follows its removal
+      spdlog::warn("Source {} failed while being removed", owner->name);
+      removal->deadline = std::chrono::steady_clock::now();
+    } else if (owner != nullptr) {
+      fail_frame_source(*owner, false);
+    } else if (!gst_object_has_as_ancestor(element,
+                                           GST_OBJECT(pipeline_->gobj()))) {
+      // Follow-up errors from a branch that's already been torn down
+      spdlog::debug("Ignoring error from a removed element");
+    } else {
+      terminate_ = true;
+    }
+  } break;
+  case Gst::MessageType::MESSAGE_ELEMENT: {
+    // Only forwarded ends of stream get past bus_sync_handler()
+    const auto forwarded = forwarded_message(msg->gobj());
+    if (forwarded == nullptr) {
+      break;
+    }
+    // The sink posts it once it's finished the last segment
+    const auto element = GST_MESSAGE_SRC(forwarded);
+    auto retired = find_retired_owner(element);
+    if (retired != nullptr) {
+      retired->retired_drained = true;
+      break;
+    }
+    auto owner = find_branch_owner(element);
+    if (owner != nullptr) {
+      owner->drained = true;
+    }
   } break;
   case Gst::MessageType::MESSAGE_EOS: {
+    // The pipeline's end of stream comes once every sink in it has finished,
+    // including those of removed sources, and may only be seen after the
+    // removal is done. It's only the end if every source still running got
+    // there; otherwise one was removed or restarted (or added since), so
+    // keep running.
+    const bool finished =
+        !frame_sources_.empty() &&
+        std::all_of(frame_sources_.begin(), frame_sources_.end(),
+                    [](const auto &source) { return source->drained; });
+    if (!finished) {
+      break;
+    }
     spdlog::info("Reached end of stream");
     terminate_ = true;
   } break;
@@ -104,7 +774,11 @@ void Pipeline::handle_message(Glib::RefPtr<Gst::Message> msg) {
       spdlog::debug("Pipeline state changed from {} to {}", old_state,
                     new_state);
       ready_ = new_state == Gst::State::STATE_READY;
+      const bool was_playing = playing_;
       playing_ = new_state == Gst::State::STATE_PLAYING;
+      if (playing_ && !was_playing) {
+        startup_.phase("playing");
+      }
     }
   } break;
   default:
@@ -115,29 +789,1055 @@ void Pipeline::handle_message(Glib::RefPtr<Gst::Message> msg) {
   }
 }
 
+bool Pipeline::emit_frame(SourceContext &source, SharedFrame pframe) {
+  const auto encoded = dynamic_cast<const EncodedFrame *>(pframe.get());
+  if (source.paused) {
+    source.await_keyframe = encoded != nullptr;
+    return false;
+  }
+  if (source.await_keyframe) {
+    if (encoded != nullptr && !encoded->keyframe()) {
+      return false;
+    }
+    source.await_keyframe = false;
+  }
+  if (source.standby) {
+    source.standing_by = true;
+    hold_frame(source, std::move(pframe));
+    return false;
+  }
+  if (source.standing_by) {
+    source.standing_by = false;
+    if (!resume_from_standby(source, pframe)) {
+      return false;
+    }
+  }
+
+  // Frames without an arrival time come from sources that aren't live.
+  // Until the pipeline has a clock, frames are scheduled like those, from
+  // the start of running time.
+  const auto clock_time = running_time(source.appsrc, pframe->timestamp());
+  const bool live = pframe->timestamp().count() != 0 && clock_time;
+  const auto now = clock_time.value_or(FramePacer::Timestamp{0});
+  FramePacer::Decision decision{};
+  if (!live) {
+    decision = source.pacer.admit_next(now);
+  } else if (source.encoding != Encoding::RAW) {
+    // Encoded frames depend on each other, so none can be dropped or repeated
+    decision = source.pacer.admit_passthrough(now);
+  } else {
+    decision = source.pacer.admit(now);
+  }
+  if (!decision.emit) {
+    spdlog::debug("Dropping frame {} from {}", pframe->frame_number(),
+                  source.name);
+    return false;
+  }
+
+  if (source.motion != nullptr &&
+      pframe->pixel_format() == PixelFormat::RGB) {
+    const auto motion = source.motion->analyze(
+        static_cast<const RGBFrame &>(*pframe), now);
+    adapt_encoder(source, motion);
+    if (motion.skip) {
+      // Let the slots pass unfilled; the last frame stays on screen without
+      // being encoded again
+      for (size_t i = 0; i <= decision.duplicates; i++) {
+        source.pacer.next_pts();
+      }
+      return false;
+    }
+  }
+
+  for (size_t i = 0; i < decision.duplicates; i++) {
+    auto dupbuf = source.last_buffer->copy();
+    stamp_buffer(dupbuf, source.pacer);
+    push_buffer(source.appsrc, dupbuf);
+  }
+
+  const bool delta_unit = encoded != nullptr && !encoded->keyframe();
+  auto framebuf = wrap_frame(std::move(pframe));
+  if (delta_unit) {
+    GST_BUFFER_FLAG_SET(framebuf->gobj(), GST_BUFFER_FLAG_DELTA_UNIT);
+  }
+  const auto pts = stamp_buffer(framebuf, source.pacer);
+  if (!live) {
+    // Play back in real time rather than as fast as the source can be read
+    wait_for_running_time(source.appsrc, pts - source.pacer.latency());
+  }
+  push_buffer(source.appsrc, framebuf);
+  source.last_buffer = framebuf;
+  if (source.snapshot != nullptr) {
+    source.snapshot->update(framebuf->gobj());
+  }
+  if (!source.first_frame_pushed) {
+    source.first_frame_pushed = true;
+    spdlog::info("Startup: source {} pushed its first frame at {} ms",
+                 source.name, source.startup->elapsed_ms());
+  }
+  return true;
+}
+
+void Pipeline::push_frame(SourceContext &source, SharedFrame pframe) {
+  if (pframe == nullptr) {
+    spdlog::info("Source {} finished", source.name);
+    gst_app_src_end_of_stream(GST_APP_SRC(source.appsrc));
+    return;
+  }
+  // A source whose frames are dropped is still alive
+  source.last_frame_ns = steady_now_ns();
+  // With the other policies appsrc either waits for room or makes room itself
+  if (source.full && source.overflow == OverflowPolicy::DROP_NEWEST) {
+    source.dropped_frames++;
+    return;
+  }
+  std::lock_guard<std::mutex> lock{source.push_mutex};
+  set_stale(source, false);
+  emit_frame(source, std::move(pframe));
+}
+
+void Pipeline::hold_frame(SourceContext &source, SharedFrame pframe) {
+  const auto encoded = dynamic_cast<const EncodedFrame *>(pframe.get());
+  if (encoded == nullptr) {
+    // The encoder starts over with a keyframe anyway, so older frames are of
+    // no use
+    if (source.snapshot != nullptr) {
+      source.snapshot->update(wrap_frame(std::move(pframe))->gobj());
+    }
+    return;
+  }
+  if (encoded->keyframe() || source.held_frames.size() >= MAX_HELD_FRAMES) {
+    source.held_frames.clear();
+  }
+  // Frames after a keyframe that was let go can't be decoded
+  if (encoded->keyframe() || !source.held_frames.empty()) {
+    source.held_frames.push_back(std::move(pframe));
+  }
+}
+
+bool Pipeline::resume_from_standby(SourceContext &source,
+                                   const SharedFrame &pframe) {
+  if (source.encoder) {
+    // So viewers can start decoding straight away
+    force_keyframe(source.encoder->gobj());
+    return true;
+  }
+  auto held = std::move(source.held_frames);
+  source.held_frames.clear();
+  const auto encoded = dynamic_cast<const EncodedFrame *>(pframe.get());
+  if (encoded != nullptr && encoded->keyframe()) {
+    return true;
+  }
+  if (held.empty()) {
+    source.await_keyframe = true;
+    return false;
+  }
+  spdlog::debug("Source {} restarting from {} held frames", source.name,
+                held.size());
+  for (auto &frame : held) {
+    emit_frame(source, std::move(frame));
+  }
+  return true;
+}
+
+bool Pipeline::emit_placeholder(SourceContext &source) {
+  if (source.standby) {
+    return false;
+  }
+  const auto &placeholder =
+      source.recovery.placeholder == PlaceholderFrame::BLACK ||
+              !source.last_buffer
+          ? source.black_buffer
+          : source.last_buffer;
+  // Nothing is missing before the pipeline is running
+  const auto now = running_time(source.appsrc, Frame::Timestamp{0});
+  if (!now) {
+    return false;
+  }
+  const auto decision = source.pacer.admit_placeholder(*now);
+  if (!decision.emit) {
+    return false;
+  }
+  for (size_t i = 0; i <= decision.duplicates; i++) {
+    auto buf = placeholder->copy();
+    stamp_buffer(buf, source.pacer);
+    push_buffer(source.appsrc, buf);
+  }
+  return true;
+}
+
+void Pipeline::set_stale(SourceContext &source, bool stale) {
+  if (source.stale.exchange(stale) == stale) {
+    return;
+  }
+  if (stale) {
+    spdlog::warn("Source {} is stale; feeding placeholder frames",
+                 source.name);
+  } else {
+    spdlog::info("Source {} recovered", source.name);
+  }
+}
+
+void Pipeline::adapt_encoder(SourceContext &source,
+                             const MotionDetector::Result &motion) {
+  if (!source.encoder) {
+    return;
+  }
+  if (motion.scene_change) {
+    spdlog::debug("Scene change in {}; forcing a keyframe", source.name);
+    force_keyframe(source.encoder->gobj());
+  }
+  if (motion.idle != source.idle && source.active_bitrate > 0) {
+    const auto bitrate =
+        motion.idle ? source.idle_bitrate : source.active_bitrate.load();
+    spdlog::info("Source {} is {}; encoding at {} kbit/s", source.name,
+                 motion.idle ? "idle" : "active", bitrate);
+    g_object_set(source.encoder->gobj(), "bitrate", bitrate, nullptr);
+  }
+  source.idle = motion.idle;
+}
+
+void Pipeline::check_stale_sources() {
+  const auto now = steady_now_ns();
+  for (auto &source : frame_sources_) {
+    const auto stale_timeout =
+        std::chrono::nanoseconds{source->recovery.stale_timeout}.count();
+    if (source->feed_mode != FeedMode::PUSH || stale_timeout == 0 ||
+        !source->frame_thread->live() ||
+        now - source->last_frame_ns < stale_timeout) {
+      continue;
+    }
+    // If the reader holds the lock it's pushing a frame, so it isn't stale
+    std::unique_lock<std::mutex> lock{source->push_mutex, std::try_to_lock};
+    if (lock.owns_lock()) {
+      set_stale(*source, true);
+      emit_placeholder(*source);
+    }
+  }
+}
+
+void Pipeline::check_first_segments() {
+  for (auto &source : frame_sources_) {
+    if (source->first_segment_written) {
+      continue;
+    }
+    // hlssink writes the playlist once the first segment is closed
+    std::error_code ec;
+    const auto playlist_time =
+        std::filesystem::last_write_time(source->playlist, ec);
+    if (!ec && playlist_time != source->old_playlist_time) {
+      source->first_segment_written = true;
+      if (source->woke_ns != 0) {
+        spdlog::info("Source {} wrote its first segment {} ms after waking",
+                     source->name,
+                     (steady_now_ns() - source->woke_ns) / 1000000);
+      } else {
+        spdlog::info("Startup: source {} wrote its first segment at {} ms",
+                     source->name, startup_.elapsed_ms());
+      }
+      remove_old_segments(*source);
+    }
+  }
+}
+
+void Pipeline::remove_old_segments(const SourceContext &source) {
+  // The new playlist has replaced the one listing them; hlssink only cleans
+  // up after itself
+  const auto directory =
+      std::filesystem::path{source.playlist}.parent_path();
+  std::error_code ec;
+  for (const auto &entry :
+       std::filesystem::directory_iterator{directory, ec}) {
+    const auto name = entry.path().filename().string();
+    if (entry.path().extension() != ".ts" || name.rfind("segment", 0) != 0 ||
+        name.rfind(source.segment_prefix, 0) == 0) {
+      continue;
+    }
+    std::error_code remove_ec;
+    std::filesystem::remove(entry.path(), remove_ec);
+    if (remove_ec) {
+      spdlog::warn("Failed to remove old segment {}: {}",
+                   entry.path().string(), remove_ec.message());
+    }
+  }
+}
+
+bool Pipeline::remove_frame_source(const std::string &name,
+                                   std::function<void()> on_removed) {
+  const auto it = std::find_if(
+      frame_sources_.begin(), frame_sources_.end(),
+      [&name](const auto &source) { return source->name == name; });
+  if (it == frame_sources_.end()) {
+    // Already being removed, e.g. by an earlier reload; whatever was to
+    // follow its removal is replaced, so it isn't added back twice
+    const auto removal = std::find_if(
+        removals_.begin(), removals_.end(),
+        [&name](const auto &removal) { return removal.source->name == name; });
+    if (removal == removals_.end()) {
+      return false;
+    }
+    removal->on_removed = std::move(on_removed);
+    return true;
+  }
+  spdlog::info("Removing source {}", name);
+  auto source = std::move(*it);
+  frame_sources_.erase(it);
+  // The reader's end of stream flows down the branch like a source finishing
+  source->frame_thread->stop();
+  removals_.push_back(Removal{std::move(source),
+                              std::chrono::steady_clock::now() +
+                                  REMOVAL_TIMEOUT,
+                              std::move(on_removed)});
+  return true;
+}
+
+bool Pipeline::has_frame_source(const std::string &name) const {
+  return std::any_of(
+      frame_sources_.begin(), frame_sources_.end(),
+      [&name](const auto &source) { return source->name == name; });
+}
+
+void Pipeline::finish_removals() {
+  const auto now = std::chrono::steady_clock::now();
+  std::vector<std::function<void()>> callbacks;
+  for (auto it = removals_.begin(); it != removals_.end();) {
+    auto &source = *it->source;
+    // A source on standby has no branch to drain
+    const bool drained = source.drained || source.branch.empty();
+    if (!drained && now < it->deadline) {
+      ++it;
+      continue;
+    }
+    if (!drained) {
+      spdlog::warn("Source {} didn't drain in time; its last segment may be "
+                   "incomplete",
+                   source.name);
+    }
+    teardown_branch(source);
+    spdlog::info("Removed source {}", source.name);
+    if (it->on_removed) {
+      callbacks.push_back(std::move(it->on_removed));
+    }
+    it = removals_.erase(it);
+  }
+  // These may add or remove sources themselves
+  for (const auto &callback : callbacks) {
+    callback();
+  }
+}
+
+void Pipeline::check_stalls() {
+  const auto now = steady_now_ns();
+  std::vector<SourceContext *> stalled;
+  for (auto &source : frame_sources_) {
+    const auto health = health_.find(source->name);
+    if (health != health_.end() && health->second.failures > 0 &&
+        std::chrono::steady_clock::now() - health->second.started >
+            HEALTHY_AFTER) {
+      spdlog::info("Source {} has recovered", source->name);
+      health->second.failures = 0;
+      health->second.backoff.reset();
+    }
+
+    const auto stall_timeout =
+        std::chrono::nanoseconds{source->recovery.stall_timeout}.count();
+    if (!playing_ || stall_timeout == 0 || source->drained) {
+      continue;
+    }
+    // Frames wait in appsrc in push mode, and in the reader's queue in pull
+    // mode once need-data stops; an inline source always has frames to read
+    // until it finishes. Otherwise there's nothing to encode, e.g. the
+    // source is quiet, rather than a stall.
+    guint64 queued_bytes = 0;
+    g_object_get(source->appsrc, "current-level-bytes", &queued_bytes,
+                 nullptr);
+    const bool backlog = queued_bytes > 0 ||
+                         source->frame_thread->queued_frames() > 0 ||
+                         source->feed_mode == FeedMode::INLINE;
+    // Frames that are taken but not encoded, e.g. static frames that are
+    // skipped, show the branch is still moving
+    const auto progress_ns =
+        std::max(source->last_output_ns.load(), source->last_taken_ns.load());
+    if (!backlog) {
+      source->backlog_since_ns = 0;
+    } else if (source->backlog_since_ns == 0 ||
+               progress_ns > source->backlog_since_ns) {
+      source->backlog_since_ns = now;
+    } else if (now - source->backlog_since_ns > stall_timeout) {
+      stalled.push_back(source.get());
+    }
+  }
+  for (auto source : stalled) {
+    spdlog::error("Source {} stalled: nothing encoded for {} ms", source->name,
+                  source->recovery.stall_timeout.count());
+    fail_frame_source(*source, true);
+  }
+}
+
+void Pipeline::check_viewers() {
+  for (const auto &name : viewers_.poll()) {
+    const auto source = find_frame_source(name);
+    if (source != nullptr) {
+      wake(*source);
+    }
+  }
+  const auto now = steady_now_ns();
+  for (auto &source : frame_sources_) {
+    const auto idle_timeout =
+        std::chrono::nanoseconds{source->demand.idle_timeout}.count();
+    if (!source->demand.on_demand || source->standby ||
+        now - source->last_viewer_ns < idle_timeout) {
+      continue;
+    }
+    spdlog::info("Source {} has had no viewers for {} ms; stopping its "
+                 "encoder",
+                 source->name, source->demand.idle_timeout.count());
+    source->standby = true;
+    retire_branch(*source);
+  }
+}
+
+void Pipeline::wake(SourceContext &source) {
+  source.last_viewer_ns = steady_now_ns();
+  if (!source.standby) {
+    return;
+  }
+  // A source that has been on standby since it was added still has the
+  // branch it started with
+  if (source.branch.empty() && !resume_branch(source)) {
+    spdlog::error("Failed to rebuild the pipeline for source {}; it stays on "
+                  "standby",
+                  source.name);
+    return;
+  }
+  source.standby = false;
+  source.wakeups++;
+  spdlog::info("Source {} has a viewer; starting its encoder", source.name);
+}
+
+void Pipeline::retire_branch(SourceContext &source) {
+  // appsrc keeps running, so frames are still read for a quick restart;
+  // anything it has queued goes nowhere
+  auto pad = gst_element_get_static_pad(source.appsrc, "src");
+  source.standby_probe = gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER,
+                                           drop_probe, nullptr, nullptr);
+  gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_IDLE, detach_probe, nullptr,
+                    nullptr);
+  gst_object_unref(pad);
+  // Torn down once its sink has finished the last segment
+  source.retired_branch = std::move(source.branch);
+  source.branch.clear();
+  source.retired_drained = false;
+  source.retired_deadline = std::chrono::steady_clock::now() + REMOVAL_TIMEOUT;
+}
+
+bool Pipeline::resume_branch(SourceContext &source) {
+  if (!source.retired_branch.empty()) {
+    if (!source.retired_drained) {
+      spdlog::warn("Source {} woke before its last segment was finished",
+                   source.name);
+    }
+    remove_retired_branch(source);
+  }
+  // A new hlssink starts a new playlist, with new segment names
+  if (!build_branch(source, Glib::wrap(source.appsrc, true))) {
+    return false;
+  }
+  for (auto element = source.branch.rbegin(); element != source.branch.rend();
+       ++element) {
+    (*element)->sync_state_with_parent();
+  }
+  source.first_segment_written = false;
+  source.woke_ns = steady_now_ns();
+  auto pad = gst_element_get_static_pad(source.appsrc, "src");
+  gst_pad_remove_probe(pad, source.standby_probe);
+  gst_object_unref(pad);
+  source.standby_probe = 0;
+  return true;
+}
+
+void Pipeline::remove_retired_branch(SourceContext &source) {
+  for (const auto &element : source.retired_branch) {
+    element->set_state(Gst::State::STATE_NULL);
+  }
+  for (const auto &element : source.retired_branch) {
+    pipeline_->remove(element);
+  }
+  source.retired_branch.clear();
+}
+
+void Pipeline::finish_retired_branches() {
+  const auto now = std::chrono::steady_clock::now();
+  for (auto &source : frame_sources_) {
+    if (source->retired_branch.empty() ||
+        (!source->retired_drained && now < source->retired_deadline)) {
+      continue;
+    }
+    if (!source->retired_drained) {
+      spdlog::warn("Source {} didn't finish its last segment before standby "
+                   "in time",
+                   source->name);
+    }
+    remove_retired_branch(*source);
+    // hlssink ends the playlist at the end of stream, but players that find
+    // it should keep polling it: reading it wakes the source
+    reopen_playlist(source->playlist);
+  }
+}
+
+void Pipeline::fail_frame_source(SourceContext &failed, bool stalled) {
+  const auto it = std::find_if(
+      frame_sources_.begin(), frame_sources_.end(),
+      [&failed](const auto &source) { return source.get() == &failed; });
+  if (it == frame_sources_.end()) {
+    return;
+  }
+  auto source = std::move(*it);
+  frame_sources_.erase(it);
+  auto &health = health_[source->name];
+  if (stalled) {
+    health.stalls++;
+  } else {
+    health.errors++;
+  }
+  health.max_restarts = source->recovery.max_restarts;
+  source->frame_thread->stop();
+  // A failed branch won't drain, so it's torn down at the next check
+  const auto name = source->name;
+  removals_.push_back(Removal{std::move(source),
+                              std::chrono::steady_clock::now(),
+                              [this, name] { schedule_restart(name); }});
+}
+
+void Pipeline::schedule_restart(const std::string &name) {
+  auto &health = health_[name];
+  if (health.failures >= health.max_restarts) {
+    spdlog::error("Source {} failed {} times in a row; giving up on it", name,
+                  health.failures + 1);
+    health.restart_pending = false;
+    return;
+  }
+  health.failures++;
+  const auto delay = health.backoff.next();
+  health.restart_at = std::chrono::steady_clock::now() + delay;
+  health.restart_pending = true;
+  spdlog::warn("Restarting source {} in {} ms (attempt {} of {})", name,
+               delay.count(), health.failures, health.max_restarts);
+}
+
+void Pipeline::check_restarts() {
+  const auto now = std::chrono::steady_clock::now();
+  for (auto &[name, health] : health_) {
+    if (!health.restart_pending || now < health.restart_at) {
+      continue;
+    }
+    health.restart_pending = false;
+    if (has_frame_source(name)) {
+      // Added back some other way, e.g. by a config reload
+      continue;
+    }
+    if (!restart_handler_ || !restart_handler_(name)) {
+      spdlog::info("Source {} is no longer configured; not restarting it",
+                   name);
+      continue;
+    }
+    health.restarts++;
+    health.started = now;
+    spdlog::info("Restarting source {}", name);
+  }
+}
+
+void Pipeline::start_failed(const std::string &name) {
+  const auto it = health_.find(name);
+  if (it != health_.end() && it->second.failures > 0) {
+    spdlog::error("Failed to restart source {}", name);
+    schedule_restart(name);
+  }
+}
+
+Pipeline::SourceContext *
+Pipeline::find_branch_owner(GstObject *element) const {
+  const auto owns = [element](const SourceContext &source) {
+    return element == GST_OBJECT(source.appsrc) ||
+           branch_contains(source.branch, element);
+  };
+  for (const auto &source : frame_sources_) {
+    if (owns(*source)) {
+      return source.get();
+    }
+  }
+  for (const auto &removal : removals_) {
+    if (removal.source->appsrc != nullptr && owns(*removal.source)) {
+      return removal.source.get();
+    }
+  }
+  return nullptr;
+}
+
+Pipeline::SourceContext *
+Pipeline::find_retired_owner(GstObject *element) const {
+  for (const auto &source : frame_sources_) {
+    if (branch_contains(source->retired_branch, element)) {
+      return source.get();
+    }
+  }
+  for (const auto &removal : removals_) {
+    if (branch_contains(removal.source->retired_branch, element)) {
+      return removal.source.get();
+    }
+  }
+  return nullptr;
+}
+
+void Pipeline::teardown_branch(SourceContext &source) {
+  remove_retired_branch(source);
+  // Upstream first, so its streaming thread stops before what it feeds
+  gst_element_set_state(source.appsrc, GST_STATE_NULL);
+  for (const auto &element : source.branch) {
+    element->set_state(Gst::State::STATE_NULL);
+  }
+  // A stopped appsrc no longer blocks pushes, so the reader can finish; it
+  // may still touch appsrc until then
+  source.frame_thread.reset();
+  gst_bin_remove(GST_BIN(pipeline_->gobj()), source.appsrc);
+  source.appsrc = nullptr;
+  for (const auto &element : source.branch) {
+    pipeline_->remove(element);
+  }
+  source.branch.clear();
+  source.encoder.reset();
+  if (!has_frame_source(source.name)) {
+    viewers_.unwatch(source.name);
+  }
+}
+
+GstBusSyncReply Pipeline::bus_sync_handler(GstBus *bus, GstMessage *msg,
+                                           gpointer udata) {
+  // With message-forward, every child's messages come wrapped as well; only
+  // a sink's end of stream is wanted
+  const auto forwarded = forwarded_message(msg);
+  if (forwarded != nullptr) {
+    return GST_MESSAGE_TYPE(forwarded) == GST_MESSAGE_EOS ? GST_BUS_PASS
+                                                          : GST_BUS_DROP;
+  }
+  if (GST_MESSAGE_TYPE(msg) != GST_MESSAGE_STREAM_STATUS) {
+    return GST_BUS_PASS;
+  }
+  GstStreamStatusType type;
+  GstElement *owner = nullptr;
+  gst_message_parse_stream_status(msg, &type, &owner);
+  if (type != GST_STREAM_STATUS_TYPE_ENTER || owner == nullptr) {
+    return GST_BUS_PASS;
+  }
+  // Only appsrcs carry a source; the source outlives its appsrc
+  const auto source = reinterpret_cast<const SourceContext *>(
+      g_object_get_data(G_OBJECT(owner), SOURCE_KEY));
+  if (source != nullptr) {
+    source->threads.apply(source->name,
+                          source->encoding == Encoding::RAW ? "enc" : "mux");
+  }
+  return GST_BUS_PASS;
+}
+
 void Pipeline::appsrc_need_data_callback(GstElement *appsrc, guint length,
                                          gpointer udata) {
-  auto frame_source = reinterpret_cast<FrameThread *>(udata);
-  auto pframe = frame_source->pop_frame();
-
-  auto framebuf = Gst::Buffer::create(pframe->size_bytes());
-  framebuf->fill(0, pframe->raw_data(), pframe->size_bytes());
-  const auto frame_rate = frame_source->frame_rate();
-  framebuf->set_duration(frame_rate.denominator * 1e9 / frame_rate.numerator);
-  const auto timestamp = pframe->timestamp().count();
-  if (timestamp == 0) {
-    framebuf->set_dts(pframe->frame_number() *
-                      (frame_rate.denominator * 1e9 / frame_rate.numerator));
+  auto &source = *reinterpret_cast<SourceContext *>(udata);
+  const bool fill_stale = source.recovery.stale_timeout.count() > 0 &&
+                          source.frame_thread->live();
+
+  // appsrc waits for a buffer after need-data, so keep popping until the pacer
+  // lets one through
+  while (true) {
+    SharedFrame pframe;
+    auto status = FrameThread::PopStatus::FRAME;
+    if (fill_stale) {
+      // Once stale, wake up every slot to keep placeholders flowing
+      auto timeout = source.recovery.stale_timeout;
+      if (source.stale) {
+        timeout = std::chrono::duration_cast<std::chrono::milliseconds>(
+            source.pacer.frame_duration());
+        if (timeout.count() == 0) {
+          timeout = DEFAULT_STALE_FILL_INTERVAL;
+        }
+      }
+      status = source.frame_thread->pop_frame(pframe, timeout);
+    } else {
+      pframe = source.frame_thread->pop_frame();
+      if (pframe == nullptr) {
+        status = FrameThread::PopStatus::FINISHED;
+      }
+    }
+
+    switch (status) {
+    case FrameThread::PopStatus::FINISHED:
+      spdlog::info("Source {} finished", source.name);
+      gst_app_src_end_of_stream(GST_APP_SRC(appsrc));
+      return;
+    case FrameThread::PopStatus::TIMEOUT:
+      set_stale(source, true);
+      if (emit_placeholder(source)) {
+        return;
+      }
+      break;
+    case FrameThread::PopStatus::FRAME:
+      source.last_taken_ns = steady_now_ns();
+      set_stale(source, false);
+      if (emit_frame(source, std::move(pframe))) {
+        return;
+      }
+      break;
+    }
+  }
+}
+
+void Pipeline::appsrc_push_need_data_callback(GstElement *appsrc,
+                                              guint length, gpointer udata) {
+  reinterpret_cast<SourceContext *>(udata)->full = false;
+}
+
+void Pipeline::appsrc_enough_data_callback(GstElement *appsrc,
+                                           gpointer udata) {
+  reinterpret_cast<SourceContext *>(udata)->full = true;
+}
+
+void Pipeline::post(std::function<void()> task) {
+  std::lock_guard<std::mutex> lock{posted_mutex_};
+  posted_.push_back(std::move(task));
+}
+
+void Pipeline::run_posted() {
+  std::vector<std::function<void()>> tasks;
+  {
+    std::lock_guard<std::mutex> lock{posted_mutex_};
+    tasks.swap(posted_);
+  }
+  for (auto &task : tasks) {
+    task();
+  }
+}
+
+std::string Pipeline::control(const json::Object &command) {
+  if (command_string(command, "command") == "snapshot") {
+    return snapshot(command);
+  }
+  auto response = std::make_shared<std::promise<std::string>>();
+  auto result = response->get_future();
+  post([this, command, response]() {
+    response->set_value(handle_control(command));
+  });
+  if (result.wait_for(CONTROL_TIMEOUT) != std::future_status::ready) {
+    // The task still runs later; its response is just dropped
+    return control_error("timed out waiting for the pipeline");
+  }
+  return result.get();
+}
+
+std::string Pipeline::snapshot(const json::Object &command) {
+  const auto source_name = command_string(command, "source");
+  if (source_name.empty()) {
+    return control_error("missing source");
+  }
+  size_t width = 0;
+  const auto width_it = command.find("width");
+  if (width_it != command.end()) {
+    if (width_it->second.type != json::Value::Type::NUMBER ||
+        width_it->second.number < 0) {
+      return control_error("invalid width");
+    }
+    width = static_cast<size_t>(width_it->second.number);
+  }
+
+  // Empty if there's no such source; null if it's encoded
+  using Lookup = std::optional<std::shared_ptr<Snapshot>>;
+  auto lookup = std::make_shared<std::promise<Lookup>>();
+  auto result = lookup->get_future();
+  post([this, source_name, lookup]() {
+    const auto source = find_frame_source(source_name);
+    lookup->set_value(source == nullptr ? Lookup{} : Lookup{source->snapshot});
+  });
+  if (result.wait_for(CONTROL_TIMEOUT) != std::future_status::ready) {
+    return control_error("timed out waiting for the pipeline");
+  }
+  const auto snapshot = result.get();
+  if (!snapshot) {
+    return control_error("no such source");
+  } else if (*snapshot == nullptr) {
+    return control_error("source is encoded upstream");
+  }
+
+  const auto image = (*snapshot)->get(width);
+  if (image.jpeg == nullptr) {
+    return control_error("no frame yet");
+  }
+  const auto age = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - image.captured);
+  return fmt::format(
+      R"({{"ok":true,"path":{},"width":{},"height":{},"bytes":{},)"
+      R"("age_ms":{}}})",
+      json::quote(image.path), image.width, image.height, image.jpeg->size(),
+      age.count());
+}
+
+Pipeline::SourceContext *
+Pipeline::find_frame_source(const std::string &name) const {
+  const auto it = std::find_if(
+      frame_sources_.begin(), frame_sources_.end(),
+      [&name](const auto &source) { return source->name == name; });
+  return it == frame_sources_.end() ? nullptr : it->get();
+}
+
+std::string Pipeline::source_stats(SourceContext &source) const {
+  std::string out = fmt::format(
+      R"({{"encoding":"{}","feed":"{}","overflow":"{}","paused":{},)"
+      R"("stale":{},"queued":{},"dropped":{},"duplicated":{})",
+      encoding_name(source.encoding), feed_mode_name(source.feed_mode),
+      overflow_policy_name(source.feed_mode == FeedMode::PUSH
+                               ? source.overflow
+                               : source.frame_thread->overflow_policy()),
+      source.paused.load(), source.stale.load(),
+      source.frame_thread->queued_frames(),
+      source.pacer.dropped() + source.dropped_frames +
+          source.frame_thread->dropped_frames(),
+      source.pacer.duplicated());
+  if (source.active_bitrate > 0) {
+    out += fmt::format(R"(,"bitrate":{})", source.idle
+                                              ? source.idle_bitrate
+                                              : source.active_bitrate.load());
+  }
+  if (source.demand.on_demand) {
+    out += fmt::format(R"(,"standby":{},"wakeups":{})", source.standby.load(),
+                       source.wakeups.load());
+  }
+  if (source.motion != nullptr) {
+    out += fmt::format(
+        R"(,"static_frames":{},"scene_changes":{},"activity":{:.3f})",
+        source.motion->skipped(), source.motion->scene_changes(),
+        source.motion->activity());
+  }
+  const auto health = health_.find(source.name);
+  if (health != health_.end()) {
+    out += fmt::format(R"(,"errors":{},"stalls":{},"restarts":{})",
+                       health->second.errors, health->second.stalls,
+                       health->second.restarts);
+  }
+  if (source.snapshot != nullptr) {
+    out += fmt::format(R"(,"snapshot_requests":{},"snapshot_encodes":{})",
+                       source.snapshot->requests(),
+                       source.snapshot->encodes());
+  }
+  if (source.clips != nullptr) {
+    out += fmt::format(
+        R"(,"clip_buffered_ms":{},"clip_buffered_bytes":{},)"
+        R"("clips_written":{},"clips_failed":{})",
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+            source.clips->buffered_duration())
+            .count(),
+        source.clips->buffered_bytes(), source.clips->clips_written(),
+        source.clips->clips_failed());
+  }
+  if (source.archiver != nullptr) {
+    out += fmt::format(
+        R"(,"archive_bytes":{},"archive_segments":{},)"
+        R"("archive_dropped":{},"archive_deleted":{})",
+        source.archiver->bytes_written(), source.archiver->segments_written(),
+        source.archiver->dropped(), source.archiver->segments_deleted());
+  }
+  for (const auto &[stat, value] : source.frame_thread->stats()) {
+    out += fmt::format(",{}:{}", json::quote(stat), value);
+  }
+  out.push_back('}');
+  return out;
+}
+
+std::string Pipeline::handle_control(const json::Object &command) {
+  const auto name = command_string(command, "command");
+  if (name == "sources") {
+    std::string out{R"({"ok":true,"sources":[)"};
+    for (const auto &source : frame_sources_) {
+      if (&source != &frame_sources_.front()) {
+        out.push_back(',');
+      }
+      out += json::quote(source->name);
+    }
+    return out + "]}";
+  }
+
+  const auto source_name = command_string(command, "source");
+  if (name == "stats") {
+    std::string out{R"({"ok":true,"sources":{)"};
+    bool first = true;
+    for (const auto &source : frame_sources_) {
+      if (!source_name.empty() && source->name != source_name) {
+        continue;
+      }
+      if (!first) {
+        out.push_back(',');
+      }
+      first = false;
+      out += json::quote(source->name) + ":" + source_stats(*source);
+    }
+    if (first && !source_name.empty()) {
+      return control_error("no such source");
+    }
+    return out + "}}";
+  }
+
+  if (source_name.empty()) {
+    return control_error(name.empty() ? "missing command" : "missing source");
+  }
+  auto source = find_frame_source(source_name);
+  if (source == nullptr) {
+    return control_error("no such source");
+  }
+
+  if (name == "keyframe") {
+    if (!source->encoder) {
+      return control_error("source is encoded upstream");
+    }
+    spdlog::info("Forcing a keyframe in {}", source->name);
+    force_keyframe(source->encoder->gobj());
+    return CONTROL_OK;
+  } else if (name == "pause" || name == "resume") {
+    const bool pause = name == "pause";
+    if (source->paused.exchange(pause) != pause) {
+      spdlog::info("{} source {}", pause ? "Pausing" : "Resuming",
+                   source->name);
+    }
+    return CONTROL_OK;
+  } else if (name == "watch") {
+    const bool started = source->standby;
+    wake(*source);
+    return fmt::format(R"({{"ok":true,"started":{}}})", started);
+  } else if (name == "overflow") {
+    OverflowPolicy policy;
+    if (!parse_overflow_policy(command_string(command, "policy"), policy)) {
+      return control_error("invalid policy");
+    }
+    // In push mode the policy is built into appsrc's settings, and inline
+    // sources have no queue
+    if (source->feed_mode != FeedMode::PULL) {
+      return control_error(fmt::format("can't change the overflow policy of "
+                                       "a source fed in {} mode",
+                                       feed_mode_name(source->feed_mode)));
+    }
+    spdlog::info("Source {} now uses overflow policy {}", source->name,
+                 overflow_policy_name(policy));
+    source->frame_thread->set_overflow_policy(policy);
+    return CONTROL_OK;
+  } else if (name == "clip") {
+    if (source->clips == nullptr) {
+      return control_error("clips aren't enabled for this source");
+    }
+    // Seconds before and after now; default to the configured pre- and
+    // post-roll, which also limit them, since the buffer can't reach back
+    // further and holds on to everything until a clip is finished
+    const auto &params = source->clip_params;
+    auto pre = params.pre_roll;
+    auto post = params.post_roll;
+    for (auto [key, length, limit] :
+         {std::tuple{"pre", &pre, params.pre_roll},
+          {"post", &post, params.max_post_roll}}) {
+      const auto it = command.find(key);
+      if (it == command.end()) {
+        continue;
+      }
+      // Also rejects NaN, and anything too big to convert
+      if (it->second.type != json::Value::Type::NUMBER ||
+          !(it->second.number >= 0 &&
+            it->second.number * 1000 <= limit.count())) {
+        return control_error(fmt::format("{} must be from 0 to {} s", key,
+                                         limit.count() / 1000.0));
+      }
+      *length = std::chrono::milliseconds{
+          static_cast<std::int64_t>(it->second.number * 1000)};
+    }
+    std::string error;
+    const auto path = source->clips->request(
+        pre, post, command_string(command, "file"), error);
+    if (path.empty()) {
+      return control_error(error);
+    }
+    return fmt::format(R"({{"ok":true,"path":{}}})", json::quote(path));
+  } else if (name != "set" && name != "get") {
+    return control_error("unknown command");
+  }
+
+  // Properties are addressed by the element's factory name, or "encoder"
+  auto element_name = command_string(command, "element");
+  if (element_name.empty()) {
+    element_name = "encoder";
+  }
+  GstElement *element = nullptr;
+  if (element_name == "encoder") {
+    element = source->encoder ? source->encoder->gobj() : nullptr;
+  } else if (element_name == "appsrc") {
+    element = source->appsrc;
   } else {
-    framebuf->set_dts(timestamp);
+    for (const auto &branch_element : source->branch) {
+      auto factory = gst_element_get_factory(branch_element->gobj());
+      if (factory != nullptr &&
+          element_name ==
+              gst_plugin_feature_get_name(GST_PLUGIN_FEATURE(factory))) {
+        element = branch_element->gobj();
+        break;
+      }
+    }
+  }
+  if (element == nullptr) {
+    return control_error("no such element");
   }
 
-  // TODO: figure out glibmm SignalProxy
-  // See gstreamermm/examples/media_player_getkmm/player_window.cc
-  // for SignalProxy example
-  GstFlowReturn ret = GST_FLOW_ERROR;
-  g_signal_emit_by_name(appsrc, "push-buffer", framebuf->gobj(), &ret);
-  if (ret < 0) {
-    spdlog::error(gst_flow_get_name(ret));
+  const auto property = command_string(command, "property");
+  auto pspec = g_object_class_find_property(G_OBJECT_GET_CLASS(element),
+                                            property.c_str());
+  if (pspec == nullptr) {
+    return control_error("no such property");
+  }
+
+  if (name == "get") {
+    if ((pspec->flags & G_PARAM_READABLE) == 0) {
+      return control_error("property isn't readable");
+    }
+    GValue value = G_VALUE_INIT;
+    g_value_init(&value, pspec->value_type);
+    g_object_get_property(G_OBJECT(element), property.c_str(), &value);
+    auto text = gst_value_serialize(&value);
+    g_value_unset(&value);
+    if (text == nullptr) {
+      return control_error("property can't be represented as text");
+    }
+    auto out = fmt::format(R"({{"ok":true,"value":{}}})", json::quote(text));
+    g_free(text);
+    return out;
+  }
+
+  if ((pspec->flags & G_PARAM_WRITABLE) == 0) {
+    return control_error("property isn't writable");
+  }
+  // Most properties are only read when the element starts
+  if (started_ && (pspec->flags & GST_PARAM_MUTABLE_PLAYING) == 0) {
+    return control_error("property can't be changed while playing");
+  }
+  const auto text = command_string(command, "value");
+  GValue value = G_VALUE_INIT;
+  g_value_init(&value, pspec->value_type);
+  if (!gst_value_deserialize(&value, text.c_str())) {
+    g_value_unset(&value);
+    return control_error("invalid value");
+  }
+  spdlog::info("Setting {} {} of {} to {}", element_name, property,
+               source->name, text);
+  if (source->encoder && element == source->encoder->gobj() &&
+      property == "bitrate" && source->active_bitrate > 0 &&
+      G_VALUE_HOLDS_UINT(&value)) {
+    // Motion adaptation switches back to this once the source is active
+    source->active_bitrate = g_value_get_uint(&value);
+    if (source->idle) {
+      g_value_unset(&value);
+      return CONTROL_OK;
+    }
   }
+  g_object_set_property(G_OBJECT(element), property.c_str(), &value);
+  g_value_unset(&value);
+  return CONTROL_OK;
 }
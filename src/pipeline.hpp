@@ -1,27 +1,103 @@
 #pragma once
 
 #include <gstreamermm.h>
+#include <atomic>
 #include <chrono>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <vector>
 
+#include "archiver.hpp"
+#include "backoff.hpp"
+#include "clip_buffer.hpp"
 #include "frame_parameters.hpp"
 #include "frame.hpp"
 #include "config.hpp"
 #include "frame_source.hpp"
+#include "frame_pacer.hpp"
+#include "json.hpp"
+#include "motion_detector.hpp"
+#include "snapshot.hpp"
+#include "startup_timer.hpp"
+#include "viewer_monitor.hpp"
 
 namespace camcoder {
 
 class Pipeline {
 public:
   /**
-   * Construct and set up the pipeline.
+   * Construct and set up the pipeline. Startup phases are marked on startup,
+   * which must outlive the pipeline.
    */
-  Pipeline(const Config &config);
+  Pipeline(const Config &config, StartupTimer &startup);
+
+  /**
+   * Load the plugins for every element the configured sources will need, so
+   * creating them later doesn't wait on the registry. Safe to run on another
+   * thread while sources are constructed.
+   */
+  static void prewarm(const Config &config);
 
   void stop() { terminate_ = true; }
 
   bool playing() const { return playing_; }
 
-  void add_frame_source(std::unique_ptr<FrameThread> frame_source);
+  /**
+   * Build a branch for the source and start reading from it. Works while
+   * the pipeline is playing, too; the new branch joins it in the same state.
+   */
+  void add_frame_source(std::unique_ptr<FrameThread> frame_source,
+                        const FrameSourceConfig &config);
+
+  /**
+   * Stop reading from a source and remove its branch once the end of stream
+   * has reached its sink, so its last segment and playlist are complete.
+   * The branch is torn down from operator()'s loop, which then calls
+   * on_removed. If the source is already being removed, on_removed replaces
+   * what was to be called. Returns false if there's no such source.
+   */
+  bool remove_frame_source(const std::string &name,
+                           std::function<void()> on_removed = {});
+
+  bool has_frame_source(const std::string &name) const;
+
+  /**
+   * Called from operator()'s loop about every 100 ms, on the same thread,
+   * e.g. to add and remove sources after a config reload.
+   */
+  void set_tick(std::function<void()> tick) { tick_ = std::move(tick); }
+
+  /**
+   * Called from operator()'s loop to add a failed source again after its
+   * branch was torn down. It mustn't block: it should construct the source
+   * elsewhere and add it later, or call start_failed if that fails. Returns
+   * false if the source is no longer configured.
+   */
+  using RestartHandler = std::function<bool(const std::string &name)>;
+
+  void set_restart_handler(RestartHandler handler) {
+    restart_handler_ = std::move(handler);
+  }
+
+  /**
+   * A source being restarted couldn't be constructed; schedule another
+   * attempt. Does nothing for a source that isn't being restarted.
+   */
+  void start_failed(const std::string &name);
+
+  /**
+   * Run task on operator()'s thread at its next iteration. Thread-safe.
+   */
+  void post(std::function<void()> task);
+
+  /**
+   * Carry out a control command on operator()'s thread and return the
+   * response as a JSON object. Thread-safe; waits for the pipeline thread,
+   * up to CONTROL_TIMEOUT.
+   */
+  std::string control(const json::Object &command);
 
   /**
    * Run the pipeline.
@@ -29,23 +105,386 @@ public:
   void operator()();
 
 private:
+  /**
+   * State for feeding one frame source into its appsrc.
+   */
+  struct SourceContext {
+    SourceContext(std::unique_ptr<FrameThread> frame_thread,
+                  const FrameSourceConfig &config);
+
+    // Stops the reader before the state it feeds goes away
+    ~SourceContext() { frame_thread.reset(); }
+
+    std::string name;
+    Encoding encoding;
+    RecoveryParameters recovery;
+    // Applied to appsrc's streaming thread, which runs the whole branch
+    ThreadOptions threads;
+    FeedMode feed_mode;
+    std::unique_ptr<FrameThread> frame_thread;
+    FramePacer pacer;
+    // Kept so the pacer can repeat it to fill gaps
+    Glib::RefPtr<Gst::Buffer> last_buffer;
+    GstElement *appsrc;
+    // Policy appsrc applies when full in push mode
+    OverflowPolicy overflow;
+    // Set between appsrc's enough-data and need-data signals in push mode
+    std::atomic<bool> full;
+    // Frames dropped because appsrc was full in push mode
+    std::atomic<std::uint64_t> dropped_frames;
+    // Serializes pushes from the reader thread and the stale check in push
+    // mode
+    std::mutex push_mutex;
+    // Black frame for the placeholder, or before any frame has arrived
+    Glib::RefPtr<Gst::Buffer> black_buffer;
+    std::atomic<bool> stale;
+    // Steady-clock time the last real frame was pushed
+    std::atomic<std::int64_t> last_frame_ns;
+    // Elements between appsrc and the sink, in order
+    std::vector<Glib::RefPtr<Gst::Element>> branch;
+    // Null for encoded sources, which aren't re-encoded
+    Glib::RefPtr<Gst::Element> encoder;
+    // Null unless motion detection is enabled
+    std::unique_ptr<MotionDetector> motion;
+    // The newest frame, for snapshots; null for encoded sources
+    std::shared_ptr<Snapshot> snapshot;
+    ClipParameters clip_params;
+    // Null unless clips are enabled; fed from the encoder (or parser) output
+    std::unique_ptr<ClipBuffer> clips;
+    ArchiveParameters archive_params;
+    // Null unless archiving is enabled; fed from the muxer's output
+    std::unique_ptr<Archiver> archiver;
+    // Encoder bitrates in kbit/s; zero if they aren't switched. The active
+    // bitrate can be changed by a control command.
+    std::atomic<unsigned int> active_bitrate;
+    unsigned int idle_bitrate;
+    std::atomic<bool> idle;
+    // Frames are dropped while paused by a control command
+    std::atomic<bool> paused;
+    // Encoded sources resume at a keyframe, since their decoder has lost its
+    // references
+    bool await_keyframe;
+    DemandParameters demand;
+    SegmentParameters segments;
+    // Set while an on-demand source has no viewers; frames are held back
+    // from the encoder
+    std::atomic<bool> standby;
+    // Whether the thread emitting frames has seen standby yet, so it can
+    // restart the encoder when standby ends
+    bool standing_by;
+    // For encoded sources, the frames since the last keyframe, held while
+    // standing by so a restart can begin at once with that keyframe
+    std::vector<SharedFrame> held_frames;
+    // Steady-clock time a viewer was last seen
+    std::atomic<std::int64_t> last_viewer_ns;
+    // Times standby ended
+    std::atomic<std::uint64_t> wakeups;
+    // Drops appsrc's buffers while on standby without a branch
+    gulong standby_probe;
+    // The branch taken off appsrc for standby, while it finishes its last
+    // segment
+    std::vector<Glib::RefPtr<Gst::Element>> retired_branch;
+    bool retired_drained;
+    std::chrono::steady_clock::time_point retired_deadline;
+    // Steady-clock time the branch was rebuilt after standby; zero if it
+    // hasn't been
+    std::int64_t woke_ns;
+    // For logging time to the first frame and the first segment
+    const StartupTimer *startup;
+    bool first_frame_pushed;
+    std::string playlist;
+    // Start of this branch's segment file names, which differs from any
+    // earlier branch of the same source
+    std::string segment_prefix;
+    // The playlist's modification time before we started, in case it's left
+    // over from a previous run
+    std::filesystem::file_time_type old_playlist_time;
+    bool first_segment_written;
+    // Set once the sink reports it has finished at the end of stream
+    bool drained;
+    // Steady-clock time the encoder (or parser) last put out a buffer
+    std::atomic<std::int64_t> last_output_ns;
+    // Steady-clock time need-data last took a frame, in pull and inline mode
+    std::atomic<std::int64_t> last_taken_ns;
+    // Steady-clock time frames were first seen waiting with none taken or
+    // put out since; zero if they weren't
+    std::int64_t backlog_since_ns;
+  };
+
+  /**
+   * Failures and restarts of a source's branch. Kept by name, since a
+   * restart replaces the SourceContext.
+   */
+  struct BranchHealth {
+    Backoff backoff{RESTART_MIN, RESTART_MAX};
+    // Failures since the branch last ran for HEALTHY_AFTER
+    unsigned int failures = 0;
+    unsigned int max_restarts = 0;
+    std::uint64_t errors = 0;
+    std::uint64_t stalls = 0;
+    std::uint64_t restarts = 0;
+    std::chrono::steady_clock::time_point started{};
+    std::chrono::steady_clock::time_point restart_at{};
+    bool restart_pending = false;
+  };
+
+  /**
+   * A source being removed, waiting for its branch to drain.
+   */
+  struct Removal {
+    std::unique_ptr<SourceContext> source;
+    std::chrono::steady_clock::time_point deadline;
+    std::function<void()> on_removed;
+  };
+
+  /**
+   * How long a removed source's branch gets to drain before it's torn down
+   * anyway.
+   */
+  static constexpr std::chrono::seconds REMOVAL_TIMEOUT{5};
+
+  /**
+   * How long control() waits for the pipeline thread to carry out a command.
+   */
+  static constexpr std::chrono::seconds CONTROL_TIMEOUT{5};
+
+  /**
+   * Bounds for the backoff between restarts of a failed branch.
+   */
+  static constexpr std::chrono::milliseconds RESTART_MIN{1000};
+  static constexpr std::chrono::milliseconds RESTART_MAX{30000};
+
+  /**
+   * A restarted branch that runs this long without failing has recovered;
+   * its failure count and backoff start over.
+   */
+  static constexpr std::chrono::seconds HEALTHY_AFTER{60};
+
+  /**
+   * Interval between placeholder frames while a source is stale.
+   */
+  static constexpr std::chrono::milliseconds DEFAULT_STALE_FILL_INTERVAL{100};
+
+  /**
+   * Most frames held from an encoded source while it stands by. A longer
+   * GOP is dropped, and the restart waits for the next keyframe instead.
+   */
+  static constexpr size_t MAX_HELD_FRAMES = 300;
+
+  /**
+   * Pace the frame and push it (and any duplicates the pacer asks for) into
+   * the source's appsrc. Returns false if the pacer dropped it.
+   */
+  static bool emit_frame(SourceContext &source, SharedFrame pframe);
+
+  /**
+   * Consumer for push mode; runs on the source's reader thread.
+   */
+  static void push_frame(SourceContext &source, SharedFrame pframe);
+
+  /**
+   * Push a placeholder frame in the next slot (plus any the pacer says were
+   * missed). Returns false if the pacer had no slot for it yet.
+   */
+  static bool emit_placeholder(SourceContext &source);
+
+  static void set_stale(SourceContext &source, bool stale);
+
+  /**
+   * Keep what a standing-by source needs for a fast restart: for encoded
+   * sources, the frames since the last keyframe; for raw ones, only the
+   * newest frame, as the snapshot.
+   */
+  static void hold_frame(SourceContext &source, SharedFrame pframe);
+
+  /**
+   * Restart the encoder when standby ends, before pframe is emitted: raw
+   * sources get a keyframe forced (a rebuilt branch's encoder starts with
+   * one anyway), and encoded ones replay their held frames. Returns false
+   * if pframe can't follow, because an encoded source has to wait for a
+   * keyframe.
+   */
+  static bool resume_from_standby(SourceContext &source,
+                                  const SharedFrame &pframe);
+
+  /**
+   * Note a viewer of an on-demand source, taking it out of standby.
+   */
+  void wake(SourceContext &source);
+
+  /**
+   * Take an on-demand source's branch off its appsrc as it goes on standby,
+   * ending its stream so the last segment is finished rather than left open.
+   */
+  void retire_branch(SourceContext &source);
+
+  /**
+   * Build a new branch for a source coming off standby, with a new playlist
+   * and segments. Returns false if it can't be built.
+   */
+  bool resume_branch(SourceContext &source);
+
+  /**
+   * Stop a retired branch and take it out of the pipeline.
+   */
+  void remove_retired_branch(SourceContext &source);
+
+  /**
+   * Tear down retired branches that have finished (or timed out).
+   */
+  void finish_retired_branches();
+
+  /**
+   * Force a keyframe on a scene change, and switch the encoder's bitrate
+   * when the source goes idle or becomes active again.
+   */
+  static void adapt_encoder(SourceContext &source,
+                            const MotionDetector::Result &motion);
+
+  /**
+   * Feed placeholders to push-mode sources that have gone quiet. Pull-mode
+   * sources do this from their need-data callback.
+   */
+  void check_stale_sources();
+
+  /**
+   * Log when each source's playlist first appears, i.e. its first segment
+   * is complete.
+   */
+  void check_first_segments();
+
+  /**
+   * Delete segments left by earlier branches of the source, or by an earlier
+   * run, once its new playlist no longer lists them.
+   */
+  void remove_old_segments(const SourceContext &source);
+
+  /**
+   * Fail sources whose branches have stalled, and forget the failures of
+   * those that have run long enough since restarting.
+   */
+  void check_stalls();
+
+  /**
+   * Wake on-demand sources whose files were read, and put those without a
+   * viewer for idle_timeout in standby.
+   */
+  void check_viewers();
+
+  /**
+   * Tear down a source whose branch stalled or reported an error, keeping
+   * the rest of the pipeline running, and schedule its restart.
+   */
+  void fail_frame_source(SourceContext &source, bool stalled);
+
+  /**
+   * Restart a failed source after a backoff, unless it has failed
+   * max_restarts times in a row.
+   */
+  void schedule_restart(const std::string &name);
+
+  /**
+   * Add back failed sources whose backoff has passed.
+   */
+  void check_restarts();
+
+  /**
+   * The source whose branch contains the element, or null. Also finds
+   * sources that are being removed.
+   */
+  SourceContext *find_branch_owner(GstObject *element) const;
+
+  /**
+   * The source whose retired branch contains the element, or null.
+   */
+  SourceContext *find_retired_owner(GstObject *element) const;
+
+  /**
+   * Tear down the branches of removed sources that have drained (or timed
+   * out), and call their on_removed callbacks.
+   */
+  void finish_removals();
+
+  /**
+   * Stop the source's appsrc and branch and take them out of the pipeline.
+   */
+  void teardown_branch(SourceContext &source);
+
+  /**
+   * Elements from appsrc (exclusive) to the sink for a source's encoding.
+   */
+  static std::vector<std::string> branch_factories(Encoding encoding);
+
+  /**
+   * Create the source's branch (encoding or parsing, muxing, and an HLS sink
+   * writing to its own directory), add it to the pipeline and link appsrc to
+   * it. Returns false if an element couldn't be created.
+   */
+  bool build_branch(SourceContext &source,
+                    const Glib::RefPtr<Gst::Element> &appsrc);
+
   void handle_message(Glib::RefPtr<Gst::Message> msg);
 
+  /**
+   * Run the tasks posted since the last iteration.
+   */
+  void run_posted();
+
+  /**
+   * The snapshot command. Only the source is looked up on the pipeline
+   * thread; the JPEG is encoded on the caller's.
+   */
+  std::string snapshot(const json::Object &command);
+
+  /**
+   * control() on the pipeline thread.
+   */
+  std::string handle_control(const json::Object &command);
+
+  /**
+   * Per-source counters as a JSON object.
+   */
+  std::string source_stats(SourceContext &source) const;
+
+  /**
+   * Null if there's no such source.
+   */
+  SourceContext *find_frame_source(const std::string &name) const;
+
+  /**
+   * Name and pin each source's streaming thread as it starts, on that
+   * thread. The encoder's own threads inherit its CPUs.
+   */
+  static GstBusSyncReply bus_sync_handler(GstBus *bus, GstMessage *msg,
+                                          gpointer udata);
+
   static void appsrc_need_data_callback(GstElement *appsrc, guint length,
                                         gpointer udata);
+  static void appsrc_push_need_data_callback(GstElement *appsrc, guint length,
+                                             gpointer udata);
+  static void appsrc_enough_data_callback(GstElement *appsrc, gpointer udata);
 
-  // Convert format into something the encoder can use
-  Glib::RefPtr<Gst::Element> convert_;
-  // We'll use H264 for now
-  Glib::RefPtr<Gst::Element> encoder_;
-  Glib::RefPtr<Gst::Element> tsmux_;
-  // We'll use HLS
-  Glib::RefPtr<Gst::Element> hls_sink_;
+  // Each source's playlist and segments go in a subdirectory named after it
+  std::string output_directory_;
+  StartupTimer &startup_;
   Glib::RefPtr<Gst::Pipeline> pipeline_;
 
+  std::function<void()> tick_;
+
+  RestartHandler restart_handler_;
+  std::map<std::string, BranchHealth> health_;
+  // Branches built so far for each source, to name their segments apart
+  std::map<std::string, unsigned int> branch_generations_;
+
+  std::mutex posted_mutex_;
+  std::vector<std::function<void()>> posted_;
+
+  bool started_;   /// True once operator() has started the pipeline
   bool terminate_; /// True when the pipeline should be stopped
   bool playing_;   /// True if the pipeline is in the playing state
   bool ready_;
-  std::vector<std::unique_ptr<FrameThread>> frame_sources_;
+  std::vector<std::unique_ptr<SourceContext>> frame_sources_;
+  std::vector<Removal> removals_;
+  ViewerMonitor viewers_;
 };
 } // namespace camcoder
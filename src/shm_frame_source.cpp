@@ -0,0 +1,187 @@
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+
+#include "shm_frame_source.hpp"
+
+using namespace camcoder;
+
+static std::uint64_t load_acquire(const std::uint64_t *p) {
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+ShmFrameSource::ShmFrameSource(const std::string &path,
+                               const FrameParameters &frame_params,
+                               const FrameRate &frame_rate)
+    : FrameSource{frame_params, frame_rate}, path_{path},
+      poll_interval_{DEFAULT_POLL_INTERVAL}, header_{nullptr},
+      mapping_size_{0}, next_seq_{0}, skipped_frames_{0}, invalid_frames_{0},
+      capture_time_ns_{0}, interrupted_{false} {}
+
+ShmFrameSource::~ShmFrameSource() { unmap(); }
+
+std::unique_ptr<ShmFrameSource>
+ShmFrameSource::from_config(const FrameSourceConfig &config) {
+  const auto path_it = config.options.find("path");
+  if (path_it == config.options.end()) {
+    spdlog::error("Option path is required for source {}", config.name);
+    return nullptr;
+  }
+
+  auto frame_source = std::make_unique<ShmFrameSource>(
+      path_it->second.as_string(), config.frame_params, config.frame_rate);
+
+  const auto poll_it = config.options.find("poll_interval_us");
+  if (poll_it != config.options.end()) {
+    const auto poll_us = poll_it->second.as_integer();
+    if (poll_us <= 0) {
+      spdlog::error("Invalid poll_interval_us {} for source {}", poll_us,
+                    config.name);
+      return nullptr;
+    }
+    frame_source->set_poll_interval(std::chrono::microseconds{poll_us});
+  }
+
+  spdlog::info("Creating ShmFrameSource<path={}>", frame_source->path());
+
+  return frame_source;
+}
+
+void ShmFrameSource::set_poll_interval(
+    std::chrono::microseconds poll_interval) {
+  poll_interval_ = poll_interval;
+}
+
+bool ShmFrameSource::connect_() {
+  unmap();
+
+  const int fd = shm_open(path_.c_str(), O_RDONLY, 0);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat st {};
+  if (fstat(fd, &st) < 0 ||
+      static_cast<size_t>(st.st_size) < sizeof(shm_ring_header)) {
+    // The producer may not have sized it yet
+    close(fd);
+    return false;
+  }
+
+  void *mapping =
+      mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    spdlog::error("Failed to map {}: {}", path_, std::strerror(errno));
+    return false;
+  }
+  auto header = reinterpret_cast<shm_ring_header *>(mapping);
+
+  const auto magic = __atomic_load_n(&header->magic, __ATOMIC_ACQUIRE);
+  const char *problem = nullptr;
+  if (magic == 0) {
+    // The producer hasn't initialized it yet
+    munmap(mapping, st.st_size);
+    return false;
+  } else if (magic != SHM_RING_MAGIC) {
+    problem = "bad magic";
+  } else if (header->version != SHM_RING_VERSION) {
+    problem = "unsupported version";
+  } else if (header->slot_count < 2) {
+    problem = "fewer than 2 slots";
+  } else if (shm_ring_size(header->slot_count, header->slot_size) >
+             static_cast<std::uint64_t>(st.st_size)) {
+    problem = "truncated";
+  } else if (header->slot_size < frame_size_bytes()) {
+    problem = "slots smaller than a frame";
+  }
+  if (problem != nullptr) {
+    spdlog::error("Shared memory ring {} is invalid: {}", path_, problem);
+    munmap(mapping, st.st_size);
+    return false;
+  }
+
+  header_ = header;
+  mapping_size_ = st.st_size;
+  // Start from the newest complete frame
+  const auto write_seq = load_acquire(&header_->write_seq);
+  next_seq_ = write_seq > 0 ? write_seq - 1 : 0;
+  spdlog::info("Mapped {} ({} slots of {} bytes)", path_, header_->slot_count,
+               header_->slot_size);
+  return true;
+}
+
+size_t ShmFrameSource::read(char *buf, size_t n) {
+  if (header_ == nullptr || n > header_->slot_size) {
+    return 0;
+  }
+
+  const auto slot_count = header_->slot_count;
+  auto idle_since = std::chrono::steady_clock::now();
+  while (true) {
+    const auto write_seq = load_acquire(&header_->write_seq);
+    if (write_seq <= next_seq_) {
+      if (interrupted_) {
+        return 0;
+      }
+      if (std::chrono::steady_clock::now() - idle_since > IDLE_TIMEOUT) {
+        spdlog::warn("No frames in {}; remapping", path_);
+        unmap();
+        return 0;
+      }
+      std::this_thread::sleep_for(poll_interval_);
+      continue;
+    }
+
+    if (write_seq - next_seq_ >= slot_count) {
+      // Lapped; skip to the newest frame
+      skipped_frames_ += write_seq - 1 - next_seq_;
+      next_seq_ = write_seq - 1;
+    }
+
+    const auto i = static_cast<std::uint32_t>(next_seq_ % slot_count);
+    const auto expected = 2 * next_seq_ + 2;
+    auto slot = shm_ring_slot(header_, i);
+    if (load_acquire(&slot->seq) != expected) {
+      // Overwritten since write_seq was read
+      skipped_frames_++;
+      next_seq_++;
+      continue;
+    }
+    const auto size = slot->size;
+    const auto timestamp_ns = slot->timestamp_ns;
+    if (size == n) {
+      std::memcpy(buf, shm_ring_data(header_, i), n);
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    const auto seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+    next_seq_++;
+    if (seq != expected) {
+      // Torn read
+      skipped_frames_++;
+      continue;
+    }
+    if (size != n) {
+      if (invalid_frames_++ == 0) {
+        spdlog::warn("Frame in {} is {} bytes rather than {}; skipping it",
+                     path_, size, n);
+      }
+      continue;
+    }
+    capture_time_ns_ = timestamp_ns;
+    return n;
+  }
+}
+
+void ShmFrameSource::unmap() {
+  if (header_ != nullptr) {
+    munmap(header_, mapping_size_);
+    header_ = nullptr;
+    mapping_size_ = 0;
+  }
+}
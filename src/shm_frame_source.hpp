@@ -0,0 +1,96 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+
+#include "frame_source.hpp"
+#include "config.hpp"
+#include "shm_ring.h"
+
+namespace camcoder {
+
+/**
+ * Reads frames from a POSIX shared-memory ring written by a producer on the
+ * same machine (see shm_ring.h). Frames are copied straight out of the
+ * mapping, so nothing on the data path makes a system call.
+ */
+class ShmFrameSource : public FrameSource {
+public:
+  /**
+   * How long to sleep between checks for a new frame.
+   */
+  static constexpr std::chrono::microseconds DEFAULT_POLL_INTERVAL{500};
+
+  /**
+   * If no frame is published for this long, remap in case the producer
+   * restarted with a new object.
+   */
+  static constexpr std::chrono::seconds IDLE_TIMEOUT{1};
+
+  ShmFrameSource(const std::string &path, const FrameParameters &frame_params,
+                 const FrameRate &frame_rate = {0, 1});
+  ~ShmFrameSource();
+
+  ShmFrameSource(const ShmFrameSource &) = delete;
+  ShmFrameSource &operator=(const ShmFrameSource &) = delete;
+
+  static std::unique_ptr<ShmFrameSource>
+  from_config(const FrameSourceConfig &config);
+
+  void set_poll_interval(std::chrono::microseconds poll_interval);
+
+  const std::string &path() const { return path_; }
+
+  /**
+   * Frames the producer overwrote before they could be read.
+   */
+  std::uint64_t skipped_frames() const { return skipped_frames_; }
+
+  /**
+   * Frames whose size didn't match the configured frame size.
+   */
+  std::uint64_t invalid_frames() const { return invalid_frames_; }
+
+private:
+  size_t read(char *buf, size_t n) override;
+
+  bool eof() const override { return false; }
+
+  bool good() const override { return header_ != nullptr; }
+
+  bool bad() const override { return header_ == nullptr; }
+
+  bool connected_() const override { return header_ != nullptr; }
+
+  bool connect_() override;
+
+  // Wakes a read polling for the next frame
+  void interrupt_() override { interrupted_ = true; }
+
+  // Waiting for the producer's next frame would hold up the streaming
+  // thread, so frames are read on a reader thread
+
+  Frame::Timestamp capture_time_() const override {
+    return Frame::Timestamp{capture_time_ns_};
+  }
+
+  SourceStats stats_() const override {
+    return {{"skipped_frames", skipped_frames_},
+            {"invalid_frames", invalid_frames_}};
+  }
+
+  void unmap();
+
+  std::string path_;
+  std::chrono::microseconds poll_interval_;
+  shm_ring_header *header_;
+  size_t mapping_size_;
+  std::uint64_t next_seq_;
+  std::atomic<std::uint64_t> skipped_frames_;
+  std::atomic<std::uint64_t> invalid_frames_;
+  // Of the frame last read, from its slot
+  std::uint64_t capture_time_ns_;
+  std::atomic<bool> interrupted_;
+};
+
+} // namespace camcoder
@@ -0,0 +1,78 @@
+/*
+ * Layout of the shared-memory frame ring read by ShmFrameSource.
+ *
+ * This header is plain C so producers can include it without pulling in
+ * camcoder. All fields are native-endian.
+ *
+ * The object starts with a shm_ring_header, followed by slot_count
+ * shm_ring_slot headers, followed by slot_count data areas of
+ * shm_ring_data_stride(slot_size) bytes each. Every part is 64-byte aligned.
+ *
+ * Frame n (counting from 0) goes in slot n % slot_count. The producer:
+ *   1. stores 2n + 1 to the slot's seq (release), marking it as being written
+ *   2. writes the frame data, size and timestamp
+ *   3. stores 2n + 2 to the slot's seq (release), marking it complete
+ *   4. stores n + 1 to the header's write_seq (release)
+ *
+ * A consumer reading frame n checks that seq is 2n + 2 before and after
+ * copying the data; if it changed, the producer lapped it and the copy is
+ * discarded. The producer never waits for consumers.
+ */
+#ifndef CAMCODER_SHM_RING_H
+#define CAMCODER_SHM_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHM_RING_MAGIC 0x48534343u /* "CCSH" */
+#define SHM_RING_VERSION 1u
+#define SHM_RING_ALIGN 64u
+
+struct shm_ring_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t slot_count;
+  uint32_t reserved;
+  /* Capacity of each slot's data area in bytes */
+  uint64_t slot_size;
+  /* Number of frames published; accessed atomically */
+  uint64_t write_seq;
+  uint8_t pad[32];
+};
+
+struct shm_ring_slot {
+  /* 2n + 1 while frame n is written, 2n + 2 once complete; accessed
+   * atomically */
+  uint64_t seq;
+  /* CLOCK_MONOTONIC time the frame was captured, or 0 */
+  uint64_t timestamp_ns;
+  /* Bytes of frame data in the slot */
+  uint64_t size;
+  uint8_t pad[40];
+};
+
+static inline uint64_t shm_ring_data_stride(uint64_t slot_size) {
+  return (slot_size + SHM_RING_ALIGN - 1) / SHM_RING_ALIGN * SHM_RING_ALIGN;
+}
+
+static inline uint64_t shm_ring_size(uint32_t slot_count, uint64_t slot_size) {
+  return sizeof(struct shm_ring_header) +
+         (uint64_t)slot_count * sizeof(struct shm_ring_slot) +
+         (uint64_t)slot_count * shm_ring_data_stride(slot_size);
+}
+
+static inline struct shm_ring_slot *
+shm_ring_slot(struct shm_ring_header *header, uint32_t i) {
+  return (struct shm_ring_slot *)((uint8_t *)header +
+                                  sizeof(struct shm_ring_header)) +
+         i;
+}
+
+static inline uint8_t *shm_ring_data(struct shm_ring_header *header,
+                                     uint32_t i) {
+  return (uint8_t *)header + sizeof(struct shm_ring_header) +
+         (uint64_t)header->slot_count * sizeof(struct shm_ring_slot) +
+         (uint64_t)i * shm_ring_data_stride(header->slot_size);
+}
+
+#endif /* CAMCODER_SHM_RING_H */
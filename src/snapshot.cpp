@@ -0,0 +1,214 @@
+#include <algorithm>
+#include <csetjmp>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+
+#include <jpeglib.h>
+#include <spdlog/spdlog.h>
+
+#include "snapshot.hpp"
+#include "utils.hpp"
+
+using namespace camcoder;
+
+namespace {
+
+/**
+ * libjpeg's default error handler exits the process; this one jumps back to
+ * encode() instead.
+ */
+struct JpegError {
+  jpeg_error_mgr mgr;
+  std::jmp_buf jump;
+};
+
+void jpeg_error_exit(j_common_ptr cinfo) {
+  auto err = reinterpret_cast<JpegError *>(cinfo->err);
+  char message[JMSG_LENGTH_MAX];
+  (*cinfo->err->format_message)(cinfo, message);
+  spdlog::error("JPEG encoding failed: {}", message);
+  std::longjmp(err->jump, 1);
+}
+
+} // namespace
+
+Snapshot::Snapshot(const FrameParameters &frame_params, std::string directory)
+    : frame_params_{frame_params}, directory_{std::move(directory)},
+      frame_mutex_{}, latest_{nullptr}, sequence_{0}, latest_time_{},
+      encode_mutex_{}, cache_{}, encodes_{0}, requests_{0} {}
+
+Snapshot::~Snapshot() {
+  if (latest_ != nullptr) {
+    gst_buffer_unref(latest_);
+  }
+}
+
+void Snapshot::update(GstBuffer *buf) {
+  gst_buffer_ref(buf);
+  GstBuffer *old = nullptr;
+  {
+    std::lock_guard<std::mutex> lock{frame_mutex_};
+    old = latest_;
+    latest_ = buf;
+    sequence_++;
+    latest_time_ = std::chrono::steady_clock::now();
+  }
+  // Outside the lock, since it may free the frame
+  if (old != nullptr) {
+    gst_buffer_unref(old);
+  }
+}
+
+Snapshot::Image Snapshot::get(size_t width) {
+  if (width >= frame_params_.width) {
+    width = 0;
+  }
+  requests_++;
+  std::lock_guard<std::mutex> encode_lock{encode_mutex_};
+
+  GstBuffer *buf = nullptr;
+  std::uint64_t sequence = 0;
+  std::chrono::steady_clock::time_point captured{};
+  {
+    std::lock_guard<std::mutex> lock{frame_mutex_};
+    sequence = sequence_;
+    captured = latest_time_;
+    if (latest_ != nullptr) {
+      buf = gst_buffer_ref(latest_);
+    }
+  }
+  if (buf == nullptr) {
+    return {};
+  }
+  const auto cached = cache_.find(width);
+  if (cached != cache_.end() && cached->second.sequence == sequence) {
+    gst_buffer_unref(buf);
+    return cached->second.image;
+  }
+
+  Image image{};
+  image.captured = captured;
+  image.width = width > 0 ? width : frame_params_.width;
+  image.height = width > 0 ? std::max<size_t>(1, frame_params_.height *
+                                                     width /
+                                                     frame_params_.width)
+                           : frame_params_.height;
+  image.path = utils::path_join(
+      directory_,
+      width > 0 ? fmt::format("snapshot-{}.jpg", width) : "snapshot.jpg");
+  auto jpeg = std::make_shared<std::vector<unsigned char>>();
+  GstMapInfo map;
+  if (gst_buffer_map(buf, &map, GST_MAP_READ)) {
+    const auto frame_size = frame_params_.width * frame_params_.height * 3;
+    bool ok = false;
+    if (map.size < frame_size) {
+      spdlog::error("Snapshot frame is {} bytes; expected {}", map.size,
+                    frame_size);
+    } else if (width > 0) {
+      std::vector<unsigned char> scaled(image.width * image.height * 3);
+      downscale(map.data, frame_params_.width, frame_params_.height,
+                scaled.data(), image.width, image.height);
+      ok = encode(scaled.data(), image.width, image.height, *jpeg);
+    } else {
+      ok = encode(map.data, image.width, image.height, *jpeg);
+    }
+    gst_buffer_unmap(buf, &map);
+    if (ok) {
+      image.jpeg = std::move(jpeg);
+    }
+  }
+  gst_buffer_unref(buf);
+  if (image.jpeg == nullptr) {
+    return image;
+  }
+  encodes_++;
+  write_file(image);
+
+  // Entries for other widths are stale now
+  for (auto it = cache_.begin(); it != cache_.end();) {
+    it = it->second.sequence != sequence ? cache_.erase(it) : std::next(it);
+  }
+  cache_[width] = CacheEntry{sequence, image};
+  return image;
+}
+
+bool Snapshot::encode(const unsigned char *rgb, size_t width, size_t height,
+                      std::vector<unsigned char> &jpeg) {
+  jpeg_compress_struct cinfo{};
+  JpegError err{};
+  cinfo.err = jpeg_std_error(&err.mgr);
+  err.mgr.error_exit = jpeg_error_exit;
+  unsigned char *out = nullptr;
+  unsigned long out_size = 0;
+  if (setjmp(err.jump)) {
+    jpeg_destroy_compress(&cinfo);
+    std::free(out);
+    return false;
+  }
+  jpeg_create_compress(&cinfo);
+  jpeg_mem_dest(&cinfo, &out, &out_size);
+  cinfo.image_width = width;
+  cinfo.image_height = height;
+  cinfo.input_components = 3;
+  cinfo.in_color_space = JCS_RGB;
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, QUALITY, TRUE);
+  jpeg_start_compress(&cinfo, TRUE);
+  while (cinfo.next_scanline < cinfo.image_height) {
+    JSAMPROW row = const_cast<unsigned char *>(rgb) +
+                   static_cast<size_t>(cinfo.next_scanline) * width * 3;
+    jpeg_write_scanlines(&cinfo, &row, 1);
+  }
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+  jpeg.assign(out, out + out_size);
+  std::free(out);
+  return true;
+}
+
+void Snapshot::downscale(const unsigned char *in, size_t in_width,
+                         size_t in_height, unsigned char *out, size_t width,
+                         size_t height) {
+  for (size_t y = 0; y < height; y++) {
+    const auto y0 = y * in_height / height;
+    const auto y1 = std::max(y0 + 1, (y + 1) * in_height / height);
+    for (size_t x = 0; x < width; x++) {
+      const auto x0 = x * in_width / width;
+      const auto x1 = std::max(x0 + 1, (x + 1) * in_width / width);
+      std::uint32_t sums[3] = {0, 0, 0};
+      for (auto iy = y0; iy < y1; iy++) {
+        const auto row = in + (iy * in_width + x0) * 3;
+        for (size_t i = 0; i < (x1 - x0) * 3; i += 3) {
+          sums[0] += row[i];
+          sums[1] += row[i + 1];
+          sums[2] += row[i + 2];
+        }
+      }
+      const auto count = static_cast<std::uint32_t>((y1 - y0) * (x1 - x0));
+      for (size_t c = 0; c < 3; c++) {
+        out[(y * width + x) * 3 + c] =
+            static_cast<unsigned char>((sums[c] + count / 2) / count);
+      }
+    }
+  }
+}
+
+void Snapshot::write_file(const Image &image) const {
+  const auto tmp_path = image.path + ".tmp";
+  {
+    std::ofstream ofs{tmp_path, std::ofstream::binary | std::ofstream::trunc};
+    ofs.write(reinterpret_cast<const char *>(image.jpeg->data()),
+              image.jpeg->size());
+    if (!ofs) {
+      spdlog::error("Failed to write {}", tmp_path);
+      return;
+    }
+  }
+  std::error_code ec;
+  std::filesystem::rename(tmp_path, image.path, ec);
+  if (ec) {
+    spdlog::error("Failed to write {}: {}", image.path, ec.message());
+  }
+}
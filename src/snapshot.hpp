@@ -0,0 +1,108 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <gst/gst.h>
+
+#include "frame_parameters.hpp"
+
+namespace camcoder {
+
+/**
+ * The newest frame pushed for a raw source, as a JPEG on demand. Keeping the
+ * frame costs only a buffer reference; it's encoded when a snapshot is asked
+ * for, at most once per frame and width, and the result is shared by every
+ * request until a newer frame arrives. Requests that come in while it's
+ * being encoded wait for it rather than encoding it again.
+ *
+ * Each encoded snapshot is also written to directory as snapshot.jpg (or
+ * snapshot-<width>.jpg when scaled), replacing the last one atomically, so
+ * the web server that serves the playlists can serve it too.
+ */
+class Snapshot {
+public:
+  static constexpr int QUALITY = 80;
+
+  struct Image {
+    // Null if there was no frame yet, or encoding failed
+    std::shared_ptr<const std::vector<unsigned char>> jpeg;
+    std::string path;
+    size_t width = 0;
+    size_t height = 0;
+    // Steady-clock time the frame was pushed
+    std::chrono::steady_clock::time_point captured{};
+  };
+
+  Snapshot(const FrameParameters &frame_params, std::string directory);
+  ~Snapshot();
+
+  Snapshot(const Snapshot &) = delete;
+  Snapshot &operator=(const Snapshot &) = delete;
+
+  /**
+   * Keep a reference to buf, the newest frame, in place of the last one.
+   * Cheap enough to call for every frame.
+   */
+  void update(GstBuffer *buf);
+
+  /**
+   * The newest frame as a JPEG, scaled down to width (keeping its aspect
+   * ratio) if that's narrower than the frame. Zero keeps the frame's width.
+   * Thread-safe.
+   */
+  Image get(size_t width = 0);
+
+  /**
+   * Times a frame was actually encoded, as opposed to served from the cache.
+   */
+  std::uint64_t encodes() const { return encodes_; }
+
+  std::uint64_t requests() const { return requests_; }
+
+private:
+  /**
+   * Encode an RGB image. Returns false on failure.
+   */
+  static bool encode(const unsigned char *rgb, size_t width, size_t height,
+                     std::vector<unsigned char> &jpeg);
+
+  /**
+   * Shrink an RGB image by averaging the input pixels each output pixel
+   * covers.
+   */
+  static void downscale(const unsigned char *in, size_t in_width,
+                        size_t in_height, unsigned char *out, size_t width,
+                        size_t height);
+
+  void write_file(const Image &image) const;
+
+  FrameParameters frame_params_;
+  std::string directory_;
+
+  // Guards the newest frame; held only briefly, since update() runs on the
+  // streaming path
+  mutable std::mutex frame_mutex_;
+  GstBuffer *latest_;
+  std::uint64_t sequence_;
+  std::chrono::steady_clock::time_point latest_time_;
+
+  // Held while encoding, so concurrent requests share one encode
+  mutable std::mutex encode_mutex_;
+  struct CacheEntry {
+    std::uint64_t sequence;
+    Image image;
+  };
+  // By requested width
+  std::map<size_t, CacheEntry> cache_;
+  std::atomic<std::uint64_t> encodes_;
+  std::atomic<std::uint64_t> requests_;
+};
+
+} // namespace camcoder
@@ -0,0 +1,181 @@
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+
+#include "socket_options.hpp"
+
+using namespace camcoder;
+
+SocketOptions SocketOptions::from_config(const FrameSourceConfig &config) {
+  SocketOptions options{};
+
+  const auto connect_timeout = config.options.find("connect_timeout");
+  if (connect_timeout != config.options.end()) {
+    options.connect_timeout =
+        std::chrono::milliseconds{connect_timeout->second.as_integer()};
+  }
+
+  const auto keepalive = config.options.find("keepalive");
+  if (keepalive != config.options.end()) {
+    options.keepalive = keepalive->second.as_boolean();
+  }
+
+  const auto user_timeout = config.options.find("user_timeout");
+  if (user_timeout != config.options.end()) {
+    options.user_timeout =
+        std::chrono::milliseconds{user_timeout->second.as_integer()};
+  }
+
+  const auto receive_buffer = config.options.find("receive_buffer");
+  if (receive_buffer != config.options.end()) {
+    options.receive_buffer =
+        static_cast<int>(receive_buffer->second.as_integer());
+  }
+
+  const auto nodelay = config.options.find("nodelay");
+  if (nodelay != config.options.end()) {
+    options.nodelay = nodelay->second.as_boolean();
+  }
+
+  const auto busy_poll = config.options.find("busy_poll_us");
+  if (busy_poll != config.options.end()) {
+    options.busy_poll =
+        std::chrono::microseconds{busy_poll->second.as_integer()};
+  }
+
+  const auto low_watermark = config.options.find("frame_low_watermark");
+  if (low_watermark != config.options.end()) {
+    options.frame_low_watermark = low_watermark->second.as_boolean();
+  }
+
+  return options;
+}
+
+int SocketOptions::open_socket(const sockpp::sock_address &addr) const {
+  const int fd = ::socket(addr.family(), SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    spdlog::warn("Failed to create socket: {}", std::strerror(errno));
+    return -1;
+  }
+  if (receive_buffer > 0 &&
+      ::setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &receive_buffer,
+                   sizeof(receive_buffer)) < 0) {
+    spdlog::warn("Failed to set receive buffer: {}", std::strerror(errno));
+  }
+  return fd;
+}
+
+bool SocketOptions::connect(sockpp::socket &sock,
+                            const sockpp::sock_address &addr) const {
+  const int fd = open_socket(addr);
+  if (fd < 0) {
+    return false;
+  }
+  sock.reset(fd);
+  // Non-blocking so the attempt can be bounded by connect_timeout
+  const int flags = ::fcntl(fd, F_GETFL);
+  ::fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+  int err = 0;
+  if (::connect(fd, addr.sockaddr_ptr(), addr.size()) < 0) {
+    err = errno;
+  }
+  if (err == EINPROGRESS) {
+    pollfd pfd{fd, POLLOUT, 0};
+    const int timeout =
+        connect_timeout.count() > 0 ? static_cast<int>(connect_timeout.count())
+                                    : -1;
+    int n = 0;
+    do {
+      n = ::poll(&pfd, 1, timeout);
+    } while (n < 0 && errno == EINTR);
+    err = ETIMEDOUT;
+    if (n > 0) {
+      socklen_t len = sizeof(err);
+      ::getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    }
+  }
+  if (err != 0) {
+    sock.close();
+    return false;
+  }
+  ::fcntl(fd, F_SETFL, flags);
+  return true;
+}
+
+bool SocketOptions::listen(sockpp::socket &sock,
+                           const sockpp::sock_address &addr,
+                           int backlog) const {
+  const int fd = open_socket(addr);
+  if (fd < 0) {
+    return false;
+  }
+  sock.reset(fd);
+  const int reuse = 1;
+  ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  if (::bind(fd, addr.sockaddr_ptr(), addr.size()) < 0 ||
+      ::listen(fd, backlog) < 0) {
+    spdlog::warn("Failed to listen: {}", std::strerror(errno));
+    sock.close();
+    return false;
+  }
+  return true;
+}
+
+bool SocketOptions::apply(sockpp::socket &sock, size_t frame_size) const {
+  bool ok = true;
+  if (keepalive) {
+    ok &= sock.set_option(SOL_SOCKET, SO_KEEPALIVE, 1);
+    ok &= sock.set_option(IPPROTO_TCP, TCP_KEEPIDLE,
+                          static_cast<int>(keepalive_idle.count()));
+    ok &= sock.set_option(IPPROTO_TCP, TCP_KEEPINTVL,
+                          static_cast<int>(keepalive_interval.count()));
+    ok &= sock.set_option(IPPROTO_TCP, TCP_KEEPCNT, keepalive_count);
+  }
+  if (user_timeout.count() > 0) {
+    ok &= sock.set_option(IPPROTO_TCP, TCP_USER_TIMEOUT,
+                          static_cast<unsigned int>(user_timeout.count()));
+  }
+  if (nodelay) {
+    ok &= sock.set_option(IPPROTO_TCP, TCP_NODELAY, 1);
+  }
+  if (busy_poll.count() > 0) {
+    // Raising this past net.core.busy_read needs CAP_NET_ADMIN
+    ok &= sock.set_option(SOL_SOCKET, SO_BUSY_POLL,
+                          static_cast<int>(busy_poll.count()));
+  }
+  if (frame_low_watermark && frame_size > 0) {
+    ok &= sock.set_option(SOL_SOCKET, SO_RCVLOWAT,
+                          static_cast<int>(frame_size));
+  }
+  if (!ok) {
+    spdlog::warn("Failed to set socket options: {}", sock.last_error_str());
+  }
+  return ok;
+}
+
+size_t camcoder::receive_exact(sockpp::socket &sock, char *buf, size_t n,
+                               ReceiveStats &stats) {
+  size_t received = 0;
+  while (received < n) {
+    const auto nrecv =
+        ::recv(sock.handle(), buf + received, n - received, MSG_WAITALL);
+    stats.recv_calls++;
+    if (nrecv > 0) {
+      received += static_cast<size_t>(nrecv);
+    } else if (nrecv < 0 && errno == EINTR) {
+      // MSG_WAITALL returns early on a signal
+      continue;
+    } else {
+      break;
+    }
+  }
+  return received;
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include <sockpp/socket.h>
+
+#include "config.hpp"
+
+namespace camcoder {
+
+/**
+ * Per-source settings for the sockets that carry frames.
+ */
+struct SocketOptions {
+  /**
+   * Give up on a connect attempt after this long instead of waiting out the
+   * kernel's SYN retries.
+   */
+  std::chrono::milliseconds connect_timeout{2000};
+
+  /**
+   * Probe idle connections so a dead peer is noticed without traffic.
+   */
+  bool keepalive = true;
+  std::chrono::seconds keepalive_idle{5};
+  std::chrono::seconds keepalive_interval{1};
+  int keepalive_count = 3;
+
+  /**
+   * Drop the connection if sent data stays unacknowledged this long
+   * (TCP_USER_TIMEOUT). Zero leaves the kernel default.
+   */
+  std::chrono::milliseconds user_timeout{10000};
+
+  /**
+   * Kernel receive buffer size in bytes (SO_RCVBUF). Zero leaves the kernel
+   * default and autotuning. Should hold a few frames at high bitrates.
+   */
+  int receive_buffer = 0;
+
+  /**
+   * Disable Nagle's algorithm (TCP_NODELAY). Mostly matters for the sender,
+   * but also stops delayed ACKs from being coalesced with replies.
+   */
+  bool nodelay = false;
+
+  /**
+   * Busy-poll the device queue for this long before sleeping in recv
+   * (SO_BUSY_POLL). Trades CPU for latency; zero disables it.
+   */
+  std::chrono::microseconds busy_poll{0};
+
+  /**
+   * Don't wake the reader until a whole frame is buffered (SO_RCVLOWAT). The
+   * kernel caps this at half the receive buffer.
+   */
+  bool frame_low_watermark = false;
+
+  static SocketOptions from_config(const FrameSourceConfig &config);
+
+  /**
+   * Open sock and connect it to addr within connect_timeout. The receive
+   * buffer is set first, since the TCP window scale is agreed in the
+   * handshake and a bigger buffer set later can't be fully used.
+   */
+  bool connect(sockpp::socket &sock, const sockpp::sock_address &addr) const;
+
+  /**
+   * Open sock listening on addr, with the receive buffer set first so
+   * accepted connections start with it.
+   */
+  bool listen(sockpp::socket &sock, const sockpp::sock_address &addr,
+              int backlog = 4) const;
+
+  /**
+   * Apply the rest of the options to a connected TCP socket carrying frames
+   * of frame_size bytes. Returns false if any of them couldn't be set.
+   */
+  bool apply(sockpp::socket &sock, size_t frame_size) const;
+
+private:
+  /**
+   * Create a TCP socket for addr's family with the receive buffer set.
+   * Returns -1 on failure.
+   */
+  int open_socket(const sockpp::sock_address &addr) const;
+};
+
+/**
+ * Counts how many recv calls it takes to read each frame.
+ */
+struct ReceiveStats {
+  std::atomic<std::uint64_t> frames{0};
+  std::atomic<std::uint64_t> recv_calls{0};
+};
+
+/**
+ * Receive exactly n bytes into buf, waiting for all of them in as few recv
+ * calls as the kernel allows (MSG_WAITALL). Calls are counted in stats; the
+ * caller counts frames. Returns the number of bytes
+ * received, which is less than n if the peer closed the connection or the
+ * socket failed.
+ */
+size_t receive_exact(sockpp::socket &sock, char *buf, size_t n,
+                     ReceiveStats &stats);
+
+} // namespace camcoder
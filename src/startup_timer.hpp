@@ -0,0 +1,45 @@
+#pragma once
+
+#include <chrono>
+#include <string_view>
+
+#include <spdlog/spdlog.h>
+
+namespace camcoder {
+
+/**
+ * Logs how long each phase of startup takes, so slow restarts can be traced
+ * to a phase.
+ */
+class StartupTimer {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  StartupTimer() : start_{Clock::now()}, last_{start_} {}
+
+  /**
+   * Log the time since the previous phase ended (or startup) and the total
+   * so far. Not thread-safe; phases are marked from the main thread.
+   */
+  void phase(std::string_view name) {
+    const auto now = Clock::now();
+    spdlog::info("Startup: {} took {} ms ({} ms total)", name,
+                 to_ms(now - last_), to_ms(now - start_));
+    last_ = now;
+  }
+
+  /**
+   * Milliseconds since startup, for events on other threads.
+   */
+  std::int64_t elapsed_ms() const { return to_ms(Clock::now() - start_); }
+
+private:
+  static std::int64_t to_ms(Clock::duration d) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(d).count();
+  }
+
+  Clock::time_point start_;
+  Clock::time_point last_;
+};
+
+} // namespace camcoder
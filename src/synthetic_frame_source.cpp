@@ -0,0 +1,189 @@
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+
+#include <spdlog/spdlog.h>
+
+#include "synthetic_frame_source.hpp"
+
+using namespace camcoder;
+
+static const std::unordered_map<std::string, SyntheticFrameSource::Pattern>
+    pattern_from_string{
+        {"gradient", SyntheticFrameSource::Pattern::GRADIENT},
+        {"bars", SyntheticFrameSource::Pattern::BARS},
+        {"noise", SyntheticFrameSource::Pattern::NOISE},
+    };
+
+SyntheticFrameSource::SyntheticFrameSource(const FrameParameters &frame_params,
+                                           const FrameRate &frame_rate,
+                                           Pattern pattern)
+    : FrameSource{frame_params, frame_rate.numerator > 0 ? frame_rate
+                                                         : DEFAULT_FRAME_RATE},
+      pattern_{pattern}, period_{}, next_due_{}, row_{},
+      noise_state_{0x9e3779b97f4a7c15ull}, generated_{0}, late_{0},
+      interrupted_{false}, interrupt_mutex_{}, interrupt_cv_{} {
+  const auto rate = this->frame_rate();
+  period_ = std::chrono::nanoseconds{1000000000ll * rate.denominator /
+                                     rate.numerator};
+  const auto width = frame_params.width;
+  switch (pattern_) {
+  case Pattern::GRADIENT:
+    // Green ramps across the frame; twice as wide so it can scroll by
+    // starting further along
+    row_.resize(2 * width);
+    for (size_t x = 0; x < row_.size(); x++) {
+      row_[x] = (x % width) * 256 / width;
+    }
+    break;
+  case Pattern::BARS: {
+    // White, yellow, cyan, green, magenta, red, blue, black
+    static constexpr std::uint8_t bars[8][3] = {
+        {235, 235, 235}, {235, 235, 16}, {16, 235, 235}, {16, 235, 16},
+        {235, 16, 235},  {235, 16, 16},  {16, 16, 235},  {16, 16, 16}};
+    row_.resize(3 * width);
+    for (size_t x = 0; x < width; x++) {
+      std::memcpy(&row_[3 * x], bars[x * 8 / width], 3);
+    }
+  } break;
+  case Pattern::NOISE:
+  default:
+    break;
+  }
+}
+
+std::unique_ptr<SyntheticFrameSource>
+SyntheticFrameSource::from_config(const FrameSourceConfig &config) {
+  auto pattern = Pattern::GRADIENT;
+  const auto pattern_it = config.options.find("pattern");
+  if (pattern_it != config.options.end()) {
+    const std::string pattern_name = pattern_it->second.as_string();
+    const auto it = pattern_from_string.find(pattern_name);
+    if (it == pattern_from_string.end()) {
+      spdlog::error("Invalid pattern {} for source {}", pattern_name,
+                    config.name);
+      return nullptr;
+    }
+    pattern = it->second;
+  }
+
+  auto frame_source = std::make_unique<SyntheticFrameSource>(
+      config.frame_params, config.frame_rate, pattern);
+
+  const auto rate = frame_source->frame_rate();
+  spdlog::info("Creating SyntheticFrameSource<pattern={}, {}x{} at {}/{}>",
+               pattern_it != config.options.end()
+                   ? std::string{pattern_it->second.as_string()}
+                   : std::string{"gradient"},
+               config.frame_params.width, config.frame_params.height,
+               rate.numerator, rate.denominator);
+
+  return frame_source;
+}
+
+size_t SyntheticFrameSource::read(char *buf, size_t n) {
+  const auto now = std::chrono::steady_clock::now();
+  if (next_due_ == std::chrono::steady_clock::time_point{}) {
+    next_due_ = now;
+  }
+  if (next_due_ > now) {
+    std::unique_lock<std::mutex> lock{interrupt_mutex_};
+    if (interrupt_cv_.wait_until(lock, next_due_,
+                                 [this] { return interrupted_.load(); })) {
+      return 0;
+    }
+  } else if (now - next_due_ > period_) {
+    // Fell behind, e.g. the reader was blocked; start the schedule over
+    // rather than catching up in a burst
+    late_++;
+    next_due_ = now;
+  }
+
+  auto data = reinterpret_cast<std::uint8_t *>(buf);
+  switch (pattern_) {
+  case Pattern::GRADIENT:
+    draw_gradient(data);
+    break;
+  case Pattern::BARS:
+    draw_bars(data);
+    break;
+  case Pattern::NOISE:
+  default:
+    draw_noise(data);
+    break;
+  }
+  draw_counter(data);
+  generated_++;
+  next_due_ += period_;
+  return n;
+}
+
+void SyntheticFrameSource::interrupt_() {
+  {
+    std::lock_guard<std::mutex> lock{interrupt_mutex_};
+    interrupted_ = true;
+  }
+  interrupt_cv_.notify_all();
+}
+
+void SyntheticFrameSource::draw_gradient(std::uint8_t *data) {
+  const auto params = frame_parameters();
+  const auto width = params.width;
+  const auto height = params.height;
+  // Scroll 4 pixels a frame, and cycle red to blue every 90 frames
+  const auto shift = (generated_ * 4) % width;
+  const auto step = generated_ % 90;
+  const std::uint8_t blue = step * 255 / 89;
+  const std::uint8_t *green = &row_[shift];
+  for (size_t y = 0; y < height; y++) {
+    const std::uint8_t red = (height - 1 - y) * (255 - blue) / height;
+    auto out = data + 3 * width * y;
+    for (size_t x = 0; x < width; x++) {
+      out[3 * x] = red;
+      out[3 * x + 1] = green[x];
+      out[3 * x + 2] = blue;
+    }
+  }
+}
+
+void SyntheticFrameSource::draw_bars(std::uint8_t *data) {
+  const auto params = frame_parameters();
+  for (size_t y = 0; y < params.height; y++) {
+    std::memcpy(data + y * row_.size(), row_.data(), row_.size());
+  }
+}
+
+void SyntheticFrameSource::draw_noise(std::uint8_t *data) {
+  // xorshift64, eight bytes at a time
+  const auto size = frame_size_bytes();
+  auto state = noise_state_;
+  size_t i = 0;
+  for (; i + sizeof(state) <= size; i += sizeof(state)) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    std::memcpy(data + i, &state, sizeof(state));
+  }
+  for (; i < size; i++) {
+    data[i] = static_cast<std::uint8_t>(state >> (8 * (i % 8)));
+  }
+  noise_state_ = state;
+}
+
+void SyntheticFrameSource::draw_counter(std::uint8_t *data) {
+  const auto params = frame_parameters();
+  const auto rows = std::min(COUNTER_BLOCK_SIZE, params.height);
+  const auto value = static_cast<std::uint32_t>(generated_);
+  for (size_t bit = 0; bit < COUNTER_BITS; bit++) {
+    const auto x0 = bit * COUNTER_BLOCK_SIZE;
+    if (x0 >= params.width) {
+      break;
+    }
+    const auto x1 = std::min(x0 + COUNTER_BLOCK_SIZE, params.width);
+    const std::uint8_t level =
+        (value >> (COUNTER_BITS - 1 - bit)) & 1 ? 255 : 0;
+    for (size_t y = 0; y < rows; y++) {
+      std::memset(data + 3 * (params.width * y + x0), level, 3 * (x1 - x0));
+    }
+  }
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+#include "frame_source.hpp"
+#include "config.hpp"
+
+namespace camcoder {
+
+/**
+ * Generates test frames at a fixed rate, for load testing without a camera.
+ * Each frame carries its frame number as a strip of black and white blocks
+ * along the top edge, most significant bit first, so dropped or repeated
+ * frames can be spotted in the output.
+ */
+class SyntheticFrameSource : public FrameSource {
+public:
+  enum class Pattern {
+    GRADIENT, /// Gradient that scrolls sideways and shifts color over time
+    BARS,     /// Static color bars
+    NOISE,    /// Random pixels, the worst case for the encoder
+  };
+
+  static constexpr FrameRate DEFAULT_FRAME_RATE{30, 1};
+
+  /**
+   * Side of each block in the frame number strip, in pixels.
+   */
+  static constexpr size_t COUNTER_BLOCK_SIZE = 8;
+  static constexpr size_t COUNTER_BITS = 32;
+
+  SyntheticFrameSource(const FrameParameters &frame_params,
+                       const FrameRate &frame_rate, Pattern pattern);
+
+  static std::unique_ptr<SyntheticFrameSource>
+  from_config(const FrameSourceConfig &config);
+
+  Pattern pattern() const { return pattern_; }
+
+private:
+  /**
+   * Wait for the frame's slot, then draw it into buf.
+   */
+  size_t read(char *buf, size_t n) override;
+
+  bool eof() const override { return false; }
+
+  bool good() const override { return !interrupted_; }
+
+  bool bad() const override { return false; }
+
+  bool connected_() const override { return true; }
+
+  bool connect_() override { return true; }
+
+  void interrupt_() override;
+
+  SourceStats stats_() const override {
+    return {{"frames_generated", generated_}, {"late_frames", late_}};
+  }
+
+  void draw_gradient(std::uint8_t *data);
+  void draw_bars(std::uint8_t *data);
+  void draw_noise(std::uint8_t *data);
+  void draw_counter(std::uint8_t *data);
+
+  Pattern pattern_;
+  std::chrono::nanoseconds period_;
+  std::chrono::steady_clock::time_point next_due_;
+  // One row of the pattern, for patterns built from repeated rows
+  std::vector<std::uint8_t> row_;
+  std::uint64_t noise_state_;
+  std::atomic<std::uint64_t> generated_;
+  // Frames drawn after their slot had already passed
+  std::atomic<std::uint64_t> late_;
+  std::atomic<bool> interrupted_;
+  std::mutex interrupt_mutex_;
+  std::condition_variable interrupt_cv_;
+};
+
+} // namespace camcoder
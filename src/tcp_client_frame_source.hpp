@@ -6,6 +6,8 @@
 #include <sockpp/tcp6_connector.h>
 
 #include "frame_source.hpp"
+#include "socket_options.hpp"
+#include "frame_decompressor.hpp"
 
 namespace camcoder {
 
@@ -21,8 +23,8 @@ public:
   TCPClientFrameSource(const std::string &host, std::uint16_t port,
                        const FrameParameters &frame_params,
                        const FrameRate &frame_rate = {0, 1})
-      : FrameSource{frame_params, frame_rate}, addr_{host, port}, connector_{
-                                                                      addr_} {}
+      : FrameSource{frame_params, frame_rate}, addr_{host, port}, connector_{},
+        options_{} {}
 
   static std::unique_ptr<TCPClientFrameSource>
   from_config(const FrameSourceConfig &config) {
@@ -51,9 +53,30 @@ public:
     spdlog::info("Creating TCPClientFrameSource<host={}, port={}>", addr_host,
                  addr_port);
 
-    return std::make_unique<TCPClientFrameSource>(
+    auto frame_source = std::make_unique<TCPClientFrameSource>(
         addr_host, static_cast<std::uint16_t>(addr_port), config.frame_params,
         config.frame_rate);
+    frame_source->set_socket_options(SocketOptions::from_config(config));
+    const auto compressed = config.options.find("compressed");
+    const auto deltas = config.options.find("deltas");
+    if (compressed != config.options.end()) {
+      frame_source->set_compressed(compressed->second.as_boolean(),
+                                   deltas != config.options.end() &&
+                                       deltas->second.as_boolean());
+    }
+    return frame_source;
+  }
+
+  void set_socket_options(const SocketOptions &options) { options_ = options; }
+
+  /**
+   * Expect frames with a FrameDecompressor header instead of raw frames,
+   * and with deltas, delta frames among them.
+   */
+  void set_compressed(bool compressed, bool deltas = false) {
+    decompressor_ = compressed ? std::make_unique<FrameDecompressor>(
+                                     frame_size_bytes(), deltas)
+                               : nullptr;
   }
 
   std::string host() const { return addr_.to_string(); }
@@ -64,7 +87,38 @@ private:
     if (!connected()) {
       return 0;
     }
-    return connector_.read_n(buf, n);
+    // Straight into the frame's memory, ideally in a single recv
+    const bool ok =
+        decompressor_ != nullptr
+            ? decompressor_->receive(connector_, buf, n, recv_stats_)
+            : receive_exact(connector_, buf, n, recv_stats_) == n;
+    if (!ok) {
+      // The peer closed the connection or went away; reconnect
+      connector_.close();
+      return 0;
+    }
+    recv_stats_.frames++;
+    return n;
+  }
+  size_t read_some(char *buf, size_t n) override {
+    if (!connected()) {
+      return 0;
+    }
+    const auto nread = connector_.read(buf, n);
+    recv_stats_.recv_calls++;
+    if (nread <= 0) {
+      connector_.close();
+      return 0;
+    }
+    return nread;
+  }
+  SourceStats stats_() const override {
+    SourceStats stats{{"frames_received", recv_stats_.frames.load()},
+                      {"recv_calls", recv_stats_.recv_calls.load()}};
+    if (decompressor_ != nullptr) {
+      stats.merge(decompressor_->stats());
+    }
+    return stats;
   }
   bool eof() const override { return false; }
   bool good() const override { return connected_(); }
@@ -72,18 +126,30 @@ private:
 
   bool connected_() const override { return connector_.is_connected(); }
 
+  void interrupt_() override { connector_.shutdown(); }
+
   bool connect_() override {
     // if sockpp::connector.connect() is called twice, it will break the
     // connection and reconnect.
     if (connected()) {
       return true;
-    } else {
-      return connector_.connect(addr_);
     }
+    // Bounded so a black-holed address doesn't stall for the SYN timeout
+    if (!options_.connect(connector_, addr_)) {
+      return false;
+    }
+    options_.apply(connector_, frame_size_bytes());
+    if (decompressor_ != nullptr) {
+      decompressor_->reset();
+    }
+    return true;
   }
 
   typename TConnector::addr_t addr_;
   TConnector connector_;
+  SocketOptions options_;
+  ReceiveStats recv_stats_;
+  std::unique_ptr<FrameDecompressor> decompressor_;
 };
 } // namespace detail
 
@@ -1,10 +1,14 @@
 #pragma once
 
+#include <mutex>
+
 #include <sockpp/tcp_acceptor.h>
 #include <sockpp/tcp6_acceptor.h>
 
 #include "frame_source.hpp"
 #include "config.hpp"
+#include "socket_options.hpp"
+#include "frame_decompressor.hpp"
 
 namespace camcoder {
 
@@ -20,7 +24,8 @@ public:
                        const FrameParameters &frame_params,
                        const FrameRate &frame_rate = {0, 1})
       : FrameSource{frame_params, frame_rate}, addr_{addr, port},
-        acceptor_{addr_}, client_sock_{}, client_addr_{} {}
+        acceptor_{}, client_sock_{}, client_addr_{}, options_{},
+        socket_mutex_{}, interrupted_{false} {}
   // TODO: constructor without specific address
 
   static std::unique_ptr<TCPServerFrameSource>
@@ -50,27 +55,118 @@ public:
     spdlog::info("Creating TCPServerFrameSource<host={}, port={}>", addr_host,
                  addr_port);
 
-    return std::make_unique<TCPServerFrameSource>(
+    auto frame_source = std::make_unique<TCPServerFrameSource>(
         addr_host, static_cast<std::uint16_t>(addr_port), config.frame_params,
         config.frame_rate);
+    frame_source->set_socket_options(SocketOptions::from_config(config));
+    const auto compressed = config.options.find("compressed");
+    const auto deltas = config.options.find("deltas");
+    if (compressed != config.options.end()) {
+      frame_source->set_compressed(compressed->second.as_boolean(),
+                                   deltas != config.options.end() &&
+                                       deltas->second.as_boolean());
+    }
+    return frame_source;
+  }
+
+  void set_socket_options(const SocketOptions &options) { options_ = options; }
+
+  /**
+   * Expect frames with a FrameDecompressor header instead of raw frames,
+   * and with deltas, delta frames among them.
+   */
+  void set_compressed(bool compressed, bool deltas = false) {
+    decompressor_ = compressed ? std::make_unique<FrameDecompressor>(
+                                     frame_size_bytes(), deltas)
+                               : nullptr;
   }
 
 private:
   size_t read(char *buf, size_t n) override {
     if (!connected()) {
       return 0;
-    } else {
-      return client_sock_.read_n(buf, n);
     }
+    // Straight into the frame's memory, ideally in a single recv
+    const bool ok =
+        decompressor_ != nullptr
+            ? decompressor_->receive(client_sock_, buf, n, recv_stats_)
+            : receive_exact(client_sock_, buf, n, recv_stats_) == n;
+    if (!ok) {
+      // The client went away; wait for the next one
+      close_client();
+      return 0;
+    }
+    recv_stats_.frames++;
+    return n;
+  }
+  size_t read_some(char *buf, size_t n) override {
+    if (!connected()) {
+      return 0;
+    }
+    const auto nread = client_sock_.read(buf, n);
+    recv_stats_.recv_calls++;
+    if (nread <= 0) {
+      close_client();
+      return 0;
+    }
+    return nread;
+  }
+  SourceStats stats_() const override {
+    SourceStats stats{{"frames_received", recv_stats_.frames.load()},
+                      {"recv_calls", recv_stats_.recv_calls.load()}};
+    if (decompressor_ != nullptr) {
+      stats.merge(decompressor_->stats());
+    }
+    return stats;
   }
   bool eof() const override { return false; }
   bool good() const override { return connected_(); }
   bool bad() const override { return !connected_(); }
 
   bool connected_() const override { return client_sock_.is_open(); }
+  void interrupt_() override {
+    std::lock_guard<std::mutex> lock{socket_mutex_};
+    interrupted_ = true;
+    // Wakes accept() as well as a read; a listening socket that's been shut
+    // down fails any later accept() too
+    acceptor_.shutdown();
+    client_sock_.shutdown();
+  }
   bool connect_() override {
-    client_sock_ = acceptor_.accept(&client_addr_);
-    return client_sock_.is_open();
+    {
+      // Listening waits for the socket options, which apply to the
+      // listening socket so accepted connections start with them
+      std::lock_guard<std::mutex> lock{socket_mutex_};
+      if (interrupted_) {
+        return false;
+      }
+      if (!acceptor_.is_open() && !options_.listen(acceptor_, addr_)) {
+        return false;
+      }
+    }
+    auto client_sock = acceptor_.accept(&client_addr_);
+    if (!client_sock.is_open()) {
+      return false;
+    }
+    {
+      // A client accepted just as we were interrupted would never be shut
+      // down
+      std::lock_guard<std::mutex> lock{socket_mutex_};
+      if (interrupted_) {
+        return false;
+      }
+      client_sock_ = std::move(client_sock);
+    }
+    options_.apply(client_sock_, frame_size_bytes());
+    if (decompressor_ != nullptr) {
+      decompressor_->reset();
+    }
+    return true;
+  }
+
+  void close_client() {
+    std::lock_guard<std::mutex> lock{socket_mutex_};
+    client_sock_.close();
   }
 
 private:
@@ -78,6 +174,13 @@ private:
   TAcceptor acceptor_;
   sockpp::stream_socket client_sock_;
   typename TAcceptor::addr_t client_addr_;
+  SocketOptions options_;
+  // Guards acceptor_ and client_sock_ being opened, replaced or closed
+  // against interrupt_() on another thread
+  std::mutex socket_mutex_;
+  bool interrupted_;
+  ReceiveStats recv_stats_;
+  std::unique_ptr<FrameDecompressor> decompressor_;
 };
 } // namespace detail
 
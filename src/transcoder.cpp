@@ -0,0 +1,284 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+
+#include <spdlog/spdlog.h>
+
+#include <gst/app/gstappsrc.h>
+#include <gst/gst.h>
+
+#include "transcoder.hpp"
+#include "utils.hpp"
+
+using namespace camcoder;
+
+/**
+ * Output time of the frame at index, counting from the first transcoded
+ * frame. Computed per frame so rounding doesn't accumulate.
+ */
+static std::chrono::nanoseconds frame_pts(std::uint64_t index,
+                                          const FrameRate &frame_rate) {
+  return std::chrono::nanoseconds{static_cast<std::int64_t>(
+      index * 1000000000ull * frame_rate.denominator / frame_rate.numerator)};
+}
+
+Transcoder::Transcoder(const Config &config, unsigned int jobs)
+    : output_directory_{config.output_directory}, config_{config},
+      jobs_{jobs > 0 ? jobs
+                     : std::max(1u, std::thread::hardware_concurrency())},
+      encoder_threads_{std::max(1u, std::thread::hardware_concurrency() /
+                                        jobs_)} {}
+
+bool Transcoder::operator()() {
+  bool ok = true;
+  for (const auto &source : config_.frame_sources) {
+    if (source.type != FrameSourceType::FILE ||
+        source.encoding != Encoding::RAW) {
+      spdlog::warn("Skipping source {}; only raw file sources can be "
+                   "transcoded",
+                   source.name);
+      continue;
+    }
+    ok = transcode(source) && ok;
+  }
+  return ok;
+}
+
+bool Transcoder::transcode(const FrameSourceConfig &config) {
+  const auto start_time = std::chrono::steady_clock::now();
+  auto source = FileFrameSource::from_config(config);
+  if (source == nullptr) {
+    spdlog::error("Failed to open source {}", config.name);
+    return false;
+  }
+  const auto frame_rate = source->frame_rate();
+  if (frame_rate.numerator == 0) {
+    spdlog::error("Source {} needs a frame_rate to be transcoded",
+                  config.name);
+    return false;
+  }
+  // Honor start_frame or start_time
+  const auto first_frame = source->position();
+  const auto total_frames = source->frames();
+  if (first_frame >= total_frames) {
+    spdlog::error("Source {} has no frames to transcode", config.name);
+    return false;
+  }
+
+  const auto directory = utils::path_join(output_directory_, config.name);
+  std::error_code ec;
+  std::filesystem::create_directories(directory, ec);
+  if (ec) {
+    spdlog::error("Failed to create {}: {}", directory, ec.message());
+    return false;
+  }
+
+  const std::uint64_t chunk_frames = std::max<std::uint64_t>(
+      1, SEGMENT_DURATION.count() * frame_rate.numerator /
+             frame_rate.denominator);
+  std::vector<Chunk> chunks;
+  for (auto frame = first_frame; frame < total_frames; frame += chunk_frames) {
+    const auto index = chunks.size();
+    chunks.push_back(Chunk{
+        frame, std::min(chunk_frames, total_frames - frame),
+        utils::path_join(directory, fmt::format("segment{:05d}.ts", index)),
+        false});
+  }
+  const auto jobs = std::min<size_t>(jobs_, chunks.size());
+  spdlog::info("Transcoding {} frames of {} in {} chunks, {} at a time",
+               total_frames - first_frame, config.name, chunks.size(), jobs);
+
+  // Each worker reads through its own file handle and scaler
+  std::atomic<size_t> next_chunk{0};
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < jobs; i++) {
+    workers.emplace_back([&] {
+      auto worker_source = FileFrameSource::from_config(config);
+      if (worker_source == nullptr) {
+        return;
+      }
+      worker_source->enable_loop(false);
+      worker_source->set_realtime(false);
+      std::unique_ptr<FrameScaler> scaler;
+      if (config.scale.cropped() || config.scale.scaled()) {
+        scaler = std::make_unique<FrameScaler>(
+            worker_source->frame_parameters(), config.scale);
+      }
+      for (auto index = next_chunk++; index < chunks.size();
+           index = next_chunk++) {
+        auto &chunk = chunks[index];
+        chunk.ok =
+            worker_source->seek_frame(chunk.first_frame) &&
+            encode_chunk(config, *worker_source, scaler.get(), chunk,
+                         frame_pts(chunk.first_frame - first_frame,
+                                   frame_rate));
+        if (!chunk.ok) {
+          spdlog::error("Failed to encode frames {} to {} of {}",
+                        chunk.first_frame,
+                        chunk.first_frame + chunk.frames - 1, config.name);
+        }
+      }
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+
+  const bool ok =
+      std::all_of(chunks.begin(), chunks.end(),
+                  [](const auto &chunk) { return chunk.ok; }) &&
+      write_playlist(utils::path_join(directory, "playlist.m3u8"), chunks,
+                     frame_rate);
+  const auto elapsed = std::chrono::duration<double>(
+                           std::chrono::steady_clock::now() - start_time)
+                           .count();
+  const auto duration =
+      std::chrono::duration<double>(
+          frame_pts(total_frames - first_frame, frame_rate))
+          .count();
+  if (ok) {
+    spdlog::info("Transcoded {:.1f} s of {} in {:.1f} s ({:.1f}x real time)",
+                 duration, config.name, elapsed,
+                 elapsed > 0 ? duration / elapsed : 0.0);
+  }
+  return ok;
+}
+
+bool Transcoder::encode_chunk(const FrameSourceConfig &config,
+                              FileFrameSource &source, FrameScaler *scaler,
+                              const Chunk &chunk,
+                              std::chrono::nanoseconds first_pts) {
+  const auto frame_params = scaler != nullptr ? scaler->output_parameters()
+                                               : source.frame_parameters();
+  const auto frame_rate = source.frame_rate();
+
+  auto pipeline = gst_pipeline_new(nullptr);
+  auto appsrc = gst_element_factory_make("appsrc", nullptr);
+  auto convert = gst_element_factory_make("videoconvert", nullptr);
+  auto encoder = gst_element_factory_make("x264enc", nullptr);
+  auto mux = gst_element_factory_make("mpegtsmux", nullptr);
+  auto sink = gst_element_factory_make("filesink", nullptr);
+  if (appsrc == nullptr || convert == nullptr || encoder == nullptr ||
+      mux == nullptr || sink == nullptr) {
+    spdlog::error("Failed to create the transcode pipeline for {}",
+                  config.name);
+    for (auto element : {appsrc, convert, encoder, mux, sink}) {
+      if (element != nullptr) {
+        gst_object_unref(element);
+      }
+    }
+    gst_object_unref(pipeline);
+    return false;
+  }
+  gst_bin_add_many(GST_BIN(pipeline), appsrc, convert, encoder, mux, sink,
+                   nullptr);
+  gst_element_link_many(appsrc, convert, encoder, mux, sink, nullptr);
+
+  auto caps = gst_caps_new_simple(
+      "video/x-raw", "format", G_TYPE_STRING, "RGB", "width", G_TYPE_INT,
+      static_cast<gint>(frame_params.width), "height", G_TYPE_INT,
+      static_cast<gint>(frame_params.height), "framerate", GST_TYPE_FRACTION,
+      static_cast<gint>(frame_rate.numerator),
+      static_cast<gint>(frame_rate.denominator), nullptr);
+  // Not live, so frames go in as fast as the encoder takes them; a few
+  // frames of queue keep reading and encoding overlapped without piling up
+  const auto frame_size = frame_params.width * frame_params.height *
+                          pixel_size(frame_params.pixel_format);
+  g_object_set(appsrc, "caps", caps, "format", GST_FORMAT_TIME, "block", TRUE,
+               "max-bytes", static_cast<guint64>(4 * frame_size), nullptr);
+  gst_caps_unref(caps);
+  g_object_set(encoder, "threads", encoder_threads_, nullptr);
+  g_object_set(sink, "location", chunk.path.c_str(), nullptr);
+
+  bool ok = gst_element_set_state(pipeline, GST_STATE_PLAYING) !=
+            GST_STATE_CHANGE_FAILURE;
+  for (std::uint64_t i = 0; ok && i < chunk.frames; i++) {
+    auto pframe = source.get_frame_ptr();
+    if (pframe == nullptr) {
+      spdlog::error("Failed to read frame {} of {}", chunk.first_frame + i,
+                    config.name);
+      ok = false;
+      break;
+    }
+    if (scaler != nullptr) {
+      pframe = scaler->scale(static_cast<const RGBFrame &>(*pframe));
+    }
+    const auto size = pframe->raw_size();
+    auto data = const_cast<char *>(pframe->raw_data());
+    auto buf = gst_buffer_new_wrapped_full(
+        GST_MEMORY_FLAG_READONLY, data, size, 0, size, pframe.release(),
+        [](gpointer frame) { delete reinterpret_cast<Frame *>(frame); });
+    const auto pts = first_pts + frame_pts(i, frame_rate);
+    GST_BUFFER_PTS(buf) = pts.count();
+    GST_BUFFER_DTS(buf) = pts.count();
+    GST_BUFFER_DURATION(buf) =
+        (first_pts + frame_pts(i + 1, frame_rate) - pts).count();
+    // appsrc takes ownership of the buffer
+    ok = gst_app_src_push_buffer(GST_APP_SRC(appsrc), buf) == GST_FLOW_OK;
+  }
+  gst_app_src_end_of_stream(GST_APP_SRC(appsrc));
+
+  // Wait for the segment to be completely written (or an error)
+  auto bus = gst_element_get_bus(pipeline);
+  auto msg = gst_bus_timed_pop_filtered(
+      bus, GST_CLOCK_TIME_NONE,
+      static_cast<GstMessageType>(GST_MESSAGE_EOS | GST_MESSAGE_ERROR));
+  if (msg != nullptr) {
+    if (GST_MESSAGE_TYPE(msg) == GST_MESSAGE_ERROR) {
+      GError *err = nullptr;
+      gst_message_parse_error(msg, &err, nullptr);
+      spdlog::error("Error transcoding {}: {}", config.name, err->message);
+      g_error_free(err);
+      ok = false;
+    }
+    gst_message_unref(msg);
+  }
+  gst_object_unref(bus);
+  gst_element_set_state(pipeline, GST_STATE_NULL);
+  gst_object_unref(pipeline);
+  return ok;
+}
+
+bool Transcoder::write_playlist(const std::string &path,
+                                const std::vector<Chunk> &chunks,
+                                const FrameRate &frame_rate) {
+  double max_duration = 0;
+  std::string entries;
+  for (const auto &chunk : chunks) {
+    const auto duration =
+        std::chrono::duration<double>(frame_pts(chunk.frames, frame_rate))
+            .count();
+    max_duration = std::max(max_duration, duration);
+    entries += fmt::format(
+        "#EXTINF:{:.3f},\n{}\n", duration,
+        std::filesystem::path{chunk.path}.filename().string());
+  }
+
+  // Written beside the playlist and renamed over it, so players never see a
+  // partial one
+  const auto tmp_path = path + ".tmp";
+  {
+    std::ofstream ofs{tmp_path, std::ofstream::trunc};
+    ofs << "#EXTM3U\n"
+        << "#EXT-X-VERSION:3\n"
+        << "#EXT-X-PLAYLIST-TYPE:VOD\n"
+        << "#EXT-X-TARGETDURATION:"
+        << static_cast<int>(std::ceil(max_duration)) << "\n"
+        << "#EXT-X-MEDIA-SEQUENCE:0\n"
+        << entries << "#EXT-X-ENDLIST\n";
+    if (!ofs) {
+      spdlog::error("Failed to write {}", tmp_path);
+      return false;
+    }
+  }
+  std::error_code ec;
+  std::filesystem::rename(tmp_path, path, ec);
+  if (ec) {
+    spdlog::error("Failed to write {}: {}", path, ec.message());
+    return false;
+  }
+  return true;
+}
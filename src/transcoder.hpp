@@ -0,0 +1,75 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "config.hpp"
+#include "file_frame_source.hpp"
+#include "frame_scaler.hpp"
+
+namespace camcoder {
+
+/**
+ * Encodes file sources to HLS as fast as possible instead of in real time,
+ * e.g. to backfill an archive. Each source is split into segment-long
+ * chunks, which start on a keyframe since every chunk gets its own encoder.
+ * Chunks are encoded in parallel, each straight to its segment file, and the
+ * playlist is written once they're all done. Timestamps run on across
+ * chunks, so the segments play back as one stream.
+ */
+class Transcoder {
+public:
+  /**
+   * Length of each segment (and chunk), matching hlssink's default target
+   * duration for the live pipeline.
+   */
+  static constexpr std::chrono::seconds SEGMENT_DURATION{15};
+
+  /**
+   * jobs is the number of chunks encoded at once; zero means one per core.
+   */
+  Transcoder(const Config &config, unsigned int jobs = 0);
+
+  /**
+   * Transcode every raw file source in the config. Returns false if any
+   * failed.
+   */
+  bool operator()();
+
+private:
+  /**
+   * A range of frames that becomes one segment.
+   */
+  struct Chunk {
+    std::uint64_t first_frame;
+    std::uint64_t frames;
+    std::string path;
+    bool ok;
+  };
+
+  bool transcode(const FrameSourceConfig &source);
+
+  /**
+   * Encode the chunk from source, which is positioned at its first frame.
+   * first_pts is the first frame's timestamp in the output.
+   */
+  bool encode_chunk(const FrameSourceConfig &config, FileFrameSource &source,
+                    FrameScaler *scaler, const Chunk &chunk,
+                    std::chrono::nanoseconds first_pts);
+
+  /**
+   * Write a complete (VOD) playlist of the chunks' segments.
+   */
+  static bool write_playlist(const std::string &path,
+                             const std::vector<Chunk> &chunks,
+                             const FrameRate &frame_rate);
+
+  std::string output_directory_;
+  const Config &config_;
+  unsigned int jobs_;
+  // x264 threads per encoder, so the encoders together use every core
+  unsigned int encoder_threads_;
+};
+
+} // namespace camcoder
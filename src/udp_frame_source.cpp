@@ -0,0 +1,206 @@
+#include <algorithm>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <spdlog/spdlog.h>
+
+#include "udp_frame_source.hpp"
+
+using namespace camcoder;
+
+static constexpr size_t RTP_HEADER_SIZE = 12;
+static constexpr size_t LINE_HEADER_SIZE = 6;
+static constexpr int RECEIVE_BUFFER_SIZE = 8 * 1024 * 1024;
+
+static std::uint16_t be16(const std::uint8_t *p) {
+  return static_cast<std::uint16_t>(p[0] << 8 | p[1]);
+}
+
+static std::uint32_t be32(const std::uint8_t *p) {
+  return static_cast<std::uint32_t>(p[0]) << 24 |
+         static_cast<std::uint32_t>(p[1]) << 16 |
+         static_cast<std::uint32_t>(p[2]) << 8 | p[3];
+}
+
+UDPFrameSource::UDPFrameSource(const std::string &host, std::uint16_t port,
+                               const FrameParameters &frame_params,
+                               const FrameRate &frame_rate)
+    : FrameSource{frame_params, frame_rate}, addr_{host, port}, sock_{},
+      datagram_(MAX_DATAGRAM_SIZE), datagram_size_{0}, pending_{false},
+      frame_(frame_size_bytes()), line_bytes_(frame_params.height),
+      have_seq_{false}, next_seq_{0}, lost_packets_{0}, concealed_lines_{0} {}
+
+std::unique_ptr<UDPFrameSource>
+UDPFrameSource::from_config(const FrameSourceConfig &config) {
+  const auto host = config.options.find("host");
+  std::string addr_host;
+  if (host == config.options.end()) {
+    spdlog::warn("No host specified for source {}; using 0.0.0.0",
+                 config.name);
+    addr_host = "0.0.0.0";
+  } else {
+    addr_host = host->second.as_string();
+  }
+
+  const auto port = config.options.find("port");
+  if (port == config.options.end()) {
+    spdlog::error("Port is required for source {}", config.name);
+    return nullptr;
+  }
+  const auto addr_port = port->second.as_integer();
+  if (addr_port <= 0 || addr_port > std::numeric_limits<std::uint16_t>::max()) {
+    spdlog::error("Invalid port {} for source {}", addr_port, config.name);
+    return nullptr;
+  }
+
+  spdlog::info("Creating UDPFrameSource<host={}, port={}>", addr_host,
+               addr_port);
+
+  return std::make_unique<UDPFrameSource>(
+      addr_host, static_cast<std::uint16_t>(addr_port), config.frame_params,
+      config.frame_rate);
+}
+
+bool UDPFrameSource::connect_() {
+  sockpp::udp_socket sock;
+  if (!sock.bind(addr_)) {
+    spdlog::error("Failed to bind {}: {}", addr_.to_string(),
+                  sock.last_error_str());
+    return false;
+  }
+  // Frames arrive as bursts of datagrams, so give the kernel room for them
+  sock.set_option(SOL_SOCKET, SO_RCVBUF, RECEIVE_BUFFER_SIZE);
+  timeval timeout{};
+  timeout.tv_usec =
+      std::chrono::duration_cast<std::chrono::microseconds>(RECEIVE_TIMEOUT)
+          .count();
+  sock.set_option(SOL_SOCKET, SO_RCVTIMEO, timeout);
+  sock_ = std::move(sock);
+  have_seq_ = false;
+  pending_ = false;
+  return true;
+}
+
+bool UDPFrameSource::receive() {
+  const auto n = sock_.recv(datagram_.data(), datagram_.size());
+  if (n <= 0) {
+    return false;
+  }
+  datagram_size_ = n;
+  return true;
+}
+
+size_t UDPFrameSource::line_size_bytes() const {
+  return frame_parameters().width * pixel_size(frame_parameters().pixel_format);
+}
+
+size_t UDPFrameSource::read(char *buf, size_t n) {
+  if (!connected() || n != frame_.size()) {
+    return 0;
+  }
+
+  std::fill(line_bytes_.begin(), line_bytes_.end(), 0);
+  bool started = false;
+  std::uint32_t rtp_timestamp = 0;
+  while (true) {
+    if (!pending_ && !receive()) {
+      // Timed out; drop whatever we had of this frame
+      return 0;
+    }
+    pending_ = false;
+
+    const auto *rtp = datagram_.data();
+    if (datagram_size_ < RTP_HEADER_SIZE + 2 || (rtp[0] >> 6) != 2) {
+      continue;
+    }
+    const auto csrc_count = rtp[0] & 0x0f;
+    const bool has_extension = rtp[0] & 0x10;
+    const bool marker = rtp[1] & 0x80;
+    const auto timestamp = be32(rtp + 4);
+    size_t payload = RTP_HEADER_SIZE + 4 * csrc_count;
+    if (has_extension && payload + 4 <= datagram_size_) {
+      payload += 4 + 4 * be16(rtp + payload + 2);
+    }
+    if (payload + 2 > datagram_size_) {
+      continue;
+    }
+
+    if (started && timestamp != rtp_timestamp) {
+      // The marker packet was lost; finish this frame and start the next one
+      // with this datagram
+      pending_ = true;
+      break;
+    }
+    started = true;
+    rtp_timestamp = timestamp;
+
+    // RFC 4175 extends the RTP sequence number to 32 bits
+    const std::uint32_t seq = be16(rtp + payload) << 16 | be16(rtp + 2);
+    if (have_seq_ && seq != next_seq_) {
+      const auto gap = seq - next_seq_;
+      // Anything "behind" us is a reordered or duplicate packet
+      if (gap < 0x80000000u) {
+        lost_packets_ += gap;
+      }
+    }
+    have_seq_ = true;
+    next_seq_ = seq + 1;
+
+    depacketize(payload + 2);
+    if (marker) {
+      break;
+    }
+  }
+
+  conceal();
+  std::memcpy(buf, frame_.data(), n);
+  return n;
+}
+
+void UDPFrameSource::depacketize(size_t payload) {
+  const auto *data = datagram_.data();
+  const auto pixel_bytes = pixel_size(frame_parameters().pixel_format);
+  const auto line_size = line_size_bytes();
+  const auto height = frame_parameters().height;
+
+  // Find where the line headers end and the segments begin
+  size_t headers_end = payload;
+  bool continuation = true;
+  while (continuation && headers_end + LINE_HEADER_SIZE <= datagram_size_) {
+    continuation = data[headers_end + 4] & 0x80;
+    headers_end += LINE_HEADER_SIZE;
+  }
+
+  size_t segment = headers_end;
+  for (size_t header = payload; header < headers_end;
+       header += LINE_HEADER_SIZE) {
+    const size_t length = be16(data + header);
+    const size_t line = be16(data + header + 2) & 0x7fff;
+    const size_t offset = (be16(data + header + 4) & 0x7fff) * pixel_bytes;
+    if (segment + length > datagram_size_) {
+      break;
+    }
+    if (line < height && offset + length <= line_size) {
+      std::memcpy(frame_.data() + line * line_size + offset, data + segment,
+                  length);
+      line_bytes_[line] += length;
+    }
+    segment += length;
+  }
+}
+
+void UDPFrameSource::conceal() {
+  const auto line_size = line_size_bytes();
+  for (size_t line = 0; line < line_bytes_.size(); line++) {
+    if (line_bytes_[line] >= line_size) {
+      continue;
+    }
+    concealed_lines_++;
+    if (line > 0) {
+      std::memcpy(frame_.data() + line * line_size,
+                  frame_.data() + (line - 1) * line_size, line_size);
+    }
+  }
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+#include <sockpp/udp_socket.h>
+
+#include "frame_source.hpp"
+#include "config.hpp"
+
+namespace camcoder {
+
+/**
+ * Receives raw frames sent as RTP datagrams with RFC 4175 payload headers:
+ * after the RTP header comes a 16-bit extended sequence number, then one or
+ * more 6-byte line headers (length, line number, pixel offset), then the
+ * line segments they describe. The RTP marker bit ends a frame.
+ *
+ * Lost packets are detected from the sequence numbers. Lines that aren't
+ * completely received are concealed by repeating the line above them (or, for
+ * the top line, whatever the previous frame had there).
+ */
+class UDPFrameSource : public FrameSource {
+public:
+  static constexpr size_t MAX_DATAGRAM_SIZE = 65536;
+
+  /**
+   * A partially received frame is abandoned after this long without a
+   * datagram.
+   */
+  static constexpr std::chrono::milliseconds RECEIVE_TIMEOUT{100};
+
+  UDPFrameSource(const std::string &host, std::uint16_t port,
+                 const FrameParameters &frame_params,
+                 const FrameRate &frame_rate = {0, 1});
+
+  static std::unique_ptr<UDPFrameSource>
+  from_config(const FrameSourceConfig &config);
+
+  std::string host() const { return addr_.to_string(); }
+  std::uint16_t port() const { return addr_.port(); }
+
+  /**
+   * Datagrams missing from the sequence.
+   */
+  std::uint64_t lost_packets() const { return lost_packets_; }
+
+  /**
+   * Lines filled in by repeating the previous line.
+   */
+  std::uint64_t concealed_lines() const { return concealed_lines_; }
+
+private:
+  size_t read(char *buf, size_t n) override;
+  bool eof() const override { return false; }
+  bool good() const override { return connected_(); }
+  bool bad() const override { return !connected_(); }
+
+  bool connected_() const override { return sock_.is_open(); }
+  bool connect_() override;
+
+  SourceStats stats_() const override {
+    return {{"lost_packets", lost_packets_},
+            {"concealed_lines", concealed_lines_}};
+  }
+
+  /**
+   * Receive the next datagram into datagram_. Returns false on timeout.
+   */
+  bool receive();
+
+  /**
+   * Copy the line segments in datagram_ into frame_, starting at payload.
+   */
+  void depacketize(size_t payload);
+
+  /**
+   * Fill in lines that weren't completely received.
+   */
+  void conceal();
+
+  size_t line_size_bytes() const;
+
+  sockpp::inet_address addr_;
+  sockpp::udp_socket sock_;
+
+  std::vector<std::uint8_t> datagram_;
+  size_t datagram_size_;
+  // True if datagram_ holds the start of the next frame
+  bool pending_;
+
+  // Reassembly buffer, kept between frames so concealment can fall back on
+  // the previous frame
+  std::vector<char> frame_;
+  std::vector<size_t> line_bytes_;
+
+  bool have_seq_;
+  std::uint32_t next_seq_;
+  std::atomic<std::uint64_t> lost_packets_;
+  std::atomic<std::uint64_t> concealed_lines_;
+};
+
+} // namespace camcoder
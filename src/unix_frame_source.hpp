@@ -0,0 +1,213 @@
+#pragma once
+
+#include <unistd.h>
+
+#include <mutex>
+
+#include <sockpp/unix_acceptor.h>
+#include <sockpp/unix_connector.h>
+
+#include "frame_source.hpp"
+#include "config.hpp"
+#include "utils.hpp"
+
+namespace camcoder {
+
+namespace detail {
+/**
+ * Find the socket path option shared by both Unix-domain sources.
+ */
+static inline std::string
+unix_path_from_config(const FrameSourceConfig &config) {
+  const auto path = config.options.find("path");
+  if (path == config.options.end()) {
+    spdlog::error("Option path is required for source {}", config.name);
+    return {};
+  }
+  return path->second.as_string();
+}
+} // namespace detail
+
+/**
+ * Connects to a producer listening on a Unix-domain stream socket. This is
+ * much cheaper than loopback TCP for producers on the same machine.
+ */
+class UnixClientFrameSource : public FrameSource {
+public:
+  UnixClientFrameSource(const std::string &path,
+                        const FrameParameters &frame_params,
+                        const FrameRate &frame_rate = {0, 1})
+      : FrameSource{frame_params, frame_rate}, path_{path}, connector_{} {}
+
+  static std::unique_ptr<UnixClientFrameSource>
+  from_config(const FrameSourceConfig &config) {
+    const auto path = detail::unix_path_from_config(config);
+    if (path.empty()) {
+      return nullptr;
+    }
+
+    spdlog::info("Creating UnixClientFrameSource<path={}>", path);
+
+    return std::make_unique<UnixClientFrameSource>(path, config.frame_params,
+                                                   config.frame_rate);
+  }
+
+  const std::string &path() const { return path_; }
+
+private:
+  size_t read(char *buf, size_t n) override {
+    if (!connected()) {
+      return 0;
+    }
+    const auto nread = connector_.read_n(buf, n);
+    if (nread < 0 || static_cast<size_t>(nread) != n) {
+      connector_.close();
+      return 0;
+    }
+    return n;
+  }
+  size_t read_some(char *buf, size_t n) override {
+    if (!connected()) {
+      return 0;
+    }
+    const auto nread = connector_.read(buf, n);
+    if (nread <= 0) {
+      connector_.close();
+      return 0;
+    }
+    return nread;
+  }
+  bool eof() const override { return false; }
+  bool good() const override { return connected_(); }
+  bool bad() const override { return !connected_(); }
+
+  bool connected_() const override { return connector_.is_connected(); }
+
+  void interrupt_() override { connector_.shutdown(); }
+
+  bool connect_() override {
+    if (connected()) {
+      return true;
+    } else {
+      return connector_.connect(sockpp::unix_address{path_});
+    }
+  }
+
+  std::string path_;
+  sockpp::unix_connector connector_;
+};
+
+/**
+ * Listens on a Unix-domain stream socket and reads frames from the one
+ * producer that connects.
+ */
+class UnixServerFrameSource : public FrameSource {
+public:
+  UnixServerFrameSource(const std::string &path,
+                        const FrameParameters &frame_params,
+                        const FrameRate &frame_rate = {0, 1})
+      : FrameSource{frame_params, frame_rate}, path_{path}, acceptor_{},
+        client_sock_{}, socket_mutex_{}, interrupted_{false} {
+    if (!utils::remove_stale_socket(path_)) {
+      spdlog::error("{} exists and isn't a socket", path_);
+      return;
+    }
+    if (!acceptor_.open(sockpp::unix_address{path_})) {
+      spdlog::error("Failed to listen on {}: {}", path_,
+                    acceptor_.last_error_str());
+    }
+  }
+
+  ~UnixServerFrameSource() {
+    if (acceptor_.is_open()) {
+      ::unlink(path_.c_str());
+    }
+  }
+
+  static std::unique_ptr<UnixServerFrameSource>
+  from_config(const FrameSourceConfig &config) {
+    const auto path = detail::unix_path_from_config(config);
+    if (path.empty()) {
+      return nullptr;
+    }
+
+    spdlog::info("Creating UnixServerFrameSource<path={}>", path);
+
+    auto frame_source = std::make_unique<UnixServerFrameSource>(
+        path, config.frame_params, config.frame_rate);
+    if (!frame_source->listening()) {
+      return nullptr;
+    }
+    return frame_source;
+  }
+
+  const std::string &path() const { return path_; }
+
+  bool listening() const { return acceptor_.is_open(); }
+
+private:
+
+  size_t read(char *buf, size_t n) override {
+    if (!connected()) {
+      return 0;
+    }
+    const auto nread = client_sock_.read_n(buf, n);
+    if (nread < 0 || static_cast<size_t>(nread) != n) {
+      close_client();
+      return 0;
+    }
+    return n;
+  }
+  size_t read_some(char *buf, size_t n) override {
+    if (!connected()) {
+      return 0;
+    }
+    const auto nread = client_sock_.read(buf, n);
+    if (nread <= 0) {
+      close_client();
+      return 0;
+    }
+    return nread;
+  }
+  bool eof() const override { return false; }
+  bool good() const override { return connected_(); }
+  bool bad() const override { return !connected_(); }
+
+  bool connected_() const override { return client_sock_.is_open(); }
+  void interrupt_() override {
+    std::lock_guard<std::mutex> lock{socket_mutex_};
+    interrupted_ = true;
+    // Wakes accept() as well as a read; a listening socket that's been shut
+    // down fails any later accept() too
+    acceptor_.shutdown();
+    client_sock_.shutdown();
+  }
+  bool connect_() override {
+    auto client_sock = acceptor_.accept();
+    if (!client_sock.is_open()) {
+      return false;
+    }
+    // A client accepted just as we were interrupted would never be shut down
+    std::lock_guard<std::mutex> lock{socket_mutex_};
+    if (interrupted_) {
+      return false;
+    }
+    client_sock_ = std::move(client_sock);
+    return true;
+  }
+
+  void close_client() {
+    std::lock_guard<std::mutex> lock{socket_mutex_};
+    client_sock_.close();
+  }
+
+  std::string path_;
+  sockpp::unix_acceptor acceptor_;
+  sockpp::stream_socket client_sock_;
+  // Guards client_sock_ being replaced or closed against interrupt_() on
+  // another thread
+  std::mutex socket_mutex_;
+  bool interrupted_;
+};
+
+} // namespace camcoder
@@ -3,6 +3,9 @@
 #include <string>
 #include <sstream>
 
+#include <sys/stat.h>
+#include <unistd.h>
+
 namespace camcoder {
 namespace utils {
 /**
@@ -19,5 +22,22 @@ static std::string path_join(const std::string &root,
   ss << child;
   return ss.str();
 }
+
+/**
+ * Remove a Unix-domain socket left behind at path by a previous run, so it
+ * can be bound again. Returns false if something other than a socket is
+ * there, which is left alone.
+ */
+static bool remove_stale_socket(const std::string &path) {
+  struct stat st {};
+  if (::lstat(path.c_str(), &st) != 0) {
+    return true;
+  }
+  if (!S_ISSOCK(st.st_mode)) {
+    return false;
+  }
+  ::unlink(path.c_str());
+  return true;
+}
 } // namespace utils
 } // namespace camcoder
@@ -0,0 +1,93 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <string_view>
+
+#include <spdlog/spdlog.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "viewer_monitor.hpp"
+
+using namespace camcoder;
+
+/**
+ * True for the files a player fetches, as opposed to e.g. snapshots.
+ */
+static bool is_stream_file(const char *name) {
+  const std::string_view view{name};
+  for (const std::string_view extension : {".m3u8", ".ts"}) {
+    if (view.size() > extension.size() &&
+        view.substr(view.size() - extension.size()) == extension) {
+      return true;
+    }
+  }
+  return false;
+}
+
+ViewerMonitor::ViewerMonitor()
+    : fd_{inotify_init1(IN_NONBLOCK | IN_CLOEXEC)}, watches_{} {
+  if (fd_ < 0) {
+    spdlog::warn("Can't watch for viewers: {}", std::strerror(errno));
+  }
+}
+
+ViewerMonitor::~ViewerMonitor() {
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+}
+
+bool ViewerMonitor::watch(const std::string &name,
+                          const std::string &directory) {
+  if (fd_ < 0) {
+    return false;
+  }
+  // Reads, including sendfile(); the encoder only ever writes these files
+  const int wd = inotify_add_watch(fd_, directory.c_str(), IN_ACCESS);
+  if (wd < 0) {
+    spdlog::warn("Can't watch {} for viewers: {}", directory,
+                 std::strerror(errno));
+    return false;
+  }
+  watches_[name] = wd;
+  return true;
+}
+
+void ViewerMonitor::unwatch(const std::string &name) {
+  const auto it = watches_.find(name);
+  if (it == watches_.end()) {
+    return;
+  }
+  inotify_rm_watch(fd_, it->second);
+  watches_.erase(it);
+}
+
+std::vector<std::string> ViewerMonitor::poll() {
+  std::vector<std::string> names;
+  if (fd_ < 0) {
+    return names;
+  }
+  alignas(inotify_event) char buf[4096];
+  while (true) {
+    const auto n = read(fd_, buf, sizeof(buf));
+    if (n <= 0) {
+      // EAGAIN once there's nothing left
+      break;
+    }
+    for (ssize_t offset = 0; offset < n;) {
+      const auto event = reinterpret_cast<const inotify_event *>(buf + offset);
+      offset += sizeof(inotify_event) + event->len;
+      if (event->len == 0 || !is_stream_file(event->name)) {
+        continue;
+      }
+      for (const auto &[name, wd] : watches_) {
+        if (wd == event->wd &&
+            std::find(names.begin(), names.end(), name) == names.end()) {
+          names.push_back(name);
+        }
+      }
+    }
+  }
+  return names;
+}
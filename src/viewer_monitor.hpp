@@ -0,0 +1,44 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace camcoder {
+
+/**
+ * Notices when sources' playlists or segments are read, e.g. by the web
+ * server serving them, as a sign that someone is watching. Uses inotify, so
+ * reads count whatever serves the files, as long as they're read from this
+ * machine's file system (not, say, from a caching proxy). Polled rather than
+ * waited on.
+ */
+class ViewerMonitor {
+public:
+  ViewerMonitor();
+  ~ViewerMonitor();
+
+  ViewerMonitor(const ViewerMonitor &) = delete;
+  ViewerMonitor &operator=(const ViewerMonitor &) = delete;
+
+  /**
+   * Start watching the directory a source writes its playlist and segments
+   * to. Returns false if it can't be watched.
+   */
+  bool watch(const std::string &name, const std::string &directory);
+
+  void unwatch(const std::string &name);
+
+  /**
+   * Sources whose playlist or segments were read since the last call, each
+   * once. Never blocks.
+   */
+  std::vector<std::string> poll();
+
+private:
+  int fd_;
+  // Watch descriptors by source name
+  std::map<std::string, int> watches_;
+};
+
+} // namespace camcoder
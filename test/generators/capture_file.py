@@ -0,0 +1,96 @@
+"""Converts a headerless raw frame file into a camcoder capture file, with frames timestamped at the frame rate plus
+optional jitter, or prints the header and timestamps of an existing capture file.
+
+USAGE: python capture_file.py [--width WIDTH] [--height HEIGHT] [--frame-rate FRAMERATE] [--jitter MS]
+                              <INPUT_FILE> <OUTPUT_FILE>
+       python capture_file.py --info <CAPTURE_FILE>
+
+Requires Python 3.
+"""
+
+from argparse import ArgumentParser
+import random
+import struct
+
+MAGIC = b'CAMCAP\0\0'
+VERSION = 1
+# magic, version, pixel format, width, height, frame rate, frame count, index offset
+HEADER = struct.Struct('<8sIIIIIIQQ')
+TIMESTAMP = struct.Struct('<q')
+PIXEL_FORMAT_RGB = 1
+
+
+def convert(args):
+    pixel_size = 3
+    frame_size = args.width * args.height * pixel_size
+    period_ns = 1e9 / args.frame_rate
+    timestamps = []
+    with open(args.input_file, 'rb') as f, open(args.output_file, 'wb') as out:
+        out.write(HEADER.pack(MAGIC, VERSION, PIXEL_FORMAT_RGB, args.width, args.height, args.frame_rate, 1, 0, 0))
+        while True:
+            frame = f.read(frame_size)
+            if len(frame) < frame_size:
+                break
+            timestamp = int(len(timestamps) * period_ns + random.uniform(0, args.jitter) * 1e6)
+            # Arrival times never go backwards
+            if timestamps:
+                timestamp = max(timestamp, timestamps[-1])
+            timestamps.append(timestamp)
+            out.write(TIMESTAMP.pack(timestamp))
+            out.write(frame)
+        index_offset = out.tell()
+        for timestamp in timestamps:
+            out.write(TIMESTAMP.pack(timestamp))
+        out.seek(0)
+        out.write(HEADER.pack(MAGIC, VERSION, PIXEL_FORMAT_RGB, args.width, args.height, args.frame_rate, 1,
+                              len(timestamps), index_offset))
+    print(f'Wrote {len(timestamps)} frames')
+
+
+def info(path):
+    with open(path, 'rb') as f:
+        magic, version, pixel_format, width, height, rate_n, rate_d, count, index_offset = \
+            HEADER.unpack(f.read(HEADER.size))
+        if magic != MAGIC:
+            raise ValueError(f'{path} is not a capture file')
+        print(f'version {version}, pixel format {pixel_format}, {width}x{height} at {rate_n}/{rate_d} fps')
+        if index_offset == 0:
+            print('No index; the file was not closed')
+            return
+        f.seek(index_offset)
+        for i in range(count):
+            (timestamp,) = TIMESTAMP.unpack(f.read(TIMESTAMP.size))
+            print(f'{i}: {timestamp / 1e6:.3f} ms')
+
+
+def main():
+    parser = ArgumentParser(
+        description='Create or inspect camcoder capture files.')
+
+    parser.add_argument('--width', type=int,
+                        default=640, help='Frame width')
+    parser.add_argument('--height', type=int,
+                        default=480, help='Frame height')
+    parser.add_argument('--frame-rate', type=int,
+                        default=30, help='Framerate')
+    parser.add_argument('--jitter', type=float, default=0.0,
+                        help='Maximum random delay added to each timestamp, in milliseconds')
+    parser.add_argument('--info', action='store_true',
+                        help='Print the header and timestamps of INPUT_FILE')
+    parser.add_argument('input_file',
+                        help='A file to read frame data from')
+    parser.add_argument('output_file', nargs='?',
+                        help='The capture file to write')
+
+    args = parser.parse_args()
+
+    if args.info:
+        info(args.input_file)
+    elif args.output_file is None:
+        parser.error('OUTPUT_FILE is required')
+    else:
+        convert(args)
+
+
+if __name__ == '__main__':
+    main()
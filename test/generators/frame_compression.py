@@ -0,0 +1,90 @@
+"""Encodes frames for TCP sources configured with `compressed = true`.
+
+Each frame is a 16-byte little-endian header followed by the payload:
+
+    uint32 magic         b'CCFZ'
+    uint8  codec         0 = uncompressed, 1 = LZ4 block, 2 = zstd frame
+    uint8  flags         bit 0: the decoded payload is XORed with the previous frame
+    uint16 reserved
+    uint32 payload_size  bytes following the header
+    uint32 frame_size    bytes once decoded
+
+LZ4 needs the lz4 package and zstd needs zstandard (pip install lz4 zstandard).
+"""
+
+import struct
+
+MAGIC = b'CCFZ'
+CODECS = {'none': 0, 'lz4': 1, 'zstd': 2}
+FLAG_DELTA = 0x01
+
+
+def _compressor(codec, level):
+    if codec == 'none':
+        return bytes
+    elif codec == 'lz4':
+        import lz4.block
+        return lambda data: lz4.block.compress(data, store_size=False,
+                                               mode='fast', acceleration=level or 1)
+    elif codec == 'zstd':
+        import zstandard
+        compressor = zstandard.ZstdCompressor(level=level or 3)
+        return compressor.compress
+    else:
+        raise ValueError(f'Unsupported codec {codec}')
+
+
+class FrameEncoder:
+    """Encodes successive frames, sending a full frame every keyframe_interval
+    frames and XOR deltas against the previous frame in between if delta is
+    set."""
+
+    def __init__(self, codec='lz4', delta=False, keyframe_interval=30, level=0):
+        self.codec = codec
+        self.delta = delta
+        self.keyframe_interval = keyframe_interval
+        self._compress = _compressor(codec, level)
+        self._previous = None
+        self._count = 0
+
+    def encode(self, frame):
+        flags = 0
+        payload = frame
+        if self.delta and self._previous is not None and \
+                self._count % self.keyframe_interval != 0:
+            flags |= FLAG_DELTA
+            size = len(frame)
+            payload = (int.from_bytes(frame, 'little') ^
+                       int.from_bytes(self._previous, 'little')).to_bytes(size, 'little')
+        self._previous = bytes(frame)
+        self._count += 1
+
+        payload = self._compress(payload)
+        header = struct.pack('<4sBBHII', MAGIC, CODECS[self.codec], flags, 0,
+                             len(payload), len(frame))
+        return header + payload
+
+
+def add_arguments(parser):
+    """Add the encoding options to an ArgumentParser."""
+    parser.add_argument('--compression', choices=['raw'] + list(CODECS), default='raw',
+                        help='Send frames raw (the default) or with a header, '
+                        'optionally compressed')
+    parser.add_argument('--delta', action='store_true',
+                        help='Send frames as XOR deltas against the previous frame '
+                        '(the source needs deltas = true)')
+    parser.add_argument('--keyframe-interval', type=int, default=30,
+                        help='Send a full frame this often when sending deltas')
+    parser.add_argument('--level', type=int, default=0,
+                        help='Compression level (LZ4 acceleration or zstd level)')
+
+
+def encoder_from_args(args):
+    """Make a function that encodes a frame for sending, per the parsed options."""
+    if args.compression == 'raw':
+        if args.delta:
+            raise ValueError('--delta needs --compression')
+        return bytes
+    encoder = FrameEncoder(args.compression, args.delta, args.keyframe_interval,
+                           args.level)
+    return encoder.encode
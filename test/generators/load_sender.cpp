@@ -0,0 +1,364 @@
+/*
+ * Simulates many TCP cameras sending raw RGB frames, to load-test camcoder.
+ * Camera i connects to PORT + i (for tcp_server sources) or, with --listen,
+ * accepts a connection on PORT + i (for tcp_client sources). Frames are
+ * generated once up front and stamped with a frame number strip like the
+ * synthetic source's, so sending costs little more than the copy into the
+ * socket.
+ *
+ * Each second it prints the frames and bytes sent, frames dropped because a
+ * camera fell behind its schedule (as a real camera would drop them), the
+ * kernel's smoothed TCP round-trip time, and the data queued in the sockets,
+ * which grows when camcoder doesn't keep up.
+ *
+ * USAGE: load_sender [--cameras N] [--width WIDTH] [--height HEIGHT]
+ *                    [--frame-rate FRAMERATE] [--duration SECONDS]
+ *                    [--pattern gradient|noise] [--listen] <HOST> <PORT>
+ *
+ * Built with camcoder (unless BUILD_GENERATORS is off), or on its own with
+ * g++ -std=c++17 -O2 -pthread -o load_sender load_sender.cpp
+ */
+
+#include <arpa/inet.h>
+#include <linux/sockios.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+constexpr size_t PIXEL_SIZE = 3;
+constexpr size_t COUNTER_BLOCK_SIZE = 8;
+constexpr size_t COUNTER_BITS = 32;
+// Distinct frames generated per camera; the counter strip makes each sent
+// frame unique anyway
+constexpr size_t FRAME_VARIANTS = 30;
+
+struct Options {
+  unsigned int cameras = 1;
+  size_t width = 640;
+  size_t height = 480;
+  double frame_rate = 30;
+  double duration = 0; // Forever
+  bool noise = false;
+  bool listen = false;
+  std::string host;
+  unsigned int port = 0;
+};
+
+struct Camera {
+  unsigned int index = 0;
+  std::atomic<std::uint64_t> frames{0};
+  std::atomic<std::uint64_t> bytes{0};
+  std::atomic<std::uint64_t> dropped{0};
+  std::atomic<std::uint64_t> reconnects{0};
+  std::atomic<int> sock{-1};
+  // With --listen, while waiting for a connection
+  std::atomic<int> listener{-1};
+};
+
+std::atomic<bool> stopping{false};
+
+void generate(const Options &options, size_t variant, std::uint8_t *data) {
+  if (options.noise) {
+    std::uint64_t state = 0x9e3779b97f4a7c15ull * (variant + 1);
+    const auto size = options.width * options.height * PIXEL_SIZE;
+    for (size_t i = 0; i < size; i++) {
+      state ^= state << 13;
+      state ^= state >> 7;
+      state ^= state << 17;
+      data[i] = static_cast<std::uint8_t>(state);
+    }
+    return;
+  }
+  const auto shift = variant * 4;
+  const auto blue = static_cast<std::uint8_t>(variant * 255 / FRAME_VARIANTS);
+  for (size_t y = 0; y < options.height; y++) {
+    const auto red = static_cast<std::uint8_t>(y * 255 / options.height);
+    for (size_t x = 0; x < options.width; x++) {
+      auto out = data + PIXEL_SIZE * (y * options.width + x);
+      out[0] = red;
+      out[1] = static_cast<std::uint8_t>(((x + shift) % options.width) * 256 /
+                                         options.width);
+      out[2] = blue;
+    }
+  }
+}
+
+void stamp_counter(const Options &options, std::uint32_t value,
+                   std::uint8_t *data) {
+  const auto rows = std::min(COUNTER_BLOCK_SIZE, options.height);
+  for (size_t bit = 0; bit < COUNTER_BITS; bit++) {
+    const auto x0 = bit * COUNTER_BLOCK_SIZE;
+    if (x0 >= options.width) {
+      break;
+    }
+    const auto x1 = std::min(x0 + COUNTER_BLOCK_SIZE, options.width);
+    const std::uint8_t level =
+        (value >> (COUNTER_BITS - 1 - bit)) & 1 ? 255 : 0;
+    for (size_t y = 0; y < rows; y++) {
+      std::memset(data + PIXEL_SIZE * (options.width * y + x0), level,
+                  PIXEL_SIZE * (x1 - x0));
+    }
+  }
+}
+
+int open_connection(const Options &options, unsigned int port,
+                    std::atomic<int> &listener) {
+  addrinfo hints{};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (options.listen) {
+    hints.ai_flags = AI_PASSIVE;
+  }
+  addrinfo *addrs = nullptr;
+  if (getaddrinfo(options.host.c_str(), std::to_string(port).c_str(), &hints,
+                  &addrs) != 0) {
+    return -1;
+  }
+  int fd = -1;
+  for (auto addr = addrs; addr != nullptr && fd < 0; addr = addr->ai_next) {
+    fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+    if (options.listen) {
+      const int one = 1;
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+      if (bind(fd, addr->ai_addr, addr->ai_addrlen) == 0 &&
+          ::listen(fd, 1) == 0) {
+        // Published before checking stopping, so main() either sees it and
+        // shuts it down or we see stopping and don't wait
+        listener = fd;
+        const int conn = stopping ? -1 : accept(fd, nullptr, nullptr);
+        listener = -1;
+        close(fd);
+        fd = conn;
+        continue;
+      }
+    } else if (connect(fd, addr->ai_addr, addr->ai_addrlen) == 0) {
+      continue;
+    }
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(addrs);
+  return fd;
+}
+
+bool send_all(int fd, const std::uint8_t *data, size_t size) {
+  while (size > 0) {
+    const auto n = send(fd, data, size, MSG_NOSIGNAL);
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+void run_camera(const Options &options, Camera &camera) {
+  const auto frame_size = options.width * options.height * PIXEL_SIZE;
+  std::vector<std::uint8_t> frames(FRAME_VARIANTS * frame_size);
+  for (size_t i = 0; i < FRAME_VARIANTS; i++) {
+    generate(options, i, &frames[i * frame_size]);
+  }
+  const auto period = std::chrono::duration_cast<Clock::duration>(
+      std::chrono::duration<double>(1 / options.frame_rate));
+  const auto port = options.port + camera.index;
+
+  std::uint32_t frame_number = 0;
+  while (!stopping) {
+    const int fd = open_connection(options, port, camera.listener);
+    if (fd < 0) {
+      std::this_thread::sleep_for(std::chrono::seconds{1});
+      continue;
+    }
+    camera.sock = fd;
+    auto next_due = Clock::now();
+    while (!stopping) {
+      const auto now = Clock::now();
+      if (now < next_due) {
+        std::this_thread::sleep_until(next_due);
+      } else if (now - next_due >= period) {
+        // Behind schedule: skip the frames whose slots have passed
+        const auto missed = (now - next_due) / period;
+        camera.dropped += missed;
+        frame_number += missed;
+        next_due += missed * period;
+      }
+      auto frame = &frames[(frame_number % FRAME_VARIANTS) * frame_size];
+      stamp_counter(options, frame_number, frame);
+      if (!send_all(fd, frame, frame_size)) {
+        break;
+      }
+      camera.frames++;
+      camera.bytes += frame_size;
+      frame_number++;
+      next_due += period;
+    }
+    camera.sock = -1;
+    close(fd);
+    if (!stopping) {
+      camera.reconnects++;
+      std::fprintf(stderr, "Camera %u disconnected; reconnecting\n",
+                   camera.index);
+    }
+  }
+}
+
+void report(const std::vector<Camera> &cameras, double seconds,
+            std::uint64_t frames, std::uint64_t bytes, std::uint64_t dropped) {
+  double rtt_sum = 0;
+  unsigned int rtt_count = 0;
+  int max_queued = 0;
+  for (const auto &camera : cameras) {
+    const int fd = camera.sock;
+    if (fd < 0) {
+      continue;
+    }
+    tcp_info info{};
+    socklen_t len = sizeof(info);
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+      rtt_sum += info.tcpi_rtt / 1000.0;
+      rtt_count++;
+    }
+    int queued = 0;
+    if (ioctl(fd, SIOCOUTQ, &queued) == 0) {
+      max_queued = std::max(max_queued, queued);
+    }
+  }
+  std::printf("%7.1f fps  %8.1f MB/s  %6llu dropped  rtt %6.2f ms  "
+              "max queued %7.1f KB  (%u connected)\n",
+              frames / seconds, bytes / seconds / 1e6,
+              static_cast<unsigned long long>(dropped),
+              rtt_count > 0 ? rtt_sum / rtt_count : 0.0, max_queued / 1e3,
+              rtt_count);
+  std::fflush(stdout);
+}
+
+void usage(const char *program) {
+  std::fprintf(stderr,
+               "Usage: %s [--cameras N] [--width WIDTH] [--height HEIGHT]\n"
+               "       [--frame-rate FRAMERATE] [--duration SECONDS]\n"
+               "       [--pattern gradient|noise] [--listen] <HOST> <PORT>\n",
+               program);
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  Options options;
+  std::vector<std::string> positional;
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    const bool has_value = i + 1 < argc;
+    if (arg == "--cameras" && has_value) {
+      options.cameras = std::strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "--width" && has_value) {
+      options.width = std::strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "--height" && has_value) {
+      options.height = std::strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "--frame-rate" && has_value) {
+      options.frame_rate = std::strtod(argv[++i], nullptr);
+    } else if (arg == "--duration" && has_value) {
+      options.duration = std::strtod(argv[++i], nullptr);
+    } else if (arg == "--pattern" && has_value) {
+      options.noise = std::string{argv[++i]} == "noise";
+    } else if (arg == "--listen") {
+      options.listen = true;
+    } else if (arg.rfind("--", 0) == 0) {
+      usage(argv[0]);
+      return 1;
+    } else {
+      positional.push_back(arg);
+    }
+  }
+  if (positional.size() != 2 || options.cameras == 0 || options.width == 0 ||
+      options.height == 0 || options.frame_rate <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+  options.host = positional[0];
+  options.port = std::strtoul(positional[1].c_str(), nullptr, 10);
+
+  std::vector<Camera> cameras(options.cameras);
+  std::vector<std::thread> threads;
+  for (unsigned int i = 0; i < options.cameras; i++) {
+    cameras[i].index = i;
+    threads.emplace_back(run_camera, std::cref(options), std::ref(cameras[i]));
+  }
+
+  const auto start = Clock::now();
+  auto last = start;
+  std::uint64_t last_frames = 0;
+  std::uint64_t last_bytes = 0;
+  std::uint64_t last_dropped = 0;
+  const auto run_time = std::chrono::duration<double>(options.duration);
+  while (options.duration == 0 || Clock::now() - start < run_time) {
+    std::this_thread::sleep_for(std::chrono::seconds{1});
+    const auto now = Clock::now();
+    std::uint64_t frames = 0;
+    std::uint64_t bytes = 0;
+    std::uint64_t dropped = 0;
+    for (const auto &camera : cameras) {
+      frames += camera.frames;
+      bytes += camera.bytes;
+      dropped += camera.dropped;
+    }
+    report(cameras, std::chrono::duration<double>(now - last).count(),
+           frames - last_frames, bytes - last_bytes, dropped - last_dropped);
+    last = now;
+    last_frames = frames;
+    last_bytes = bytes;
+    last_dropped = dropped;
+  }
+
+  stopping = true;
+  for (auto &camera : cameras) {
+    // Wakes accept() as well as a send
+    for (const int fd : {camera.listener.load(), camera.sock.load()}) {
+      if (fd >= 0) {
+        shutdown(fd, SHUT_RDWR);
+      }
+    }
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  const auto elapsed =
+      std::chrono::duration<double>(Clock::now() - start).count();
+  std::uint64_t frames = 0;
+  std::uint64_t dropped = 0;
+  std::uint64_t reconnects = 0;
+  for (const auto &camera : cameras) {
+    frames += camera.frames;
+    dropped += camera.dropped;
+    reconnects += camera.reconnects;
+  }
+  std::printf("Sent %llu frames in %.1f s (%.1f fps per camera), dropped %llu, "
+              "reconnected %llu times\n",
+              static_cast<unsigned long long>(frames), elapsed,
+              frames / elapsed / options.cameras,
+              static_cast<unsigned long long>(dropped),
+              static_cast<unsigned long long>(reconnects));
+  return 0;
+}
@@ -0,0 +1,86 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shm_producer.h"
+
+int shm_producer_open(struct shm_producer *producer, const char *name,
+                      uint32_t slot_count, uint64_t slot_size) {
+  memset(producer, 0, sizeof(*producer));
+  if (slot_count < 2 || strlen(name) >= sizeof(producer->name)) {
+    errno = EINVAL;
+    return -1;
+  }
+  strcpy(producer->name, name);
+
+  /* Replace any stale object so consumers notice and remap */
+  shm_unlink(name);
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+  if (fd < 0) {
+    return -1;
+  }
+  producer->size = shm_ring_size(slot_count, slot_size);
+  if (ftruncate(fd, producer->size) < 0) {
+    close(fd);
+    shm_unlink(name);
+    return -1;
+  }
+  void *mapping = mmap(NULL, producer->size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    shm_unlink(name);
+    return -1;
+  }
+
+  producer->header = mapping;
+  producer->header->version = SHM_RING_VERSION;
+  producer->header->slot_count = slot_count;
+  producer->header->slot_size = slot_size;
+  /* Consumers check the magic last */
+  __atomic_store_n(&producer->header->magic, SHM_RING_MAGIC, __ATOMIC_RELEASE);
+  return 0;
+}
+
+uint8_t *shm_producer_begin(struct shm_producer *producer) {
+  const uint32_t i = producer->seq % producer->header->slot_count;
+  struct shm_ring_slot *slot = shm_ring_slot(producer->header, i);
+  __atomic_store_n(&slot->seq, 2 * producer->seq + 1, __ATOMIC_RELAXED);
+  /* Keep the data writes after the odd sequence number */
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  return shm_ring_data(producer->header, i);
+}
+
+void shm_producer_commit(struct shm_producer *producer, uint64_t size,
+                         uint64_t timestamp_ns) {
+  const uint32_t i = producer->seq % producer->header->slot_count;
+  struct shm_ring_slot *slot = shm_ring_slot(producer->header, i);
+  if (timestamp_ns == 0) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    timestamp_ns = (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+  }
+  slot->timestamp_ns = timestamp_ns;
+  slot->size = size;
+  __atomic_store_n(&slot->seq, 2 * producer->seq + 2, __ATOMIC_RELEASE);
+  producer->seq++;
+  __atomic_store_n(&producer->header->write_seq, producer->seq,
+                   __ATOMIC_RELEASE);
+}
+
+void shm_producer_write(struct shm_producer *producer, const void *frame,
+                        uint64_t size) {
+  memcpy(shm_producer_begin(producer), frame, size);
+  shm_producer_commit(producer, size, 0);
+}
+
+void shm_producer_close(struct shm_producer *producer) {
+  if (producer->header != NULL) {
+    munmap(producer->header, producer->size);
+    producer->header = NULL;
+    shm_unlink(producer->name);
+  }
+}
@@ -0,0 +1,60 @@
+/*
+ * Minimal producer for camcoder's shared-memory frame ring.
+ *
+ *   struct shm_producer producer;
+ *   if (shm_producer_open(&producer, "/camcoder-shm", 8, frame_size) < 0) ...
+ *   uint8_t *slot = shm_producer_begin(&producer);
+ *   fill_frame(slot);
+ *   shm_producer_commit(&producer, frame_size, 0);
+ *   ...
+ *   shm_producer_close(&producer);
+ *
+ * Build with: cc -O2 -I../../src -c shm_producer.c (link with -lrt on older
+ * glibc).
+ */
+#ifndef CAMCODER_SHM_PRODUCER_H
+#define CAMCODER_SHM_PRODUCER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "shm_ring.h"
+
+struct shm_producer {
+  struct shm_ring_header *header;
+  size_t size;
+  uint64_t seq;
+  char name[256];
+};
+
+/*
+ * Create (or replace) the shared memory object and initialize an empty ring.
+ * Returns 0 on success and -1 with errno set on failure.
+ */
+int shm_producer_open(struct shm_producer *producer, const char *name,
+                      uint32_t slot_count, uint64_t slot_size);
+
+/*
+ * Claim the next slot and return its data area (slot_size bytes).
+ */
+uint8_t *shm_producer_begin(struct shm_producer *producer);
+
+/*
+ * Publish the slot claimed by shm_producer_begin. A zero timestamp_ns uses
+ * the current CLOCK_MONOTONIC time.
+ */
+void shm_producer_commit(struct shm_producer *producer, uint64_t size,
+                         uint64_t timestamp_ns);
+
+/*
+ * Copy a whole frame into the ring and publish it.
+ */
+void shm_producer_write(struct shm_producer *producer, const void *frame,
+                        uint64_t size);
+
+/*
+ * Unmap and unlink the object.
+ */
+void shm_producer_close(struct shm_producer *producer);
+
+#endif /* CAMCODER_SHM_PRODUCER_H */
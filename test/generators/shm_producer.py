@@ -0,0 +1,125 @@
+"""Writes frames into a shared-memory ring for camcoder's shm source. See src/shm_ring.h for the layout.
+
+USAGE: python shm_producer.py [--width WIDTH] [--height HEIGHT] [--frame-rate FRAMERATE] [--slots SLOTS] <NAME> <INPUT_FILE>
+
+Requires Python 3.8 and Linux (the object is created under /dev/shm). Python has no atomic stores, so this relies on
+stores not being reordered, which holds on x86; use shm_producer.c elsewhere.
+"""
+
+from argparse import ArgumentParser
+import mmap
+import os
+import struct
+import time
+
+SHM_RING_MAGIC = 0x48534343
+SHM_RING_VERSION = 1
+SHM_RING_ALIGN = 64
+HEADER_SIZE = 64
+SLOT_HEADER_SIZE = 64
+
+# magic, version, slot_count, reserved, slot_size, write_seq
+HEADER_FORMAT = '=IIIIQQ'
+WRITE_SEQ_OFFSET = 24
+# seq, timestamp_ns, size
+SLOT_FORMAT = '=QQQ'
+
+
+def data_stride(slot_size):
+    return (slot_size + SHM_RING_ALIGN - 1) // SHM_RING_ALIGN * SHM_RING_ALIGN
+
+
+class ShmProducer:
+    def __init__(self, name, slot_count, slot_size):
+        if slot_count < 2:
+            raise ValueError('At least 2 slots are required')
+        self.path = os.path.join('/dev/shm', name.lstrip('/'))
+        self.slot_count = slot_count
+        self.slot_size = slot_size
+        self.seq = 0
+        size = HEADER_SIZE + slot_count * (SLOT_HEADER_SIZE + data_stride(slot_size))
+
+        # Replace any stale object so consumers notice and remap
+        if os.path.exists(self.path):
+            os.unlink(self.path)
+        fd = os.open(self.path, os.O_RDWR | os.O_CREAT | os.O_EXCL, 0o644)
+        try:
+            os.ftruncate(fd, size)
+            self.mapping = mmap.mmap(fd, size)
+        finally:
+            os.close(fd)
+
+        # Write the magic last so consumers don't see a half-initialized header
+        struct.pack_into(HEADER_FORMAT, self.mapping, 0, 0, SHM_RING_VERSION, slot_count, 0, slot_size, 0)
+        struct.pack_into('=I', self.mapping, 0, SHM_RING_MAGIC)
+
+    def write(self, frame, timestamp_ns=None):
+        if len(frame) > self.slot_size:
+            raise ValueError(f'Frame of {len(frame)} bytes is larger than a slot')
+        if timestamp_ns is None:
+            timestamp_ns = time.monotonic_ns()
+        i = self.seq % self.slot_count
+        slot_offset = HEADER_SIZE + i * SLOT_HEADER_SIZE
+        data_offset = HEADER_SIZE + self.slot_count * SLOT_HEADER_SIZE + i * data_stride(self.slot_size)
+
+        struct.pack_into('=Q', self.mapping, slot_offset, 2 * self.seq + 1)
+        self.mapping[data_offset:data_offset + len(frame)] = frame
+        struct.pack_into(SLOT_FORMAT, self.mapping, slot_offset, 2 * self.seq + 2, timestamp_ns, len(frame))
+        self.seq += 1
+        struct.pack_into('=Q', self.mapping, WRITE_SEQ_OFFSET, self.seq)
+
+    def close(self):
+        self.mapping.close()
+        os.unlink(self.path)
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+
+def main():
+    parser = ArgumentParser(
+        description='Write frames from a file into a shared-memory ring.')
+
+    parser.add_argument('--width', type=int,
+                        default=640, help='Frame width')
+    parser.add_argument('--height', type=int,
+                        default=480, help='Frame height')
+    parser.add_argument('--frame-rate', type=int,
+                        default=30, help='Framerate')
+    parser.add_argument('--format', type=lambda s: s.lower(), default='rgb',
+                        help='Format (only RGB supported for now)')
+    parser.add_argument('--slots', type=int, default=8,
+                        help='Number of frames the ring holds')
+    parser.add_argument('name',
+                        help='Shared memory object name, e.g. /camcoder-shm')
+    parser.add_argument('input_file',
+                        help='A file to read frame data from')
+
+    args = parser.parse_args()
+
+    if args.format != 'rgb':
+        raise ValueError(f'Unsupported format {args.format}')
+    pixel_size = 3
+    frame_size = args.width * args.height * pixel_size
+
+    with ShmProducer(args.name, args.slots, frame_size) as producer, \
+            open(args.input_file, 'rb') as f:
+        period = 1 / args.frame_rate
+        while True:
+            t_start = time.time()
+            frame = f.read(frame_size)
+            if len(frame) < frame_size:
+                # Seek to the beginning of the file and try again
+                f.seek(0)
+                continue
+
+            producer.write(frame)
+
+            time.sleep(max(0, period - (time.time() - t_start)))
+
+
+if __name__ == '__main__':
+    main()
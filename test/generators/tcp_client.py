@@ -10,6 +10,8 @@ from argparse import ArgumentParser
 import socket
 import time
 
+import frame_compression
+
 
 def main():
     parser = ArgumentParser(
@@ -29,8 +31,10 @@ def main():
                         help='The port to connect to')
     parser.add_argument('input_file',
                         help='A file to read frame data from')
+    frame_compression.add_arguments(parser)
 
     args = parser.parse_args()
+    encode = frame_compression.encoder_from_args(args)
 
     if args.format != 'rgb':
         raise ValueError(f'Unsupported format {args.format}')
@@ -51,7 +55,7 @@ def main():
                 f.seek(0)
                 continue
 
-            sock.sendall(frame)
+            sock.sendall(encode(frame))
 
             time.sleep(max(0, period - (time.time() - t_start)))
 
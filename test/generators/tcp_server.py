@@ -10,6 +10,8 @@ from argparse import ArgumentParser
 import socket
 import time
 
+import frame_compression
+
 
 def main():
     parser = ArgumentParser(
@@ -27,8 +29,10 @@ def main():
                         help='A port for listening for connections')
     parser.add_argument('input_file',
                         help='A file to read frame data from')
+    frame_compression.add_arguments(parser)
 
     args = parser.parse_args()
+    encode = frame_compression.encoder_from_args(args)
 
     if args.format != 'rgb':
         raise ValueError(f'Unsupported format {args.format}')
@@ -52,7 +56,7 @@ def main():
                     f.seek(0)
                     continue
 
-                conn.sendall(frame)
+                conn.sendall(encode(frame))
 
                 time.sleep(max(0, period - (time.time() - t_start)))
 
@@ -0,0 +1,111 @@
+"""Sends frames from a file as RTP datagrams with RFC 4175 payload headers, like a camera that streams raw video over
+UDP.
+
+USAGE: python udp_sender.py [--width WIDTH] [--height HEIGHT] [--frame-rate FRAMERATE] [--mtu MTU] [--loss LOSS]
+                            <PORT> <INPUT_FILE>
+
+Requires Python 3.
+"""
+
+from argparse import ArgumentParser
+import random
+import socket
+import struct
+import time
+
+RTP_HEADER_SIZE = 12
+LINE_HEADER_SIZE = 6
+PAYLOAD_TYPE = 96
+# RFC 4175 uses a 90 kHz RTP clock
+RTP_CLOCK_RATE = 90000
+
+
+def packetize(frame, width, height, pixel_size, max_payload):
+    """Yield (line headers, data) pairs covering the frame, each fitting in max_payload bytes after the extended
+    sequence number."""
+    stride = width * pixel_size
+    line = 0
+    offset = 0  # in pixels
+    while line < height:
+        headers = []
+        segments = []
+        room = max_payload - 2
+        while line < height and room > LINE_HEADER_SIZE + pixel_size:
+            room -= LINE_HEADER_SIZE
+            pixels = min(width - offset, room // pixel_size)
+            length = pixels * pixel_size
+            headers.append((length, line, offset))
+            start = line * stride + offset * pixel_size
+            segments.append(frame[start:start + length])
+            room -= length
+            offset += pixels
+            if offset == width:
+                line += 1
+                offset = 0
+        packed = b''
+        for i, (length, header_line, header_offset) in enumerate(headers):
+            continuation = 0x8000 if i < len(headers) - 1 else 0
+            packed += struct.pack('!HHH', length, header_line & 0x7fff, continuation | (header_offset & 0x7fff))
+        yield packed, b''.join(segments)
+
+
+def main():
+    parser = ArgumentParser(
+        description='Stream a raw frame file as RTP/RFC 4175 datagrams.')
+
+    parser.add_argument('--width', type=int,
+                        default=640, help='Frame width')
+    parser.add_argument('--height', type=int,
+                        default=480, help='Frame height')
+    parser.add_argument('--frame-rate', type=int,
+                        default=30, help='Framerate')
+    parser.add_argument('--format', type=lambda s: s.lower(), default='rgb',
+                        help='Format (only RGB supported for now)')
+    parser.add_argument('--address', type=str, default='127.0.0.1',
+                        help='The address to send to')
+    parser.add_argument('--mtu', type=int, default=1400,
+                        help='Maximum datagram size')
+    parser.add_argument('--loss', type=float, default=0.0,
+                        help='Fraction of datagrams to drop, to exercise concealment')
+    parser.add_argument('port', type=int,
+                        help='The port to send to')
+    parser.add_argument('input_file',
+                        help='A file to read frame data from')
+
+    args = parser.parse_args()
+
+    if args.format != 'rgb':
+        raise ValueError(f'Unsupported format {args.format}')
+    pixel_size = 3
+    frame_size = args.width * args.height * pixel_size
+    max_payload = args.mtu - RTP_HEADER_SIZE
+
+    with socket.socket(socket.AF_INET, socket.SOCK_DGRAM) as sock, \
+            open(args.input_file, 'rb') as f:
+        seq = 0
+        period = 1 / args.frame_rate
+        t_origin = time.time()
+        while True:
+            t_start = time.time()
+            frame = f.read(frame_size)
+            if len(frame) < frame_size:
+                # Seek to the beginning of the file and try again
+                f.seek(0)
+                continue
+
+            timestamp = int((t_start - t_origin) * RTP_CLOCK_RATE) & 0xffffffff
+            packets = list(packetize(frame, args.width, args.height, pixel_size, max_payload))
+            for i, (headers, data) in enumerate(packets):
+                marker = 0x80 if i == len(packets) - 1 else 0
+                rtp = struct.pack('!BBHII', 0x80, marker | PAYLOAD_TYPE, seq & 0xffff, timestamp, 0)
+                payload = struct.pack('!H', (seq >> 16) & 0xffff) + headers + data
+                seq = (seq + 1) & 0xffffffff
+                if args.loss > 0 and random.random() < args.loss:
+                    continue
+                sock.sendto(rtp + payload, (args.address, args.port))
+
+            time.sleep(max(0, period - (time.time() - t_start)))
+
+
+if __name__ == '__main__':
+    main()